@@ -18,6 +18,7 @@
 #include "cache.h"
 #include "fs.h"
 #include "log.h"
+#include "util.h"
 
 #include <fuse.h>
 #include <fuse_opt.h>
@@ -48,6 +49,42 @@ static struct fuse_opt cramp_fuse_opts[] = {
 
   CRAMP_FUSE_OPT("--bamsize=%lld", bamsize, 0),
 
+  CRAMP_FUSE_OPT("--threads=%d",   threads, 0),
+  CRAMP_FUSE_OPT("threads=%d",     threads, 0),
+
+  CRAMP_FUSE_OPT("--parallel",     parallel, 1),
+  CRAMP_FUSE_OPT("parallel",       parallel, 1),
+
+  CRAMP_FUSE_OPT("--bam-level=%d", bam_level, 0),
+  CRAMP_FUSE_OPT("bam-level=%d",   bam_level, 0),
+
+  CRAMP_FUSE_OPT("--precalc=%d",   precalc, 0),
+  CRAMP_FUSE_OPT("precalc=%d",     precalc, 0),
+
+  CRAMP_FUSE_OPT("--no-watch",     watch, 0),
+  CRAMP_FUSE_OPT("nowatch",        watch, 0),
+
+  CRAMP_FUSE_OPT("--block-cache=%s", block_cache, 0),
+  CRAMP_FUSE_OPT("block-cache=%s",   block_cache, 0),
+
+  CRAMP_FUSE_OPT("--spill=%s",     spill, 0),
+  CRAMP_FUSE_OPT("spill=%s",       spill, 0),
+
+  CRAMP_FUSE_OPT("--ref-memory=%s", ref_memory, 0),
+  CRAMP_FUSE_OPT("ref-memory=%s",   ref_memory, 0),
+
+  CRAMP_FUSE_OPT("--handles=%d",   handles, 0),
+  CRAMP_FUSE_OPT("handles=%d",     handles, 0),
+
+  CRAMP_FUSE_OPT("--dir-cache=%s", dir_cache, 0),
+  CRAMP_FUSE_OPT("dir-cache=%s",   dir_cache, 0),
+
+  CRAMP_FUSE_OPT("--attr-cache=%d", attr_cache, 0),
+  CRAMP_FUSE_OPT("attr-cache=%d",   attr_cache, 0),
+
+  CRAMP_FUSE_OPT("--trust-extension", trust_ext, 1),
+  CRAMP_FUSE_OPT("trust-extension",   trust_ext, 1),
+
   FUSE_OPT_KEY("--debug",          CRAMP_FUSE_CONF_KEY_DEBUG_ME),
 
   FUSE_OPT_KEY("-d",               CRAMP_FUSE_CONF_KEY_DEBUG_ALL),
@@ -102,13 +139,45 @@ static void usage(void) {
     "\n"
     "Options:\n"
     "  -S, --source=DIR|URL   Source directory (defaults to the CWD)\n"
+    "      --threads=N        Conversion threads, shared by all files\n"
+    "                         (defaults to 0; i.e., single threaded)\n"
+    "      --parallel         Convert whole files a container at a time,\n"
+    "                         across all threads\n"
+    "      --bam-level=0..9   Virtual BAM compression level (defaults to\n"
+    "                         HTSLib's; 0 = uncompressed BGZF)\n"
+    "      --precalc=N        Background workers calculating BAM sizes\n"
+    "                         (defaults to 1; 0 = only when read)\n"
+    "      --no-watch         Don't watch the source directory for changes\n"
+    "      --block-cache=SIZE Memory for converted data, shared by all\n"
+    "                         readers (e.g., 4G; defaults to 0 = none)\n"
+    "      --spill=SIZE       Local disk for converted data, kept between\n"
+    "                         mounts (e.g., 100G; defaults to 0 = none)\n"
+    "      --ref-memory=SIZE  Memory for reference sequences, shared by all\n"
+    "                         CRAMs (e.g., 8G; defaults to 4G; 0 = none)\n"
+    "      --handles=N        Idle CRAM file handles kept open for reuse\n"
+    "                         (defaults to 64; 0 = none)\n"
+    "      --dir-cache=SIZE   Memory for directory listings, kept until\n"
+    "                         they change (e.g., 1G; defaults to 256M;\n"
+    "                         0 = none)\n"
+    "      --attr-cache=SECS  How long virtual files' attributes (and misses)\n"
+    "                         are cached (defaults to 60; 0 = not cached)\n"
+    "      --trust-extension  List every *.cram as a virtual BAM, without\n"
+    "                         reading it; non-CRAMs fail when opened\n"
     "  -h, --help             This helpful text\n"
     "      --version          Print version\n"
     "\n"
-    "The source directory may also be provided as a mount option (e.g., in\n"
-    "your fstab). When pointing to a URL, this is expected to resolve to a\n"
+    "The source directory, threads, parallel, bam-level, precalc, nowatch,\n"
+    "block-cache, spill, ref-memory, handles, dir-cache, attr-cache and\n"
+    "trust-extension may also be provided as mount options (e.g., in your\n"
+    "fstab).\n"
+    "When pointing to a URL, the source is expected to resolve to a\n"
     "manifest file (i.e., a file of CRAM URLs).\n"
     "\n"
+    "Besides foo.bam, each foo.cram can be opened as foo.lN.bam, converted\n"
+    "at compression level N (0..9). These variants aren't listed.\n"
+    "Each is also listed as foo.noqual.bam, without base qualities, and\n"
+    "foo.minimal.bam, with just the alignments, which are quicker to make.\n"
+    "\n"
     "Note: The search order for CRAM reference files is:\n"
     " * Per the REF_CACHE environment variable;\n"
     " * Per the REF_PATH environment variable;\n"
@@ -184,9 +253,16 @@ int main(int argc, char** argv) {
   static cramp_conf_t cramp_conf;
   memset(&cramp_conf, 0, sizeof(cramp_conf));
   ctx->conf = &cramp_conf;
+  cramp_conf.bam_level  = -1;
+  cramp_conf.precalc    = 1;
+  cramp_conf.watch      = 1;
+  cramp_conf.ref_budget = CRAMP_REFS_DEFAULT;
+  cramp_conf.handles    = 64;
+  cramp_conf.dir_budget = CRAMP_DIRS_DEFAULT;
+  cramp_conf.attr_cache = CRAMP_ATTRS_DEFAULT;
 
   /* Initialise CRAM stat cache */
-  ctx->cache = kh_init(stat_hash);
+  ctx->cache = cramp_cache_init();
 
   /* Parse command line arguments via FUSE */
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
@@ -239,6 +315,72 @@ int main(int argc, char** argv) {
     ctx->conf->bamsize = SSIZE_MAX;
   }
 
+  /* Check compression level */
+  if (ctx->conf->bam_level < -1 || ctx->conf->bam_level > 9) {
+    errno = EINVAL;
+    WTF("BAM compression level must be between 0 and 9");
+  }
+
+  /* Sanitise thread pool size */
+  if (ctx->conf->threads < 0) {
+    ctx->conf->threads = 0;
+  }
+
+  /* Parse block cache budget */
+  if (ctx->conf->block_cache) {
+    ssize_t budget = parse_size(ctx->conf->block_cache);
+    if (budget < 0) {
+      errno = EINVAL;
+      WTF("\"%s\" isn't a valid block cache size", ctx->conf->block_cache);
+    }
+    ctx->conf->block_budget = (size_t)budget;
+  }
+
+  /* Parse spill cache budget */
+  if (ctx->conf->spill) {
+    ssize_t budget = parse_size(ctx->conf->spill);
+    if (budget < 0) {
+      errno = EINVAL;
+      WTF("\"%s\" isn't a valid spill cache size", ctx->conf->spill);
+    }
+    ctx->conf->spill_budget = (size_t)budget;
+  }
+
+  /* Parse shared reference budget */
+  if (ctx->conf->ref_memory) {
+    ssize_t budget = parse_size(ctx->conf->ref_memory);
+    if (budget < 0) {
+      errno = EINVAL;
+      WTF("\"%s\" isn't a valid reference memory size", ctx->conf->ref_memory);
+    }
+    ctx->conf->ref_budget = (size_t)budget;
+  }
+
+  /* Parse directory listing cache budget */
+  if (ctx->conf->dir_cache) {
+    ssize_t budget = parse_size(ctx->conf->dir_cache);
+    if (budget < 0) {
+      errno = EINVAL;
+      WTF("\"%s\" isn't a valid directory cache size", ctx->conf->dir_cache);
+    }
+    ctx->conf->dir_budget = (size_t)budget;
+  }
+
+  /* Sanitise file handle pool size */
+  if (ctx->conf->handles < 0) {
+    ctx->conf->handles = 0;
+  }
+
+  /* Sanitise precalculation pool size */
+  if (ctx->conf->precalc < 0) {
+    ctx->conf->precalc = 0;
+  }
+
+  /* Sanitise attribute cache lifetime */
+  if (ctx->conf->attr_cache < 0) {
+    ctx->conf->attr_cache = 0;
+  }
+
   /* Let's go! */
   return fuse_main(args.argc, args.argv, &cramp_ops, &cramp_ctx);
 }
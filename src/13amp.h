@@ -15,9 +15,37 @@
 
 #define CRAMP_FUSE_OPT(t, p, v) { t, offsetof(cramp_conf_t, p), v }
 
+/* Needed for htsThreadPool */
+#include <htslib/hts.h>
+#include <htslib/thread_pool.h>
+
+/* Needed for cramp_attrs_t */
+#include "attrs.h"
+
+/* Needed for cramp_blocks_t */
+#include "blocks.h"
+
 /* Needed for cramp_cache_t */
 #include "cache.h"
 
+/* Needed for cramp_dirs_t */
+#include "dirs.h"
+
+/* Needed for cramp_handles_t */
+#include "handles.h"
+
+/* Needed for cramp_precalc_t */
+#include "precalc.h"
+
+/* Needed for cramp_refs_t */
+#include "refs.h"
+
+/* Needed for cramp_spill_t */
+#include "spill.h"
+
+/* Needed for cramp_watch_t */
+#include "watch.h"
+
 /* Option keys for FUSE */
 enum {
   CRAMP_FUSE_CONF_KEY_HELP,
@@ -36,6 +64,24 @@ enum {
   @var    debug_level  Debugging level
   @var    one_thread   Run single threaded
   @var    bamsize      Default BAM file size
+  @var    threads      Conversion thread pool size (0 = No pool)
+  @var    parallel     Convert whole files a container at a time
+  @var    bam_level    Virtual BAM compression level (-1 = Default)
+  @var    precalc      Background size precalculation workers (0 = None)
+  @var    watch        Watch the source directory for changes
+  @var    block_cache  Converted data cache budget, as given (e.g., "4G")
+  @var    block_budget Converted data cache budget (bytes; 0 = No cache)
+  @var    spill        Spill cache budget, as given (e.g., "100G")
+  @var    spill_budget Spill cache budget (bytes; 0 = No spill cache)
+  @var    ref_memory   Shared reference budget, as given (e.g., "8G")
+  @var    ref_budget   Shared reference budget (bytes; 0 = Not shared)
+  @var    handles      Idle CRAM file pointers kept open (0 = None)
+  @var    dir_cache    Directory listing cache budget, as given (e.g., "1G")
+  @var    dir_budget   Directory listing cache budget (bytes; 0 = No cache)
+  @var    attr_cache   Virtual file attribute cache lifetime (seconds;
+                       0 = No cache)
+  @var    trust_ext    List virtual BAMs for anything named *.cram, only
+                       checking that it's a CRAM when it's opened
 */
 typedef struct cramp_conf {
   const char* source;
@@ -43,16 +89,50 @@ typedef struct cramp_conf {
   int         debug_level;
   int         one_thread;
   off_t       bamsize;
+  int         threads;
+  int         parallel;
+  int         bam_level;
+  int         precalc;
+  int         watch;
+  const char* block_cache;
+  size_t      block_budget;
+  const char* spill;
+  size_t      spill_budget;
+  const char* ref_memory;
+  size_t      ref_budget;
+  int         handles;
+  const char* dir_cache;
+  size_t      dir_budget;
+  int         attr_cache;
+  int         trust_ext;
 } cramp_conf_t;
 
 /**
   @brief  13 Amp global context
-  @var    conf   Pointer to configuration
-  @var    cache  CRAM stat runtime cache
+  @var    conf     Pointer to configuration
+  @var    cache    CRAM stat runtime cache
+  @var    pool     Conversion thread pool, shared by all conversions
+  @var    precalc  Background size precalculation (NULL = None)
+  @var    watch    Source directory watcher (NULL = None)
+  @var    blocks   Converted data cache, shared by all conversions (NULL = None)
+  @var    spill    On-disk converted data cache (NULL = None)
+  @var    refs     Reference sequences, shared by all CRAMs (NULL = None)
+  @var    handles  Pool of open CRAM file pointers (NULL = None)
+  @var    dirs     Directory listing cache (NULL = None)
+  @var    attrs    Virtual file attribute cache (NULL = None)
 */
 typedef struct cramp_ctx {
-  cramp_conf_t*  conf;
-  cramp_cache_t* cache;
+  cramp_conf_t*    conf;
+  cramp_cache_t*   cache;
+  htsThreadPool    pool;
+  cramp_precalc_t* precalc;
+  cramp_watch_t*   watch;
+  cramp_blocks_t*  blocks;
+  cramp_spill_t*   spill;
+  cramp_refs_t*    refs;
+  cramp_handles_t* handles;
+  cramp_dirs_t*    dirs;
+  cramp_attrs_t*   attrs;
 } cramp_ctx_t;
 
 #endif
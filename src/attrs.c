@@ -0,0 +1,464 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#include "config.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "attrs.h"
+
+#include <htslib/khash.h>
+
+/*
+  NOTES
+
+  Getting the attributes of a virtual file costs an lstat that fails,
+  a stat of the CRAM behind it and a stat cache lookup; a path that only
+  looks like it might be virtual (e.g., a BAI that tools probe for)
+  costs much the same, to fail. On a network filesystem, tools that stat
+  the same files over and over pay for all of that every time.
+
+  So those results, positive and negative, are cached, by mount path,
+  for --attr-cache seconds (real files are left to the kernel's own
+  cache). A virtual BAM whose size isn't final yet (i.e., it's still the
+  placeholder) is only cached for CRAMP_ATTRS_PENDING seconds, as it
+  could be sized at any moment; likewise, a virtual BAI that's missing
+  because it hasn't been built yet (see fs.c).
+
+  Otherwise, entries are forgotten by the watcher (see watch.c), when
+  anything in their directory changes (e.g., the CRAM's written, or a
+  real file appears that masks a virtual one); forgetting a directory
+  also forgets the region directories (foo.cram.d) of its CRAMs. Without
+  the watcher, changes take up to the lifetime to show.
+
+  The watcher can't see every change, though: inotify misses writes by
+  other clients of a network filesystem (e.g., NFS or Lustre). So found
+  entries also remember the CRAM they inherit their attributes from,
+  and are checked against it with one stat (rather than the lstat,
+  stat and lookups it took to make them): if its inode or mtime have
+  changed, the entry's not used. Misses aren't checked, so a CRAM that
+  appears on another client still takes up to the lifetime to show.
+
+  n.b., This is only our side: the kernel caches attributes too, for
+  attr_timeout, which the high-level FUSE API can only set for the whole
+  mount, not per reply. So that's left at FUSE's default (1 second),
+  otherwise the kernel would go on serving a placeholder size for that
+  long after the real one's known.
+
+  Entries are grouped by directory, so a directory can be forgotten in
+  one go. The cache holds at most ATTRS_MAX entries: when it's full,
+  expired entries are swept out (at most once a second) and, if it's
+  still full, nothing more is cached until something expires.
+*/
+
+/* Most entries in the cache */
+#define ATTRS_MAX (256 * 1024)
+
+/* Extension of a CRAM's region directory */
+#define ATTRS_REGION_DIR ".cram.d"
+
+/**
+  @brief   Cached attributes
+  @var     st       Attributes (if found)
+  @var     err      Result (0 = Found; -errno = Not found)
+  @var     expires  When the entry expires (monotonic seconds)
+  @var     source   CRAM the attributes are inherited from (NULL = None)
+  @var     name     File name
+*/
+typedef struct attrs_entry {
+  struct stat st;
+  int         err;
+  time_t      expires;
+  const char* source;
+  char        name[];
+} attrs_entry_t;
+
+/* Initialise entry map type (file name => entry) */
+KHASH_MAP_INIT_STR(attr_map, attrs_entry_t*)
+
+/**
+  @brief   Cached directory
+  @var     key      Directory (mount path; "" = Root)
+  @var     region   Directory is a CRAM's region directory
+  @var     entries  Entries, by file name
+*/
+typedef struct attrs_dir {
+  const char*        key;
+  int                region;
+  khash_t(attr_map)* entries;
+} attrs_dir_t;
+
+/* Initialise directory map type (directory => entries) */
+KHASH_MAP_INIT_STR(attr_dirs, attrs_dir_t*)
+
+/**
+  @brief   Attribute cache
+  @var     ttl      Lifetime of final entries (seconds)
+  @var     count    Number of entries
+  @var     regions  Number of region directories
+  @var     swept    When expired entries were last swept out
+  @var     dirs     Directories, by mount path
+  @var     lock     Readers-writer lock
+*/
+struct cramp_attrs {
+  time_t              ttl;
+  size_t              count;
+  size_t              regions;
+  time_t              swept;
+  khash_t(attr_dirs)* dirs;
+  pthread_rwlock_t    lock;
+};
+
+/**
+  @brief   Current monotonic time
+  @return  Seconds
+*/
+static time_t attrs_now(void) {
+  struct timespec now;
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+/**
+  @brief   Split a mount path into its directory and file name
+  @param   path  Mount path
+  @param   dir   Buffer for the directory (PATH_MAX bytes)
+  @return  Pointer to the file name (NULL if the path's too long)
+*/
+static const char* attrs_split(const char* path, char* dir) {
+  const char* name = strrchr(path, '/');
+  size_t len = name ? (size_t)(name - path) : 0;
+
+  if (len >= PATH_MAX) {
+    return NULL;
+  }
+
+  memcpy(dir, path, len);
+  dir[len] = '\0';
+
+  return name ? name + 1 : path;
+}
+
+/**
+  @brief   Free an entry
+  @param   entry  Entry
+*/
+static void attrs_free(attrs_entry_t* entry) {
+  free((void*)entry->source);
+  free((void*)entry);
+}
+
+/**
+  @brief   Drop a directory's entries from the cache
+  @param   c    Cache (write locked)
+  @param   key  Directory's position in the cache
+*/
+static void attrs_drop(cramp_attrs_t* c, khiter_t key) {
+  attrs_dir_t* dir = kh_value(c->dirs, key);
+
+  attrs_entry_t* entry;
+  kh_foreach_value(dir->entries, entry, attrs_free(entry));
+  c->count   -= kh_size(dir->entries);
+  c->regions -= dir->region;
+
+  kh_del(attr_dirs, c->dirs, key);
+  kh_destroy(attr_map, dir->entries);
+  free((void*)dir->key);
+  free((void*)dir);
+}
+
+/**
+  @brief   Sweep expired entries out of the cache
+  @param   c    Cache (write locked)
+  @param   now  Current monotonic time
+*/
+static void attrs_sweep(cramp_attrs_t* c, time_t now) {
+  for (khiter_t key = kh_begin(c->dirs); key != kh_end(c->dirs); ++key) {
+    if (!kh_exist(c->dirs, key)) {
+      continue;
+    }
+
+    khash_t(attr_map)* entries = kh_value(c->dirs, key)->entries;
+    for (khiter_t k = kh_begin(entries); k != kh_end(entries); ++k) {
+      if (kh_exist(entries, k) && kh_value(entries, k)->expires <= now) {
+        attrs_free(kh_value(entries, k));
+        kh_del(attr_map, entries, k);
+        --c->count;
+      }
+    }
+
+    if (kh_size(entries) == 0) {
+      attrs_drop(c, key);
+    }
+  }
+
+  c->swept = now;
+}
+
+/**
+  @brief   Create an attribute cache
+  @param   ttl  Lifetime of final entries (seconds)
+  @return  Pointer to cache (NULL on failure)
+*/
+cramp_attrs_t* cramp_attrs_init(time_t ttl) {
+  cramp_attrs_t* c = calloc(1, sizeof(cramp_attrs_t));
+  if (c == NULL) {
+    return NULL;
+  }
+
+  c->ttl  = ttl;
+  c->dirs = kh_init(attr_dirs);
+  if (c->dirs == NULL) {
+    free((void*)c);
+    return NULL;
+  }
+
+  (void)pthread_rwlock_init(&c->lock, NULL);
+  return c;
+}
+
+/**
+  @brief   Get cached attributes
+  @param   c     Cache (NULL = No-op)
+  @param   path  Mount path
+  @param   st    stat structure, to be filled (if found)
+  @param   err   Set to the result (0 = Found; -errno = Not found)
+  @return  Cached (0 = False; 1 = True)
+
+  Found entries are only used if the CRAM they inherit from still has
+  the same inode and mtime (n.b., that's checked without the lock).
+*/
+int cramp_attrs_get(cramp_attrs_t* c, const char* path, struct stat* st, int* err) {
+  char dir[PATH_MAX];
+  char source[PATH_MAX];
+  int  found = 0;
+
+  if (c == NULL) {
+    return 0;
+  }
+
+  const char* name = attrs_split(path, dir);
+  if (name == NULL) {
+    return 0;
+  }
+
+  time_t now = attrs_now();
+  (void)pthread_rwlock_rdlock(&c->lock);
+
+  khiter_t key = kh_get(attr_dirs, c->dirs, dir);
+  if (key != kh_end(c->dirs)) {
+    khash_t(attr_map)* entries = kh_value(c->dirs, key)->entries;
+
+    khiter_t k = kh_get(attr_map, entries, name);
+    if (k != kh_end(entries) && kh_value(entries, k)->expires > now) {
+      attrs_entry_t* entry = kh_value(entries, k);
+
+      *source = '\0';
+      if (entry->err == 0) {
+        memcpy(st, &entry->st, sizeof(struct stat));
+        if (entry->source) {
+          (void)strcpy(source, entry->source);
+        }
+      }
+      *err  = entry->err;
+      found = 1;
+    }
+  }
+
+  (void)pthread_rwlock_unlock(&c->lock);
+
+  struct stat cram;
+  if (found && *source && (stat(source, &cram) == -1
+                       || cram.st_ino          != st->st_ino
+                       || cram.st_mtim.tv_sec  != st->st_mtim.tv_sec
+                       || cram.st_mtim.tv_nsec != st->st_mtim.tv_nsec)) {
+    found = 0;
+  }
+
+  return found;
+}
+
+/**
+  @brief   Put attributes into the cache
+  @param   c      Cache (NULL = No-op)
+  @param   path   Mount path
+  @param   st     Attributes (if found)
+  @param   err    Result (0 = Found; -errno = Not found)
+  @param   final  Attributes are final (0 = False, so only cache them
+                  briefly; 1 = True)
+  @param   source CRAM the attributes are inherited from, i.e., whose
+                  inode and mtime they have (NULL = None)
+*/
+void cramp_attrs_put(cramp_attrs_t* c, const char* path, const struct stat* st, int err, int final, const char* source) {
+  char dir[PATH_MAX];
+
+  if (c == NULL) {
+    return;
+  }
+
+  /* Copied up front, as it can't be checked without it */
+  char* copy = NULL;
+  if (err == 0 && source) {
+    size_t len = strlen(source);
+    if (len >= PATH_MAX || (copy = malloc(len + 1)) == NULL) {
+      return;
+    }
+    memcpy(copy, source, len + 1);
+  }
+
+  const char* name = attrs_split(path, dir);
+  if (name == NULL) {
+    free((void*)copy);
+    return;
+  }
+
+  time_t now = attrs_now();
+  (void)pthread_rwlock_wrlock(&c->lock);
+
+  if (c->count >= ATTRS_MAX) {
+    if (c->swept == now) {
+      goto finish_up;
+    }
+
+    attrs_sweep(c, now);
+    if (c->count >= ATTRS_MAX) {
+      goto finish_up;
+    }
+  }
+
+  /* Find (or create) the directory */
+  int ret;
+  khiter_t key = kh_get(attr_dirs, c->dirs, dir);
+  if (key == kh_end(c->dirs)) {
+    size_t len = strlen(dir);
+    attrs_dir_t* cached = calloc(1, sizeof(attrs_dir_t));
+    char* copy = malloc(len + 1);
+    khash_t(attr_map)* entries = kh_init(attr_map);
+    ret = -1;
+
+    if (cached && copy && entries) {
+      memcpy(copy, dir, len + 1);
+      key = kh_put(attr_dirs, c->dirs, copy, &ret);
+    }
+
+    if (ret == -1) {
+      if (entries) {
+        kh_destroy(attr_map, entries);
+      }
+      free((void*)copy);
+      free((void*)cached);
+      goto finish_up;
+    }
+
+    cached->key     = copy;
+    cached->region  = (len > sizeof(ATTRS_REGION_DIR) - 1
+                    && strcmp(copy + len - (sizeof(ATTRS_REGION_DIR) - 1), ATTRS_REGION_DIR) == 0);
+    cached->entries = entries;
+    kh_value(c->dirs, key) = cached;
+    c->regions += cached->region;
+  }
+
+  /* Find (or create) the entry, which holds its own name */
+  khash_t(attr_map)* entries = kh_value(c->dirs, key)->entries;
+  attrs_entry_t* entry;
+
+  khiter_t k = kh_get(attr_map, entries, name);
+  if (k != kh_end(entries)) {
+    entry = kh_value(entries, k);
+
+  } else {
+    size_t len = strlen(name);
+    entry = malloc(sizeof(attrs_entry_t) + len + 1);
+    if (entry == NULL) {
+      goto finish_up;
+    }
+    memcpy(entry->name, name, len + 1);
+    entry->source = NULL;
+
+    k = kh_put(attr_map, entries, entry->name, &ret);
+    if (ret == -1) {
+      free((void*)entry);
+      goto finish_up;
+    }
+
+    kh_value(entries, k) = entry;
+    ++c->count;
+  }
+
+  if (err == 0) {
+    memcpy(&entry->st, st, sizeof(struct stat));
+  }
+  entry->err     = err;
+  entry->expires = now + (final ? c->ttl : CRAMP_ATTRS_PENDING);
+
+  free((void*)entry->source);
+  entry->source = copy;
+  copy = NULL;
+
+finish_up:
+  (void)pthread_rwlock_unlock(&c->lock);
+  free((void*)copy);
+}
+
+/**
+  @brief   Forget a directory's entries, as something in it has changed
+  @param   c    Cache (NULL = No-op)
+  @param   dir  Directory, as a mount path without a trailing slash
+                ("" = Root; NULL = All)
+
+  The region directories of any CRAMs in it (foo.cram.d) are forgotten,
+  too.
+*/
+void cramp_attrs_forget(cramp_attrs_t* c, const char* dir) {
+  if (c == NULL) {
+    return;
+  }
+
+  (void)pthread_rwlock_wrlock(&c->lock);
+
+  if (dir) {
+    khiter_t key = kh_get(attr_dirs, c->dirs, dir);
+    if (key != kh_end(c->dirs)) {
+      attrs_drop(c, key);
+    }
+  }
+
+  /* Region directories are only looked for if there are any */
+  size_t len = dir ? strlen(dir) : 0;
+
+  for (khiter_t key = kh_begin(c->dirs); (dir == NULL || c->regions) && key != kh_end(c->dirs); ++key) {
+    if (!kh_exist(c->dirs, key)) {
+      continue;
+    }
+
+    const attrs_dir_t* cached = kh_value(c->dirs, key);
+    if (dir == NULL || (cached->region && strncmp(cached->key, dir, len) == 0
+                                       && cached->key[len] == '/'
+                                       && strchr(cached->key + len + 1, '/') == NULL)) {
+      attrs_drop(c, key);
+    }
+  }
+
+  (void)pthread_rwlock_unlock(&c->lock);
+}
+
+/**
+  @brief   Free all memory allocated by the cache
+  @param   c  Cache (NULL = No-op)
+*/
+void cramp_attrs_destroy(cramp_attrs_t* c) {
+  if (c == NULL) {
+    return;
+  }
+
+  cramp_attrs_forget(c, NULL);
+  kh_destroy(attr_dirs, c->dirs);
+
+  (void)pthread_rwlock_destroy(&c->lock);
+  free((void*)c);
+}
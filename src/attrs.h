@@ -0,0 +1,28 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#ifndef _CRAMP_ATTRS_H
+#define _CRAMP_ATTRS_H
+
+/* Needed for time_t */
+#include <time.h>
+
+/* Needed for struct stat */
+#include <sys/stat.h>
+
+/* Default attribute cache lifetime (seconds) */
+#define CRAMP_ATTRS_DEFAULT 60
+
+/* Lifetime of attributes with a size that isn't final (seconds) */
+#define CRAMP_ATTRS_PENDING 1
+
+/* Opaque attribute cache */
+typedef struct cramp_attrs cramp_attrs_t;
+
+extern cramp_attrs_t* cramp_attrs_init(time_t);
+extern int            cramp_attrs_get(cramp_attrs_t*, const char*, struct stat*, int*);
+extern void           cramp_attrs_put(cramp_attrs_t*, const char*, const struct stat*, int, int, const char*);
+extern void           cramp_attrs_forget(cramp_attrs_t*, const char*);
+extern void           cramp_attrs_destroy(cramp_attrs_t*);
+
+#endif
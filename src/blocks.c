@@ -0,0 +1,373 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "blocks.h"
+
+#include <htslib/khash.h>
+
+/*
+  NOTES
+
+  Each open virtual BAM converts independently, so several readers of
+  the same file (or one that keeps reopening it) each pay for the same
+  conversion. This is a process wide cache of converted data, shared by
+  all of them, within a fixed memory budget (--block-cache).
+
+  Reads aren't aligned to BGZF blocks, so the cache holds fixed size
+  pages of the virtual BAM instead (CRAMP_BLOCKS_PAGE bytes, at aligned
+  offsets). Pages are keyed by the stat cache key (i.e., CRAM path and
+  compression level), the CRAM's mtime and the page number; a page
+  shorter than the rest is the last in the file. A file's pages are all
+  dropped when they're found to be for a different mtime.
+
+  Pages are evicted least recently used first. Everything happens under
+  one lock; the work under it is a hash lookup and a memcpy of at most
+  a page, per page.
+*/
+
+/**
+  @brief   Cached page
+  @var     file   File the page belongs to
+  @var     index  Page number
+  @var     len    Length of data (less than a page = Last page)
+  @var     data   Data
+  @var     prev   More recently used page (NULL = Most recent)
+  @var     next   Less recently used page (NULL = Least recent)
+*/
+typedef struct blocks_page {
+  struct blocks_file* file;
+  size_t              index;
+  size_t              len;
+  char*               data;
+  struct blocks_page* prev;
+  struct blocks_page* next;
+} blocks_page_t;
+
+/* Initialise page map type (page number => page) */
+KHASH_MAP_INIT_INT64(page_map, blocks_page_t*)
+
+/**
+  @brief   Cached file
+  @var     key    Stat cache key
+  @var     mtime  CRAM mtime the pages are for
+  @var     pages  Pages, by page number
+*/
+typedef struct blocks_file {
+  const char*        key;
+  time_t             mtime;
+  khash_t(page_map)* pages;
+} blocks_file_t;
+
+/* Initialise file map type (stat cache key => file) */
+KHASH_MAP_INIT_STR(file_map, blocks_file_t*)
+
+/**
+  @brief   Converted data cache
+  @var     budget  Memory budget (bytes)
+  @var     used    Memory used by page data (bytes)
+  @var     files   Files, by stat cache key
+  @var     head    Most recently used page
+  @var     tail    Least recently used page
+  @var     lock    Mutex
+*/
+struct cramp_blocks {
+  size_t             budget;
+  size_t             used;
+  khash_t(file_map)* files;
+  blocks_page_t*     head;
+  blocks_page_t*     tail;
+  pthread_mutex_t    lock;
+};
+
+/**
+  @brief   Take a page out of the LRU list
+  @param   b     Cache (locked)
+  @param   page  Page
+*/
+static void blocks_unlink(cramp_blocks_t* b, blocks_page_t* page) {
+  *(page->prev ? &page->prev->next : &b->head) = page->next;
+  *(page->next ? &page->next->prev : &b->tail) = page->prev;
+  page->prev = page->next = NULL;
+}
+
+/**
+  @brief   Put a page at the front of the LRU list
+  @param   b     Cache (locked)
+  @param   page  Page (unlinked)
+*/
+static void blocks_touch(cramp_blocks_t* b, blocks_page_t* page) {
+  page->next = b->head;
+  *(b->head ? &b->head->prev : &b->tail) = page;
+  b->head = page;
+}
+
+/**
+  @brief   Drop a page from the cache
+  @param   b     Cache (locked)
+  @param   page  Page
+*/
+static void blocks_drop(cramp_blocks_t* b, blocks_page_t* page) {
+  khiter_t key = kh_get(page_map, page->file->pages, page->index);
+  if (key != kh_end(page->file->pages)) {
+    kh_del(page_map, page->file->pages, key);
+  }
+
+  blocks_unlink(b, page);
+  b->used -= page->len;
+
+  free((void*)page->data);
+  free((void*)page);
+}
+
+/**
+  @brief   Find a file in the cache
+  @param   b       Cache (locked)
+  @param   source  Stat cache key
+  @param   mtime   CRAM mtime
+  @param   create  Create the file if it's not there (0 = False; 1 = True)
+  @return  Pointer to file (NULL if not found, or on failure)
+
+  If the file's pages are for a different mtime, they're dropped.
+*/
+static blocks_file_t* blocks_file(cramp_blocks_t* b, const char* source, time_t mtime, int create) {
+  blocks_file_t* file = NULL;
+
+  khiter_t key = kh_get(file_map, b->files, source);
+  if (key != kh_end(b->files)) {
+    file = kh_value(b->files, key);
+
+  } else if (create) {
+    size_t len = strlen(source);
+    file = calloc(1, sizeof(blocks_file_t));
+    char* copy = malloc(len + 1);
+    khash_t(page_map)* pages = kh_init(page_map);
+    int ret = -1;
+
+    if (file && copy && pages) {
+      memcpy(copy, source, len + 1);
+      key = kh_put(file_map, b->files, copy, &ret);
+    }
+
+    if (ret == -1) {
+      if (pages) {
+        kh_destroy(page_map, pages);
+      }
+      free((void*)copy);
+      free((void*)file);
+      return NULL;
+    }
+
+    file->key   = copy;
+    file->mtime = mtime;
+    file->pages = pages;
+    kh_value(b->files, key) = file;
+  }
+
+  if (file && file->mtime != mtime) {
+    if (!create) {
+      return NULL;
+    }
+
+    blocks_page_t* page;
+    kh_foreach_value(file->pages, page, blocks_drop(b, page));
+    file->mtime = mtime;
+  }
+
+  return file;
+}
+
+/**
+  @brief   Create a converted data cache
+  @param   budget  Memory budget (bytes)
+  @return  Pointer to cache (NULL on failure)
+*/
+cramp_blocks_t* cramp_blocks_init(size_t budget) {
+  cramp_blocks_t* b = calloc(1, sizeof(cramp_blocks_t));
+  if (b == NULL) {
+    return NULL;
+  }
+
+  b->budget = budget;
+  b->files  = kh_init(file_map);
+  if (b->files == NULL) {
+    free((void*)b);
+    return NULL;
+  }
+
+  (void)pthread_mutex_init(&b->lock, NULL);
+  return b;
+}
+
+/**
+  @brief   Read from the cache
+  @param   b       Cache (NULL = No-op)
+  @param   source  Stat cache key
+  @param   mtime   CRAM mtime
+  @param   buf     Data buffer
+  @param   size    Data size (bytes)
+  @param   offset  Data offset (bytes)
+  @param   eof     Set when the read reached the end of the file
+  @return  Number of bytes read, contiguously from the offset
+*/
+size_t cramp_blocks_read(cramp_blocks_t* b, const char* source, time_t mtime, char* buf, size_t size, off_t offset, int* eof) {
+  size_t copied = 0;
+  *eof = 0;
+
+  if (b == NULL) {
+    return 0;
+  }
+
+  (void)pthread_mutex_lock(&b->lock);
+
+  blocks_file_t* file = blocks_file(b, source, mtime, 0);
+  while (file && copied < size) {
+    off_t  at    = offset + copied;
+    size_t index = at / CRAMP_BLOCKS_PAGE;
+
+    khiter_t key = kh_get(page_map, file->pages, index);
+    if (key == kh_end(file->pages)) {
+      break;
+    }
+
+    blocks_page_t* page = kh_value(file->pages, key);
+    size_t skip = at - (off_t)index * CRAMP_BLOCKS_PAGE;
+
+    if (skip < page->len) {
+      size_t len = page->len - skip;
+      if (len > size - copied) {
+        len = size - copied;
+      }
+
+      memcpy(buf + copied, page->data + skip, len);
+      copied += len;
+    }
+
+    blocks_unlink(b, page);
+    blocks_touch(b, page);
+
+    /* A short page is the last */
+    if (page->len < CRAMP_BLOCKS_PAGE && copied < size) {
+      *eof = 1;
+      break;
+    }
+  }
+
+  (void)pthread_mutex_unlock(&b->lock);
+  return copied;
+}
+
+/**
+  @brief   Check whether a page is cached
+  @param   b       Cache (NULL = No-op)
+  @param   source  Stat cache key
+  @param   mtime   CRAM mtime
+  @param   index   Page number
+  @return  Cached (0 = False; 1 = True)
+*/
+int cramp_blocks_has(cramp_blocks_t* b, const char* source, time_t mtime, size_t index) {
+  int found = 0;
+
+  if (b == NULL) {
+    return 0;
+  }
+
+  (void)pthread_mutex_lock(&b->lock);
+
+  blocks_file_t* file = blocks_file(b, source, mtime, 0);
+  if (file && kh_get(page_map, file->pages, index) != kh_end(file->pages)) {
+    found = 1;
+  }
+
+  (void)pthread_mutex_unlock(&b->lock);
+  return found;
+}
+
+/**
+  @brief   Put a page into the cache
+  @param   b       Cache (NULL = No-op)
+  @param   source  Stat cache key
+  @param   mtime   CRAM mtime
+  @param   index   Page number
+  @param   data    Page data (ownership is taken)
+  @param   len     Length of data (a whole page, unless it's the last)
+
+  Least recently used pages are evicted to make room.
+*/
+void cramp_blocks_put(cramp_blocks_t* b, const char* source, time_t mtime, size_t index, char* data, size_t len) {
+  if (b == NULL || len > b->budget) {
+    free((void*)data);
+    return;
+  }
+
+  (void)pthread_mutex_lock(&b->lock);
+
+  blocks_file_t* file = blocks_file(b, source, mtime, 1);
+  if (file == NULL || kh_get(page_map, file->pages, index) != kh_end(file->pages)) {
+    goto finish_up;
+  }
+
+  while (b->tail && b->used + len > b->budget) {
+    blocks_drop(b, b->tail);
+  }
+
+  blocks_page_t* page = malloc(sizeof(blocks_page_t));
+  if (page == NULL) {
+    goto finish_up;
+  }
+
+  int ret;
+  khiter_t key = kh_put(page_map, file->pages, index, &ret);
+  if (ret == -1) {
+    free((void*)page);
+    goto finish_up;
+  }
+
+  page->file  = file;
+  page->index = index;
+  page->len   = len;
+  page->data  = data;
+  page->prev  = page->next = NULL;
+  kh_value(file->pages, key) = page;
+
+  blocks_touch(b, page);
+  b->used += len;
+  data = NULL;
+
+finish_up:
+  (void)pthread_mutex_unlock(&b->lock);
+  free((void*)data);
+}
+
+/**
+  @brief   Free all memory allocated by the cache
+  @param   b  Cache (NULL = No-op)
+*/
+void cramp_blocks_destroy(cramp_blocks_t* b) {
+  if (b == NULL) {
+    return;
+  }
+
+  while (b->tail) {
+    blocks_drop(b, b->tail);
+  }
+
+  blocks_file_t* file;
+  kh_foreach_value(b->files, file, {
+    kh_destroy(page_map, file->pages);
+    free((void*)file->key);
+    free((void*)file);
+  });
+  kh_destroy(file_map, b->files);
+
+  (void)pthread_mutex_destroy(&b->lock);
+  free((void*)b);
+}
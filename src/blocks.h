@@ -0,0 +1,25 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#ifndef _CRAMP_BLOCKS_H
+#define _CRAMP_BLOCKS_H
+
+/* Needed for off_t and size_t */
+#include <sys/types.h>
+
+/* Needed for time_t */
+#include <time.h>
+
+/* Size of a cached page of virtual BAM data */
+#define CRAMP_BLOCKS_PAGE (64 * 1024)
+
+/* Opaque converted data cache */
+typedef struct cramp_blocks cramp_blocks_t;
+
+extern cramp_blocks_t* cramp_blocks_init(size_t);
+extern size_t          cramp_blocks_read(cramp_blocks_t*, const char*, time_t, char*, size_t, off_t, int*);
+extern int             cramp_blocks_has(cramp_blocks_t*, const char*, time_t, size_t);
+extern void            cramp_blocks_put(cramp_blocks_t*, const char*, time_t, size_t, char*, size_t);
+extern void            cramp_blocks_destroy(cramp_blocks_t*);
+
+#endif
@@ -4,11 +4,17 @@
 #include "config.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -18,6 +24,1096 @@
 #include "log.h"
 #include "util.h"
 
+#include <htslib/hts.h>
+#include <htslib/khash.h>
+
+/*
+  NOTES
+
+  The cache is shared between FUSE threads, which look it up on every
+  getattr and readdir, and the conversions, precalculation workers and
+  watcher that update it. It's split into shards, by a hash of the key,
+  each with its own readers-writer lock, so lookups only share a lock
+  (and then only with lookups of keys in the same shard) and updates
+  only exclude the shard they're in.
+
+  Records never leave their shard's lock: cramp_cache_get copies them
+  out, and everything else copies out just what it needs. The one
+  exception to lookups being shared is a record that's only in the
+  mapped cache file, which is loaded into its shard under the exclusive
+  lock the first time it's looked up.
+
+  Sizes take a long time to calculate, so they're not only written out
+  at unmount: every update and eviction is also appended to a journal
+  beside the cache file (with a ".journal" suffix), under the shard's
+  lock, in a single write. A compaction thread folds the journal into
+  the cache file (see cramp_cache_write) once it's grown long enough, or
+  has had something in it for long enough; the journal is truncated
+  while every shard is still locked, so nothing's lost in between. At
+  mount, the journal is replayed over the cache file. An entry that was
+  torn by a crash fails its checksum, and it and anything after it are
+  discarded.
+
+  Records are keyed by the CRAM's fingerprint, rather than its path, so
+  CRAMs that are renamed, or linked into other trees, are still cached.
+  The fingerprint is a hash of the CRAM's inode, size and mtime (to the
+  nanosecond), its first CACHE_FP_PREFIX bytes (the file definition and
+  the first container, i.e., the header) and the HTSLib version, which
+  determines the conversion. The device isn't hashed, as its number
+  needn't survive a reboot (e.g., on NFS), but aliases made since
+  mounting still match it. The compression level, view
+  or region are then suffixed to that, as they were to the path.
+
+  Paths are just aliases for fingerprints, remembered for as long as the
+  CRAM's stat information is unchanged, so the CRAM's only read again
+  when it's changed. A CRAM that can't be fingerprinted (e.g., it's
+  unreadable) is keyed by its path, as before. Every key is made via an
+  alias, so they're sharded by path too, under their own readers-writer
+  locks, and lookups only wait on aliases being added or forgotten.
+
+  Whether it's really a CRAM (i.e., it starts with the magic number) is
+  remembered with the alias, too, as that's on hand when it's read, so
+  repeated directory listings don't open anything.
+
+  Aliases are kept in the cache file and journaled, like records (but
+  without the device, whose number needn't survive a reboot), so that
+  holds across mounts too: an alias that's not in memory is looked up in
+  the mapped cache file. Forgetting an alias leaves a marker in its
+  place, which is journaled, so the cache file's copy stays hidden.
+*/
+
+/* Initialise hash table type (cache key => record) */
+KHASH_MAP_INIT_STR(stat_hash, cramp_stat_t*)
+
+/* Number of cache shards (a power of two) */
+#define CACHE_SHARDS 32
+
+/**
+  @brief   Cache shard
+  @var     lock  Readers-writer lock
+  @var     hash  Records, by cache key
+*/
+typedef struct cache_shard {
+  pthread_rwlock_t    lock;
+  khash_t(stat_hash)* hash;
+} cache_shard_t;
+
+/* Journal entries, or seconds with any, before the journal is compacted */
+#define CACHE_JOURNAL_MAX      4096
+#define CACHE_JOURNAL_INTERVAL 300
+
+/**
+  @brief   Journal entry (followed by its key, without a NUL)
+  @var     keylen  Length of the key
+  @var     check   Checksum of the key and the other fields
+  @var     mtime   CRAM mtime
+  @var     size    Converted BAM size (0 = Evicted)
+*/
+typedef struct cache_journal_entry {
+  uint32_t keylen;
+  uint32_t check;
+  int64_t  mtime;
+  int64_t  size;
+} cache_journal_entry_t;
+
+/**
+  @brief   Stored path alias (see cache_alias_t)
+  @var     ino   Inode
+  @var     size  Size
+  @var     sec   mtime (seconds)
+  @var     nsec  mtime (nanoseconds)
+  @var     fp    Fingerprint
+  @var     cram  Starts with the CRAM magic number (0 = False; 1 = True;
+                 -1 = Forgotten)
+*/
+typedef struct cache_stored_alias {
+  uint64_t ino;
+  int64_t  size;
+  int64_t  sec;
+  int64_t  nsec;
+  uint64_t fp;
+  int64_t  cram;
+} cache_stored_alias_t;
+
+/* Flag on the length of a journal alias entry's path, which tells it
+   apart from a record's entry (n.b., keys are never that long)       */
+#define CACHE_JOURNAL_ALIAS 0x80000000U
+
+/**
+  @brief   Journal alias entry (followed by its path, without a NUL)
+  @var     pathlen  Length of the path, with CACHE_JOURNAL_ALIAS set
+  @var     check    Checksum of the path and the other fields
+  @var     alias    Alias
+*/
+typedef struct cache_journal_alias {
+  uint32_t             pathlen;
+  uint32_t             check;
+  cache_stored_alias_t alias;
+} cache_journal_alias_t;
+
+/**
+  @brief   CRAM stat cache
+  @var     shards     Shards, by hash of the cache key
+  @var     path       Cache file (NULL = Not journaling)
+  @var     journal    Journal file descriptor (-1 = Not journaling)
+  @var     pending    Number of journal entries since the last compaction
+  @var     stop       Stop the compaction thread (0 = False; 1 = True)
+  @var     lock       Mutex (for pending and stop)
+  @var     wake       Condition to wake the compaction thread
+  @var     writing    Mutex, held while the cache file's written
+  @var     running    Compaction thread is running (0 = False; 1 = True)
+  @var     compactor  Compaction thread
+*/
+struct cramp_cache {
+  cache_shard_t   shards[CACHE_SHARDS];
+  const char*     path;
+  int             journal;
+  size_t          pending;
+  int             stop;
+  pthread_mutex_t lock;
+  pthread_cond_t  wake;
+  pthread_mutex_t writing;
+  int             running;
+  pthread_t       compactor;
+};
+
+/* Bytes at the start of a CRAM that are fingerprinted */
+#define CACHE_FP_PREFIX (64 * 1024)
+
+/* Length of a fingerprint key ("fp", 16 hex digits and a NUL) */
+#define CACHE_FP_LEN 19
+
+/**
+  @brief   Path alias for a CRAM's fingerprint
+  @var     dev    Device (0 = Unknown, as it's not stored)
+  @var     ino    Inode
+  @var     size   Size
+  @var     mtime  mtime (n.b., with nanoseconds)
+  @var     fp     Fingerprint
+  @var     cram   Starts with the CRAM magic number (0 = False; 1 = True;
+                  -1 = Forgotten, so it hides the cache file's alias)
+*/
+typedef struct cache_alias {
+  dev_t           dev;
+  ino_t           ino;
+  off_t           size;
+  struct timespec mtime;
+  uint64_t        fp;
+  int             cram;
+} cache_alias_t;
+
+/* Initialise alias map type (CRAM path => alias) */
+KHASH_MAP_INIT_STR(alias_map, cache_alias_t)
+
+/* Number of alias shards (a power of two) */
+#define ALIAS_SHARDS 32
+
+/**
+  @brief   Alias shard
+  @var     lock     Readers-writer lock
+  @var     aliases  Aliases, by CRAM path (NULL until one's added)
+*/
+typedef struct alias_shard {
+  pthread_rwlock_t    lock;
+  khash_t(alias_map)* aliases;
+} alias_shard_t;
+
+/* Path aliases, shared by everything that makes cache keys (with their
+   locks initialised once)                                              */
+static alias_shard_t  cache_aliases[ALIAS_SHARDS];
+static pthread_once_t alias_once = PTHREAD_ONCE_INIT;
+
+/* How a record is looked up (see cache_lock_record) */
+enum cache_mode {
+  cache_read,   /* Shared lock */
+  cache_write,  /* Exclusive lock */
+  cache_create  /* Exclusive lock, creating the record if need be */
+};
+
+/* Magic number, version and byte order mark of the cache file format
+   n.b., Version 1 files were keyed by path, and version 2 files didn't
+   have aliases, so they're ignored                                     */
+#define CACHE_MAGIC   "13AMPSC\n"
+#define CACHE_VERSION 3
+#define CACHE_ORDER   0x01020304
+
+/**
+  @brief   Cache file header
+  @var     magic     Magic number (CACHE_MAGIC)
+  @var     version   Format version (CACHE_VERSION)
+  @var     order     Byte order mark (CACHE_ORDER, in the writer's order)
+  @var     nslots    Number of record slots (a power of two)
+  @var     nrecords  Number of records
+  @var     naslots   Number of alias slots (a power of two)
+  @var     aliases   Offset of the alias slots
+  @var     strings   Offset of the string table
+  @var     strlen    Length of the string table
+  @var     check     Checksum of the preceding fields
+*/
+typedef struct cache_file_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t order;
+  uint64_t nslots;
+  uint64_t nrecords;
+  uint64_t naslots;
+  uint64_t aliases;
+  uint64_t strings;
+  uint64_t strlen;
+  uint64_t check;
+} cache_file_header_t;
+
+/**
+  @brief   Cache file record slot
+  @var     hash    Hash of the key (0 = Empty slot)
+  @var     key     Offset of the key in the string table
+  @var     keylen  Length of the key (n.b., it's also NUL terminated)
+  @var     check   Checksum of the key and the other fields
+  @var     mtime   CRAM mtime
+  @var     size    Converted BAM size
+*/
+typedef struct cache_file_record {
+  uint64_t hash;
+  uint64_t key;
+  uint32_t keylen;
+  uint32_t check;
+  int64_t  mtime;
+  int64_t  size;
+} cache_file_record_t;
+
+/**
+  @brief   Cache file alias slot
+  @var     hash     Hash of the path (0 = Empty slot)
+  @var     path     Offset of the path in the string table
+  @var     pathlen  Length of the path (n.b., it's also NUL terminated)
+  @var     check    Checksum of the path and the other fields
+  @var     alias    Alias
+*/
+typedef struct cache_file_alias {
+  uint64_t             hash;
+  uint64_t             path;
+  uint32_t             pathlen;
+  uint32_t             check;
+  cache_stored_alias_t alias;
+} cache_file_alias_t;
+
+/**
+  @brief   Memory mapped cache file
+  @var     base     Start of the mapping (NULL = Nothing mapped)
+  @var     len      Length of the mapping
+  @var     header   File header
+  @var     slots    Record slots
+  @var     aliases  Alias slots
+  @var     strings  String table
+*/
+static struct {
+  void*                      base;
+  size_t                     len;
+  const cache_file_header_t* header;
+  const cache_file_record_t* slots;
+  const cache_file_alias_t*  aliases;
+  const char*                strings;
+} cache_map;
+
+/* Cache whose journal aliases are appended to (NULL = None), as they're
+   shared by the whole process, like the mapped cache file              */
+static cramp_cache_t* cache_journaled = NULL;
+
+/**
+  @brief   64-bit FNV-1a hash
+  @param   hash  Hash so far (start with CACHE_FNV_BASIS)
+  @param   data  Data
+  @param   len   Length of data
+  @return  Hash
+*/
+#define CACHE_FNV_BASIS 0xcbf29ce484222325ULL
+static uint64_t cache_fnv(uint64_t hash, const void* data, size_t len) {
+  const unsigned char* c = data;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= c[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/**
+  @brief   Hash of a cache key, for the cache file
+  @param   key  Cache key
+  @param   len  Length of key
+  @return  Hash (never 0, which marks an empty slot)
+*/
+static uint64_t cache_file_hash(const char* key, size_t len) {
+  uint64_t hash = cache_fnv(CACHE_FNV_BASIS, key, len);
+  return hash ? hash : 1;
+}
+
+/**
+  @brief   Checksum of a cache file record
+  @param   record  Record
+  @param   key     Record's key
+  @return  Checksum
+*/
+static uint32_t cache_file_check(const cache_file_record_t* record, const char* key) {
+  uint64_t check = cache_fnv(CACHE_FNV_BASIS, key, record->keylen);
+  check = cache_fnv(check, &record->hash,  sizeof(record->hash));
+  check = cache_fnv(check, &record->mtime, sizeof(record->mtime));
+  check = cache_fnv(check, &record->size,  sizeof(record->size));
+  return (uint32_t)(check ^ (check >> 32));
+}
+
+/**
+  @brief   Find a record in the mapped cache file
+  @param   source  Cache key
+  @return  Pointer to record (NULL if not found, or it's corrupt)
+*/
+static const cache_file_record_t* cache_map_find(const char* source) {
+  if (cache_map.base == NULL) {
+    return NULL;
+  }
+
+  size_t   len  = strlen(source);
+  uint64_t hash = cache_file_hash(source, len);
+  uint64_t mask = cache_map.header->nslots - 1;
+
+  /* Linear probing, up to an empty slot */
+  for (uint64_t i = 0; i <= mask; ++i) {
+    const cache_file_record_t* record = &cache_map.slots[(hash + i) & mask];
+    if (record->hash == 0) {
+      break;
+    }
+
+    if (record->hash == hash && record->keylen == len
+     && record->key + len < cache_map.header->strlen) {
+      const char* key = cache_map.strings + record->key;
+      if (memcmp(key, source, len) == 0) {
+        return (cache_file_check(record, key) == record->check) ? record : NULL;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  @brief   Checksum of a stored alias
+  @param   path   CRAM file
+  @param   len    Length of path
+  @param   tag    Cache file slot's hash, or journal entry's path length
+  @param   alias  Stored alias
+  @return  Checksum
+*/
+static uint32_t cache_alias_check(const char* path, size_t len, uint64_t tag, const cache_stored_alias_t* alias) {
+  uint64_t check = cache_fnv(CACHE_FNV_BASIS, path, len);
+  check = cache_fnv(check, &tag,  sizeof(tag));
+  check = cache_fnv(check, alias, sizeof(*alias));
+  return (uint32_t)(check ^ (check >> 32));
+}
+
+/**
+  @brief   Find an alias in the mapped cache file
+  @param   source  CRAM file
+  @return  Pointer to alias slot (NULL if not found, or it's corrupt)
+*/
+static const cache_file_alias_t* cache_map_alias(const char* source) {
+  if (cache_map.base == NULL) {
+    return NULL;
+  }
+
+  size_t   len  = strlen(source);
+  uint64_t hash = cache_file_hash(source, len);
+  uint64_t mask = cache_map.header->naslots - 1;
+
+  /* Linear probing, up to an empty slot */
+  for (uint64_t i = 0; i <= mask; ++i) {
+    const cache_file_alias_t* slot = &cache_map.aliases[(hash + i) & mask];
+    if (slot->hash == 0) {
+      break;
+    }
+
+    if (slot->hash == hash && slot->pathlen == len
+     && slot->path + len < cache_map.header->strlen) {
+      const char* path = cache_map.strings + slot->path;
+      if (memcmp(path, source, len) == 0) {
+        return (cache_alias_check(path, len, hash, &slot->alias) == slot->check) ? slot : NULL;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  @brief   Append an entry to the journal
+  @param   cache  CRAM stat cache
+  @param   entry  Entry (and its key or path)
+  @param   len    Length of entry
+  @return  Appended (0 = False; 1 = True)
+
+  The entry is written in one go, to a file opened for appending, so
+  entries from different shards don't interleave.
+*/
+static int cache_journal_append(cramp_cache_t* cache, const void* entry, size_t len) {
+  if (write(cache->journal, entry, len) != (ssize_t)len) {
+    return 0;
+  }
+
+  (void)pthread_mutex_lock(&cache->lock);
+  if (++cache->pending == CACHE_JOURNAL_MAX) {
+    (void)pthread_cond_signal(&cache->wake);
+  }
+  (void)pthread_mutex_unlock(&cache->lock);
+  return 1;
+}
+
+/**
+  @brief   Initialise the alias shards' locks
+*/
+static void alias_init(void) {
+  for (int i = 0; i < ALIAS_SHARDS; ++i) {
+    (void)pthread_rwlock_init(&cache_aliases[i].lock, NULL);
+  }
+}
+
+/**
+  @brief   Alias shard for a CRAM's path
+  @param   source  CRAM file
+  @return  Pointer to its shard
+*/
+static alias_shard_t* alias_shard(const char* source) {
+  (void)pthread_once(&alias_once, alias_init);
+
+  uint64_t hash = cache_file_hash(source, strlen(source));
+  return &cache_aliases[(hash ^ (hash >> 32)) & (ALIAS_SHARDS - 1)];
+}
+
+/**
+  @brief   Check whether an alias still matches its CRAM
+  @param   alias  Alias
+  @param   st     CRAM's stat information
+  @return  Matches (0 = False; 1 = True)
+*/
+static int alias_matches(const cache_alias_t* alias, const struct stat* st) {
+  return (alias->dev == 0 || alias->dev == st->st_dev)
+      && alias->ino           == st->st_ino
+      && alias->size          == st->st_size
+      && alias->mtime.tv_sec  == st->st_mtim.tv_sec
+      && alias->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+  @brief   Alias from its stored form
+  @param   stored  Stored alias
+  @return  Alias (of an unknown device)
+*/
+static cache_alias_t alias_load(const cache_stored_alias_t* stored) {
+  cache_alias_t alias = {
+    0, (ino_t)stored->ino, (off_t)stored->size,
+    {(time_t)stored->sec, (long)stored->nsec},
+    stored->fp, (int)stored->cram
+  };
+  return alias;
+}
+
+/**
+  @brief   Stored form of an alias
+  @param   alias  Alias
+  @return  Stored alias
+*/
+static cache_stored_alias_t alias_store(const cache_alias_t* alias) {
+  cache_stored_alias_t stored = {
+    (uint64_t)alias->ino, (int64_t)alias->size,
+    (int64_t)alias->mtime.tv_sec, (int64_t)alias->mtime.tv_nsec,
+    alias->fp, (int64_t)alias->cram
+  };
+  return stored;
+}
+
+/**
+  @brief   Add or replace a CRAM's path alias
+  @param   shard   Its shard (locked exclusively)
+  @param   source  CRAM file
+  @param   alias   Alias
+  @return  Added (0 = False; 1 = True)
+*/
+static int alias_put(alias_shard_t* shard, const char* source, const cache_alias_t* alias) {
+  if (shard->aliases == NULL) {
+    shard->aliases = kh_init(alias_map);
+    if (shard->aliases == NULL) {
+      return 0;
+    }
+  }
+
+  int ret = 0;
+  khiter_t key = kh_get(alias_map, shard->aliases, source);
+
+  if (key == kh_end(shard->aliases)) {
+    size_t srclen = strlen(source);
+    char*  copy   = malloc(srclen + 1);
+    if (copy == NULL) {
+      return 0;
+    }
+
+    memcpy(copy, source, srclen + 1);
+    key = kh_put(alias_map, shard->aliases, copy, &ret);
+    if (ret == -1) {
+      free((void*)copy);
+      return 0;
+    }
+  }
+
+  kh_value(shard->aliases, key) = *alias;
+  return 1;
+}
+
+/**
+  @brief   Append a CRAM's path alias to the journal
+  @param   source  CRAM file (with its shard locked exclusively)
+  @param   alias   Alias
+*/
+static void alias_journal(const char* source, const cache_alias_t* alias) {
+  cramp_cache_t* cache = cache_journaled;
+  if (cache == NULL || cache->journal == -1) {
+    return;
+  }
+
+  size_t len = strlen(source);
+  cache_journal_alias_t* entry = malloc(sizeof(cache_journal_alias_t) + len);
+  if (entry == NULL) {
+    return;
+  }
+
+  entry->pathlen = (uint32_t)len | CACHE_JOURNAL_ALIAS;
+  entry->alias   = alias_store(alias);
+  entry->check   = cache_alias_check(source, len, entry->pathlen, &entry->alias);
+  memcpy(entry + 1, source, len);
+
+  if (!cache_journal_append(cache, entry, sizeof(cache_journal_alias_t) + len)) {
+    LOG("Couldn't journal the alias %s", source);
+  }
+  free((void*)entry);
+}
+
+/**
+  @brief   Forget a CRAM's path alias
+  @param   source  CRAM file
+  @param   fp      Pointer to be set to its fingerprint (NULL = Don't care)
+  @return  Alias found (0 = False; 1 = True)
+
+  The alias is kept, marked as forgotten, so the cache file's copy of
+  it is hidden too; that's journaled, so it stays forgotten.
+*/
+static int cache_unalias(const char* source, uint64_t* fp) {
+  cache_alias_t  alias;
+  int            found = 0;
+  alias_shard_t* shard = alias_shard(source);
+
+  (void)pthread_rwlock_wrlock(&shard->lock);
+
+  khash_t(alias_map)* aliases = shard->aliases;
+  khiter_t key = aliases ? kh_get(alias_map, aliases, source) : 0;
+  if (aliases && key != kh_end(aliases)) {
+    alias = kh_value(aliases, key);
+    found = alias.cram != -1;
+  } else {
+    const cache_file_alias_t* stored = cache_map_alias(source);
+    if (stored) {
+      alias = alias_load(&stored->alias);
+      found = alias.cram != -1;
+    }
+  }
+
+  if (found) {
+    if (fp) {
+      *fp = alias.fp;
+    }
+
+    alias.cram = -1;
+    if (alias_put(shard, source, &alias)) {
+      alias_journal(source, &alias);
+    }
+  }
+
+  (void)pthread_rwlock_unlock(&shard->lock);
+  return found;
+}
+
+/**
+  @brief   Fingerprint a CRAM file
+  @param   source  CRAM file
+  @param   peek    Only use the alias; don't read the CRAM (0 = False; 1 = True)
+  @param   fp      Pointer to be set to its fingerprint
+  @param   cram    Pointer to be set to whether it's a CRAM (1 = Yes;
+                   0 = No; -ENOENT = It's gone)
+  @return  Fingerprinted (0 = False, with errno; 1 = True)
+
+  The path's alias is used if the CRAM's stat information still matches
+  it (or the CRAM's gone, so its records can still be found); otherwise,
+  the CRAM is fingerprinted afresh and the alias updated (and journaled).
+  An alias that's not in memory is looked up in the cache file, so the
+  CRAMs of a previous mount aren't read again.
+*/
+static int cache_fingerprint(const char* source, int peek, uint64_t* fp, int* cram) {
+  struct stat st;
+  int found = 0;
+  int gone  = stat(source, &st) == -1;
+  int errsav = errno;
+  alias_shard_t* shard = alias_shard(source);
+
+  /* Lookups only share the shard, so they don't hold each other up */
+  (void)pthread_rwlock_rdlock(&shard->lock);
+
+  cache_alias_t alias;
+  int known = 0;
+
+  khash_t(alias_map)* aliases = shard->aliases;
+  khiter_t key = aliases ? kh_get(alias_map, aliases, source) : 0;
+  if (aliases && key != kh_end(aliases)) {
+    alias = kh_value(aliases, key);
+    known = 1;
+  } else {
+    const cache_file_alias_t* stored = cache_map_alias(source);
+    if (stored) {
+      alias = alias_load(&stored->alias);
+      known = 1;
+    }
+  }
+
+  if (known && alias.cram != -1 && (gone || alias_matches(&alias, &st))) {
+    *fp   = alias.fp;
+    *cram = gone ? -ENOENT : alias.cram;
+    found = 1;
+  }
+
+  (void)pthread_rwlock_unlock(&shard->lock);
+
+  if (found || gone || peek) {
+    errno = gone ? errsav : ENOENT;
+    return found;
+  }
+
+  /* Hash the stat information, HTSLib version and start of the CRAM */
+  size_t  len = (st.st_size < CACHE_FP_PREFIX) ? (size_t)st.st_size : CACHE_FP_PREFIX;
+  char*   buf = malloc(len + 1);
+  int     fd  = open(source, O_RDONLY | O_CLOEXEC);
+  ssize_t got = (buf && fd != -1) ? pread(fd, buf, len, 0) : -1;
+
+  errsav = (got == -1) ? errno : EIO;
+  if (fd != -1) {
+    (void)close(fd);
+  }
+
+  if (got != (ssize_t)len) {
+    free((void*)buf);
+    errno = errsav;
+    return 0;
+  }
+
+  uint64_t fields[] = {
+    (uint64_t)st.st_ino, (uint64_t)st.st_size,
+    (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec
+  };
+
+  const char* version = hts_version();
+  uint64_t hash = cache_fnv(CACHE_FNV_BASIS, fields, sizeof(fields));
+  hash = cache_fnv(hash, version, strlen(version));
+  hash = cache_fnv(hash, buf, len);
+
+  alias = (cache_alias_t){
+    st.st_dev, st.st_ino, st.st_size, st.st_mtim, hash,
+    len >= 4 && memcmp(buf, "CRAM", 4) == 0
+  };
+  free((void*)buf);
+
+  /* Remember it (n.b., failing to is harmless) */
+  (void)pthread_rwlock_wrlock(&shard->lock);
+  if (alias_put(shard, source, &alias)) {
+    alias_journal(source, &alias);
+  }
+  (void)pthread_rwlock_unlock(&shard->lock);
+
+  *fp   = hash;
+  *cram = alias.cram;
+  return 1;
+}
+
+/**
+  @brief   Cache key for a decoding view of a CRAM, at a compression level
+  @param   base   CRAM's fingerprint, or path
+  @param   level  BGZF compression level (-1 = Default)
+  @param   view   Decoding view
+  @return  malloc'd key (NULL on failure)
+
+  Conversions at different levels have different sizes, so explicit
+  levels are suffixed (e.g., "fp0123456789abcdef@l1"), as are views other
+  than the full one (e.g., "fp0123456789abcdef@vnoqual").
+*/
+static const char* cache_view_key(const char* base, int level, enum cramp_view view) {
+  const char* name = (view == view_full) ? "" : cramp_view_name(view);
+  size_t len = strlen(base);
+  size_t namelen = strlen(name);
+
+  char* key = malloc(len + namelen + 7);
+  if (key) {
+    char* k = key + len;
+    memcpy(key, base, len + 1);
+    if (level >= 0) {
+      k += snprintf(k, 4, "@l%d", level);
+    }
+    if (namelen) {
+      *k++ = '@';
+      *k++ = 'v';
+      memcpy(k, name, namelen + 1);
+    }
+  }
+
+  return key;
+}
+
+/**
+  @brief   Base of the cache keys for a CRAM file
+  @param   source  CRAM file
+  @param   peek    Only use the alias; don't read the CRAM (0 = False; 1 = True)
+  @param   base    Buffer for the fingerprint (CACHE_FP_LEN bytes)
+  @return  Fingerprint, or the path if it can't be taken (NULL if peeking)
+*/
+static const char* cache_base(const char* source, int peek, char* base) {
+  uint64_t fp;
+  int cram;
+  if (!cache_fingerprint(source, peek, &fp, &cram)) {
+    return peek ? NULL : source;
+  }
+
+  (void)snprintf(base, CACHE_FP_LEN, "fp%016" PRIx64, fp);
+  return base;
+}
+
+/**
+  @brief   Cache key for a decoding view of a CRAM file, at a compression level
+  @param   source  CRAM file
+  @param   level   BGZF compression level (-1 = Default)
+  @param   view    Decoding view
+  @return  malloc'd key (NULL on failure)
+
+  This is the CRAM's fingerprint (or, failing that, its path), suffixed
+  per cache_view_key (e.g., "fp0123456789abcdef@l1@vnoqual").
+*/
+const char* cramp_cache_view_key(const char* source, int level, enum cramp_view view) {
+  char base[CACHE_FP_LEN];
+  return cache_view_key(cache_base(source, 0, base), level, view);
+}
+
+/**
+  @brief   Cache key for a decoding view of a CRAM file, if it's known
+  @param   source  CRAM file
+  @param   level   BGZF compression level (-1 = Default)
+  @param   view    Decoding view
+  @return  malloc'd key (NULL if the CRAM hasn't been fingerprinted since
+           it last changed, or on failure)
+
+  As cramp_cache_view_key, but without reading the CRAM.
+*/
+const char* cramp_cache_peek_key(const char* source, int level, enum cramp_view view) {
+  char base[CACHE_FP_LEN];
+  const char* from = cache_base(source, 1, base);
+  return from ? cache_view_key(from, level, view) : NULL;
+}
+
+/**
+  @brief   Cache key for a CRAM file, converted at a compression level
+  @param   source  CRAM file
+  @param   level   BGZF compression level (-1 = Default)
+  @return  malloc'd key (NULL on failure)
+*/
+const char* cramp_cache_key(const char* source, int level) {
+  return cramp_cache_view_key(source, level, view_full);
+}
+
+/**
+  @brief   Check whether a file is a CRAM, by its magic number
+  @param   source  File
+  @return  1 = Yep; 0 = Nope; -errno = Error
+
+  The file's read (and fingerprinted) only if it's changed since it was
+  last checked.
+*/
+int cramp_cache_is_cram(const char* source) {
+  uint64_t fp;
+  int cram;
+  return cache_fingerprint(source, 0, &fp, &cram) ? cram : -errno;
+}
+
+/**
+  @brief   Cache key for a region of a CRAM file, at a compression level
+  @param   source  CRAM file
+  @param   level   BGZF compression level (-1 = Default)
+  @param   region  Region (e.g., "chr1:1-5000000")
+  @return  malloc'd key (NULL on failure)
+
+  Regions are suffixed to the file's key, per cramp_cache_key (i.e., the
+  CRAM's fingerprint, or its path if it can't be taken, with any level),
+  after "@r" (e.g., "fp0123456789abcdef@l1@rchr1%3A1-10"). The binary
+  cache file stores keys verbatim, but ":" and "%" are still percent
+  encoded, as they were for the old text format, so a region imported
+  from it only has its path swapped for the fingerprint (see
+  cache_rekey).
+*/
+const char* cramp_cache_region_key(const char* source, int level, const char* region) {
+  const char* base = cramp_cache_key(source, level);
+  if (base == NULL) {
+    return NULL;
+  }
+
+  size_t len = strlen(base);
+  size_t reglen = 0;
+  for (const char* c = region; *c; ++c) {
+    reglen += (*c == ':' || *c == '%') ? 3 : 1;
+  }
+
+  char* key = malloc(len + reglen + 3);
+  if (key) {
+    char* k = key + len;
+    memcpy(key, base, len);
+    *k++ = '@';
+    *k++ = 'r';
+
+    for (const char* c = region; *c; ++c) {
+      if (*c == ':' || *c == '%') {
+        k += sprintf(k, "%%%02X", (unsigned char)*c);
+      } else {
+        *k++ = *c;
+      }
+    }
+    *k = '\0';
+  }
+
+  free((void*)base);
+  return key;
+}
+
+/**
+  @brief   Drop the header blocks and BAI index of a record
+  @param   record  Record (locked)
+*/
+static void cache_forget(cramp_stat_t* record) {
+  free((void*)record->header);
+  free((void*)record->bai);
+  record->header = record->bai    = NULL;
+  record->hlen   = record->bailen = 0;
+}
+
+/**
+  @brief   Reset a record that's for a different mtime
+  @param   record  Record (locked)
+  @param   mtime   CRAM mtime
+
+  Everything in an out of date record is dropped (i.e., it's uncached).
+*/
+static void cache_reset(cramp_stat_t* record, time_t mtime) {
+  if (record->mtime != mtime) {
+    cramp_index_destroy(record->index);
+    record->index = NULL;
+    record->mtime = mtime;
+    record->size  = 0;
+    cache_forget(record);
+  }
+}
+
+/**
+  @brief   Shard of the cache that holds a key
+  @param   cache   CRAM stat cache
+  @param   source  CRAM file
+  @return  Pointer to shard
+*/
+static cache_shard_t* cache_shard(cramp_cache_t* cache, const char* source) {
+  uint64_t hash = cache_file_hash(source, strlen(source));
+  return &cache->shards[(hash ^ (hash >> 32)) & (CACHE_SHARDS - 1)];
+}
+
+/**
+  @brief   Create a record in a shard by source
+  @param   hash    Shard's records (locked)
+  @param   source  CRAM file (not already in the hash)
+  @return  Pointer to zeroed record (NULL on failure)
+*/
+static cramp_stat_t* cache_insert(khash_t(stat_hash)* hash, const char* source) {
+  int ret;
+
+  /* Create a new record, with its own copy of the key */
+  size_t len = strlen(source);
+  const char* newsrc = malloc(len + 1);
+  cramp_stat_t* record = calloc(1, sizeof(cramp_stat_t));
+  if (newsrc == NULL || record == NULL) {
+    free((void*)newsrc);
+    free((void*)record);
+    return NULL;
+  }
+  memcpy((void*)newsrc, source, len + 1);
+
+  khiter_t key = kh_put(stat_hash, hash, newsrc, &ret);
+  if (ret == -1) {
+    free((void*)newsrc);
+    free((void*)record);
+    return NULL;
+  }
+
+  kh_value(hash, key) = record;
+  return record;
+}
+
+/**
+  @brief   Find a record in a shard by source
+  @param   hash    Shard's records (locked)
+  @param   source  CRAM file
+  @return  Pointer to record (NULL if not found)
+
+  Records that are only in the cache file are loaded into the hash on
+  first use (so the shard must be locked exclusively), so they can be
+  updated like any other. Records in the hash shadow those in the file.
+*/
+static cramp_stat_t* cache_find(khash_t(stat_hash)* hash, const char* source) {
+  khiter_t key = kh_get(stat_hash, hash, source);
+  if (key != kh_end(hash)) {
+    return kh_value(hash, key);
+  }
+
+  const cache_file_record_t* disk = cache_map_find(source);
+  if (disk == NULL) {
+    return NULL;
+  }
+
+  cramp_stat_t* record = cache_insert(hash, source);
+  if (record) {
+    record->mtime = (time_t)disk->mtime;
+    record->size  = (off_t)disk->size;
+  }
+
+  return record;
+}
+
+/**
+  @brief   Find or create a record in a shard by source
+  @param   hash    Shard's records (locked)
+  @param   source  CRAM file
+  @return  Pointer to record (NULL on failure)
+
+  New records are zeroed (i.e., uncached, per cramp_cache_stat).
+*/
+static cramp_stat_t* cache_record(khash_t(stat_hash)* hash, const char* source) {
+  cramp_stat_t* record = cache_find(hash, source);
+  return record ? record : cache_insert(hash, source);
+}
+
+/**
+  @brief   Lock the shard that holds a key and find its record
+  @param   cache   CRAM stat cache
+  @param   source  CRAM file
+  @param   mode    How to lock and look up the record
+  @param   shard   Pointer to be set to the shard (unlock it when done)
+  @return  Pointer to record (NULL if not found, or on failure)
+
+  A read that finds the record only in the cache file retakes the lock
+  exclusively, to load it.
+*/
+static cramp_stat_t* cache_lock_record(cramp_cache_t* cache, const char* source, enum cache_mode mode, cache_shard_t** shard) {
+  cache_shard_t* s = cache_shard(cache, source);
+  *shard = s;
+
+  if (mode == cache_read) {
+    (void)pthread_rwlock_rdlock(&s->lock);
+
+    khiter_t key = kh_get(stat_hash, s->hash, source);
+    if (key != kh_end(s->hash)) {
+      return kh_value(s->hash, key);
+    }
+
+    if (cache_map_find(source) == NULL) {
+      return NULL;
+    }
+
+    (void)pthread_rwlock_unlock(&s->lock);
+  }
+
+  (void)pthread_rwlock_wrlock(&s->lock);
+  return (mode == cache_create) ? cache_record(s->hash, source)
+                                : cache_find(s->hash, source);
+}
+
+/**
+  @brief   Checksum of a journal entry
+  @param   entry  Journal entry
+  @param   key    Entry's key
+  @return  Checksum
+*/
+static uint32_t cache_journal_check(const cache_journal_entry_t* entry, const char* key) {
+  uint64_t check = cache_fnv(CACHE_FNV_BASIS, key, entry->keylen);
+  check = cache_fnv(check, &entry->keylen, sizeof(entry->keylen));
+  check = cache_fnv(check, &entry->mtime,  sizeof(entry->mtime));
+  check = cache_fnv(check, &entry->size,   sizeof(entry->size));
+  return (uint32_t)(check ^ (check >> 32));
+}
+
+/**
+  @brief   Append a record's statistics to the journal
+  @param   cache   CRAM stat cache (with the key's shard locked exclusively)
+  @param   source  CRAM file
+  @param   mtime   CRAM mtime
+  @param   size    Converted BAM size (0 = Evicted)
+*/
+static void cache_journal(cramp_cache_t* cache, const char* source, time_t mtime, off_t size) {
+  if (cache->journal == -1) {
+    return;
+  }
+
+  size_t len = strlen(source);
+  cache_journal_entry_t* entry = malloc(sizeof(cache_journal_entry_t) + len);
+  if (entry == NULL) {
+    return;
+  }
+
+  entry->keylen = (uint32_t)len;
+  entry->mtime  = (int64_t)mtime;
+  entry->size   = (int64_t)size;
+  entry->check  = cache_journal_check(entry, source);
+  memcpy(entry + 1, source, len);
+
+  if (!cache_journal_append(cache, entry, sizeof(cache_journal_entry_t) + len)) {
+    LOG("Couldn't journal %s", source);
+  }
+  free((void*)entry);
+}
+
+/**
+  @brief   Create a CRAM stat cache
+  @return  Pointer to cache (NULL on failure)
+*/
+cramp_cache_t* cramp_cache_init(void) {
+  cramp_cache_t* cache = calloc(1, sizeof(cramp_cache_t));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  for (int i = 0; i < CACHE_SHARDS; ++i) {
+    cache->shards[i].hash = kh_init(stat_hash);
+    if (cache->shards[i].hash == NULL) {
+      while (i--) {
+        kh_destroy(stat_hash, cache->shards[i].hash);
+        (void)pthread_rwlock_destroy(&cache->shards[i].lock);
+      }
+      free((void*)cache);
+      return NULL;
+    }
+
+    (void)pthread_rwlock_init(&cache->shards[i].lock, NULL);
+  }
+
+  cache->journal = -1;
+  (void)pthread_mutex_init(&cache->lock, NULL);
+  (void)pthread_cond_init(&cache->wake, NULL);
+  (void)pthread_mutex_init(&cache->writing, NULL);
+
+  return cache;
+}
+
 /**
   @brief   Put record into the cache by source
   @param   cache   CRAM stat cache
@@ -26,52 +1122,457 @@
   @return  1 = Success; 0 = Fail
 */
 int cramp_cache_put(cramp_cache_t* cache, const char* source, cramp_stat_t* record) {
-  int ret;
+  int ret = -1;
+
+  /* Check key doesn't exist (in the hash or the cache file) */
+  cache_shard_t* shard;
+  if (cache_lock_record(cache, source, cache_write, &shard) == NULL) {
+    /* Insert key and set value */
+    khiter_t key = kh_put(stat_hash, shard->hash, source, &ret);
+    if (ret != -1) {
+      kh_value(shard->hash, key) = record;
+      if (record->size) {
+        cache_journal(cache, source, record->mtime, record->size);
+      }
+    }
+  }
+
+  (void)pthread_rwlock_unlock(&shard->lock);
+  return ret != -1;
+}
+
+/**
+  @brief   Get a copy of a record from cache by source
+  @param   cache   CRAM stat cache
+  @param   source  CRAM file
+  @param   copy    Pointer to record to copy into
+  @return  Pointer to copy (NULL if not cached)
+
+  Only the statistics are copied; the index, header and BAI pointers
+  are left NULL (use the accessors for those), but their lengths are.
+*/
+cramp_stat_t* cramp_cache_get(cramp_cache_t* cache, const char* source, cramp_stat_t* copy) {
+  cache_shard_t* shard;
+  cramp_stat_t* record = cache_lock_record(cache, source, cache_read, &shard);
+
+  if (record) {
+    *copy        = *record;
+    copy->index  = NULL;
+    copy->header = copy->bai = NULL;
+  }
+
+  (void)pthread_rwlock_unlock(&shard->lock);
+  return record ? copy : NULL;
+}
 
-  /* Check key doesn't exist */
-  khiter_t key = kh_get(stat_hash, cache, source);
-  if (key != kh_end(cache)) {
+/**
+  @brief   Insert or update a record in the cache by source
+  @param   cache   CRAM stat cache
+  @param   source  CRAM file
+  @param   mtime   CRAM mtime
+  @param   size    Converted BAM size
+  @param   index   Checkpoint index (ownership is taken; may be NULL)
+  @return  1 = Success; 0 = Fail
+
+  The index of an existing record is only replaced if a new one is
+  provided, but it's dropped regardless if the mtime has changed (as its
+  checkpoints no longer apply), as are the header and BAI index.
+*/
+int cramp_cache_update(cramp_cache_t* cache, const char* source, time_t mtime, off_t size, cramp_index_t* index) {
+  cache_shard_t* shard;
+  cramp_stat_t* record = cache_lock_record(cache, source, cache_create, &shard);
+  if (record == NULL) {
+    (void)pthread_rwlock_unlock(&shard->lock);
+    cramp_index_destroy(index);
     return 0;
   }
 
-  /* Insert key */
-  key = kh_put(stat_hash, cache, source, &ret);
-  if (ret == -1) {
+  /* Checkpoint updates don't change anything that's journaled */
+  if (record->mtime != mtime || record->size != size) {
+    cache_journal(cache, source, mtime, size);
+  }
+
+  if (record->mtime != mtime) {
+    if (index == NULL) {
+      cramp_index_destroy(record->index);
+      record->index = NULL;
+    }
+
+    cache_forget(record);
+  }
+  record->mtime = mtime;
+  record->size  = size;
+
+  if (index) {
+    cramp_index_destroy(record->index);
+    record->index = index;
+  }
+
+  (void)pthread_rwlock_unlock(&shard->lock);
+  return 1;
+}
+
+/**
+  @brief   Evict a record from the cache by source
+  @param   cache   CRAM stat cache
+  @param   source  CRAM file
+  @return  1 = Evicted; 0 = Not cached
+
+  The record isn't freed, as it would then be reloaded from the cache
+  file; it's zeroed, which makes it uncached as far as cramp_cache_stat
+  is concerned, and it won't be written to disk.
+*/
+int cramp_cache_evict(cramp_cache_t* cache, const char* source) {
+  int evicted = 0;
+
+  cache_shard_t* shard;
+  cramp_stat_t* record = cache_lock_record(cache, source, cache_write, &shard);
+  if (record) {
+    record->mtime = 0;
+    record->size  = 0;
+    cramp_index_destroy(record->index);
+    record->index = NULL;
+    cache_forget(record);
+    cache_journal(cache, source, 0, 0);
+    evicted = 1;
+  }
+
+  (void)pthread_rwlock_unlock(&shard->lock);
+  return evicted;
+}
+
+/**
+  @brief   Evict a CRAM's records, at every compression level and view
+  @param   cache   CRAM stat cache
+  @param   source  CRAM file
+  @return  Number of records evicted
+
+  The records are found by the fingerprint the CRAM last had (so this
+  works once it's been changed), and the path's alias is forgotten, so
+  it's fingerprinted afresh next time.
+*/
+int cramp_cache_evict_file(cramp_cache_t* cache, const char* source) {
+  int evicted = 0;
+
+  uint64_t fp;
+  char base[CACHE_FP_LEN];
+  const char* from = source;
+  if (cache_unalias(source, &fp)) {
+    (void)snprintf(base, CACHE_FP_LEN, "fp%016" PRIx64, fp);
+    from = base;
+  }
+
+  for (int level = -1; level <= 9; ++level) {
+    for (int view = view_full; view < view_count; ++view) {
+      const char* key = cache_view_key(from, level, view);
+      if (key) {
+        evicted += cramp_cache_evict(cache, key);
+        free((void*)key);
+      }
+    }
+  }
+
+  return evicted;
+}
+
+/**
+  @brief   Forget which fingerprint a CRAM's path is an alias for
+  @param   source  CRAM file
+
+  Its records are left for any other paths to it (e.g., if it's been
+  renamed, or was a link).
+*/
+void cramp_cache_unalias(const char* source) {
+  (void)cache_unalias(source, NULL);
+}
+
+/**
+  @brief   Find the nearest checkpoint at, or before, an offset
+  @param   cache   CRAM stat cache
+  @param   source  CRAM file
+  @param   mtime   CRAM mtime
+  @param   offset  Virtual BAM offset
+  @param   cp      Pointer to checkpoint, to be set if one is found
+  @return  1 = Found; 0 = Not found
+
+  Only checkpoints for the exact mtime are valid, as any change to the
+  CRAM will shift everything around. The checkpoint is copied out, so it
+  stays valid regardless of any concurrent updates.
+*/
+int cramp_cache_checkpoint(cramp_cache_t* cache, const char* source, time_t mtime, off_t offset, cramp_checkpoint_t* cp) {
+  int found = 0;
+
+  cache_shard_t* shard;
+  cramp_stat_t* record = cache_lock_record(cache, source, cache_read, &shard);
+  if (record) {
+    cramp_index_t* index = record->index;
+
+    if (index && index->n && record->mtime == mtime && index->cp[0].bam <= offset) {
+      /* Binary search for the last checkpoint at or before the offset */
+      size_t lo = 0, hi = index->n;
+      while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->cp[mid].bam <= offset) {
+          lo = mid;
+        } else {
+          hi = mid;
+        }
+      }
+
+      *cp = index->cp[lo];
+      found = 1;
+    }
+  }
+
+  (void)pthread_rwlock_unlock(&shard->lock);
+  return found;
+}
+
+/**
+  @brief   Converted BAM size of a cached CRAM
+  @param   cache   CRAM stat cache
+  @param   source  CRAM file
+  @param   mtime   CRAM mtime
+  @return  Size (0 if not cached, or out of date)
+*/
+off_t cramp_cache_size(cramp_cache_t* cache, const char* source, time_t mtime) {
+  off_t size = 0;
+
+  cache_shard_t* shard;
+  cramp_stat_t* record = cache_lock_record(cache, source, cache_read, &shard);
+  if (record) {
+    if (record->mtime == mtime) {
+      size = record->size;
+    }
+  }
+
+  (void)pthread_rwlock_unlock(&shard->lock);
+  return size;
+}
+
+/**
+  @brief   Put the serialised BAM header blocks of a CRAM into the cache
+  @param   cache   CRAM stat cache
+  @param   source  CRAM file
+  @param   mtime   CRAM mtime
+  @param   header  Header blocks (ownership is taken)
+  @param   len     Length of header blocks
+  @return  1 = Success; 0 = Fail
+
+  If the record is for a different mtime, everything else in it is out
+  of date, so it's reset (i.e., uncached, save for the header).
+*/
+int cramp_cache_set_header(cramp_cache_t* cache, const char* source, time_t mtime, char* header, size_t len) {
+  cache_shard_t* shard;
+  cramp_stat_t* record = cache_lock_record(cache, source, cache_create, &shard);
+  if (record == NULL) {
+    (void)pthread_rwlock_unlock(&shard->lock);
+    free((void*)header);
+    return 0;
+  }
+
+  cache_reset(record, mtime);
+
+  free((void*)record->header);
+  record->header = header;
+  record->hlen   = len;
+
+  (void)pthread_rwlock_unlock(&shard->lock);
+  return 1;
+}
+
+/**
+  @brief   Read from the cached BAM header blocks of a CRAM
+  @param   cache   CRAM stat cache
+  @param   source  CRAM file
+  @param   mtime   CRAM mtime
+  @param   buf     Data buffer
+  @param   size    Data size (bytes)
+  @param   offset  Data offset (bytes)
+  @return  Number of bytes read (-1 if the header isn't cached)
+
+  The header blocks are the start of the virtual BAM, so this reads
+  whatever part of the range falls within them (possibly nothing).
+*/
+ssize_t cramp_cache_header(cramp_cache_t* cache, const char* source, time_t mtime, char* buf, size_t size, off_t offset) {
+  ssize_t copied = -1;
+
+  cache_shard_t* shard;
+  cramp_stat_t* record = cache_lock_record(cache, source, cache_read, &shard);
+  if (record) {
+
+    if (record->header && record->mtime == mtime) {
+      copied = 0;
+      if (offset < (off_t)record->hlen) {
+        copied = record->hlen - offset;
+        if ((size_t)copied > size) {
+          copied = size;
+        }
+        memcpy(buf, record->header + offset, copied);
+      }
+    }
+  }
+
+  (void)pthread_rwlock_unlock(&shard->lock);
+  return copied;
+}
+
+/**
+  @brief   Put the BAI index of a CRAM's virtual BAM into the cache
+  @param   cache   CRAM stat cache
+  @param   source  CRAM file
+  @param   mtime   CRAM mtime
+  @param   bai     BAI index (ownership is taken)
+  @param   len     Length of BAI index
+  @return  1 = Success; 0 = Fail
+
+  As with the header, a record for a different mtime is reset.
+*/
+int cramp_cache_set_bai(cramp_cache_t* cache, const char* source, time_t mtime, char* bai, size_t len) {
+  cache_shard_t* shard;
+  cramp_stat_t* record = cache_lock_record(cache, source, cache_create, &shard);
+  if (record == NULL) {
+    (void)pthread_rwlock_unlock(&shard->lock);
+    free((void*)bai);
     return 0;
   }
 
-  /* Set value */
-  kh_value(cache, key) = record;
-  return 1;
+  cache_reset(record, mtime);
+
+  free((void*)record->bai);
+  record->bai    = bai;
+  record->bailen = len;
+
+  (void)pthread_rwlock_unlock(&shard->lock);
+  return 1;
+}
+
+/**
+  @brief   Get the BAI index of a CRAM's virtual BAM from the cache
+  @param   cache   CRAM stat cache
+  @param   source  CRAM file
+  @param   mtime   CRAM mtime
+  @param   bai     Pointer to be set to a malloc'd copy (NULL = Length only)
+  @return  Length of BAI index (-1 if it isn't cached, or on failure)
+*/
+ssize_t cramp_cache_bai(cramp_cache_t* cache, const char* source, time_t mtime, char** bai) {
+  ssize_t len = -1;
+
+  cache_shard_t* shard;
+  cramp_stat_t* record = cache_lock_record(cache, source, cache_read, &shard);
+  if (record) {
+
+    if (record->bai && record->mtime == mtime) {
+      len = record->bailen;
+
+      if (bai) {
+        *bai = malloc(len);
+        if (*bai) {
+          memcpy(*bai, record->bai, len);
+        } else {
+          len = -1;
+        }
+      }
+    }
+  }
+
+  (void)pthread_rwlock_unlock(&shard->lock);
+  return len;
+}
+
+/**
+  @brief   Free all memory allocated by stat cache
+  @param   cache  CRAM stat cache
+*/
+void cramp_cache_destroy(cramp_cache_t* cache) {
+  if (cache->running) {
+    (void)pthread_mutex_lock(&cache->lock);
+    cache->stop = 1;
+    (void)pthread_cond_signal(&cache->wake);
+    (void)pthread_mutex_unlock(&cache->lock);
+    (void)pthread_join(cache->compactor, NULL);
+  }
+
+  if (cache_journaled == cache) {
+    cache_journaled = NULL;
+  }
+
+  if (cache->journal != -1) {
+    (void)close(cache->journal);
+  }
+  free((void*)cache->path);
+
+  for (int i = 0; i < CACHE_SHARDS; ++i) {
+    const char* source;
+    cramp_stat_t* record;
+    kh_foreach(cache->shards[i].hash, source, record, {
+      free((void*)source);
+      cramp_index_destroy(record->index);
+      cache_forget(record);
+      free((void*)record);
+    })
+    kh_destroy(stat_hash, cache->shards[i].hash);
+    (void)pthread_rwlock_destroy(&cache->shards[i].lock);
+  }
+
+  (void)pthread_mutex_destroy(&cache->lock);
+  (void)pthread_cond_destroy(&cache->wake);
+  (void)pthread_mutex_destroy(&cache->writing);
+  free((void*)cache);
+
+  for (int i = 0; i < ALIAS_SHARDS; ++i) {
+    alias_shard_t* shard = &cache_aliases[i];
+    if (shard->aliases) {
+      const char* path;
+      kh_foreach_key(shard->aliases, path, free((void*)path));
+      kh_destroy(alias_map, shard->aliases);
+      shard->aliases = NULL;
+    }
+  }
+
+  if (cache_map.base) {
+    (void)munmap(cache_map.base, cache_map.len);
+    memset(&cache_map, 0, sizeof(cache_map));
+  }
 }
 
 /**
-  @brief   Get record from cache by source
-  @param   cache   CRAM stat cache
-  @param   source  CRAM file
-  @return  Pointer to record (NULL on failure)
+  @brief   Append a checkpoint to an index
+  @param   index  Checkpoint index
+  @param   bam    Offset of the BGZF block in the virtual BAM
+  @param   cram   Offset of the CRAM container
+  @param   skip   Number of records to skip in the container
+  @return  1 = Success; 0 = Fail
 */
-cramp_stat_t* cramp_cache_get(cramp_cache_t* cache, const char* source) {
-  khiter_t key = kh_get(stat_hash, cache, source);
-  if (key == kh_end(cache)) {
-    return NULL;
+int cramp_index_push(cramp_index_t* index, off_t bam, off_t cram, size_t skip) {
+  if (index->n == index->m) {
+    size_t m = index->m ? index->m * 2 : 64;
+    cramp_checkpoint_t* cp = realloc(index->cp, m * sizeof(cramp_checkpoint_t));
+    if (cp == NULL) {
+      return 0;
+    }
+
+    index->cp = cp;
+    index->m  = m;
   }
 
-  return kh_value(cache, key);
+  index->cp[index->n].bam  = bam;
+  index->cp[index->n].cram = cram;
+  index->cp[index->n].skip = skip;
+  ++index->n;
+
+  return 1;
 }
 
 /**
-  @brief   Free all memory allocated by stat cache
-  @param   cache  CRAM stat cache
+  @brief   Free all memory allocated by a checkpoint index
+  @param   index  Checkpoint index (may be NULL)
 */
-void cramp_cache_destroy(cramp_cache_t* cache) {
-  const char* source;
-  cramp_stat_t* record;
-  kh_foreach(cache, source, record, {
-    free((void*)source);
-    free((void*)record);
-  })
-  kh_destroy(stat_hash, cache);
+void cramp_index_destroy(cramp_index_t* index) {
+  if (index) {
+    free((void*)index->cp);
+    free((void*)index);
+  }
 }
 
 /**
@@ -100,6 +1601,23 @@ struct stat* cramp_cache_stat(struct stat* stbuf, cramp_stat_t* cached) {
   return stbuf;
 }
 
+/**
+  @brief   Set the file size of a virtual BAI based on cached value
+  @param   stbuf   Pointer to stat structure
+  @param   cached  Pointer to cache stat structure
+  @return  Pointer to stat structure
+
+  As cramp_cache_stat, but for the BAI index of the virtual BAM.
+*/
+struct stat* cramp_cache_stat_bai(struct stat* stbuf, cramp_stat_t* cached) {
+  if (cached == NULL || cached->bailen == 0 || cached->mtime < stbuf->st_mtime) {
+    return cramp_cache_stat(stbuf, NULL);
+  }
+
+  stbuf->st_size = cached->bailen;
+  return stbuf;
+}
+
 /**
   @brief   djb2 Hash
 
@@ -216,8 +1734,33 @@ const char* cramp_cache_file(const char* source) {
 }
 
 /**
-  The CRAM stat cache file is a simple, plain-text, one record per line
-  format using ":" characters as field delimiters. The fields will be in
+  The CRAM stat cache file is binary, so it can be memory mapped when the
+  filesystem is mounted, and records only looked up (and copied into the
+  hash) as they're needed. It's a header, followed by open addressing
+  hash tables of fixed size record and alias slots, followed by a string
+  table of the records' keys and the aliases' paths:
+
+  * Header (cache_file_header_t), with its own checksum;
+  * nslots record slots (cache_file_record_t), each with a 64-bit FNV-1a
+    hash of its key (0 = empty), the offset and length of the key in the
+    string table, the CRAM mtime and the converted BAM size, and a
+    checksum of all of that (and the key), so corrupt records are just
+    ignored. Collisions are resolved by linear probing, and there's
+    always at least one empty slot;
+  * naslots alias slots (cache_file_alias_t), likewise, but by path and
+    with the CRAM's inode, size, mtime (to the nanosecond), fingerprint
+    and whether it's a CRAM;
+  * The string table: each key or path, NUL terminated.
+
+  Everything's in the writer's byte order; a cache file from a machine
+  of the other endianness, or of an unknown version, is ignored (i.e.,
+  we start from scratch). The file is rewritten in full, into a
+  temporary file that's then renamed over the old one, so the mapping
+  of the old one stays good until it's unmapped.
+
+  Previously, the CRAM stat cache file was a simple, plain-text, one
+  record per line format using ":" characters as field delimiters, which
+  is still read if that's what we find. The fields will be in
   the following fixed order:
 
   * CRAM source path
@@ -248,17 +1791,135 @@ enum chunk {
 };
 
 /**
-  @brief   Read the CRAM stat cache from disk
+  @brief   Memory map a binary cache file
+  @param   path  Path to the cache file
+  @return  Number of records (-1 if it's not a valid binary cache file)
+
+  Only the header is checked; records are checked as they're used.
+*/
+static ssize_t cache_map_open(const char* path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct stat st;
+  void* base = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(cache_file_header_t)) {
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  (void)close(fd);
+
+  if (base == MAP_FAILED) {
+    return -1;
+  }
+
+  const cache_file_header_t* header = base;
+  size_t len   = st.st_size;
+  size_t slots = sizeof(cache_file_header_t);
+
+  int valid = memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) == 0
+           && header->version == CACHE_VERSION
+           && header->order   == CACHE_ORDER
+           && header->check   == cache_fnv(CACHE_FNV_BASIS, header, offsetof(cache_file_header_t, check))
+           && header->nslots > 0 && (header->nslots & (header->nslots - 1)) == 0
+           && header->nslots <= (len - slots) / sizeof(cache_file_record_t)
+           && header->aliases == slots + header->nslots * sizeof(cache_file_record_t)
+           && header->naslots > 0 && (header->naslots & (header->naslots - 1)) == 0
+           && header->naslots <= (len - header->aliases) / sizeof(cache_file_alias_t)
+           && header->strings == header->aliases + header->naslots * sizeof(cache_file_alias_t)
+           && header->strlen  <= len - header->strings;
+
+  if (!valid) {
+    (void)munmap(base, len);
+    return -1;
+  }
+
+  cache_map.base    = base;
+  cache_map.len     = len;
+  cache_map.header  = header;
+  cache_map.slots   = (const cache_file_record_t*)((const char*)base + slots);
+  cache_map.aliases = (const cache_file_alias_t*)((const char*)base + header->aliases);
+  cache_map.strings = (const char*)base + header->strings;
+
+  return (ssize_t)header->nrecords;
+}
+
+/**
+  @brief   Re-key a record from a text cache file by its CRAM's fingerprint
+  @param   key    Text cache key
+  @param   mtime  CRAM mtime, when the record was made
+  @return  malloc'd key (NULL if the CRAM's gone or changed, or on failure)
+
+  Text cache files were keyed by the CRAM's path, with any level, view or
+  region suffixed (per cache_view_key and cramp_cache_region_key). The
+  path is taken to be the longest prefix of the key, up to an "@", that's
+  a regular file; its suffixes are then kept after its fingerprint.
+*/
+static const char* cache_rekey(const char* key, time_t mtime) {
+  size_t len    = strlen(key);
+  char*  source = malloc(len + 1);
+  if (source == NULL || len == 0) {
+    free((void*)source);
+    return NULL;
+  }
+  memcpy(source, key, len + 1);
+
+  /* Only ever truncated further, so nothing needs putting back */
+  struct stat st;
+  size_t pathlen = len;
+  while (stat(source, &st) == -1 || !S_ISREG(st.st_mode)) {
+    do {
+      --pathlen;
+    } while (pathlen > 0 && key[pathlen] != '@');
+
+    if (pathlen == 0) {
+      free((void*)source);
+      return NULL;
+    }
+
+    source[pathlen] = '\0';
+  }
+
+  char*    rekeyed = NULL;
+  uint64_t fp;
+  int      cram;
+  if (st.st_mtime == mtime && cache_fingerprint(source, 0, &fp, &cram)) {
+    size_t suflen = len - pathlen;
+    rekeyed = malloc(CACHE_FP_LEN + suflen);
+    if (rekeyed) {
+      (void)snprintf(rekeyed, CACHE_FP_LEN, "fp%016" PRIx64, fp);
+      memcpy(rekeyed + CACHE_FP_LEN - 1, key + pathlen, suflen + 1);
+    }
+  }
+
+  free((void*)source);
+  return rekeyed;
+}
+
+/**
+  @brief   Read the cache file
   @param   path   Path to the cache file
-  @param   cache  Pointer to the stat cache hash
+  @param   cache  Pointer to the stat cache
   @return  Non-negative: Number of entries read; -1: Error
 
-  n.b., If the cache file doesn't exist, this will return 0
+  A binary cache file is memory mapped, rather than read, with records
+  loaded on demand; a text cache file (in the old format) is imported,
+  and counted as pending, so it's rewritten in the binary format. Its
+  records are re-keyed by fingerprint (see cache_rekey), which reads the
+  start of each CRAM once; those whose CRAMs are gone, or have changed
+  since, are dropped.
 */
-ssize_t cramp_cache_read(const char* path, cramp_cache_t* cache) {
+static ssize_t cache_import(const char* path, cramp_cache_t* cache) {
   static const int ALL_FOUND = (1 << CHUNK_EOF) - 1;
 
-  ssize_t read = 0;
+  ssize_t read = cache_map_open(path);
+  if (read >= 0) {
+    LOG("Mapped %ld entries from cache", read);
+    return read;
+  }
+
+  read = 0;
   FILE* file = fopen(path, "r+");
   if (file == NULL) {
     return -1;
@@ -294,7 +1955,7 @@ ssize_t cramp_cache_read(const char* path, cramp_cache_t* cache) {
 
     int found = 0;
     const char*   source = NULL;
-    cramp_stat_t* record = malloc(sizeof(cramp_stat_t));
+    cramp_stat_t* record = calloc(1, sizeof(cramp_stat_t));
     if (record == NULL) {
       return -1;
     }
@@ -346,20 +2007,25 @@ ssize_t cramp_cache_read(const char* path, cramp_cache_t* cache) {
       ++p;
     }
 
-    /* Insert record into cache */
-    if (found == ALL_FOUND) {
+    /* Insert record into cache, under its CRAM's fingerprint (n.b., a
+       CRAM that was listed under several paths only needs it once)    */
+    const char* key = (found == ALL_FOUND) ? cache_rekey(source, record->mtime) : NULL;
+    if (key) {
       int ret;
-      khiter_t newKey = kh_put(stat_hash, cache, source, &ret);
-      if (ret != -1) {
-        kh_value(cache, newKey) = record;
+      khash_t(stat_hash)* hash = cache_shard(cache, key)->hash;
+      khiter_t newKey = kh_put(stat_hash, hash, key, &ret);
+      if (ret > 0) {
+        kh_value(hash, newKey) = record;
         ++read;
         success = 1;
+      } else {
+        free((void*)key);
       }
     }
 
     /* Free everything that needs to be on parse failure */
+    free((void*)source);
     if (!success) {
-      free((void*)source);
       free((void*)record);
     }
   }
@@ -367,41 +2033,525 @@ ssize_t cramp_cache_read(const char* path, cramp_cache_t* cache) {
   free((void*)line);
   (void)fclose(file);
 
+  cache->pending += read;
+
   LOG("Read %ld entries from cache", read);
   return read;
 }
 
+/**
+  @brief   Replay a journal alias entry
+  @param   buf  Entry
+  @param   len  Length of the journal from the entry on
+  @return  Length of the entry (0 if it's damaged)
+*/
+static size_t cache_replay_alias(const char* buf, size_t len) {
+  cache_journal_alias_t entry;
+  if (len < sizeof(entry)) {
+    return 0;
+  }
+  memcpy(&entry, buf, sizeof(entry));
+
+  const char* path    = buf + sizeof(entry);
+  size_t      pathlen = entry.pathlen & ~CACHE_JOURNAL_ALIAS;
+  if (pathlen > len - sizeof(entry)
+   || cache_alias_check(path, pathlen, entry.pathlen, &entry.alias) != entry.check) {
+    return 0;
+  }
+
+  char* source = malloc(pathlen + 1);
+  if (source == NULL) {
+    return 0;
+  }
+  memcpy(source, path, pathlen);
+  source[pathlen] = '\0';
+
+  alias_shard_t* shard = alias_shard(source);
+  cache_alias_t  alias = alias_load(&entry.alias);
+
+  (void)pthread_rwlock_wrlock(&shard->lock);
+  (void)alias_put(shard, source, &alias);
+  (void)pthread_rwlock_unlock(&shard->lock);
+
+  free((void*)source);
+  return sizeof(entry) + pathlen;
+}
+
+/**
+  @brief   Replay the journal over the cache
+  @param   path   Path to the journal
+  @param   cache  Pointer to the stat cache
+  @return  Number of entries replayed
+
+  The journal is truncated after the last good entry, so anything that
+  was torn by a crash doesn't hide what's appended after it.
+*/
+static size_t cache_replay(const char* path, cramp_cache_t* cache) {
+  size_t replayed = 0;
+  char*  buf      = NULL;
+
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd == -1) {
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    goto finish_up;
+  }
+
+  size_t len = st.st_size;
+  buf = malloc(len);
+  if (buf == NULL || read(fd, buf, len) != (ssize_t)len) {
+    goto finish_up;
+  }
+
+  size_t offset = 0;
+  while (len - offset >= sizeof(cache_journal_entry_t)) {
+    cache_journal_entry_t entry;
+    memcpy(&entry, buf + offset, sizeof(entry));
+
+    /* Aliases are interleaved with records */
+    if (entry.keylen & CACHE_JOURNAL_ALIAS) {
+      size_t used = cache_replay_alias(buf + offset, len - offset);
+      if (used == 0) {
+        break;
+      }
+
+      offset += used;
+      ++replayed;
+      continue;
+    }
+
+    const char* key = buf + offset + sizeof(entry);
+    if (entry.keylen > len - offset - sizeof(entry)
+     || cache_journal_check(&entry, key) != entry.check) {
+      break;
+    }
+
+    char* source = malloc(entry.keylen + 1);
+    if (source == NULL) {
+      break;
+    }
+    memcpy(source, key, entry.keylen);
+    source[entry.keylen] = '\0';
+
+    cache_shard_t* shard;
+    cramp_stat_t* record = cache_lock_record(cache, source, cache_create, &shard);
+    if (record) {
+      cache_reset(record, (time_t)entry.mtime);
+      record->size = (off_t)entry.size;
+      ++replayed;
+    }
+    (void)pthread_rwlock_unlock(&shard->lock);
+
+    free((void*)source);
+    offset += sizeof(entry) + entry.keylen;
+  }
+
+  if (offset < len) {
+    LOG("Discarding %ld bytes of damaged journal", (long)(len - offset));
+    (void)ftruncate(fd, offset);
+  }
+
+finish_up:
+  free((void*)buf);
+  (void)close(fd);
+  return replayed;
+}
+
+/**
+  @brief   Compaction thread
+  @param   arg  Pointer to the stat cache
+  @return  NULL
+
+  Folds the journal into the cache file when it's long enough, or when
+  anything's been in it for CACHE_JOURNAL_INTERVAL seconds.
+*/
+static void* cache_compactor(void* arg) {
+  cramp_cache_t* cache = (cramp_cache_t*)arg;
+
+  (void)pthread_mutex_lock(&cache->lock);
+
+  while (!cache->stop) {
+    struct timespec until;
+    (void)clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += CACHE_JOURNAL_INTERVAL;
+
+    while (!cache->stop && cache->pending < CACHE_JOURNAL_MAX) {
+      if (pthread_cond_timedwait(&cache->wake, &cache->lock, &until) == ETIMEDOUT) {
+        break;
+      }
+    }
+
+    if (cache->stop || cache->pending == 0) {
+      continue;
+    }
+
+    (void)pthread_mutex_unlock(&cache->lock);
+    if (cramp_cache_write(cache->path, cache) == -1) {
+      LOG("Couldn't compact the journal into \"%s\"", cache->path);
+    }
+    (void)pthread_mutex_lock(&cache->lock);
+  }
+
+  (void)pthread_mutex_unlock(&cache->lock);
+  return NULL;
+}
+
+/**
+  @brief   Read the CRAM stat cache from disk
+  @param   path   Path to the cache file
+  @param   cache  Pointer to the stat cache
+  @return  Non-negative: Number of entries read; -1: Error
+
+  The journal is then replayed over it (regardless of whether the cache
+  file could be read), and subsequent updates are journaled.
+
+  n.b., If the cache file doesn't exist, this will return 0
+*/
+ssize_t cramp_cache_read(const char* path, cramp_cache_t* cache) {
+  ssize_t read = cache_import(path, cache);
+
+  size_t len = strlen(path);
+  char* copy    = malloc(len + 1);
+  char* journal = malloc(len + 9);
+  if (copy == NULL || journal == NULL) {
+    free((void*)copy);
+    free((void*)journal);
+    return read;
+  }
+  memcpy(copy, path, len + 1);
+  memcpy(journal, path, len);
+  memcpy(journal + len, ".journal", 9);
+
+  size_t replayed = cache_replay(journal, cache);
+  if (replayed) {
+    LOG("Replayed %ld entries from journal", (long)replayed);
+  }
+  cache->pending += replayed;
+
+  cache->journal = open(journal, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (cache->journal == -1) {
+    /* Not a fatal error: the cache is just written at unmount */
+    LOG("Couldn't open the cache journal \"%s\"", journal);
+  } else {
+    cache_journaled = cache;
+  }
+
+  cache->path    = copy;
+  cache->running = pthread_create(&cache->compactor, NULL, cache_compactor, cache) == 0;
+
+  free((void*)journal);
+  return read;
+}
+
+/**
+  @brief   Check whether a mapped cache file record is still wanted
+  @param   cache   Pointer to the stat cache (locked)
+  @param   record  Mapped record
+  @return  Key (NULL if it's empty, corrupt or superseded by the hash)
+*/
+static const char* cache_map_wanted(cramp_cache_t* cache, const cache_file_record_t* record) {
+  if (record->hash == 0 || record->key + record->keylen >= cache_map.header->strlen) {
+    return NULL;
+  }
+
+  const char* key = cache_map.strings + record->key;
+  if (key[record->keylen] != '\0' || cache_file_check(record, key) != record->check) {
+    return NULL;
+  }
+
+  khash_t(stat_hash)* hash = cache_shard(cache, key)->hash;
+  if (kh_get(stat_hash, hash, key) != kh_end(hash)) {
+    return NULL;
+  }
+
+  return key;
+}
+
+/**
+  @brief   Add a record to a cache file's slots and string table
+  @param   slots    Record slots
+  @param   mask     Number of slots, less one
+  @param   strings  String table
+  @param   offset   Length of the string table so far (updated)
+  @param   key      Cache key
+  @param   mtime    CRAM mtime
+  @param   size     Converted BAM size
+*/
+static void cache_file_add(cache_file_record_t* slots, uint64_t mask, char* strings, uint64_t* offset, const char* key, int64_t mtime, int64_t size) {
+  size_t   len  = strlen(key);
+  uint64_t hash = cache_file_hash(key, len);
+
+  cache_file_record_t* record = &slots[hash & mask];
+  while (record->hash) {
+    record = &slots[(record - slots + 1) & mask];
+  }
+
+  record->hash   = hash;
+  record->key    = *offset;
+  record->keylen = (uint32_t)len;
+  record->mtime  = mtime;
+  record->size   = size;
+  record->check  = cache_file_check(record, key);
+
+  memcpy(strings + *offset, key, len + 1);
+  *offset += len + 1;
+}
+
+/**
+  @brief   Check whether a mapped cache file alias is still wanted
+  @param   slot  Mapped alias slot (with every alias shard locked)
+  @return  Path (NULL if it's empty, corrupt or superseded in memory)
+*/
+static const char* cache_map_alias_wanted(const cache_file_alias_t* slot) {
+  if (slot->hash == 0 || slot->path + slot->pathlen >= cache_map.header->strlen) {
+    return NULL;
+  }
+
+  const char* path = cache_map.strings + slot->path;
+  if (path[slot->pathlen] != '\0'
+   || cache_alias_check(path, slot->pathlen, slot->hash, &slot->alias) != slot->check) {
+    return NULL;
+  }
+
+  khash_t(alias_map)* aliases = alias_shard(path)->aliases;
+  if (aliases && kh_get(alias_map, aliases, path) != kh_end(aliases)) {
+    return NULL;
+  }
+
+  return path;
+}
+
+/**
+  @brief   Add an alias to a cache file's alias slots and string table
+  @param   slots    Alias slots
+  @param   mask     Number of slots, less one
+  @param   strings  String table
+  @param   offset   Length of the string table so far (updated)
+  @param   path     CRAM file
+  @param   alias    Stored alias
+*/
+static void cache_file_add_alias(cache_file_alias_t* slots, uint64_t mask, char* strings, uint64_t* offset, const char* path, const cache_stored_alias_t* alias) {
+  size_t   len  = strlen(path);
+  uint64_t hash = cache_file_hash(path, len);
+
+  cache_file_alias_t* slot = &slots[hash & mask];
+  while (slot->hash) {
+    slot = &slots[(slot - slots + 1) & mask];
+  }
+
+  slot->hash    = hash;
+  slot->path    = *offset;
+  slot->pathlen = (uint32_t)len;
+  slot->alias   = *alias;
+  slot->check   = cache_alias_check(path, len, hash, alias);
+
+  memcpy(strings + *offset, path, len + 1);
+  *offset += len + 1;
+}
+
 /**
   @brief   Write the CRAM stat cache to disk
   @param   path    Path to the cache file
-  @param   cache   Pointer to the stat cache hash
+  @param   cache   Pointer to the stat cache
   @return  Non-negative: Number of entries written; -1: Error
+
+  Records that were mapped from the cache file, but never loaded into
+  the hash, are carried over, as are path aliases that are only in the
+  cache file; forgotten aliases aren't written. Updates (and new
+  aliases) are held off while it's written.
+
+  If this is the journaled cache file, then the journal is truncated
+  afterwards; if there's nothing in the journal, there's nothing to do.
 */
 ssize_t cramp_cache_write(const char* path, cramp_cache_t* cache) {
-  /* Open cache file */
-  FILE* output = fopen(path, "w+");
-  if (output == NULL) {
-    return -1;
-  }
+  ssize_t              written = -1;
+  cache_file_record_t* slots   = NULL;
+  cache_file_alias_t*  aslots  = NULL;
+  char*                strings = NULL;
+  char*                tmp     = NULL;
+  FILE*                output  = NULL;
 
-  /* Write pseudo-header */
-  cramp_ctx_t* ctx = CTX;
-  const char*  source = ctx->conf->source;
-  (void)fprintf(output, "# %s\n", source);
-  
-  /* Write data */
-  ssize_t       written = 0;
   const char*   cramfile;
   cramp_stat_t* record;
-  kh_foreach(cache, cramfile, record, {
-    (void)fprintf(output, "%s:%ld:%lld\n", cramfile,
-                                           record->mtime,
-                                           record->size);
-    ++written;
-  })
+  cache_alias_t alias;
+
+  int journaled = cache->path && strcmp(path, cache->path) == 0;
+
+  (void)pthread_mutex_lock(&cache->writing);
+  for (int i = 0; i < CACHE_SHARDS; ++i) {
+    (void)pthread_rwlock_rdlock(&cache->shards[i].lock);
+  }
+
+  (void)pthread_once(&alias_once, alias_init);
+  for (int i = 0; i < ALIAS_SHARDS; ++i) {
+    (void)pthread_rwlock_rdlock(&cache_aliases[i].lock);
+  }
+
+  /* Nothing to add, so the cache file's up to date */
+  if (journaled && cache->pending == 0) {
+    written = 0;
+    goto finish_up;
+  }
+
+  /* Size everything up, skipping evicted records */
+  uint64_t nrecords = 0;
+  uint64_t strsize  = 0;
+  for (int i = 0; i < CACHE_SHARDS; ++i) {
+    kh_foreach(cache->shards[i].hash, cramfile, record, {
+      if (record->size) {
+        ++nrecords;
+        strsize += strlen(cramfile) + 1;
+      }
+    })
+  }
+
+  uint64_t mapped = cache_map.base ? cache_map.header->nslots : 0;
+  for (uint64_t i = 0; i < mapped; ++i) {
+    const char* key = cache_map_wanted(cache, &cache_map.slots[i]);
+    if (key) {
+      ++nrecords;
+      strsize += cache_map.slots[i].keylen + 1;
+    }
+  }
+
+  uint64_t naliases = 0;
+  for (int i = 0; i < ALIAS_SHARDS; ++i) {
+    if (cache_aliases[i].aliases) {
+      kh_foreach(cache_aliases[i].aliases, cramfile, alias, {
+        if (alias.cram != -1) {
+          ++naliases;
+          strsize += strlen(cramfile) + 1;
+        }
+      })
+    }
+  }
+
+  uint64_t amapped = cache_map.base ? cache_map.header->naslots : 0;
+  for (uint64_t i = 0; i < amapped; ++i) {
+    const char* apath = cache_map_alias_wanted(&cache_map.aliases[i]);
+    if (apath) {
+      ++naliases;
+      strsize += cache_map.aliases[i].pathlen + 1;
+    }
+  }
 
-  (void)fclose(output);
+  /* At most half full, so probes stay short and there's an empty slot */
+  uint64_t nslots = 16;
+  while (nslots < 2 * nrecords) {
+    nslots <<= 1;
+  }
+
+  uint64_t naslots = 16;
+  while (naslots < 2 * naliases) {
+    naslots <<= 1;
+  }
+
+  size_t pathlen = strlen(path);
+  slots   = calloc(nslots, sizeof(cache_file_record_t));
+  aslots  = calloc(naslots, sizeof(cache_file_alias_t));
+  strings = malloc(strsize + 1);
+  tmp     = malloc(pathlen + 5);
+  if (slots == NULL || aslots == NULL || strings == NULL || tmp == NULL) {
+    goto finish_up;
+  }
+
+  uint64_t offset = 0;
+  for (int i = 0; i < CACHE_SHARDS; ++i) {
+    kh_foreach(cache->shards[i].hash, cramfile, record, {
+      if (record->size) {
+        cache_file_add(slots, nslots - 1, strings, &offset, cramfile, record->mtime, record->size);
+      }
+    })
+  }
+
+  for (uint64_t i = 0; i < mapped; ++i) {
+    const cache_file_record_t* old = &cache_map.slots[i];
+    const char* key = cache_map_wanted(cache, old);
+    if (key) {
+      cache_file_add(slots, nslots - 1, strings, &offset, key, old->mtime, old->size);
+    }
+  }
+
+  for (int i = 0; i < ALIAS_SHARDS; ++i) {
+    if (cache_aliases[i].aliases) {
+      kh_foreach(cache_aliases[i].aliases, cramfile, alias, {
+        if (alias.cram != -1) {
+          cache_stored_alias_t stored = alias_store(&alias);
+          cache_file_add_alias(aslots, naslots - 1, strings, &offset, cramfile, &stored);
+        }
+      })
+    }
+  }
+
+  for (uint64_t i = 0; i < amapped; ++i) {
+    const cache_file_alias_t* old = &cache_map.aliases[i];
+    const char* apath = cache_map_alias_wanted(old);
+    if (apath) {
+      cache_file_add_alias(aslots, naslots - 1, strings, &offset, apath, &old->alias);
+    }
+  }
+
+  cache_file_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+  header.version  = CACHE_VERSION;
+  header.order    = CACHE_ORDER;
+  header.nslots   = nslots;
+  header.nrecords = nrecords;
+  header.naslots  = naslots;
+  header.aliases  = sizeof(header) + nslots * sizeof(cache_file_record_t);
+  header.strings  = header.aliases + naslots * sizeof(cache_file_alias_t);
+  header.strlen   = strsize;
+  header.check    = cache_fnv(CACHE_FNV_BASIS, &header, offsetof(cache_file_header_t, check));
+
+  /* Write to a temporary file and rename it over the old one, which
+     may still be mapped                                              */
+  memcpy(tmp, path, pathlen);
+  memcpy(tmp + pathlen, ".tmp", 5);
+
+  output = fopen(tmp, "w");
+  if (output == NULL) {
+    goto finish_up;
+  }
+
+  int ok = fwrite(&header, sizeof(header), 1, output) == 1
+        && fwrite(slots, sizeof(cache_file_record_t), nslots, output) == nslots
+        && fwrite(aslots, sizeof(cache_file_alias_t), naslots, output) == naslots
+        && fwrite(strings, 1, strsize, output) == strsize;
+
+  if (fclose(output) == 0 && ok && rename(tmp, path) == 0) {
+    written = (ssize_t)nrecords;
+    LOG("Wrote %ld entries to cache", written);
+
+    /* Everything that's journaled is now in the cache file */
+    if (journaled) {
+      if (cache->journal != -1) {
+        (void)ftruncate(cache->journal, 0);
+      }
+
+      (void)pthread_mutex_lock(&cache->lock);
+      cache->pending = 0;
+      (void)pthread_mutex_unlock(&cache->lock);
+    }
+  } else {
+    (void)unlink(tmp);
+  }
+
+finish_up:
+  for (int i = 0; i < ALIAS_SHARDS; ++i) {
+    (void)pthread_rwlock_unlock(&cache_aliases[i].lock);
+  }
+  for (int i = 0; i < CACHE_SHARDS; ++i) {
+    (void)pthread_rwlock_unlock(&cache->shards[i].lock);
+  }
+  (void)pthread_mutex_unlock(&cache->writing);
 
-  LOG("Wrote %ld entries to cache", written);
+  free((void*)slots);
+  free((void*)aslots);
+  free((void*)strings);
+  free((void*)tmp);
   return written;
 }
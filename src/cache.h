@@ -8,32 +8,84 @@
 #include <sys/types.h>
 #include <time.h>
 
-#include <htslib/khash.h>
+/* Needed for enum cramp_view */
+#include "handles.h"
+
+/**
+  @brief   Conversion checkpoint
+  @var     bam   Offset of a BGZF block in the virtual BAM
+  @var     cram  Offset of the CRAM container holding its first record
+  @var     skip  Number of records in that container preceding it
+*/
+typedef struct cramp_checkpoint {
+  off_t  bam;
+  off_t  cram;
+  size_t skip;
+} cramp_checkpoint_t;
+
+/**
+  @brief   Checkpoint index (in increasing offset order)
+  @var     n   Number of checkpoints
+  @var     m   Number of allocated checkpoints
+  @var     cp  Checkpoints
+*/
+typedef struct cramp_index {
+  size_t              n;
+  size_t              m;
+  cramp_checkpoint_t* cp;
+} cramp_index_t;
 
 /**
   @brief   CRAM file statistics
   @var     mtime  Last modified time
   @var     size   File size
-  @var     TODO   (For future use)
+  @var     index  Checkpoint index (NULL if not yet known)
+  @var     header Serialised BAM header blocks (NULL if not yet known)
+  @var     hlen   Length of header blocks
+  @var     bai    BAI index of the virtual BAM (NULL if not yet known)
+  @var     bailen Length of BAI index
 */
 typedef struct cramp_stat {
-  time_t mtime;
-  off_t  size;
-  void*  TODO;
+  time_t         mtime;
+  off_t          size;
+  cramp_index_t* index;
+  char*          header;
+  size_t         hlen;
+  char*          bai;
+  size_t         bailen;
 } cramp_stat_t;
 
-/* Initialise hash table type */
-KHASH_MAP_INIT_STR(stat_hash, cramp_stat_t*)
-typedef khash_t(stat_hash) cramp_cache_t;
+/* Opaque CRAM stat cache */
+typedef struct cramp_cache cramp_cache_t;
+
+extern cramp_cache_t* cramp_cache_init(void);
+extern int            cramp_cache_put(cramp_cache_t*, const char*, cramp_stat_t*);
+extern cramp_stat_t*  cramp_cache_get(cramp_cache_t*, const char*, cramp_stat_t*);
+extern int            cramp_cache_update(cramp_cache_t*, const char*, time_t, off_t, cramp_index_t*);
+extern int            cramp_cache_evict(cramp_cache_t*, const char*);
+extern int            cramp_cache_evict_file(cramp_cache_t*, const char*);
+extern void           cramp_cache_unalias(const char*);
+extern int            cramp_cache_checkpoint(cramp_cache_t*, const char*, time_t, off_t, cramp_checkpoint_t*);
+extern off_t          cramp_cache_size(cramp_cache_t*, const char*, time_t);
+extern int            cramp_cache_set_header(cramp_cache_t*, const char*, time_t, char*, size_t);
+extern ssize_t        cramp_cache_header(cramp_cache_t*, const char*, time_t, char*, size_t, off_t);
+extern int            cramp_cache_set_bai(cramp_cache_t*, const char*, time_t, char*, size_t);
+extern ssize_t        cramp_cache_bai(cramp_cache_t*, const char*, time_t, char**);
+extern void           cramp_cache_destroy(cramp_cache_t*);
+extern const char*    cramp_cache_key(const char*, int);
+extern const char*    cramp_cache_region_key(const char*, int, const char*);
+extern const char*    cramp_cache_view_key(const char*, int, enum cramp_view);
+extern const char*    cramp_cache_peek_key(const char*, int, enum cramp_view);
+extern int            cramp_cache_is_cram(const char*);
 
-extern int           cramp_cache_put(cramp_cache_t*, const char*, cramp_stat_t*);
-extern cramp_stat_t* cramp_cache_get(cramp_cache_t*, const char*);
-extern void          cramp_cache_destroy(cramp_cache_t*);
+extern int            cramp_index_push(cramp_index_t*, off_t, off_t, size_t);
+extern void           cramp_index_destroy(cramp_index_t*);
 
-extern struct stat*  cramp_cache_stat(struct stat*, cramp_stat_t*);
+extern struct stat*   cramp_cache_stat(struct stat*, cramp_stat_t*);
+extern struct stat*   cramp_cache_stat_bai(struct stat*, cramp_stat_t*);
 
-extern const char*   cramp_cache_file(const char*);
-extern ssize_t       cramp_cache_read(const char*, cramp_cache_t*);
-extern ssize_t       cramp_cache_write(const char*, cramp_cache_t*);
+extern const char*    cramp_cache_file(const char*);
+extern ssize_t        cramp_cache_read(const char*, cramp_cache_t*);
+extern ssize_t        cramp_cache_write(const char*, cramp_cache_t*);
 
 #endif
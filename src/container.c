@@ -0,0 +1,81 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "container.h"
+#include "handles.h"
+#include "util.h"
+
+#include <htslib/cram.h>
+#include <htslib/hfile.h>
+#include <htslib/hts.h>
+
+/**
+  @brief   Locate the data containers of a CRAM file
+  @param   path     Path to CRAM file
+  @param   n        Pointer to number of containers, to be set
+  @param   records  Pointer to total number of records, to be set
+  @return  malloc'd array of container locations (NULL on failure)
+
+  Only the container headers are read; their bodies are skipped over.
+  Containers without records (e.g., the file header's) are omitted.
+*/
+cramp_container_t* cramp_containers(const char* path, size_t* n, size_t* records) {
+  cramp_handle_t* handle = cramp_handles_get(CTX->handles, path, view_full);
+  if (handle == NULL) {
+    return NULL;
+  }
+
+  cram_fd* fd  = handle->fp->fp.cram;
+  hFILE*   hfp = cram_fd_get_fp(fd);
+
+  cramp_container_t* cont = NULL;
+  size_t             m    = 0;
+
+  *n       = 0;
+  *records = 0;
+
+  while (1) {
+    off_t offset = htell(hfp);
+
+    cram_container* c = cram_read_container(fd);
+    if (c == NULL) {
+      break;
+    }
+
+    int32_t nrec = cram_container_get_num_records(c);
+    int32_t len  = cram_container_get_length(c);
+    cram_free_container(c);
+
+    if (nrec > 0) {
+      if (*n == m) {
+        m = m ? m * 2 : 64;
+        cramp_container_t* grown = realloc(cont, m * sizeof(cramp_container_t));
+        if (grown == NULL) {
+          free((void*)cont);
+          cramp_handles_put(CTX->handles, handle);
+          return NULL;
+        }
+        cont = grown;
+      }
+
+      cont[*n].offset = offset;
+      cont[*n].first  = *records;
+      cont[*n].nrec   = nrec;
+      ++*n;
+      *records += nrec;
+    }
+
+    if (hseek(hfp, len, SEEK_CUR) < 0) {
+      break;
+    }
+  }
+
+  cramp_handles_put(CTX->handles, handle);
+  return cont;
+}
@@ -0,0 +1,24 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#ifndef _CRAMP_CONTAINER_H
+#define _CRAMP_CONTAINER_H
+
+/* Needed for off_t and size_t */
+#include <sys/types.h>
+
+/**
+  @brief   CRAM container location
+  @var     offset  Offset of the container in the CRAM file
+  @var     first   Ordinal of the container's first record
+  @var     nrec    Number of records in the container
+*/
+typedef struct cramp_container {
+  off_t  offset;
+  size_t first;
+  size_t nrec;
+} cramp_container_t;
+
+extern cramp_container_t* cramp_containers(const char*, size_t*, size_t*);
+
+#endif
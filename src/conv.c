@@ -4,19 +4,34 @@
 #include "config.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "blocks.h"
+#include "cache.h"
+#include "container.h"
+#include "conv.h"
+#include "dirs.h"
+#include "handles.h"
 #include "log.h"
+#include "par.h"
+#include "precalc.h"
+#include "ring.h"
+#include "spill.h"
 #include "util.h"
 
 #include <htslib/bgzf.h>
+#include <htslib/cram.h>
 #include <htslib/hfile.h>
 #include <htslib/hts.h>
 #include <htslib/sam.h>
+#include <htslib/thread_pool.h>
 
 /*
   NOTES
@@ -24,20 +39,71 @@
   To convert a CRAM file to a BAM file, we use HTSLib in the same way
   that `samtools view` does. That is, we open and read the CRAM file
   while writing to a newly opened BAM file; it's pretty straightforward.
-  
-  hts_open, however, takes a string parameter for its file reference
-  (i.e., file name), accepting `-` for `stdout`. We want to spool the
-  converted data directly into memory, so our "trick" (hack) is to
-  create a pipe and change the output BAM's file descriptor to the write
-  end, while another thread is `read`ing the read end. (We use threads,
-  instead of `fork`, to reduce overhead.)
-
-  We are currently doing linear seeking from the start of the file. This
-  is hopelessly inefficient, but it proves the concept! The difficulty
-  of random access will be mapping the seek offset from the BAM to the
-  CRAM; it will be far from linear...
+
+  We want to spool the converted data directly into memory, so the BAM
+  is opened (with hts_hopen) on an hFILE whose backend writes straight
+  into a ring buffer (see ring.c). The conversion is driven by the reads
+  themselves, converting records only until the ring holds the data
+  that's been asked for.
+
+  If the mount has a thread pool (--threads), it's attached to both the
+  CRAM input (for decoding) and the BAM output (for compression). The
+  pool is shared by all conversions, so open files don't multiply the
+  number of threads. A multithreaded BGZF output is written by HTSLib's
+  writer thread, so the ring retains enough extra to cover the blocks
+  that are in flight when a read is satisfied.
+
+  Each open virtual BAM owns a conversion stream, which keeps going for
+  as long as reads are sequential. The ring retains the most recently
+  converted data, so slightly out-of-order reads (e.g., from the
+  kernel's readahead) don't cause a restart.
+
+  Random access relies on checkpoints, which map the offset of a BGZF
+  block in the virtual BAM to the CRAM container that holds the block's
+  first record (and how many records into the container it is). HTSLib
+  never splits a record across blocks, unless it's bigger than a block,
+  and always flushes after the header, so the output from a checkpoint
+  onwards is exactly the same as if we'd streamed through to it. The
+  checkpoints (one per container) are recorded during a full conversion
+  from the start of the file and kept in the stat cache; reads before
+  the window, or beyond a later checkpoint, resume from the nearest one.
+  Without them, we're back to linear seeking from the start.
+
+  At level 0, BGZF blocks are stored rather than deflated, so each one
+  is just its data plus a fixed overhead. The size of such a conversion
+  therefore follows from the lengths of the records, by simulating the
+  block layout, without compressing (or writing) anything at all.
+
+  Because block addresses aren't known until blocks are compressed (and,
+  with threads, that happens elsewhere, later), the block layout is
+  simulated using HTSLib's packing rule, as each record is written. This
+  gives the ordinal of the block that each record starts; the ring's
+  hFILE reports the offset of each ordinal as it's written, at which
+  point any pending checkpoint for it can be recorded. The simulation is
+  checked against the BGZF handle after every record; if it ever goes
+  wrong, no checkpoints are published.
+
+  With --parallel (and a thread pool), conversions from the start of the
+  file -- i.e., full reads and size calculations -- are instead done a
+  container at a time, concurrently (see par.c). The output is byte for
+  byte the same, so whichever way a conversion is done, its size and
+  checkpoints are good for the other.
+
+  A stream can also be restricted to a region (e.g., chr1:1-5000000), in
+  which case it's a self-contained BAM of just the records that overlap
+  it, read through the CRAM's index with an HTSLib iterator. These are
+  cached under their own keys (see cramp_cache_region_key); the header
+  and EOF shortcuts still apply, but there are no checkpoints, so reads
+  from before the window start again from the beginning of the region.
+
+  Likewise, a stream can be of a reduced decoding view (e.g., without
+  base qualities; see handles.c), which is otherwise converted like any
+  other, but cached under its own key (see cramp_cache_view_key).
 */
 
+/* Size of the lookback window */
+#define CONV_WINDOW (4 * 1024 * 1024)
+
 /**
   @brief   File block mapping
   @var     start  Start of block
@@ -50,255 +116,966 @@ typedef struct block {
 
 #define END_OF(x) ((x).start + (x).len)
 
+/* Serialised length of a BAM record: block_size, core and variable data
+   (without the query name's alignment padding)
+   n.b., Only valid for records with fewer than 65536 CIGAR operations */
+#define BAM_RECORD_LEN(b) (4 + 32 + (b)->l_data - (b)->core.l_extranul)
+
+
 /**
-  @brief   This is lifted from HTSLib, so we can manipulate the file
-           descriptor of the output BAM
+  @brief   Checkpoint awaiting the offset of its block
+  @var     block  Ordinal of the BGZF block
+  @var     cram   Offset of the CRAM container
+  @var     skip   Records to skip in the container
+*/
+typedef struct pending {
+  size_t block;
+  off_t  cram;
+  size_t skip;
+} pending_t;
 
-  WARNING  This needs to be kept in step with HTSLib (see hfile.c)
+/**
+  @brief   Persistent conversion stream
+  @var     path     CRAM file path
+  @var     level    BGZF compression level (-1 = Default)
+  @var     view     Decoding view
+  @var     region   Region to convert (NULL = Whole file)
+  @var     key      Stat cache key (per path, level, view and region)
+  @var     mtime    CRAM mtime, when the stream was opened
+  @var     pool     Thread pool (NULL = Single threaded)
+  @var     parallel Convert whole files in parallel (0 = False; 1 = True)
+  @var     handle   Borrowed CRAM file pointer (NULL = None)
+  @var     cramp    CRAM file pointer (the handle's)
+  @var     fresh    CRAM file pointer is unread (0 = False; 1 = True)
+  @var     idx      CRAM index (NULL = Not loaded)
+  @var     itr      Region iterator (NULL = Reading the whole file)
+  @var     header   BAM header (the handle's)
+  @var     bam      BAM record
+  @var     output   BAM file pointer (NULL = Not converting)
+  @var     par      Parallel conversion (NULL = Not converting in parallel)
+  @var     ring     Ring buffer of converted data
+  @var     from     Checkpoint the conversion was resumed from
+  @var     resumed  Conversion was resumed (0 = False; 1 = True)
+  @var     n        Ordinal of the next record
+  @var     cont     CRAM container locations
+  @var     ncont    Number of CRAM containers
+  @var     records  Total number of records in the CRAM containers
+  @var     c        Index of the current container
+  @var     want     Looking for a checkpoint (0 = False; 1 = True)
+  @var     index    Checkpoint index being recorded (NULL = Not recording)
+  @var     track    Block layout simulation is good (0 = False; 1 = True)
+  @var     block    Simulated ordinal of the current block
+  @var     fill     Simulated uncompressed size of the current block
+  @var     blocks   Number of blocks written into the ring
+  @var     pend     Checkpoints awaiting their block's offset
+  @var     npend    Number of pending checkpoints
+  @var     mpend    Allocated pending checkpoints
+  @var     phead    Index of the oldest pending checkpoint
+  @var     failed   Recording a checkpoint failed (0 = False; 1 = True)
+  @var     cplock   Mutex for checkpoint recording (shared with the writer)
+  @var     eof      Conversion has finished (0 = False; 1 = True)
+  @var     publish  Size and index are ready for the cache (0 = False; 1 = True)
+  @var     baifile  Temporary BAI index file being built (NULL = Not indexing)
+  @var     lock     Mutex serialising reads
 */
-struct hFILE_fd {
-  hFILE base;
-  int   fd;
-  int   is_socket:1;
+struct cramp_conv {
+  const char*        path;
+  int                level;
+  enum cramp_view    view;
+  const char*        region;
+  const char*        key;
+  time_t             mtime;
+  htsThreadPool*     pool;
+  int                parallel;
+  cramp_handle_t*    handle;
+  htsFile*           cramp;
+  int                fresh;
+  hts_idx_t*         idx;
+  hts_itr_t*         itr;
+  bam_hdr_t*         header;
+  bam1_t*            bam;
+  htsFile*           output;
+  cramp_par_t*       par;
+  cramp_ring_t*      ring;
+  cramp_checkpoint_t from;
+  int                resumed;
+  size_t             n;
+  cramp_container_t* cont;
+  size_t             ncont;
+  size_t             records;
+  size_t             c;
+  int                want;
+  cramp_index_t*     index;
+  int                track;
+  size_t             block;
+  size_t             fill;
+  size_t             blocks;
+  pending_t*         pend;
+  size_t             npend;
+  size_t             mpend;
+  size_t             phead;
+  int                failed;
+  pthread_mutex_t    cplock;
+  int                eof;
+  int                publish;
+  const char*        baifile;
+  pthread_mutex_t    lock;
 };
 
 /**
-  @brief   Argument structure to pass into conversion function
-  @var     cramp    CRAM file pointer
-  @var     pipe_fd  File descriptor for the write end of a pipe
+  @brief   Start building the BAI index of a stream's output
+  @param   conv  Conversion stream (with its header written)
+
+  HTSLib can only save an index to a file, so it's built into a
+  temporary one beside the cache file. Failing to start just means no
+  index; nor is it built again if it's already cached.
 */
-struct conv_args {
-  htsFile* cramp;
-  int      pipe_fd;
-};
+static void conv_bai_init(cramp_conv_t* conv) {
+  static const char suffix[] = ".bai.XXXXXX";
+  cramp_ctx_t* ctx = CTX;
+
+  if (cramp_cache_bai(ctx->cache, conv->key, conv->mtime, NULL) >= 0) {
+    return;
+  }
+
+  size_t len = strlen(ctx->conf->cache);
+  char* tmp = malloc(len + sizeof(suffix));
+  if (tmp == NULL) {
+    return;
+  }
+  memcpy(tmp, ctx->conf->cache, len);
+  memcpy(tmp + len, suffix, sizeof(suffix));
+
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    free((void*)tmp);
+    return;
+  }
+  (void)close(fd);
+
+  if (sam_idx_init(conv->output, conv->header, 0, tmp) < 0) {
+    LOG("Couldn't index the conversion of %s", conv->path);
+    (void)unlink(tmp);
+    free((void*)tmp);
+    return;
+  }
+
+  conv->baifile = tmp;
+}
 
 /**
-  @brief   Argument structure to pass into the transformation function
-  @var     args     Pointer to specific transformation function arguments
-  @var     pipe_fd  File descriptor for the read end of a pipe
+  @brief   Put a stream's finished BAI index into the stat cache
+  @param   conv  Conversion stream
+
+  Virtual indices are only listed once they're built, so the listing of
+  the CRAM's directory is forgotten (n.b., not those of any other links
+  to it, which catch up when they change).
 */
-struct trans_args {
-  void* args;
-  int   pipe_fd;
-};
+static void conv_bai_publish(cramp_conv_t* conv) {
+  cramp_ctx_t* ctx = CTX;
+  struct stat st;
+  char* data = NULL;
+
+  int fd = open(conv->baifile, O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    data = malloc(st.st_size);
+    if (data && read(fd, data, st.st_size) == st.st_size) {
+      (void)cramp_cache_set_bai(ctx->cache, conv->key, conv->mtime, data, st.st_size);
+      data = NULL;
+
+      LOG("BAI of %s is %ld bytes", conv->path, (long)st.st_size);
+
+      const char* slash = strrchr(conv->path, '/');
+      if (slash) {
+        size_t len = (slash == conv->path) ? 1 : (size_t)(slash - conv->path);
+        char* dir = malloc(len + 1);
+        if (dir) {
+          memcpy(dir, conv->path, len);
+          dir[len] = '\0';
+          cramp_dirs_forget(ctx->dirs, dir);
+          free((void*)dir);
+        }
+      }
+    }
+  }
+
+  free((void*)data);
+  (void)close(fd);
+}
 
 /**
-  @brief   Argument structure to pass into the size transformation
-  @var     bam_size  Size of the converted BAM file
+  @brief   Stop building a stream's BAI index
+  @param   conv  Conversion stream
 */
-struct size_args {
-  ssize_t bam_size;
-};
+static void conv_bai_drop(cramp_conv_t* conv) {
+  if (conv->baifile) {
+    (void)unlink(conv->baifile);
+    free((void*)conv->baifile);
+    conv->baifile = NULL;
+  }
+}
 
 /**
-  @brief   Argument structure to pass into the read transformation
-  @var     from    Offset to read from (bytes)
-  @var     bytes   Maximum number of bytes to read
-  @var     buffer  Pointer to data buffer
-  @var     size    Actual number of bytes read (i.e., buffer size)
+  @brief   Stop the conversion of a stream
+  @param   conv  Conversion stream
+
+  Anything still in the ring is left there, to be read from.
 */
-struct read_args {
-  off_t   from;
-  size_t  bytes;
-  char*   buffer;
-  ssize_t size;
-};
+static void conv_stop(cramp_conv_t* conv) {
+  if (conv->output) {
+    (void)hts_close(conv->output);
+    conv->output = NULL;
+  }
+
+  conv_bai_drop(conv);
+
+  if (conv->par) {
+    cramp_par_close(conv->par);
+    conv->par = NULL;
+  }
+
+  cramp_index_destroy(conv->index);
+  conv->index = NULL;
+
+  free((void*)conv->cont);
+  conv->cont  = NULL;
+  conv->ncont = 0;
+
+  conv->npend = conv->phead = 0;
+}
 
 /**
-  @brief   Convert CRAM to BAM and write data into a pipe
-  @param   argv  Pointer to argument structure
-  @return  Exit status (NULL = OK)
+  @brief   Record pending checkpoints, as their blocks are written
+  @param   arg     Conversion stream
+  @param   block   Ordinal of the block
+  @param   offset  Offset of the block in the virtual BAM
+
+  n.b., With a thread pool, this is called from HTSLib's writer thread.
 */
-void* convert(void* argv) {
-  struct conv_args* args = (struct conv_args*)argv;
+static void conv_block(void* arg, size_t block, off_t offset) {
+  cramp_conv_t* conv = (cramp_conv_t*)arg;
+  (void)pthread_mutex_lock(&conv->cplock);
+
+  conv->blocks = block + 1;
+
+  if (conv->phead < conv->npend && conv->pend[conv->phead].block == block) {
+    pending_t* p = &conv->pend[conv->phead++];
+
+    if (!conv->failed && !cramp_index_push(conv->index, offset, p->cram, p->skip)) {
+      conv->failed = 1;
+    }
+
+    if (conv->phead == conv->npend) {
+      conv->npend = conv->phead = 0;
+    }
+  }
+
+  (void)pthread_mutex_unlock(&conv->cplock);
+}
 
-  /* Initialise output BAM */
-  bam1_t*  bam    = bam_init1();
-  htsFile* output = hts_open("-", "wb");
+/**
+  @brief   Queue a checkpoint until its block is written
+  @param   conv   Conversion stream
+  @param   block  Ordinal of the block
+  @param   cram   Offset of the CRAM container
+  @param   skip   Records to skip in the container
+  @return  1 = Success; 0 = Fail
+*/
+static int conv_pend(cramp_conv_t* conv, size_t block, off_t cram, size_t skip) {
+  int ok = 1;
+  (void)pthread_mutex_lock(&conv->cplock);
 
-  /* Change file descriptor of output BAM to pipe */
-  struct hFILE_fd* fp = (struct hFILE_fd*)(output->fp.bgzf->fp);
-  fp->fd = args->pipe_fd;
+  if (conv->npend == conv->mpend) {
+    size_t m = conv->mpend ? conv->mpend * 2 : 16;
+    pending_t* grown = realloc(conv->pend, m * sizeof(pending_t));
 
-  /* Write header */
-  bam_hdr_t* header = sam_hdr_read(args->cramp);
-  sam_hdr_write(output, header);
+    if (grown == NULL) {
+      ok = 0;
+      goto finish_up;
+    }
 
-  /* Write data body */
-  while (sam_read1(args->cramp, header, bam) >= 0) {
-    if (sam_write1(output, header, bam) < 0) break;
+    conv->pend  = grown;
+    conv->mpend = m;
   }
 
-  hts_close(output);
-  bam_destroy1(bam);
+  conv->pend[conv->npend++] = (pending_t){ block, cram, skip };
 
-  pthread_exit(NULL);
+finish_up:
+  (void)pthread_mutex_unlock(&conv->cplock);
+  return ok;
 }
 
 /**
-  @brief   Consume data from a pipe and aggregate its size
-  @param   argv  Pointer to argument structure
-  @return  Exit status (NULL = OK)
+  @brief   Drop a stream's region iterator and CRAM index
+  @param   conv  Conversion stream
 */
-void* trans_size(void* argv) {
-  struct trans_args* args = (struct trans_args*)argv;
-  struct size_args* targs = (struct size_args*)(args->args);
+static void conv_region_drop(cramp_conv_t* conv) {
+  if (conv->itr) {
+    hts_itr_destroy(conv->itr);
+    conv->itr = NULL;
+  }
+
+  if (conv->idx) {
+    hts_idx_destroy(conv->idx);
+    conv->idx = NULL;
+  }
+}
 
-  ssize_t i    = 0;
-  void*   data = malloc(PIPE_BUF);
+/**
+  @brief   Position a stream's CRAM file pointer at the start of its region
+  @param   conv  Conversion stream (with a CRAM file pointer and header)
+  @return  Exit status (0 = OK; -errno = not so much)
 
-  /* Read from pipe to get size */
-  while ((i = read(args->pipe_fd, data, PIPE_BUF)) > 0) {
-    targs->bam_size += i;
+  The region is parsed per `samtools view`; if it's not valid for the
+  CRAM (or the CRAM's not indexed), it doesn't exist.
+*/
+static int conv_region(cramp_conv_t* conv) {
+  if (conv->itr) {
+    hts_itr_destroy(conv->itr);
+    conv->itr = NULL;
   }
 
-  close(args->pipe_fd);
-  free(data);
+  if (conv->idx == NULL) {
+    conv->idx = sam_index_load(conv->cramp, conv->path);
+    if (conv->idx == NULL) {
+      return -ENOENT;
+    }
+  }
 
-  pthread_exit(NULL);
+  conv->itr = sam_itr_querys(conv->idx, conv->header, conv->region);
+  return conv->itr ? 0 : -ENOENT;
 }
 
 /**
-  @brief   Consume a particular chunk of data from a pipe
-  @param   argv  Pointer to argument structure
-  @return  Exit status (NULL = OK)
-
-    0                    N
-    |____________________|         The data is read into chunks of
-             ...                   length at most N, until EOF, where
-    iN     from          (i+1)N    the data from the previous chunk is
-    |______XXXXXXXXXXXXXX|         overwritten. We want a subset of the
-                                   data, at `from` bytes of length
-    (i+1)N               (i+2)N    `bytes` (modulo EOF), to be copied
-    |XXXXXXXXXXXXXXXXXXXX|         into our output buffer.
-             ...
-    kN       from+bytes  (k+1)N
-    |XXXXXXXXX___________|
-             ...
-    jN           EOF
-    |____________|
+  @brief   Get a fresh CRAM file pointer, and the header, for a stream
+  @param   conv  Conversion stream
+  @return  Exit status (0 = OK; -errno = not so much)
 
+  If the CRAM file pointer has already been read from, it's given back
+  to the pool and another is borrowed (n.b., usually the same one, sought
+  back to the start). Nothing may still refer to the old header.
 */
-void* trans_read(void* argv) {
-  static off_t bam_eof_offset = 0;
-  static char* bam_eof = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+static int conv_cram(cramp_conv_t* conv) {
+  if (!conv->fresh) {
+    /* The index and iterator belong to the old file pointer */
+    conv_region_drop(conv);
+
+    cramp_handles_put(CTX->handles, conv->handle);
+    conv->handle = cramp_handles_get(CTX->handles, conv->path, conv->view);
+    conv->cramp  = conv->handle ? conv->handle->fp : NULL;
+    conv->header = conv->handle ? conv->handle->header : NULL;
 
-  /* The virtual BAM EOF block occupies the last 28 bytes of the file.
-     When we don't know the size in advance, and a seek is done to check
-     the EOF is correct, we just return that block (which is static; see
-     above), rather than streaming it all through.
-  
-     TODO It would be good, while we're still streaming, to also have
-          this behaviour when the size *is* known.                    */
-  if (bam_eof_offset == 0) {
-    cramp_ctx_t* ctx = CTX;
-    bam_eof_offset = ctx->conf->bamsize - 28;
+    if (conv->handle == NULL) {
+      return -errno;
+    }
+    conv->fresh = 1;
   }
 
-  struct trans_args* args = (struct trans_args*)argv;
-  struct read_args* targs = (struct read_args*)(args->args);
+  return 0;
+}
 
-  block_t chunk   = { 0, 0 };
-  block_t wanted  = { targs->from, targs->bytes };
-  block_t to_copy = { 0, 0 };
+/**
+  @brief   BAM output mode for a stream's compression level
+  @param   conv  Conversion stream
+  @param   mode  Mode buffer (at least 4 bytes)
+*/
+static void conv_mode(const cramp_conv_t* conv, char* mode) {
+  memcpy(mode, "wb", 3);
+  if (conv->level >= 0) {
+    mode[2] = '0' + conv->level;
+    mode[3] = '\0';
+  }
+}
 
-  char* buf = targs->buffer;
+/**
+  @brief   Start the conversion of a stream
+  @param   conv  Conversion stream
+  @param   from  Checkpoint to resume from (NULL = Start of file)
+  @return  Exit status (0 = OK; -errno = not so much)
 
-  if (wanted.start == bam_eof_offset) {
-    /* Return EOF block (or part, thereof) */
-    to_copy.len = wanted.len > 28 ? 28 : wanted.len;
-    memcpy((void*)buf, (void*)bam_eof, to_copy.len);
-    targs->size = to_copy.len;
+  Checkpoints are recorded whenever we start from the beginning.
+*/
+static int conv_start(cramp_conv_t* conv, const cramp_checkpoint_t* from) {
+  conv_stop(conv);
 
-  } else {
-    /* Stream through */
-    char* data = malloc(PIPE_BUF);
-
-    while ((chunk.len = read(args->pipe_fd, data, PIPE_BUF)) > 0) {
-      if (wanted.start < END_OF(chunk) && END_OF(wanted) > chunk.start) {
-        /* Calculate copy region relative to chunk */
-        to_copy.start = wanted.start - chunk.start;
-        if (to_copy.start < 0) {
-          to_copy.start = 0;
-        }
+  int res = conv_cram(conv);
+  if (res < 0) {
+    return res;
+  }
 
-        to_copy.len = wanted.len - targs->size;
-        if (END_OF(to_copy) > chunk.len) {
-          to_copy.len = chunk.len - to_copy.start;
-        }
+  /* The pool's only attached to a file pointer the first time it's
+     borrowed; after that, it stays attached                         */
+  cramp_handles_attach(conv->handle, conv->pool);
 
-        memcpy((void*)(buf + targs->size),
-               (void*)(data + to_copy.start),
-               to_copy.len);
-        targs->size += to_copy.len;
-      
-        /* Break the loop if we've read what we need */
-        if (targs->size == wanted.len) {
-          break;
-        }
+  conv->fresh   = 0;
+  conv->eof     = 0;
+  conv->publish = 0;
+  conv->n       = 0;
+  conv->resumed = (from != NULL);
+  conv->failed  = 0;
+  conv->blocks  = 0;
+
+  cramp_ring_reset(conv->ring, from ? from->bam : 0);
+
+  /* Regions are read through the CRAM's index, from the start of the
+     region, so they have no checkpoints (nor parallelism)            */
+  if (conv->region) {
+    res = conv_region(conv);
+    if (res < 0) {
+      return res;
+    }
+
+  } else if (!from) {
+    /* n.b., Failing to locate the containers just means no checkpoints */
+    conv->cont = cramp_containers(conv->path, &conv->ncont, &conv->records);
+    if (conv->cont) {
+      conv->index = calloc(1, sizeof(cramp_index_t));
+    }
+    conv->c    = 0;
+    conv->want = 1;
+
+    /* n.b., Failing to start in parallel just means we stream */
+    if (conv->parallel && conv->index) {
+      conv->par = cramp_par_open(conv->path, conv->header,
+                                 conv->cont, conv->ncont,
+                                 conv->pool, conv->level, conv->view);
+      if (conv->par) {
+        return 0;
+      }
+    }
+  }
+
+  /* Open the output BAM into the ring; blocks are only tracked when
+     we're recording checkpoints                                      */
+  hFILE* hfp = cramp_ring_hopen(conv->ring, conv->index ? conv_block : NULL, conv);
+  if (hfp == NULL) {
+    int errsav = errno;
+    conv_stop(conv);
+    return -errsav;
+  }
+
+  char mode[4];
+  conv_mode(conv, mode);
+
+  conv->output = hts_hopen(hfp, "-", mode);
+  if (conv->output == NULL) {
+    (void)hclose(hfp);
+    conv_stop(conv);
+    return -EIO;
+  }
+
+  if (conv->pool) {
+    (void)hts_set_opt(conv->output, HTS_OPT_THREAD_POOL, conv->pool);
+  }
+
+  if (from) {
+    /* Resume from checkpoint, without (re)writing the header */
+    conv->from = *from;
+
+    if (cram_seek(conv->cramp->fp.cram, from->cram, SEEK_SET) != 0) {
+      conv_stop(conv);
+      return -EIO;
+    }
+
+    for (; conv->n < from->skip; ++conv->n) {
+      if (sam_read1(conv->cramp, conv->header, conv->bam) < 0) {
+        conv_stop(conv);
+        return -EIO;
       }
+    }
 
-      chunk.start += chunk.len;
+  } else {
+    if (sam_hdr_write(conv->output, conv->header) < 0) {
+      conv_stop(conv);
+      return -EIO;
     }
 
-    close(args->pipe_fd);
-    free(data);
+    /* The header is flushed (and, with threads, written) in full, so the
+       records start in the block after it                            */
+    (void)pthread_mutex_lock(&conv->cplock);
+    conv->block = conv->blocks;
+    (void)pthread_mutex_unlock(&conv->cplock);
+
+    conv->fill  = 0;
+    conv->track = (conv->output->fp.bgzf->block_offset == 0);
+
+    /* Index the output as it's written, for the virtual BAI (n.b., only
+       the full view has one)                                         */
+    if (conv->region == NULL && conv->view == view_full) {
+      conv_bai_init(conv);
+    }
   }
 
-  pthread_exit(NULL);
+  return 0;
 }
 
 /**
-  @brief   Write the BAM, converted from a CRAM, down a pipe to a transformation
-  @param   cramp      CRAM file pointer
-  @param   transform  Transformation function
-  @param   args       Arguments for the transformation function
+  @brief   Serialise the BAM header blocks of a stream into the stat cache
+  @param   conv  Conversion stream
   @return  Exit status (0 = OK; -errno = not so much)
+
+  The header is always flushed into its own block(s), so it's written
+  alone, at the stream's level, and everything before the EOF marker is
+  byte for byte the start of the virtual BAM. A stream that's already
+  converting has the header, so the CRAM is only read if it hasn't.
 */
-int conv_pipe(htsFile* cramp, void*(*transform)(void*), void* args) {
-  /* Create the pipe */
-  int pipe_fd[2];
-  if (pipe(pipe_fd) == -1) {
-    return -errno;
+static int conv_header(cramp_conv_t* conv) {
+  cramp_ctx_t* ctx = CTX;
+  int res;
+
+  if (conv->header == NULL && (res = conv_cram(conv)) < 0) {
+    return res;
   }
 
-  /* Set thread arguments */
-  struct conv_args c_args = { cramp, pipe_fd[1] };
-  struct trans_args t_args = { args, pipe_fd[0] };
+  char mode[4];
+  conv_mode(conv, mode);
 
-  /* Create joinable conversion and transformation threads */
-  pthread_t t_conv, t_trans;
-  pthread_attr_t attr;
+  char*    data = NULL;
+  off_t    len  = -1;
+  htsFile* out  = NULL;
+  cramp_ring_t* ring = cramp_ring_buffer(BGZF_MAX_BLOCK_SIZE);
+  hFILE*   hfp  = ring ? cramp_ring_hopen(ring, NULL, NULL) : NULL;
 
-  (void)pthread_attr_init(&attr);
-  (void)pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+  if (hfp) {
+    out = hts_hopen(hfp, "-", mode);
+    if (out == NULL) {
+      (void)hclose(hfp);
+    }
+  }
 
-  if (pthread_create(&t_conv, &attr, convert, (void*)&c_args)) {
-    return -errno;
+  if (out) {
+    res = sam_hdr_write(out, conv->header);
+    if (hts_close(out) == 0 && res == 0) {
+      len = cramp_ring_end(ring) - 28;
+    }
   }
-  if (pthread_create(&t_trans, &attr, transform, (void*)&t_args)) {
-    return -errno;
+
+  if (len > 0) {
+    data = malloc(len);
+    if (data && cramp_ring_copy(ring, data, 0, len) == (size_t)len) {
+      (void)cramp_cache_set_header(ctx->cache, conv->key, conv->mtime, data, len);
+      data = NULL;
+    }
   }
 
-  (void)pthread_attr_destroy(&attr);
+  free((void*)data);
+  cramp_ring_destroy(ring);
+  return (len > 0) ? 0 : -EIO;
+}
 
-  if (pthread_join(t_conv, NULL)) {
-    return -errno;
+/**
+  @brief   Put the next block of a parallel conversion into the ring
+  @param   conv  Conversion stream
+  @return  Exit status (0 = OK; -errno = not so much)
+*/
+static int conv_step_par(cramp_conv_t* conv) {
+  cramp_par_block_t block;
+  off_t at = cramp_ring_end(conv->ring);
+
+  int res = cramp_par_next(conv->par, &block);
+  if (res < 0) {
+    conv_stop(conv);
+    return -EIO;
   }
-  if (pthread_join(t_trans, NULL)) {
-    return -errno;
+
+  if (res == 0) {
+    /* End of the CRAM: The EOF marker is already in the ring */
+    cramp_par_close(conv->par);
+    conv->par = NULL;
+
+    if (conv->index && conv->index->n == 0) {
+      cramp_index_destroy(conv->index);
+      conv->index = NULL;
+    }
+
+    conv->eof     = 1;
+    conv->publish = !conv->resumed;
+    return 0;
+  }
+
+  if (!cramp_ring_write(conv->ring, block.data, block.len)) {
+    conv_stop(conv);
+    return -ENOMEM;
+  }
+
+  if (block.checkpoint && conv->index
+   && !cramp_index_push(conv->index, at, block.cram, block.skip)) {
+    cramp_index_destroy(conv->index);
+    conv->index = NULL;
   }
 
   return 0;
 }
 
 /**
-  @brief   Calculate the size of a BAM, converted from a CRAM
+  @brief   Convert the next record (or block, in parallel) of a stream
+  @param   conv  Conversion stream
+  @return  Exit status (0 = OK; -errno = not so much)
+
+  At the end of the CRAM, the BAM is closed (flushing its last block
+  and EOF marker into the ring).
+*/
+static int conv_step(cramp_conv_t* conv) {
+  if (conv->par) {
+    return conv_step_par(conv);
+  }
+
+  bam1_t* bam = conv->bam;
+  BGZF*   bgzf = conv->output->fp.bgzf;
+
+  int ret = conv->itr ? sam_itr_next(conv->cramp, conv->itr, bam)
+                      : sam_read1(conv->cramp, conv->header, bam);
+  if (ret < -1) {
+    conv_stop(conv);
+    return -EIO;
+  }
+
+  if (ret == -1) {
+    /* End of the CRAM: Closing the output waits for all its blocks,
+       but the index must be saved first                              */
+    int indexed = conv->baifile && sam_idx_save(conv->output) == 0;
+    int res = hts_close(conv->output);
+    conv->output = NULL;
+
+    if (res < 0) {
+      conv_stop(conv);
+      return -EIO;
+    }
+
+    if (indexed) {
+      conv_bai_publish(conv);
+    }
+    conv_bai_drop(conv);
+
+    /* Don't trust the index if the record counts don't agree, or any
+       checkpoint went astray                                         */
+    if (conv->index && (conv->index->n == 0 || conv->n != conv->records
+                        || !conv->track || conv->failed || conv->npend)) {
+      cramp_index_destroy(conv->index);
+      conv->index = NULL;
+    }
+
+    conv->eof     = 1;
+    conv->publish = !conv->resumed;
+    return 0;
+  }
+
+  while (conv->c + 1 < conv->ncont && conv->n >= conv->cont[conv->c + 1].first) {
+    ++conv->c;
+    conv->want = 1;
+  }
+
+  if (conv->index && conv->track) {
+    /* Simulate where the record goes: HTSLib flushes first, if it won't
+       fit in what's left of the current block                        */
+    size_t len = BAM_RECORD_LEN(bam);
+
+    if (bam->core.n_cigar > 0xffff) {
+      conv->track = 0;
+
+    } else {
+      if (conv->fill && conv->fill + len > BGZF_BLOCK_SIZE) {
+        ++conv->block;
+        conv->fill = 0;
+      }
+
+      /* Record a checkpoint at the first block to start in each
+         container, before the block can possibly be written          */
+      if (conv->want && conv->fill == 0) {
+        cramp_container_t* cont = &conv->cont[conv->c];
+
+        if (!conv_pend(conv, conv->block, cont->offset, conv->n - cont->first)) {
+          conv->track = 0;
+        }
+        conv->want = 0;
+      }
+
+      conv->fill  += len;
+      conv->block += conv->fill / BGZF_BLOCK_SIZE;
+      conv->fill  %= BGZF_BLOCK_SIZE;
+    }
+  }
+
+  if (sam_write1(conv->output, conv->header, bam) < 0) {
+    conv_stop(conv);
+    return -EIO;
+  }
+
+  if (conv->track && conv->fill != (size_t)bgzf->block_offset) {
+    conv->track = 0;
+  }
+
+  ++conv->n;
+  return 0;
+}
+
+/**
+  @brief   Create a conversion stream
+  @param   path    Path to CRAM file
+  @param   handle  Borrowed CRAM file pointer (ownership is taken; NULL = Borrow on demand)
+  @param   window  Size of the lookback window (0 = Count only)
+  @param   level   BGZF compression level (-1 = Default)
+  @param   view    Decoding view
+  @param   region  Region to convert (NULL = Whole file)
+  @return  Pointer to conversion stream (NULL on failure)
+*/
+static cramp_conv_t* conv_new(const char* path, cramp_handle_t* handle, size_t window, int level, enum cramp_view view, const char* region) {
+  cramp_conv_t* conv = calloc(1, sizeof(cramp_conv_t));
+  if (conv == NULL) {
+    return NULL;
+  }
+
+  cramp_ctx_t* ctx = CTX;
+  if (ctx->pool.pool) {
+    conv->pool     = &ctx->pool;
+    conv->parallel = ctx->conf->parallel;
+
+    /* Make room for the blocks in flight */
+    if (window) {
+      window += (ctx->pool.qsize + 2) * BGZF_MAX_BLOCK_SIZE;
+    }
+  }
+
+  struct stat st;
+  size_t len = strlen(path);
+  size_t reglen = region ? strlen(region) : 0;
+
+  conv->path   = malloc(len + 1);
+  conv->region = region ? malloc(reglen + 1) : NULL;
+  conv->key    = region ? cramp_cache_region_key(path, level, region)
+                        : cramp_cache_view_key(path, level, view);
+  conv->ring   = cramp_ring_init(window);
+  conv->bam    = bam_init1();
+
+  if (conv->path == NULL || conv->key == NULL || conv->ring == NULL
+                         || conv->bam == NULL || stat(path, &st) == -1
+                         || (region && conv->region == NULL)) {
+    int errsav = errno;
+    free((void*)conv->path);
+    free((void*)conv->region);
+    free((void*)conv->key);
+    cramp_ring_destroy(conv->ring);
+    if (conv->bam) {
+      bam_destroy1(conv->bam);
+    }
+    free((void*)conv);
+    errno = errsav;
+    return NULL;
+  }
+  memcpy((void*)conv->path, path, len + 1);
+  if (region) {
+    memcpy((void*)conv->region, region, reglen + 1);
+  }
+
+  conv->level  = level;
+  conv->view   = view;
+  conv->mtime  = st.st_mtime;
+  conv->handle = handle;
+  conv->cramp  = handle ? handle->fp : NULL;
+  conv->header = handle ? handle->header : NULL;
+  conv->fresh  = (handle != NULL);
+  (void)pthread_mutex_init(&conv->lock, NULL);
+  (void)pthread_mutex_init(&conv->cplock, NULL);
+
+  return conv;
+}
+
+/* Overhead of a stored BGZF block (-1 = Not constant; see below) */
+static off_t stored_overhead = -1;
+
+/**
+  @brief   Measure the overhead of stored (level 0) BGZF blocks
+
+  This is done with HTSLib itself, rather than assumed, and only trusted
+  if it's the same for the smallest and largest blocks.
+*/
+static void conv_stored_calibrate(void) {
+  static char raw[BGZF_BLOCK_SIZE];
+  static char block[BGZF_MAX_BLOCK_SIZE];
+
+  static const size_t sizes[] = { 1, BGZF_BLOCK_SIZE / 2, BGZF_BLOCK_SIZE };
+  off_t overhead = -1;
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    size_t len = BGZF_MAX_BLOCK_SIZE;
+    if (bgzf_compress(block, &len, raw, sizes[i], 0) != 0) {
+      return;
+    }
+
+    off_t measured = (off_t)len - (off_t)sizes[i];
+    if (overhead >= 0 && measured != overhead) {
+      return;
+    }
+    overhead = measured;
+  }
+
+  stored_overhead = overhead;
+}
+
+/**
+  @brief   Size of the stored (level 0) BGZF blocks holding some data
+  @param   len       Length of data (bytes)
+  @param   overhead  Overhead per block
+  @return  Size of blocks
+*/
+static off_t conv_stored(off_t len, off_t overhead) {
+  off_t blocks = (len + BGZF_BLOCK_SIZE - 1) / BGZF_BLOCK_SIZE;
+  return len + blocks * overhead;
+}
+
+/**
+  @brief   Calculate the size of a level 0 BAM, without converting
   @param   path  Path to CRAM file
-  @return  Size of the converted BAM file
+  @param   pool  Thread pool for decoding (NULL = Single threaded)
+  @return  Size of the converted BAM file (-1 on failure)
+
+  The CRAM is still decoded, for the record lengths, but nothing is
+  serialised or compressed (other than the header, for its length).
+  Records with more than 65535 CIGAR operations have a length we don't
+  predict, so they're a failure: the caller should convert instead.
+*/
+static off_t conv_size_stored(const char* path, htsThreadPool* pool) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  (void)pthread_once(&once, conv_stored_calibrate);
+
+  off_t overhead = stored_overhead;
+  if (overhead < 0) {
+    return -1;
+  }
+
+  off_t           size   = -1;
+  cramp_handle_t* handle = cramp_handles_get(CTX->handles, path, view_full);
+  bam1_t*         bam    = bam_init1();
+  cramp_ring_t*   ring   = cramp_ring_init(0);
+
+  if (handle == NULL || bam == NULL || ring == NULL) {
+    goto finish_up;
+  }
+
+  htsFile*   fp     = handle->fp;
+  bam_hdr_t* header = handle->header;
+
+  cramp_handles_attach(handle, pool);
+
+  /* The header's length is counted by "writing" it uncompressed into a
+     ring with no capacity; it's flushed into its own block(s)        */
+  hFILE* hfp = cramp_ring_hopen(ring, NULL, NULL);
+  if (hfp == NULL) {
+    goto finish_up;
+  }
+
+  htsFile* out = hts_hopen(hfp, "-", "wbu");
+  if (out == NULL) {
+    (void)hclose(hfp);
+    goto finish_up;
+  }
+
+  int res = sam_hdr_write(out, header);
+  if (hts_close(out) < 0 || res < 0) {
+    goto finish_up;
+  }
+
+  off_t total = conv_stored(cramp_ring_end(ring), overhead);
+  off_t fill  = 0;
+  size_t n    = 0;
+  int   ret;
+
+  /* Records are packed per HTSLib's rule (see conv_step) */
+  while ((ret = sam_read1(fp, header, bam)) >= 0) {
+    if (bam->core.n_cigar > 0xffff) {
+      goto finish_up;
+    }
+
+    /* Give way to reads, if we're in the background */
+    if ((++n & 0xfff) == 0 && cramp_precalc_yield()) {
+      goto finish_up;
+    }
 
-  TODO There is no caching of any kind, which makes this hopelessly
-  inefficient. At this point, it's just to prove the concept works!
+    off_t len = BAM_RECORD_LEN(bam);
+    if (fill && fill + len > BGZF_BLOCK_SIZE) {
+      total += conv_stored(fill, overhead);
+      fill   = 0;
+    }
+
+    fill  += len;
+    total += (fill / BGZF_BLOCK_SIZE) * conv_stored(BGZF_BLOCK_SIZE, overhead);
+    fill  %= BGZF_BLOCK_SIZE;
+  }
+
+  if (ret == -1) {
+    /* Last block and EOF marker */
+    size = total + conv_stored(fill, overhead) + 28;
+  }
+
+finish_up:
+  cramp_ring_destroy(ring);
+  if (bam) {
+    bam_destroy1(bam);
+  }
+  cramp_handles_put(CTX->handles, handle);
+
+  return size;
+}
+
+/**
+  @brief   Convert a CRAM in full, for its size (and so on)
+  @param   path      Path to CRAM file
+  @param   level     BGZF compression level (-1 = Default)
+  @param   parallel  Convert in parallel, if possible (0 = False; 1 = True)
+  @return  Size of the converted BAM file (-1 on failure)
+
+  The size, checkpoints, header and (unless it's done in parallel) BAI
+  index are all put into the stat cache.
+*/
+static off_t conv_full(const char* path, int level, int parallel) {
+  cramp_ctx_t* ctx = CTX;
+  off_t size = -1;
+
+  /* Nothing needs to be retained, so the ring just counts */
+  cramp_conv_t* conv = conv_new(path, NULL, 0, level, view_full, NULL);
+  if (conv == NULL) {
+    return -1;
+  }
+  conv->parallel &= parallel;
+
+  int res = conv_start(conv, NULL);
+  while (res == 0 && !conv->eof) {
+    /* Background calculations give way to reads (or are abandoned) */
+    if (cramp_precalc_yield()) {
+      res = -ECANCELED;
+      break;
+    }
+
+    res = conv_step(conv);
+  }
+
+  if (res == 0) {
+    cramp_index_t* index = conv->index;
+    size_t checkpoints = index ? index->n : 0;
+
+    size = cramp_ring_end(conv->ring);
+    (void)cramp_cache_update(ctx->cache, conv->key, conv->mtime, size, index);
+    conv->index = NULL;
+
+    /* While we have the header to hand */
+    (void)conv_header(conv);
+
+    LOG("BAM of %s is %ld bytes, with %lu checkpoints", path, size, checkpoints);
+  }
+
+  (void)cramp_conv_close(conv);
+  return size;
+}
+
+/**
+  @brief   Calculate the size of a BAM, converted from a CRAM
+  @param   path   Path to CRAM file
+  @param   level  BGZF compression level (-1 = Default)
+  @return  Size of the converted BAM file (-1 on failure)
 
   Potential caching and precalculation mechanisms:
 
@@ -311,6 +1088,8 @@ int conv_pipe(htsFile* cramp, void*(*transform)(void*), void* args) {
   * Use a background thread pool that watches the source directory for
     CRAM files; when it spots a new one (or at start up), it calculates
     the converted BAM size. (As opposed to on-demand size calculation.)
+    Done at start up, by precalc.c, which throttles itself through
+    cramp_precalc_yield.
 
   The OS needs the size to signal the EOF to other syscalls. AFAIK,
   there is no way we can do this from userland, even though we know when
@@ -319,36 +1098,356 @@ int conv_pipe(htsFile* cramp, void*(*transform)(void*), void* args) {
   This may make a remote source a complete non-starter, as it would be
   far too expensive to perform this -- even with any of the above
   optimisations -- over HTTP.
+
+  Level 0 sizes are calculated analytically, when possible; the full
+  conversion is the fallback. Either way, the size is put into the stat
+  cache, along with the checkpoints (and header) from a full conversion.
 */
-off_t cramp_conv_size(const char* path) {
-  struct size_args filesize = { 0 };
-  
-  htsFile* cramp = hts_open(path, "r");
-  (void)conv_pipe(cramp, trans_size, (void*)&filesize);
-  (void)hts_close(cramp);
-
-  LOG("BAM of %s is %lu bytes", path, filesize.bam_size);
-  return filesize.bam_size;
+off_t cramp_conv_size(const char* path, int level) {
+  cramp_ctx_t* ctx = CTX;
+  off_t size = -1;
+
+  if (level == 0) {
+    struct stat st;
+    if (stat(path, &st) == 0) {
+      size = conv_size_stored(path, ctx->pool.pool ? &ctx->pool : NULL);
+    }
+
+    if (size >= 0) {
+      const char* key = cramp_cache_key(path, level);
+      if (key) {
+        (void)cramp_cache_update(ctx->cache, key, st.st_mtime, size, NULL);
+        free((void*)key);
+      }
+
+      LOG("BAM of %s is %ld bytes (calculated)", path, size);
+      return size;
+    }
+
+    /* Don't fall back if a background calculation was abandoned */
+    if (cramp_precalc_yield()) {
+      return -1;
+    }
+  }
+
+  return conv_full(path, level, ctx->conf->parallel);
+}
+
+/**
+  @brief   Get the BAI index of a virtual BAM, building it if necessary
+  @param   path   Path to CRAM file
+  @param   level  BGZF compression level (-1 = Default)
+  @param   bai    Pointer to be set to a malloc'd copy of the index
+                  (NULL = Just build it)
+  @return  Length of the index (-errno on failure)
+
+  The index is built as a side effect of any streamed conversion from
+  the start of the file, so this is just one of those, which also puts
+  the size and checkpoints into the stat cache. Only HTSLib's own output
+  can be indexed, so it's never done in parallel. It takes as long as
+  a full conversion, so it's only done in the background (see
+  cramp_precalc_bai).
+*/
+ssize_t cramp_conv_bai(const char* path, int level, char** bai) {
+  cramp_ctx_t* ctx = CTX;
+  struct stat st;
+
+  const char* key = cramp_cache_key(path, level);
+  if (key == NULL) {
+    return -errno;
+  }
+
+  if (stat(path, &st) == -1) {
+    int errsav = errno;
+    free((void*)key);
+    return -errsav;
+  }
+
+  ssize_t len = cramp_cache_bai(ctx->cache, key, st.st_mtime, bai);
+  if (len < 0 && conv_full(path, level, 0) >= 0) {
+    len = cramp_cache_bai(ctx->cache, key, st.st_mtime, bai);
+  }
+
+  free((void*)key);
+  return (len < 0) ? -EIO : len;
+}
+
+/**
+  @brief   Open a conversion stream
+  @param   path    Path to CRAM file
+  @param   handle  Borrowed CRAM file pointer (ownership is taken; NULL = Borrow on demand)
+  @param   level   BGZF compression level (-1 = Default)
+  @param   view    Decoding view
+  @param   region  Region to convert (NULL = Whole file)
+  @return  Pointer to conversion stream (NULL on failure)
+
+  The conversion doesn't start until the first read, but a region is
+  checked up front (failing with ENOENT if it's not valid).
+*/
+cramp_conv_t* cramp_conv_open(const char* path, cramp_handle_t* handle, int level, enum cramp_view view, const char* region) {
+  cramp_conv_t* conv = conv_new(path, handle, CONV_WINDOW, level, view, region);
+
+  if (conv && region) {
+    int res = conv_cram(conv);
+    if (res == 0) {
+      res = conv_region(conv);
+    }
+
+    if (res < 0) {
+      /* As with any other failure, the caller keeps its file pointer */
+      if (conv->handle == handle) {
+        conv->handle = NULL;
+      }
+
+      (void)cramp_conv_close(conv);
+      errno = -res;
+      return NULL;
+    }
+  }
+
+  return conv;
+}
+
+/**
+  @brief   Put converted pages into the block and spill caches
+  @param   conv    Conversion stream (locked)
+  @param   blocks  Block cache (NULL = None)
+  @param   spill   Spill cache (NULL = None)
+  @param   start   Start of the converted data that was read
+  @param   end     End of the converted data that was read
+
+  Only whole pages that the ring still holds are cached, except for the
+  last page of the file, which is usually short (or even empty, if the
+  file is a whole number of pages).
+*/
+static void conv_pages(cramp_conv_t* conv, cramp_blocks_t* blocks, cramp_spill_t* spill, off_t start, off_t end) {
+  if ((blocks == NULL && spill == NULL) || start >= end) {
+    return;
+  }
+
+  off_t ring_end = cramp_ring_end(conv->ring);
+  size_t last = (end == ring_end && conv->eof) ? end / CRAMP_BLOCKS_PAGE
+                                               : (end - 1) / CRAMP_BLOCKS_PAGE;
+
+  for (size_t index = start / CRAMP_BLOCKS_PAGE; index <= last; ++index) {
+    off_t from = (off_t)index * CRAMP_BLOCKS_PAGE;
+    off_t to   = from + CRAMP_BLOCKS_PAGE;
+
+    if (to > ring_end) {
+      if (!conv->eof) {
+        break;
+      }
+      to = ring_end;
+    }
+
+    int ram  = blocks && !cramp_blocks_has(blocks, conv->key, conv->mtime, index);
+    int disk = cramp_spill_wants(spill, conv->key, conv->mtime, index);
+
+    if (from < cramp_ring_start(conv->ring) || !(ram || disk)) {
+      continue;
+    }
+
+    char* data = malloc(to > from ? to - from : 1);
+    if (data == NULL) {
+      return;
+    }
+
+    if (cramp_ring_copy(conv->ring, data, from, to - from) != (size_t)(to - from)) {
+      free((void*)data);
+      continue;
+    }
+
+    if (disk) {
+      cramp_spill_put(spill, conv->key, conv->mtime, index, data, to - from);
+    }
+
+    if (ram) {
+      cramp_blocks_put(blocks, conv->key, conv->mtime, index, data, to - from);
+    } else {
+      free((void*)data);
+    }
+  }
 }
 
 /**
   @brief   Read the BAM file, converted from a CRAM, into the buffer
-  @param   cramp   CRAM file pointer
+  @param   conv    Conversion stream
   @param   buf     Data buffer
   @param   size    Data size (bytes)
   @param   offset  Data offset (bytes)
   @return  Exit status (Success: number of bytes read; Fail: -1)
-  
-  TODO Set errno like pread. Note that errno is thread-local, so
-  ultimately we'll have to pass it around to get it back to the FUSE
-  operations (the same goes for cramp_conv_size).
 
-  TODO This performs a linear read, with no caching, so is hopelessly
-  inefficient. At this point, it's just to prove the concept works!
+  Sequential reads continue the stream from where the last one left off
+  and reads that fall within the lookback window are copied from it, so
+  reading the whole file is linear in its size. Reading from before the
+  window, or beyond a later checkpoint, restarts the conversion from the
+  nearest checkpoint (or the beginning, if there aren't any).
+
+  When a conversion from the start of the file finishes, its size and
+  checkpoints are put into the stat cache.
+
+  Tools that only check the header (e.g., `samtools view -H`) or the EOF
+  marker (e.g., `samtools quickcheck`) needn't convert anything: the
+  header blocks are serialised on their own, on the first read from the
+  start of the file, and kept in the stat cache; the EOF marker is
+  always the last 28 bytes, of the cached size, if it's known, or the
+  --bamsize placeholder, if not.
+
+  With a block cache (--block-cache), reads are served from there first
+  and whatever is converted is put there, a page at a time, for anybody
+  else reading the same file. Likewise for the spill cache (--spill),
+  which is next in line, on disk.
 */
-ssize_t cramp_conv_read(htsFile* cramp, char* buf, size_t size, off_t offset) {
-  struct read_args data = { offset, size, buf, 0 };
-  (void)conv_pipe(cramp, trans_read, (void*)&data);
-  errno = ENOSYS;
-  return data.size;
+ssize_t cramp_conv_read(cramp_conv_t* conv, char* buf, size_t size, off_t offset) {
+  static const char bam_eof[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+
+  cramp_ctx_t* ctx = CTX;
+
+  /* The virtual BAM EOF block occupies the last 28 bytes of the file,
+     so reads of it (or part, thereof) are just copied                */
+  off_t bam_size = cramp_cache_size(ctx->cache, conv->key, conv->mtime);
+  if (bam_size == 0) {
+    bam_size = ctx->conf->bamsize;
+  }
+
+  if (offset >= bam_size - 28) {
+    if (offset >= bam_size) {
+      return 0;
+    }
+
+    size_t len = bam_size - offset;
+    if (len > size) {
+      len = size;
+    }
+    memcpy((void*)buf, (void*)(bam_eof + offset - (bam_size - 28)), len);
+    return len;
+  }
+
+  /* Likewise, the header blocks, which are serialised on first use */
+  ssize_t copied = cramp_cache_header(ctx->cache, conv->key, conv->mtime,
+                                      buf, size, offset);
+  if (copied == -1 && offset == 0) {
+    (void)pthread_mutex_lock(&conv->lock);
+    (void)conv_header(conv);
+    (void)pthread_mutex_unlock(&conv->lock);
+
+    copied = cramp_cache_header(ctx->cache, conv->key, conv->mtime,
+                                buf, size, offset);
+  }
+
+  if (copied == -1) {
+    copied = 0;
+  }
+
+  if (copied == (ssize_t)size) {
+    return copied;
+  }
+
+  /* Anything that's already been converted, by anyone, is just copied */
+  int eof;
+  copied += cramp_blocks_read(ctx->blocks, conv->key, conv->mtime, buf + copied,
+                              size - copied, offset + copied, &eof);
+  if (copied < (ssize_t)size && !eof) {
+    copied += cramp_spill_read(ctx->spill, conv->key, conv->mtime, buf + copied,
+                               size - copied, offset + copied, &eof);
+  }
+
+  if (copied == (ssize_t)size || eof) {
+    return copied;
+  }
+
+  (void)pthread_mutex_lock(&conv->lock);
+
+  /* ...and we convert the rest */
+  off_t from = offset + copied;
+  cramp_ring_t* ring = conv->ring;
+  cramp_checkpoint_t cp;
+  int have_cp = cramp_cache_checkpoint(ctx->cache, conv->key, conv->mtime, from, &cp);
+
+  /* (Re)start the stream if it's not going, we need data from before the
+     window, or we can jump ahead rather than streaming through       */
+  if ((!conv->output && !conv->par && !conv->eof)
+   || from < cramp_ring_start(ring)
+   || (have_cp && cp.bam > cramp_ring_end(ring))) {
+    int res = conv_start(conv, have_cp ? &cp : NULL);
+    if (res < 0) {
+      errno = -res;
+      copied = -1;
+      goto finish_up;
+    }
+  }
+
+  block_t wanted = { offset, size };
+
+  while (copied < wanted.len) {
+    /* Copy whatever we can from the ring... */
+    copied += cramp_ring_copy(ring, buf + copied,
+                              wanted.start + copied,
+                              wanted.len - copied);
+
+    /* ...otherwise, convert some more */
+    if (copied < wanted.len) {
+      if (conv->eof) {
+        break;
+      }
+
+      /* The ring is sized so this shouldn't happen, but we can't loop */
+      if (wanted.start + copied < cramp_ring_start(ring)) {
+        LOG("Conversion of %s overran its window", conv->path);
+        errno  = EIO;
+        copied = -1;
+        goto finish_up;
+      }
+
+      int res = conv_step(conv);
+      if (res < 0) {
+        errno = -res;
+        copied = -1;
+        goto finish_up;
+      }
+    }
+  }
+
+  conv_pages(conv, ctx->blocks, ctx->spill, from, offset + copied);
+
+  if (conv->publish) {
+    cramp_index_t* index = conv->index;
+    size_t checkpoints = index ? index->n : 0;
+
+    (void)cramp_cache_update(ctx->cache, conv->key, conv->mtime,
+                             cramp_ring_end(ring), index);
+    conv->index   = NULL;
+    conv->publish = 0;
+
+    LOG("BAM of %s is %ld bytes, with %lu checkpoints", conv->path,
+        cramp_ring_end(ring), checkpoints);
+  }
+
+finish_up:
+  (void)pthread_mutex_unlock(&conv->lock);
+  return copied;
+}
+
+/**
+  @brief   Close a conversion stream
+  @param   conv  Conversion stream
+  @return  Exit status (0 = OK; -1 = Fail)
+*/
+int cramp_conv_close(cramp_conv_t* conv) {
+  conv_stop(conv);
+  conv_region_drop(conv);
+  cramp_handles_put(CTX->handles, conv->handle);
+
+  bam_destroy1(conv->bam);
+  cramp_ring_destroy(conv->ring);
+
+  (void)pthread_mutex_destroy(&conv->lock);
+  (void)pthread_mutex_destroy(&conv->cplock);
+  free((void*)conv->pend);
+  free((void*)conv->path);
+  free((void*)conv->region);
+  free((void*)conv->key);
+  free((void*)conv);
+
+  return 0;
 }
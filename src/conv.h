@@ -4,7 +4,19 @@
 #ifndef _CRAMP_CONV_H
 #define _CRAMP_CONV_H
 
-extern off_t   cramp_conv_size(const char*);
-extern ssize_t cramp_conv_read(htsFile*, char*, size_t, off_t);
+/* Needed for off_t and ssize_t */
+#include <sys/types.h>
+
+/* Needed for cramp_handle_t */
+#include "handles.h"
+
+/* Opaque conversion stream */
+typedef struct cramp_conv cramp_conv_t;
+
+extern off_t         cramp_conv_size(const char*, int);
+extern ssize_t       cramp_conv_bai(const char*, int, char**);
+extern cramp_conv_t* cramp_conv_open(const char*, cramp_handle_t*, int, enum cramp_view, const char*);
+extern ssize_t       cramp_conv_read(cramp_conv_t*, char*, size_t, off_t);
+extern int           cramp_conv_close(cramp_conv_t*);
 
 #endif
@@ -0,0 +1,356 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "dirs.h"
+#include "listing.h"
+
+#include <htslib/khash.h>
+
+/*
+  NOTES
+
+  Listing a directory reads the whole source directory and checks every
+  CRAM in it, to inject its virtual BAMs. Scanners that walk the mount
+  over and over do that for every directory, every time, so complete
+  (sealed) listings are cached, by source directory, within a memory
+  budget (--dir-cache).
+
+  A cached listing is only served while its directory is unchanged: its
+  device, inode, mtime and ctime are checked against a fresh stat when
+  it's opened. The watcher (see watch.c) also forgets a directory's
+  listing whenever anything in it changes, which catches what its mtime
+  doesn't (e.g., a CRAM that's rewritten in place). Listings are built
+  against a stat taken beforehand, so if anything's forgotten while one
+  is being built, it isn't cached; nor is one of a directory modified
+  within the last second, as a change within the same timestamp would
+  go unnoticed.
+
+  An open directory holds a reference to the listing it's served from,
+  so its offsets (positions in the listing) are stable until it's
+  closed, even if the listing's evicted or replaced meanwhile. Listings
+  are evicted least recently used first. Everything happens under one
+  lock, including taking and releasing references.
+
+  The stat structures in a listing aren't updated as virtual BAMs are
+  sized; FUSE only takes the inode and file type from them, and getattr
+  gives the current size.
+*/
+
+/**
+  @brief   Cached directory
+  @var     key      Source directory
+  @var     dev      Device of the directory
+  @var     ino      Inode of the directory
+  @var     mtime    Modification time of the directory
+  @var     ctime    Status change time of the directory
+  @var     listing  Listing (sealed)
+  @var     size     Memory used by the listing (bytes)
+  @var     prev     More recently used directory (NULL = Most recent)
+  @var     next     Less recently used directory (NULL = Least recent)
+*/
+typedef struct dirs_dir {
+  const char*      key;
+  dev_t            dev;
+  ino_t            ino;
+  struct timespec  mtime;
+  struct timespec  ctime;
+  cramp_listing_t* listing;
+  size_t           size;
+  struct dirs_dir* prev;
+  struct dirs_dir* next;
+} dirs_dir_t;
+
+/* Initialise directory map type (source directory => directory) */
+KHASH_MAP_INIT_STR(dir_map, dirs_dir_t*)
+
+/**
+  @brief   Directory listing cache
+  @var     budget      Memory budget (bytes)
+  @var     used        Memory used by listings (bytes)
+  @var     generation  Number of times anything's been forgotten
+  @var     dirs        Directories, by source directory
+  @var     head        Most recently used directory
+  @var     tail        Least recently used directory
+  @var     lock        Mutex
+*/
+struct cramp_dirs {
+  size_t            budget;
+  size_t            used;
+  unsigned long     generation;
+  khash_t(dir_map)* dirs;
+  dirs_dir_t*       head;
+  dirs_dir_t*       tail;
+  pthread_mutex_t   lock;
+};
+
+/**
+  @brief   Take a directory out of the LRU list
+  @param   c    Cache (locked)
+  @param   dir  Directory
+*/
+static void dirs_unlink(cramp_dirs_t* c, dirs_dir_t* dir) {
+  *(dir->prev ? &dir->prev->next : &c->head) = dir->next;
+  *(dir->next ? &dir->next->prev : &c->tail) = dir->prev;
+  dir->prev = dir->next = NULL;
+}
+
+/**
+  @brief   Put a directory at the front of the LRU list
+  @param   c    Cache (locked)
+  @param   dir  Directory (unlinked)
+*/
+static void dirs_touch(cramp_dirs_t* c, dirs_dir_t* dir) {
+  dir->next = c->head;
+  *(c->head ? &c->head->prev : &c->tail) = dir;
+  c->head = dir;
+}
+
+/**
+  @brief   Drop a directory from the cache
+  @param   c    Cache (locked)
+  @param   dir  Directory
+
+  Its listing is freed once nobody's reading it.
+*/
+static void dirs_drop(cramp_dirs_t* c, dirs_dir_t* dir) {
+  khiter_t key = kh_get(dir_map, c->dirs, dir->key);
+  if (key != kh_end(c->dirs)) {
+    kh_del(dir_map, c->dirs, key);
+  }
+
+  dirs_unlink(c, dir);
+  c->used -= dir->size;
+
+  cramp_listing_release(dir->listing);
+  free((void*)dir->key);
+  free((void*)dir);
+}
+
+/**
+  @brief   Check whether a cached directory is unchanged
+  @param   dir  Directory
+  @param   st   stat structure of the source directory, now
+  @return  Unchanged (0 = False; 1 = True)
+*/
+static int dirs_current(const dirs_dir_t* dir, const struct stat* st) {
+  return dir->dev           == st->st_dev
+      && dir->ino           == st->st_ino
+      && dir->mtime.tv_sec  == st->st_mtim.tv_sec
+      && dir->mtime.tv_nsec == st->st_mtim.tv_nsec
+      && dir->ctime.tv_sec  == st->st_ctim.tv_sec
+      && dir->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/**
+  @brief   Create a directory listing cache
+  @param   budget  Memory budget (bytes)
+  @return  Pointer to cache (NULL on failure)
+*/
+cramp_dirs_t* cramp_dirs_init(size_t budget) {
+  cramp_dirs_t* c = calloc(1, sizeof(cramp_dirs_t));
+  if (c == NULL) {
+    return NULL;
+  }
+
+  c->budget = budget;
+  c->dirs   = kh_init(dir_map);
+  if (c->dirs == NULL) {
+    free((void*)c);
+    return NULL;
+  }
+
+  (void)pthread_mutex_init(&c->lock, NULL);
+  return c;
+}
+
+/**
+  @brief   Get a directory's cached listing
+  @param   c           Cache (NULL = No-op)
+  @param   dir         Source directory (without a trailing slash)
+  @param   st          stat structure of the source directory, now
+  @param   generation  Set to pass to cramp_dirs_put, on a miss
+  @return  Pointer to listing, which must be released (NULL = Not cached)
+
+  A listing for a directory that's since changed is dropped.
+*/
+cramp_listing_t* cramp_dirs_get(cramp_dirs_t* c, const char* dir, const struct stat* st, unsigned long* generation) {
+  cramp_listing_t* listing = NULL;
+
+  if (c == NULL) {
+    return NULL;
+  }
+
+  (void)pthread_mutex_lock(&c->lock);
+
+  *generation = c->generation;
+
+  khiter_t key = kh_get(dir_map, c->dirs, dir);
+  if (key != kh_end(c->dirs)) {
+    dirs_dir_t* cached = kh_value(c->dirs, key);
+
+    if (dirs_current(cached, st)) {
+      listing = cached->listing;
+      cramp_listing_hold(listing);
+
+      dirs_unlink(c, cached);
+      dirs_touch(c, cached);
+
+    } else {
+      dirs_drop(c, cached);
+    }
+  }
+
+  (void)pthread_mutex_unlock(&c->lock);
+  return listing;
+}
+
+/**
+  @brief   Put a directory's listing into the cache
+  @param   c           Cache (NULL = No-op)
+  @param   dir         Source directory (without a trailing slash)
+  @param   st          stat structure of the source directory, from
+                       before the listing was built
+  @param   generation  As set by cramp_dirs_get, before the listing was
+                       built
+  @param   listing     Listing (sealed; the caller keeps its reference)
+
+  Least recently used listings are evicted to make room.
+*/
+void cramp_dirs_put(cramp_dirs_t* c, const char* dir, const struct stat* st, unsigned long generation, cramp_listing_t* listing) {
+  if (c == NULL) {
+    return;
+  }
+
+  size_t size = cramp_listing_size(listing);
+  if (size > c->budget || st->st_mtime >= time(NULL) - 1) {
+    return;
+  }
+
+  (void)pthread_mutex_lock(&c->lock);
+
+  /* Something changed while the listing was being built */
+  if (generation != c->generation) {
+    goto finish_up;
+  }
+
+  khiter_t key = kh_get(dir_map, c->dirs, dir);
+  if (key != kh_end(c->dirs)) {
+    dirs_drop(c, kh_value(c->dirs, key));
+  }
+
+  while (c->tail && c->used + size > c->budget) {
+    dirs_drop(c, c->tail);
+  }
+
+  size_t len = strlen(dir);
+  dirs_dir_t* cached = calloc(1, sizeof(dirs_dir_t));
+  char* copy = malloc(len + 1);
+  int ret = -1;
+
+  if (cached && copy) {
+    memcpy(copy, dir, len + 1);
+    key = kh_put(dir_map, c->dirs, copy, &ret);
+  }
+
+  if (ret == -1) {
+    free((void*)copy);
+    free((void*)cached);
+    goto finish_up;
+  }
+
+  cached->key     = copy;
+  cached->dev     = st->st_dev;
+  cached->ino     = st->st_ino;
+  cached->mtime   = st->st_mtim;
+  cached->ctime   = st->st_ctim;
+  cached->listing = listing;
+  cached->size    = size;
+  kh_value(c->dirs, key) = cached;
+
+  cramp_listing_hold(listing);
+  dirs_touch(c, cached);
+  c->used += size;
+
+finish_up:
+  (void)pthread_mutex_unlock(&c->lock);
+}
+
+/**
+  @brief   Release a listing
+  @param   c        Cache (NULL = The listing isn't shared)
+  @param   listing  Listing (NULL = No-op)
+*/
+void cramp_dirs_release(cramp_dirs_t* c, cramp_listing_t* listing) {
+  if (listing == NULL) {
+    return;
+  }
+
+  if (c) {
+    (void)pthread_mutex_lock(&c->lock);
+  }
+
+  cramp_listing_release(listing);
+
+  if (c) {
+    (void)pthread_mutex_unlock(&c->lock);
+  }
+}
+
+/**
+  @brief   Forget a directory's listing, as something in it has changed
+  @param   c    Cache (NULL = No-op)
+  @param   dir  Source directory, without a trailing slash (NULL = All)
+*/
+void cramp_dirs_forget(cramp_dirs_t* c, const char* dir) {
+  if (c == NULL) {
+    return;
+  }
+
+  (void)pthread_mutex_lock(&c->lock);
+
+  ++c->generation;
+
+  if (dir == NULL) {
+    while (c->tail) {
+      dirs_drop(c, c->tail);
+    }
+
+  } else {
+    khiter_t key = kh_get(dir_map, c->dirs, dir);
+    if (key != kh_end(c->dirs)) {
+      dirs_drop(c, kh_value(c->dirs, key));
+    }
+  }
+
+  (void)pthread_mutex_unlock(&c->lock);
+}
+
+/**
+  @brief   Free all memory allocated by the cache
+  @param   c  Cache (NULL = No-op)
+
+  n.b., Any listings still held by open directories are left to them
+*/
+void cramp_dirs_destroy(cramp_dirs_t* c) {
+  if (c == NULL) {
+    return;
+  }
+
+  while (c->tail) {
+    dirs_drop(c, c->tail);
+  }
+
+  kh_destroy(dir_map, c->dirs);
+
+  (void)pthread_mutex_destroy(&c->lock);
+  free((void*)c);
+}
@@ -0,0 +1,29 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#ifndef _CRAMP_DIRS_H
+#define _CRAMP_DIRS_H
+
+/* Needed for size_t */
+#include <sys/types.h>
+
+/* Needed for struct stat */
+#include <sys/stat.h>
+
+/* Needed for cramp_listing_t */
+#include "listing.h"
+
+/* Default directory listing cache budget (bytes) */
+#define CRAMP_DIRS_DEFAULT ((size_t)256 << 20)
+
+/* Opaque directory listing cache */
+typedef struct cramp_dirs cramp_dirs_t;
+
+extern cramp_dirs_t*    cramp_dirs_init(size_t);
+extern cramp_listing_t* cramp_dirs_get(cramp_dirs_t*, const char*, const struct stat*, unsigned long*);
+extern void             cramp_dirs_put(cramp_dirs_t*, const char*, const struct stat*, unsigned long, cramp_listing_t*);
+extern void             cramp_dirs_release(cramp_dirs_t*, cramp_listing_t*);
+extern void             cramp_dirs_forget(cramp_dirs_t*, const char*);
+extern void             cramp_dirs_destroy(cramp_dirs_t*);
+
+#endif
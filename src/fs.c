@@ -9,6 +9,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,15 +18,20 @@
 #include <unistd.h>
 
 #include "13amp.h"
+#include "attrs.h"
 #include "log.h"
 #include "util.h"
 #include "conv.h"
 #include "cache.h"
+#include "dirs.h"
+#include "listing.h"
+#include "precalc.h"
+#include "watch.h"
 
 #include <fuse.h>
 
 #include <htslib/hts.h>
-#include <htslib/khash.h>
+#include <htslib/thread_pool.h>
 
 /* chmod a-w ALL THE THINGS! */
 #define UNWRITEABLE (~(S_IWUSR | S_IWGRP | S_IWOTH))
@@ -33,8 +39,9 @@
 /* Check we have a file or symlink */
 #define CAN_OPEN(st_mode) ((st_mode) & (S_IFREG | S_IFLNK))
 
-/* Initialise hash table type */
-KHASH_MAP_INIT_STR(hash_t, struct cramp_entry_t*)
+/* Size of a buffer for a CRAM's virtual file name (n.b., its extension
+   is replaced by at most ".VIEW.bam.bai")                            */
+#define VIRTUAL_NAME_MAX (NAME_MAX + 32)
 
 /**
   @brief   Initialise filesystem
@@ -45,12 +52,101 @@ void* cramp_init(struct fuse_conn_info* conn) {
   cramp_ctx_t* ctx = CTX;
   (void)conn;
 
+  /* Keep hold of the context for our own threads */
+  cramp_ctx_set(ctx);
+
   /* Log configuration */
   LOG("conf.source = %s",      ctx->conf->source);
   LOG("conf.cache = %s",       ctx->conf->cache);
   LOG("conf.bamsize = %s",     human_size(ctx->conf->bamsize));
   LOG("conf.debug_level = %d", ctx->conf->debug_level);
   LOG("conf.one_thread = %s",  ctx->conf->one_thread ? "true" : "false");
+  LOG("conf.threads = %d",     ctx->conf->threads);
+  LOG("conf.parallel = %s",    ctx->conf->parallel ? "true" : "false");
+  LOG("conf.bam_level = %d",   ctx->conf->bam_level);
+  LOG("conf.precalc = %d",     ctx->conf->precalc);
+  LOG("conf.watch = %s",       ctx->conf->watch ? "true" : "false");
+  LOG("conf.block_budget = %s", human_size(ctx->conf->block_budget));
+  LOG("conf.spill_budget = %s", human_size(ctx->conf->spill_budget));
+  LOG("conf.ref_budget = %s",   human_size(ctx->conf->ref_budget));
+  LOG("conf.handles = %d",      ctx->conf->handles);
+  LOG("conf.dir_budget = %s",   human_size(ctx->conf->dir_budget));
+  LOG("conf.attr_cache = %d",   ctx->conf->attr_cache);
+
+  /* Create the conversion thread pool
+     n.b., This must happen here, rather than in main, as FUSE forks to
+           daemonise and threads don't survive the fork               */
+  if (ctx->conf->threads > 0) {
+    ctx->pool.pool  = hts_tpool_init(ctx->conf->threads);
+    ctx->pool.qsize = ctx->conf->threads * 2;
+
+    if (ctx->pool.pool == NULL) {
+      /* Not a fatal error: we can still convert single threaded */
+      LOG("Couldn't create a pool of %d threads", ctx->conf->threads);
+    }
+  }
+
+  /* Create the converted data cache */
+  if (ctx->conf->block_budget > 0) {
+    ctx->blocks = cramp_blocks_init(ctx->conf->block_budget);
+    if (ctx->blocks == NULL) {
+      /* Not a fatal error: every reader just converts for themselves */
+      LOG("Couldn't create a %s block cache", human_size(ctx->conf->block_budget));
+    }
+  }
+
+  /* Create the shared reference store */
+  if (ctx->conf->ref_budget > 0) {
+    ctx->refs = cramp_refs_init(ctx->conf->ref_budget);
+    if (ctx->refs == NULL) {
+      /* Not a fatal error: every CRAM just loads its own references */
+      LOG("Couldn't create a %s reference store", human_size(ctx->conf->ref_budget));
+    }
+  }
+
+  /* Create the CRAM file pointer pool */
+  if (ctx->conf->handles > 0) {
+    ctx->handles = cramp_handles_init(ctx->conf->handles);
+    if (ctx->handles == NULL) {
+      /* Not a fatal error: every CRAM is just opened afresh */
+      LOG("Couldn't create a pool of %d file handles", ctx->conf->handles);
+    }
+  }
+
+  /* Create the directory listing cache */
+  if (ctx->conf->dir_budget > 0) {
+    ctx->dirs = cramp_dirs_init(ctx->conf->dir_budget);
+    if (ctx->dirs == NULL) {
+      /* Not a fatal error: directories are just listed afresh */
+      LOG("Couldn't create a %s directory cache", human_size(ctx->conf->dir_budget));
+    }
+  }
+
+  /* Create the attribute cache */
+  if (ctx->conf->attr_cache > 0) {
+    ctx->attrs = cramp_attrs_init(ctx->conf->attr_cache);
+    if (ctx->attrs == NULL) {
+      /* Not a fatal error: virtual files are just looked up afresh */
+      LOG("Couldn't create an attribute cache");
+    }
+  }
+
+  /* Open the spill cache, which lives beside the cache file */
+  if (ctx->conf->spill_budget > 0) {
+    size_t len = strlen(ctx->conf->cache);
+    char* spilldir = malloc(len + 3);
+    if (spilldir) {
+      memcpy(spilldir, ctx->conf->cache, len);
+      memcpy(spilldir + len, ".d", 3);
+
+      ctx->spill = cramp_spill_init(spilldir, ctx->conf->spill_budget);
+      if (ctx->spill == NULL) {
+        /* Not a fatal error: we just don't keep anything */
+        LOG("Couldn't open the spill cache in \"%s\"", spilldir);
+      }
+      free((void*)spilldir);
+    }
+  }
 
   /* Load cache */
   if (cramp_cache_read(ctx->conf->cache, ctx->cache) == -1) {
@@ -58,18 +154,64 @@ void* cramp_init(struct fuse_conn_info* conn) {
     LOG("Couldn't read cache file \"%s\"", ctx->conf->cache); 
   }
 
+  /* Start calculating the sizes of anything that's not in the cache
+     n.b., Again, this must happen after the fork                     */
+  if (ctx->conf->precalc > 0) {
+    ctx->precalc = cramp_precalc_init(ctx->conf->source, ctx->conf->precalc);
+    if (ctx->precalc == NULL) {
+      /* Not a fatal error: sizes are still calculated on read */
+      LOG("Couldn't start %d precalculation workers", ctx->conf->precalc);
+    }
+  }
+
+  /* Watch for changes, to keep the cache (and precalculation) current */
+  if (ctx->conf->watch) {
+    ctx->watch = cramp_watch_init(ctx->conf->source);
+    if (ctx->watch == NULL) {
+      /* Not a fatal error: the cache is still checked against mtimes */
+      LOG("Couldn't watch \"%s\" for changes", ctx->conf->source);
+    }
+  }
+
   return ctx;
 }
 
+/**
+  @brief   Note that a path that looked virtual isn't
+  @param   ctx        Global context
+  @param   path       File path
+  @param   cram_name  CRAM path, as found (NULL = Not found)
+  @param   err        Error to return (i.e., from lstat)
+  @return  -err
+
+  The miss is cached, unless the CRAM couldn't be looked for.
+*/
+static int missing(cramp_ctx_t* ctx, const char* path, const char* cram_name, int err) {
+  if (cram_name || errno != ENOMEM) {
+    cramp_attrs_put(ctx->attrs, path, NULL, -err, 1, NULL);
+  }
+
+  return -err;
+}
+
 /**
   @brief   Get file attributes
   @param   path   File path
   @param   stbuf  stat buffer
   @return  Exit status (0 = OK; -errno = not so much)
+
+  The attributes of virtual files, and of paths that only looked like
+  they might be, are cached (see attrs.c), along with the CRAM they're
+  inherited from, against which they're revalidated.
 */
 int cramp_getattr(const char* path, struct stat* stbuf) {
   cramp_ctx_t* ctx = CTX;
 
+  int cached_res;
+  if (cramp_attrs_get(ctx->attrs, path, stbuf, &cached_res)) {
+    return cached_res;
+  }
+
   const char* srcpath = source_path(path);
   if (srcpath == NULL) {
     return -errno;
@@ -78,30 +220,103 @@ int cramp_getattr(const char* path, struct stat* stbuf) {
   int res = lstat(srcpath, stbuf);
   int errsav = errno;
 
+  /* Whether the path's virtual and, if so, whether its size is final
+     and which CRAM its attributes are inherited from                 */
+  int virtual = 0;
+  int final   = 1;
+  const char* inherited = NULL;
+
   if (res == -1) {
     if (errsav == ENOENT && has_extension(srcpath, ".bam")) {
-      /* It looks like we might have a virtual BAM file */
-      const char* cram_name = sub_extension(srcpath, ".cram");
+      /* It looks like we might have a virtual BAM file (or a view or
+         region of one), which inherits its stat from the CRAM file   */
+      int level;
+      enum cramp_view view = view_full;
+      const char* region = NULL;
+      const char* cram_name = virtual_cram(srcpath, &level, stbuf);
       if (cram_name == NULL) {
-        errsav = errno;
-        free((void*)srcpath);
-        return -errsav;
+        cram_name = virtual_view(srcpath, &level, &view, stbuf);
+      }
+      if (cram_name == NULL) {
+        cram_name = virtual_region(srcpath, &level, &region, stbuf);
       }
 
-      /* Inherit stat from CRAM file */
-      /* n.b., stat, rather than lstat, to follow symlinks */
-      int res = stat(cram_name, stbuf);
-
-      if (res == -1 || !CAN_OPEN(stbuf->st_mode)) {
+      if (cram_name == NULL || !CAN_OPEN(stbuf->st_mode)) {
         /* ...guess not */
+        res = missing(ctx, path, cram_name, errsav);
         free((void*)srcpath);
         free((void*)cram_name);
-        return -errsav;
+        free((void*)region);
+        return res;
       }
 
       /* Set virtual BAM file size */
-      (void)cramp_cache_stat(stbuf, cramp_cache_get(ctx->cache, cram_name));
-      free((void*)cram_name);
+      const char* key = region ? cramp_cache_region_key(cram_name, level, region)
+                               : cramp_cache_view_key(cram_name, level, view);
+      if (key) {
+        cramp_stat_t cached;
+        (void)cramp_cache_stat(stbuf, cramp_cache_get(ctx->cache, key, &cached));
+        free((void*)key);
+      }
+      free((void*)region);
+
+      virtual   = 1;
+      final     = (stbuf->st_size != ctx->conf->bamsize);
+      inherited = cram_name;
+
+    } else if (errsav == ENOENT && has_extension(srcpath, ".bai")) {
+      /* ...or the index of one, likewise, once it's been built */
+      int level;
+      const char* cram_name = virtual_bai(srcpath, &level, stbuf);
+
+      if (cram_name == NULL || !CAN_OPEN(stbuf->st_mode)) {
+        res = missing(ctx, path, cram_name, errsav);
+        free((void*)srcpath);
+        free((void*)cram_name);
+        return res;
+      }
+
+      /* Set virtual BAI file size */
+      cramp_stat_t  cached;
+      cramp_stat_t* record = NULL;
+      const char* key = cramp_cache_key(cram_name, level);
+      if (key) {
+        record = cramp_cache_get(ctx->cache, key, &cached);
+        free((void*)key);
+      }
+      (void)cramp_cache_stat_bai(stbuf, record);
+
+      /* One that hasn't been built is missing until it has, so it's
+         queued (and the miss is only cached briefly)                */
+      if (stbuf->st_size == ctx->conf->bamsize) {
+        cramp_precalc_bai(ctx->precalc, cram_name, level);
+        cramp_attrs_put(ctx->attrs, path, NULL, -ENOENT, 0, NULL);
+        free((void*)srcpath);
+        free((void*)cram_name);
+        return -ENOENT;
+      }
+
+      virtual   = 1;
+      inherited = cram_name;
+
+    } else if (errsav == ENOENT && has_extension(srcpath, ".d")) {
+      /* ...or the directory of a CRAM's regions, which can be passed
+         through (but not read)                                       */
+      const char* cram_name = virtual_region_dir(srcpath, stbuf);
+
+      if (cram_name == NULL || !CAN_OPEN(stbuf->st_mode)) {
+        res = missing(ctx, path, cram_name, errsav);
+        free((void*)srcpath);
+        free((void*)cram_name);
+        return res;
+      }
+
+      mode_t readable = stbuf->st_mode & (S_IRUSR | S_IRGRP | S_IROTH);
+      stbuf->st_mode  = S_IFDIR | readable | (readable >> 2);
+      stbuf->st_nlink = 2;
+
+      virtual   = 1;
+      inherited = cram_name;
 
     } else {
       free((void*)srcpath);
@@ -112,7 +327,12 @@ int cramp_getattr(const char* path, struct stat* stbuf) {
   /* Make read only */
   stbuf->st_mode &= UNWRITEABLE;
 
+  if (virtual) {
+    cramp_attrs_put(ctx->attrs, path, stbuf, 0, final, inherited);
+  }
+
   free((void*)srcpath);
+  free((void*)inherited);
   return 0;
 }
 
@@ -168,36 +388,97 @@ int cramp_open(const char* path, struct fuse_file_info* fi) {
 
   if (f->filep == -1) {
     if (errsav == ENOENT && has_extension(srcpath, ".bam")) {
-      /* It looks like we might have a virtual BAM file */
-      const char* cram_name = sub_extension(srcpath, ".cram");
+      /* It looks like we might have a virtual BAM file (or a view or
+         region of one)                                               */
+      int level;
+      struct stat st;
+      enum cramp_view view = view_full;
+      const char* region = NULL;
+      const char* cram_name = virtual_cram(srcpath, &level, &st);
+      if (cram_name == NULL) {
+        cram_name = virtual_view(srcpath, &level, &view, &st);
+      }
+      if (cram_name == NULL) {
+        cram_name = virtual_region(srcpath, &level, &region, &st);
+      }
       free((void*)srcpath);
       if (cram_name == NULL) {
-        int errsav = errno;
         free((void*)f);
         return -errsav;
       }
 
-      f->cramp = hts_open(cram_name, "r");
+      /* Frequently opened virtual BAMs may be materialised on disk */
+      f->filep = (region || view) ? -1 : cramp_spill_open(CTX->spill, cram_name, level, st.st_mtime);
+      if (f->filep != -1) {
+        LOG("Opened virtual BAM file %s from the spill cache", path);
+        free((void*)cram_name);
+        fi->fh = (unsigned long)f;
+        return 0;
+      }
+
+      /* Only genuine CRAM files can be borrowed (EINVAL otherwise) */
+      cramp_handle_t* handle = cramp_handles_get(CTX->handles, cram_name, view);
       int cramperr = errno;
 
-      if (f->cramp == NULL) {
+      if (handle == NULL) {
         free((void*)cram_name);
+        free((void*)region);
         free((void*)f);
-        return -cramperr;
+        return (cramperr == EINVAL) ? -errsav : -cramperr;
       } else {
-        const htsFormat* format = hts_get_format(f->cramp);
-        if (format->format == cram) {
-          /* We've got a genuine CRAM file */
-          LOG("Opened virtual BAM file %s from %s", path, cram_name);
-          f->type = fd_cram;
-        } else {
-          (void)hts_close(f->cramp);
+        f->conv = cramp_conv_open(cram_name, handle, level, view, region);
+        if (f->conv == NULL) {
+          int converr = errno;
+          cramp_handles_put(CTX->handles, handle);
           free((void*)cram_name);
+          free((void*)region);
           free((void*)f);
-          return -errsav;
+          return -converr;
         }
+
+        LOG("Opened virtual BAM file %s from %s", path, cram_name);
+        f->type = fd_cram;
       }
       free((void*)cram_name);
+      free((void*)region);
+    } else if (errsav == ENOENT && has_extension(srcpath, ".bai")) {
+      /* It looks like we might have a virtual BAI file, which is served
+         from the cache; building one takes a full conversion, so if it
+         isn't cached, that's queued and it's missing until it is      */
+      int level;
+      struct stat st;
+      const char* cram_name = virtual_bai(srcpath, &level, &st);
+      free((void*)srcpath);
+      if (cram_name == NULL) {
+        free((void*)f);
+        return -errsav;
+      }
+
+      struct cramp_mem* mem = malloc(sizeof(struct cramp_mem));
+      const char* key = mem ? cramp_cache_key(cram_name, level) : NULL;
+      ssize_t len = -ENOMEM;
+
+      if (key) {
+        len = cramp_cache_bai(CTX->cache, key, st.st_mtime, &mem->data);
+        if (len < 0) {
+          cramp_precalc_bai(CTX->precalc, cram_name, level);
+          len = -ENOENT;
+        }
+        free((void*)key);
+      }
+
+      if (len < 0) {
+        free((void*)mem);
+        free((void*)cram_name);
+        free((void*)f);
+        return len;
+      }
+
+      LOG("Opened virtual BAI file %s from %s", path, cram_name);
+      mem->len = len;
+      f->type  = fd_mem;
+      f->mem   = mem;
+      free((void*)cram_name);
     } else {
       free((void*)srcpath);
       free((void*)f);
@@ -221,11 +502,15 @@ int cramp_open(const char* path, struct fuse_file_info* fi) {
   @return  Exit status (Success: number of bytes read; Fail: -errno)
 */
 int cramp_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+  cramp_ctx_t* ctx = CTX;
   int res = 0;
 
   struct cramp_filep* f = get_filep(fi);
   (void)path;
 
+  /* Background precalculation is held off while we're reading */
+  cramp_precalc_enter(ctx->precalc);
+
   if (f) {
     switch (f->type) {
       case fd_normal:
@@ -235,11 +520,18 @@ int cramp_read(const char* path, char* buf, size_t size, off_t offset, struct fu
         break;
 
       case fd_cram:
-        if ((res = cramp_conv_read(f->cramp, buf, size, offset)) == -1) {
+        if ((res = cramp_conv_read(f->conv, buf, size, offset)) == -1) {
           res = -errno;
         }
         break;
 
+      case fd_mem:
+        if (offset < (off_t)f->mem->len) {
+          res = (f->mem->len - offset < size) ? f->mem->len - offset : size;
+          memcpy(buf, f->mem->data + offset, res);
+        }
+        break;
+
       default:
         res = -EPERM;
     }
@@ -247,6 +539,7 @@ int cramp_read(const char* path, char* buf, size_t size, off_t offset, struct fu
     res = -EBADF;
   }
 
+  cramp_precalc_leave(ctx->precalc);
   return res;
 }
 
@@ -271,11 +564,16 @@ int cramp_release(const char* path, struct fuse_file_info* fi) {
         break;
 
       case fd_cram:
-        if (hts_close(f->cramp) == -1) {
+        if (cramp_conv_close(f->conv) == -1) {
           res = -errno;
         }
         break;
 
+      case fd_mem:
+        free((void*)f->mem->data);
+        free((void*)f->mem);
+        break;
+
       default:
         res = -EBADF;
     }
@@ -318,197 +616,252 @@ int cramp_opendir(const char* path, struct fuse_file_info* fi) {
     return -res;
   }
 
-  d->offset = 0;
-  d->entry = NULL;
+  /* Listings are cached by source directory, named as the watcher
+     names them (i.e., without the root's trailing slash)           */
+  size_t len = strlen(srcpath);
+  while (len > 1 && srcpath[len - 1] == '/') {
+    --len;
+  }
+  ((char*)srcpath)[len] = '\0';
+
+  d->path    = srcpath;
+  d->listing = NULL;
+
+  /* Whatever's being listed is probably of interest, so size it next */
+  cramp_precalc_hint(CTX->precalc, srcpath);
 
   fi->fh = (unsigned long)d;
-  free((void*)srcpath);
   return 0;
 }
 
 /**
-  @brief   Read directory
-  @param   path    File path
-  @param   buf     Data buffer
-  @param   filler  Function to add a readdir entry
-  @param   offset  Offset of next entry
-  @param   fi      FUSE file info
-  @return  Exit status (0 = OK; -errno = not so much)
+  @brief   Name of one of a CRAM's virtual files
+  @param   buf        Buffer (VIRTUAL_NAME_MAX bytes)
+  @param   cram_name  CRAM file name
+  @param   view       Decoding view
+  @param   suffix     Suffix (e.g., ".bai"; "" for the BAM itself)
+  @return  Pointer to buf (NULL if the name's too long)
+
+  i.e., foo.bam (or foo.VIEW.bam) for foo.cram, plus the suffix
 */
-int cramp_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
+static const char* virtual_name(char* buf, const char* cram_name, enum cramp_view view, const char* suffix) {
+  int stem = (int)(strlen(cram_name) - strlen(".cram"));
+  int len  = (view == view_full) ? snprintf(buf, VIRTUAL_NAME_MAX, "%.*s.bam%s", stem, cram_name, suffix)
+                                 : snprintf(buf, VIRTUAL_NAME_MAX, "%.*s.%s.bam%s", stem, cram_name, cramp_view_name(view), suffix);
+
+  return (len > 0 && len < VIRTUAL_NAME_MAX) ? buf : NULL;
+}
+
+/**
+  @brief   Inject a CRAM's virtual files into a directory listing
+  @param   contents   Directory listing
+  @param   cram_name  CRAM file name
+  @param   srcpath    Source path of the CRAM file
+  @param   st         stat structure of the CRAM file
+  @return  Exit status (0 = OK; -1 = Failure, with errno set)
+
+  foo.bam is injected for foo.cram, with its index (foo.bam.bai) once
+  it's been built, then foo.VIEW.bam for each decoding view, unless a
+  real file clashes (n.b., failing to inject the views is harmless). A
+  real foo.bam also masks the index, but not the views, whichever order
+  they're listed in.
+*/
+static int inject_cram(cramp_listing_t* contents, const char* cram_name, const char* srcpath, const struct stat* st) {
   cramp_ctx_t* ctx = CTX;
-  struct cramp_dirp* d = get_dirp(fi);
-  khash_t(hash_t) *contents = kh_init(hash_t);
+  int trust = ctx->conf->trust_ext;
+  char name[VIRTUAL_NAME_MAX];
 
-  /* Seek to the correct offset, if necessary */
-  if (offset != d->offset) {
-    seekdir(d->dp, offset);
-    d->entry = NULL;
-    d->offset = offset;
-  }
+  for (int view = view_full; view < view_count; ++view) {
+    if (virtual_name(name, cram_name, view, "") == NULL) {
+      continue;
+    }
 
-  /* Loop through directory contents */
-  while (1) {
-    /* Read directory, if necessary; break loop when nothing returned */
-    if (!d->entry) {
-      d->entry = readdir(d->dp);
-      if (!d->entry) {
-        break;
+    struct stat* bam_st = cramp_listing_virtual(contents, name, st);
+    if (bam_st == NULL) {
+      if (view == view_full && errno != EEXIST) {
+        return -1;
       }
+      continue;
     }
 
-    struct stat* st = calloc(1, sizeof(struct stat));
-    if (st == NULL) {
-      return -errno;
+    /* Set virtual BAM file size, as each view is sized separately
+       (without reading the CRAM, if we're trusting the extension)  */
+    cramp_stat_t  copy;
+    cramp_stat_t* cached = NULL;
+    const char* cache_key = trust ? cramp_cache_peek_key(srcpath, ctx->conf->bam_level, view)
+                                  : cramp_cache_view_key(srcpath, ctx->conf->bam_level, view);
+    if (cache_key) {
+      cached = cramp_cache_get(ctx->cache, cache_key, &copy);
+      (void)cramp_cache_stat(bam_st, cached);
+      free((void*)cache_key);
     }
 
-    st->st_ino  = d->entry->d_ino;
-    st->st_mode = DTTOIF(d->entry->d_type) & UNWRITEABLE; 
+    /* Only the full view has a virtual index, which isn't listed until
+       it's been built (see conv_bai_publish)                        */
+    if (view == view_full && cached && cached->bailen && cached->mtime >= st->st_mtime
+                          && virtual_name(name, cram_name, view, ".bai")) {
+      struct stat* index_st = cramp_listing_virtual(contents, name, st);
+      if (index_st) {
+        (void)cramp_cache_stat_bai(index_st, cached);
+      }
+    }
+  }
 
-    /* If the key already exists in the hash table, then it MUST be an
-       injected virtual BAM file. Our policy is that real files mask
-       virtual ones, so we must remove the injected entry and free its
-       memory allocation (rather than simply overwriting).            */
+  return 0;
+}
 
-    khiter_t key = kh_get(hash_t, contents, d->entry->d_name);
-    if (key != kh_end(contents)) {
-      const char* clash_key = kh_key(contents, key);
-      struct cramp_entry_t* clash_details = kh_value(contents, key);
+/**
+  @brief   Build an open directory's listing, or find it in the cache
+  @param   d  Directory
+  @return  Exit status (0 = OK; -errno = not so much)
 
-      free((void*)clash_key);
-      free((void*)clash_details->st);
-      free((void*)clash_details);
-      kh_del(hash_t, contents, key);
+  The listing is built in an arena (see listing.c), so beyond that, the
+  only allocations are the CRAMs' stat cache keys.
+*/
+static int list_dir(struct cramp_dirp* d) {
+  cramp_ctx_t* ctx = CTX;
+  int trust = ctx->conf->trust_ext;
+
+  /* The listing's cached against the directory as it was beforehand */
+  struct stat   dir_st;
+  unsigned long generation = 0;
+  int           cacheable  = (fstat(dirfd(d->dp), &dir_st) == 0);
+
+  if (cacheable) {
+    d->listing = cramp_dirs_get(ctx->dirs, d->path, &dir_st, &generation);
+    if (d->listing) {
+      return 0;
     }
+  }
 
-    /* Insert item into hash table */
-    int ret;
-    key = kh_put(hash_t, contents, d->entry->d_name, &ret);
-    if (ret == -1) {
-      int errsav = errno;
-      free((void*)st);
-      errno = errsav;
-      goto finish_up;
+  cramp_listing_t* contents = cramp_listing_init();
+  char*            srcpath  = NULL;
+
+  errno = ENOMEM;
+  if (contents == NULL) {
+    goto finish_up;
+  }
+
+  /* CRAMs' source paths are built in place, after their directory's
+     (n.b., as per path_concat, without doubling up any slashes)     */
+  size_t dirlen = strlen(d->path);
+  while (dirlen && d->path[dirlen - 1] == '/') {
+    --dirlen;
+  }
+
+  srcpath = malloc(dirlen + NAME_MAX + 2);
+  if (srcpath == NULL) {
+    goto finish_up;
+  }
+  memcpy(srcpath, d->path, dirlen);
+  srcpath[dirlen++] = '/';
+
+  /* Loop through directory contents, from the start */
+  rewinddir(d->dp);
+
+  while (1) {
+    /* Read directory; break loop when nothing returned */
+    errno = 0;
+    struct dirent* entry = readdir(d->dp);
+    if (entry == NULL) {
+      if (errno) {
+        goto finish_up;
+      }
+      break;
     }
 
-    struct cramp_entry_t* details = malloc(sizeof(struct cramp_entry_t));
-    if (details == NULL) {
-      int errsav = errno;
-      kh_del(hash_t, contents, key);
-      free((void*)st);
-      errno = errsav;
+    /* Real files mask virtual ones, so if there's an entry of the same
+       name, it MUST be an injected virtual BAM (or BAI) file, which is
+       taken over. A masked virtual BAM takes its virtual index with it. */
+    const char*  entry_name = entry->d_name;
+    struct stat* st         = cramp_listing_real(contents, entry_name);
+    if (st == NULL) {
       goto finish_up;
     }
 
-    details->virtual = 0;
-    details->st = st;
-    kh_value(contents, key) = details;
+    st->st_ino  = entry->d_ino;
+    st->st_mode = DTTOIF(entry->d_type) & UNWRITEABLE; 
 
-    /* Inject virtual BAM file, if we've got a non-clashing CRAM
+    /* Inject virtual BAM files, if we've got a CRAM
 
        1. Check we've got a file/symlink
        2. Check extension is ".cram"
-       3. Check there isn't a clashing ".bam"
-       4. Check it is actually a CRAM
-       5. Inject :)                                                   */
-
-    if (CAN_OPEN(st->st_mode) && has_extension(d->entry->d_name, ".cram")) {
-      const char* bam_name = sub_extension(d->entry->d_name, ".bam");
-      if (bam_name) {
-        if (kh_get(hash_t, contents, bam_name) == kh_end(contents)) {
-          const char* fullpath = path_concat(path, d->entry->d_name);
-          if (fullpath) {
-            const char* srcpath = source_path(fullpath);
-            free((void*)fullpath);
-            if (srcpath) {
-              int res = is_cram(srcpath);
-
-              if (res < 0) {
-                errno = -res;
-                free((void*)srcpath);
-                free((void*)bam_name);
-                goto finish_up;
-              }
-
-              if (res) {
-                int ret;
-                khiter_t key = kh_put(hash_t, contents, bam_name, &ret);
-
-                if (ret == -1) {
-                  /* Key insertion failure */
-                  free((void*)srcpath);
-                  free((void*)bam_name);
-                  goto finish_up;
-                }
-
-                /* Create virtual entry */
-                struct cramp_entry_t* details = malloc(sizeof(struct cramp_entry_t));
-                if (details == NULL) {
-                  int errsav = errno;
-                  kh_del(hash_t, contents, key);
-                  free((void*)srcpath);
-                  free((void*)bam_name);
-                  errno = errsav;
-                  goto finish_up;
-                }
-
-                details->virtual = 1;
-                details->st = calloc(1, sizeof(struct stat));
-                memcpy(details->st, st, sizeof(struct stat));
-
-                /* Set virtual BAM file size */
-                (void)cramp_cache_stat(details->st, cramp_cache_get(ctx->cache, srcpath));
-
-                /* Insert virtual entry */
-                kh_value(contents, key) = details;
-              }
-              free((void*)srcpath);
-            } else {
-              free((void*)bam_name);
-              goto finish_up;
-            } 
-          } else {
-            free((void*)bam_name);
-            goto finish_up;
-          }
-        } else {
-          /* Ignore if there's a clash */
-          free((void*)bam_name);
-        }
-      } else {
+       3. Check it is actually a CRAM (unless we're trusting the
+          extension, in which case that's left until it's opened)
+       4. Inject :) (n.b., the views are injected even if there's a
+          clashing ".bam", as they're still served)                 */
+
+    if (CAN_OPEN(st->st_mode) && has_extension(entry_name, ".cram")) {
+      memcpy(srcpath + dirlen, entry_name, strlen(entry_name) + 1);
+
+      int res = trust ? 1 : is_cram(srcpath);
+      if (res < 0) {
+        errno = -res;
         goto finish_up;
       }
-    }
 
-    d->entry = NULL;
+      if (res && inject_cram(contents, entry_name, srcpath, st) == -1) {
+        goto finish_up;
+      }
+    }
   }
 
-  /* If we've got this far, then everything's good and we can generate
-     the directory entries by ensuring the error number is zero. Then,
-     or otherwise, we free memory and destroy the hash table.         */
-  errno = 0;
+  /* If we've got this far, then everything's good and, once the
+     listing's sealed, it can be served (and shared)               */
+  errno = (cramp_listing_seal(contents) == -1) ? ENOMEM : 0;
 
 finish_up:;
   int errsav = errno;
+  free((void*)srcpath);
 
-  const char* entry;
-  struct cramp_entry_t* details;
-  kh_foreach(contents, entry, details, {
-    /* Create directory entry */
-    if (!errsav && filler(buf, entry, details->st, 0)) {
-      break;
+  if (errsav) {
+    cramp_listing_release(contents);
+    return -errsav;
+  }
+
+  if (cacheable) {
+    cramp_dirs_put(ctx->dirs, d->path, &dir_st, generation, contents);
+  }
+
+  d->listing = contents;
+  return 0;
+}
+
+/**
+  @brief   Read directory
+  @param   path    File path
+  @param   buf     Data buffer
+  @param   filler  Function to add a readdir entry
+  @param   offset  Offset of next entry
+  @param   fi      FUSE file info
+  @return  Exit status (0 = OK; -errno = not so much)
+
+  Each entry's offset is its position in the listing, plus one, which
+  is where the next readdir resumes from, directly.
+*/
+int cramp_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
+  struct cramp_dirp* d = get_dirp(fi);
+  (void)path;
+
+  /* The listing's built (or found) once per open directory, so its
+     offsets stay put until the directory's closed                  */
+  if (d->listing == NULL) {
+    int res = list_dir(d);
+    if (res < 0) {
+      return res;
     }
+  }
 
-    /* Free hash table entry data */
-    if (details->virtual) {
-      free((void*)entry);
+  const char*        entry;
+  const struct stat* st;
+  for (size_t i = (size_t)offset; (entry = cramp_listing_at(d->listing, i, &st)); ++i) {
+    /* Create directory entry, until FUSE's buffer is full */
+    if (filler(buf, entry, st, (off_t)(i + 1))) {
+      break;
     }
-    free((void*)details->st);
-    free((void*)details);
-  })
-  kh_destroy(hash_t, contents);
+  }
 
-  return -errsav;
+  return 0;
 }
 
 /**
@@ -526,6 +879,8 @@ int cramp_releasedir(const char* path, struct fuse_file_info* fi) {
   if(closedir(d->dp) == -1) {
     res = -errno;
   }
+  cramp_dirs_release(CTX->dirs, d->listing);
+  free((void*)d->path);
   free((void*)d);
 
   return res;
@@ -538,11 +893,31 @@ int cramp_releasedir(const char* path, struct fuse_file_info* fi) {
 void cramp_destroy(void* data) {
   cramp_ctx_t* ctx = (cramp_ctx_t*)data;
 
+  /* Stop watching and precalculating before the cache (or pool) goes */
+  cramp_watch_destroy(ctx->watch);
+  cramp_precalc_destroy(ctx->precalc);
+
   if (cramp_cache_write(ctx->conf->cache, ctx->cache) == -1) {
     LOG("Couldn't write to cache file \"%s\"", ctx->conf->cache);
   }
 
+  /* Idle file pointers may still have the thread pool attached */
+  cramp_handles_destroy(ctx->handles);
+
+  if (ctx->pool.pool) {
+    hts_tpool_destroy(ctx->pool.pool);
+  }
+
+  cramp_blocks_destroy(ctx->blocks);
+  cramp_dirs_destroy(ctx->dirs);
+  cramp_attrs_destroy(ctx->attrs);
+  cramp_spill_destroy(ctx->spill);
+  cramp_refs_destroy(ctx->refs);
   cramp_cache_destroy(ctx->cache);
   free((void*)ctx->conf->source);
   free((void*)ctx->conf->cache);
+  free((void*)ctx->conf->block_cache);
+  free((void*)ctx->conf->spill);
+  free((void*)ctx->conf->ref_memory);
+  free((void*)ctx->conf->dir_cache);
 }
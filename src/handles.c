@@ -0,0 +1,424 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#include "config.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "handles.h"
+#include "refs.h"
+#include "util.h"
+
+#include <htslib/cram.h>
+#include <htslib/hfile.h>
+#include <htslib/hts.h>
+#include <htslib/khash.h>
+#include <htslib/sam.h>
+
+/*
+  NOTES
+
+  Opening a CRAM reads and parses its header and sets up its references,
+  which every open virtual BAM, size calculation, parallel decoder and
+  checkpoint scan used to repeat for itself. Instead, CRAM file pointers
+  (and their headers) are borrowed from a process wide pool, and given
+  back when they're done with, rather than closed.
+
+  A returned file pointer is idle, pooled under its CRAM's path, until
+  it's borrowed again, when it's sought back to the first container (so
+  it's as good as freshly opened). Idle file pointers for a CRAM that has
+  since been modified are closed, rather than lent out. Those that have
+  been idle for longer than CRAMP_HANDLES_IDLE seconds, or that don't fit
+  in the pool (--handles), least recently used first, are closed too;
+  this is checked whenever a file pointer is borrowed or returned.
+
+  The pool only holds idle file pointers: there's no limit on how many
+  can be borrowed at once.
+
+  File pointers are borrowed for a decoding view, which restricts the
+  fields HTSLib reconstructs (CRAM_OPT_REQUIRED_FIELDS and
+  CRAM_OPT_DECODE_MD). These are just options on the file pointer, so
+  they're set whenever a file pointer is lent out for a different view
+  than it had.
+
+  Likewise, the thread pool stays attached to a file pointer after it's
+  given back. HTSLib sets up a new queue on the pool every time one is
+  attached (and the old one is never released), so it's only attached
+  once per file pointer (see cramp_handles_attach).
+*/
+
+/**
+  @brief   Pooled CRAM file pointer
+  @var     handle  File pointer and header (n.b., first, to cast to)
+  @var     path    Path to CRAM file
+  @var     mtime   CRAM mtime when it was opened
+  @var     start   Offset of the first container
+  @var     idle    When it was returned to the pool
+  @var     sib     Next idle file pointer for the same CRAM
+  @var     prev    More recently returned file pointer (NULL = Most recent)
+  @var     next    Less recently returned file pointer (NULL = Least recent)
+*/
+typedef struct handles_entry {
+  cramp_handle_t        handle;
+  const char*           path;
+  time_t                mtime;
+  off_t                 start;
+  time_t                idle;
+  struct handles_entry* sib;
+  struct handles_entry* prev;
+  struct handles_entry* next;
+} handles_entry_t;
+
+/* Initialise idle map type (CRAM path => idle file pointers) */
+KHASH_MAP_INIT_STR(idle_map, handles_entry_t*)
+
+/**
+  @brief   Pool of open CRAM file pointers
+  @var     max    Maximum idle file pointers
+  @var     count  Idle file pointers
+  @var     idle   Idle file pointers, by CRAM path
+  @var     head   Most recently returned file pointer
+  @var     tail   Least recently returned file pointer
+  @var     lock   Mutex
+*/
+struct cramp_handles {
+  size_t             max;
+  size_t             count;
+  khash_t(idle_map)* idle;
+  handles_entry_t*   head;
+  handles_entry_t*   tail;
+  pthread_mutex_t    lock;
+};
+
+/**
+  @brief   Close a pooled file pointer
+  @param   e  File pointer
+*/
+static void handles_close(handles_entry_t* e) {
+  if (e->handle.header) {
+    bam_hdr_destroy(e->handle.header);
+  }
+  if (e->handle.fp) {
+    /* It might be sharing references (see refs.c) */
+    (void)cramp_refs_close(CTX->refs, e->handle.fp);
+  }
+
+  free((void*)e->path);
+  free((void*)e);
+}
+
+/**
+  @brief   Open a CRAM file pointer for the pool
+  @param   path   Path to CRAM file
+  @param   mtime  CRAM mtime
+  @return  Pointer to file pointer (NULL on failure; EINVAL = Not a CRAM)
+*/
+static handles_entry_t* handles_open(const char* path, time_t mtime) {
+  size_t len = strlen(path);
+  handles_entry_t* e = calloc(1, sizeof(handles_entry_t));
+  char* copy = malloc(len + 1);
+
+  if (e == NULL || copy == NULL) {
+    free((void*)copy);
+    free((void*)e);
+    return NULL;
+  }
+
+  memcpy(copy, path, len + 1);
+  e->path  = copy;
+  e->mtime = mtime;
+
+  e->handle.fp = hts_open(path, "r");
+  if (e->handle.fp == NULL) {
+    goto fail;
+  }
+
+  const htsFormat* format = hts_get_format(e->handle.fp);
+  if (format == NULL || format->format != cram) {
+    errno = EINVAL;
+    goto fail;
+  }
+
+  e->handle.header = sam_hdr_read(e->handle.fp);
+  if (e->handle.header == NULL) {
+    errno = EIO;
+    goto fail;
+  }
+
+  /* Nothing's been decoded, so it can still take the shared references */
+  cramp_refs_share(CTX->refs, path, e->handle.fp, e->handle.header);
+
+  e->start = htell(cram_fd_get_fp(e->handle.fp->fp.cram));
+  return e;
+
+fail:
+  {
+    int errsav = errno;
+    handles_close(e);
+    errno = errsav;
+  }
+  return NULL;
+}
+
+/**
+  @brief   Name of a decoding view
+  @param   view  Decoding view
+  @return  Name (e.g., "noqual"; "" for the full view)
+
+  Views are exposed as foo.NAME.bam and keyed in the stat cache by name.
+*/
+const char* cramp_view_name(enum cramp_view view) {
+  static const char* names[view_count] = {
+    [view_full]    = "",
+    [view_noqual]  = "noqual",
+    [view_minimal] = "minimal"
+  };
+
+  return (view >= 0 && view < view_count) ? names[view] : "";
+}
+
+/**
+  @brief   Set the fields a file pointer decodes
+  @param   handle  File pointer
+  @param   view    Decoding view
+*/
+static void handles_view(cramp_handle_t* handle, enum cramp_view view) {
+  /* Fields per view (n.b., INT_MAX and -1 are HTSLib's defaults) */
+  static const int fields[view_count] = {
+    [view_full]    = INT_MAX,
+    [view_noqual]  = INT_MAX & ~SAM_QUAL,
+    [view_minimal] = SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR
+                   | SAM_RNEXT | SAM_PNEXT | SAM_TLEN
+  };
+  static const int decode_md[view_count] = {
+    [view_full]    = -1,
+    [view_noqual]  = 0,
+    [view_minimal] = 0
+  };
+
+  if (handle->view != view) {
+    (void)hts_set_opt(handle->fp, CRAM_OPT_REQUIRED_FIELDS, fields[view]);
+    (void)hts_set_opt(handle->fp, CRAM_OPT_DECODE_MD, decode_md[view]);
+    handle->view = view;
+  }
+}
+
+/**
+  @brief   Attach a thread pool to a borrowed file pointer
+  @param   handle  File pointer
+  @param   pool    Thread pool (NULL = No-op)
+
+  n.b., Once attached, a thread pool can't be swapped or detached
+*/
+void cramp_handles_attach(cramp_handle_t* handle, htsThreadPool* pool) {
+  if (pool && handle->pool == NULL) {
+    (void)hts_set_opt(handle->fp, HTS_OPT_THREAD_POOL, pool);
+    handle->pool = pool;
+  }
+}
+
+/**
+  @brief   Take an idle file pointer out of the pool
+  @param   h  Pool (locked)
+  @param   e  File pointer
+*/
+static void handles_unlink(cramp_handles_t* h, handles_entry_t* e) {
+  khiter_t key = kh_get(idle_map, h->idle, e->path);
+  if (key != kh_end(h->idle)) {
+    handles_entry_t** sib = &kh_value(h->idle, key);
+    while (*sib && *sib != e) {
+      sib = &(*sib)->sib;
+    }
+    if (*sib) {
+      *sib = e->sib;
+    }
+
+    /* No more idle file pointers for this CRAM */
+    if (kh_value(h->idle, key) == NULL) {
+      const char* path = kh_key(h->idle, key);
+      kh_del(idle_map, h->idle, key);
+      free((void*)path);
+    }
+  }
+
+  *(e->prev ? &e->prev->next : &h->head) = e->next;
+  *(e->next ? &e->next->prev : &h->tail) = e->prev;
+  e->prev = e->next = e->sib = NULL;
+  --h->count;
+}
+
+/**
+  @brief   Close idle file pointers that have outstayed their welcome
+  @param   h    Pool (locked)
+  @param   now  Current time
+*/
+static void handles_sweep(cramp_handles_t* h, time_t now) {
+  while (h->tail && (h->count > h->max || h->tail->idle + CRAMP_HANDLES_IDLE <= now)) {
+    handles_entry_t* e = h->tail;
+    handles_unlink(h, e);
+    handles_close(e);
+  }
+}
+
+/**
+  @brief   Create a pool of CRAM file pointers
+  @param   max  Maximum idle file pointers
+  @return  Pointer to pool (NULL on failure)
+*/
+cramp_handles_t* cramp_handles_init(size_t max) {
+  cramp_handles_t* h = calloc(1, sizeof(cramp_handles_t));
+  if (h == NULL) {
+    return NULL;
+  }
+
+  h->max  = max;
+  h->idle = kh_init(idle_map);
+  if (h->idle == NULL) {
+    free((void*)h);
+    return NULL;
+  }
+
+  (void)pthread_mutex_init(&h->lock, NULL);
+  return h;
+}
+
+/**
+  @brief   Borrow a CRAM file pointer
+  @param   h     Pool (NULL = Always open a new one)
+  @param   path  Path to CRAM file
+  @param   view  Decoding view
+  @return  Pointer to file pointer (NULL on failure; EINVAL = Not a CRAM)
+
+  The file pointer is positioned at the first container and must be
+  given back with cramp_handles_put.
+*/
+cramp_handle_t* cramp_handles_get(cramp_handles_t* h, const char* path, enum cramp_view view) {
+  struct stat st;
+  if (stat(path, &st) == -1) {
+    return NULL;
+  }
+
+  handles_entry_t* e = NULL;
+
+  if (h) {
+    (void)pthread_mutex_lock(&h->lock);
+    handles_sweep(h, time(NULL));
+
+    khiter_t key;
+    while (e == NULL && (key = kh_get(idle_map, h->idle, path)) != kh_end(h->idle)) {
+      e = kh_value(h->idle, key);
+      handles_unlink(h, e);
+
+      /* The CRAM's changed since it was opened */
+      if (e->mtime != st.st_mtime) {
+        handles_close(e);
+        e = NULL;
+      }
+    }
+
+    (void)pthread_mutex_unlock(&h->lock);
+  }
+
+  if (e && cram_seek(e->handle.fp->fp.cram, e->start, SEEK_SET) != 0) {
+    handles_close(e);
+    e = NULL;
+  }
+
+  if (e == NULL) {
+    e = handles_open(path, st.st_mtime);
+  }
+
+  if (e == NULL) {
+    return NULL;
+  }
+
+  handles_view(&e->handle, view);
+  return &e->handle;
+}
+
+/**
+  @brief   Give back a borrowed CRAM file pointer
+  @param   h       Pool (NULL = Just close it)
+  @param   handle  File pointer (NULL = No-op)
+
+  The file pointer may have been read from, or sought, but must still
+  be usable.
+*/
+void cramp_handles_put(cramp_handles_t* h, cramp_handle_t* handle) {
+  if (handle == NULL) {
+    return;
+  }
+
+  handles_entry_t* e = (handles_entry_t*)handle;
+  if (h == NULL || h->max == 0) {
+    handles_close(e);
+    return;
+  }
+
+  (void)pthread_mutex_lock(&h->lock);
+
+  int ret;
+  khiter_t key = kh_get(idle_map, h->idle, e->path);
+  if (key == kh_end(h->idle)) {
+    size_t len = strlen(e->path);
+    char* copy = malloc(len + 1);
+
+    ret = -1;
+    if (copy) {
+      memcpy(copy, e->path, len + 1);
+      key = kh_put(idle_map, h->idle, copy, &ret);
+    }
+
+    if (ret == -1) {
+      (void)pthread_mutex_unlock(&h->lock);
+      free((void*)copy);
+      handles_close(e);
+      return;
+    }
+
+    kh_value(h->idle, key) = NULL;
+  }
+
+  time_t now = time(NULL);
+
+  e->idle = now;
+  e->sib  = kh_value(h->idle, key);
+  kh_value(h->idle, key) = e;
+
+  e->prev = NULL;
+  e->next = h->head;
+  *(h->head ? &h->head->prev : &h->tail) = e;
+  h->head = e;
+  ++h->count;
+
+  handles_sweep(h, now);
+  (void)pthread_mutex_unlock(&h->lock);
+}
+
+/**
+  @brief   Close all the idle file pointers and free the pool
+  @param   h  Pool (NULL = No-op)
+*/
+void cramp_handles_destroy(cramp_handles_t* h) {
+  if (h == NULL) {
+    return;
+  }
+
+  while (h->tail) {
+    handles_entry_t* e = h->tail;
+    handles_unlink(h, e);
+    handles_close(e);
+  }
+  kh_destroy(idle_map, h->idle);
+
+  (void)pthread_mutex_destroy(&h->lock);
+  free((void*)h);
+}
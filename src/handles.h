@@ -0,0 +1,51 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#ifndef _CRAMP_HANDLES_H
+#define _CRAMP_HANDLES_H
+
+/* Needed for size_t */
+#include <sys/types.h>
+
+/* Needed for htsFile, htsThreadPool and bam_hdr_t */
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+
+/* Seconds an unused CRAM file pointer is kept for */
+#define CRAMP_HANDLES_IDLE 60
+
+/**
+  @brief   Decoding view of a CRAM
+  @var     view_full     Every field
+  @var     view_noqual   Everything but base qualities (and MD/NM generation)
+  @var     view_minimal  Just the alignment (i.e., no name, sequence,
+                         qualities or tags)
+  @var     view_count    Number of views
+*/
+enum cramp_view {view_full, view_noqual, view_minimal, view_count};
+
+/**
+  @brief   Borrowed CRAM file pointer
+  @var     fp      CRAM file pointer, positioned at the first container
+  @var     header  CRAM header
+  @var     view    Fields being decoded
+  @var     pool    Thread pool attached (NULL = None)
+*/
+typedef struct cramp_handle {
+  htsFile*        fp;
+  bam_hdr_t*      header;
+  enum cramp_view view;
+  htsThreadPool*  pool;
+} cramp_handle_t;
+
+/* Opaque pool of open CRAM file pointers */
+typedef struct cramp_handles cramp_handles_t;
+
+extern cramp_handles_t* cramp_handles_init(size_t);
+extern cramp_handle_t*  cramp_handles_get(cramp_handles_t*, const char*, enum cramp_view);
+extern void             cramp_handles_put(cramp_handles_t*, cramp_handle_t*);
+extern void             cramp_handles_attach(cramp_handle_t*, htsThreadPool*);
+extern void             cramp_handles_destroy(cramp_handles_t*);
+extern const char*      cramp_view_name(enum cramp_view);
+
+#endif
@@ -0,0 +1,419 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#include "config.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "listing.h"
+
+/*
+  NOTES
+
+  A directory listing is built from the real entries plus the virtual
+  ones injected for each CRAM. Directories of sequencing data can have
+  hundreds of thousands of entries, so allocating (and freeing) each
+  entry, name and hash table node separately dominated the cost of
+  listing them.
+
+  Instead, everything a listing holds comes from a bump arena: entries,
+  with their stat structure and name inline, are carved out of chunks
+  that double in size (up to LISTING_CHUNK_MAX), so a listing takes a
+  handful of allocations, however big it gets, and is freed chunk by
+  chunk. Entries are indexed by an open addressing (linear probing)
+  table of pointers, which doubles when it's half full, and are chained
+  in the order they were added, which is the order they're listed in.
+
+  Real entries mask virtual ones of the same name: the virtual entry is
+  taken over in place, and a masked virtual BAM masks its virtual index
+  (n.b., masked entries stay in the table, but aren't listed, and can be
+  taken over again).
+
+  Once it's complete, a listing is sealed: the table is freed and the
+  listed entries are indexed by position, so a readdir can resume from
+  any offset directly. Sealed listings are read only, so can be shared
+  (see dirs.c), and are reference counted; they're freed when they're
+  last released.
+*/
+
+/* Alignment of arena allocations (enough for struct stat) */
+#define LISTING_ALIGN 16
+
+/* Initial and largest arena chunk sizes (bytes) */
+#define LISTING_CHUNK     (16 * 1024)
+#define LISTING_CHUNK_MAX (4 * 1024 * 1024)
+
+/* Initial number of table slots (a power of two) */
+#define LISTING_SLOTS 256
+
+/**
+  @brief   Arena chunk header (data follows, from LISTING_HEADER)
+  @var     next  Previously allocated chunk
+*/
+typedef struct listing_chunk {
+  struct listing_chunk* next;
+} listing_chunk_t;
+
+/* Offset of a chunk's data */
+#define LISTING_HEADER ((sizeof(listing_chunk_t) + LISTING_ALIGN - 1) & ~(size_t)(LISTING_ALIGN - 1))
+
+/**
+  @brief   Listing entry
+  @var     next     Next entry, in the order they were added
+  @var     hash     Hash of the name
+  @var     virtual  Entry is virtual (0 = False; 1 = True)
+  @var     masked   Entry is masked by a real one (0 = False; 1 = True)
+  @var     st       Stat structure of entry
+  @var     name     Entry name
+*/
+typedef struct listing_entry {
+  struct listing_entry* next;
+  uint32_t              hash;
+  int                   virtual;
+  int                   masked;
+  struct stat           st;
+  char                  name[];
+} listing_entry_t;
+
+/**
+  @brief   Directory listing
+  @var     chunks  Arena chunks (most recent first)
+  @var     free    Start of the free space in the current chunk
+  @var     end     End of the current chunk
+  @var     chunk   Size of the next chunk (bytes)
+  @var     bytes   Memory allocated for the arena (bytes)
+  @var     slots   Table of entries (NULL = Sealed)
+  @var     mask    Number of slots, less one
+  @var     count   Number of entries
+  @var     head    First entry
+  @var     tail    Link to the next entry added
+  @var     listed  Listed entries, by position (once sealed)
+  @var     nlisted Number of listed entries
+  @var     refs    Reference count
+*/
+struct cramp_listing {
+  listing_chunk_t*  chunks;
+  char*             free;
+  char*             end;
+  size_t            chunk;
+  size_t            bytes;
+  listing_entry_t** slots;
+  size_t            mask;
+  size_t            count;
+  listing_entry_t*  head;
+  listing_entry_t** tail;
+  listing_entry_t** listed;
+  size_t            nlisted;
+  unsigned int      refs;
+};
+
+/**
+  @brief   Allocate from a listing's arena
+  @param   l     Listing
+  @param   size  Size (bytes)
+  @return  Pointer to memory (NULL on failure)
+
+  Allocations too big for a chunk get one of their own.
+*/
+static void* listing_alloc(cramp_listing_t* l, size_t size) {
+  size = (size + LISTING_ALIGN - 1) & ~(size_t)(LISTING_ALIGN - 1);
+
+  if ((size_t)(l->end - l->free) < size) {
+    size_t len = l->chunk;
+    if (len - LISTING_HEADER < size) {
+      len = LISTING_HEADER + size;
+    }
+
+    listing_chunk_t* chunk = malloc(len);
+    if (chunk == NULL) {
+      return NULL;
+    }
+
+    chunk->next = l->chunks;
+    l->chunks   = chunk;
+    l->free     = (char*)chunk + LISTING_HEADER;
+    l->end      = (char*)chunk + len;
+    l->bytes   += len;
+
+    if (l->chunk < LISTING_CHUNK_MAX) {
+      l->chunk *= 2;
+    }
+  }
+
+  void* ptr = l->free;
+  l->free += size;
+  return ptr;
+}
+
+/**
+  @brief   Hash an entry name (FNV-1a)
+  @param   name  Entry name
+  @return  Hash
+*/
+static uint32_t listing_hash(const char* name) {
+  uint32_t hash = 2166136261u;
+
+  for (const unsigned char* c = (const unsigned char*)name; *c; ++c) {
+    hash = (hash ^ *c) * 16777619u;
+  }
+
+  return hash;
+}
+
+/**
+  @brief   Find an entry's slot
+  @param   l     Listing
+  @param   name  Entry name
+  @param   hash  Hash of the name
+  @return  Pointer to the entry's slot (or the empty slot it'd go in)
+*/
+static listing_entry_t** listing_slot(cramp_listing_t* l, const char* name, uint32_t hash) {
+  for (size_t i = hash & l->mask; ; i = (i + 1) & l->mask) {
+    listing_entry_t* entry = l->slots[i];
+    if (entry == NULL || (entry->hash == hash && strcmp(entry->name, name) == 0)) {
+      return &l->slots[i];
+    }
+  }
+}
+
+/**
+  @brief   Double the size of a listing's table
+  @param   l  Listing
+  @return  Exit status (0 = OK; -1 = Failure)
+*/
+static int listing_grow(cramp_listing_t* l) {
+  size_t slots = 2 * (l->mask + 1);
+
+  listing_entry_t** table = calloc(slots, sizeof(listing_entry_t*));
+  if (table == NULL) {
+    return -1;
+  }
+
+  free((void*)l->slots);
+  l->slots = table;
+  l->mask  = slots - 1;
+
+  for (listing_entry_t* entry = l->head; entry; entry = entry->next) {
+    *listing_slot(l, entry->name, entry->hash) = entry;
+  }
+
+  return 0;
+}
+
+/**
+  @brief   Add an entry to a listing
+  @param   l        Listing
+  @param   name     Entry name (not already in the listing)
+  @param   hash     Hash of the name
+  @param   virtual  Entry is virtual (0 = False; 1 = True)
+  @return  Pointer to entry (NULL on failure)
+
+  The entry's stat structure is zeroed.
+*/
+static listing_entry_t* listing_add(cramp_listing_t* l, const char* name, uint32_t hash, int virtual) {
+  if (2 * (l->count + 1) > l->mask + 1 && listing_grow(l) == -1) {
+    return NULL;
+  }
+
+  size_t len = strlen(name);
+  listing_entry_t* entry = listing_alloc(l, sizeof(listing_entry_t) + len + 1);
+  if (entry == NULL) {
+    return NULL;
+  }
+
+  memset(entry, 0, sizeof(listing_entry_t));
+  memcpy(entry->name, name, len + 1);
+  entry->hash    = hash;
+  entry->virtual = virtual;
+
+  *listing_slot(l, name, hash) = entry;
+  *l->tail = entry;
+  l->tail  = &entry->next;
+  ++l->count;
+
+  return entry;
+}
+
+/**
+  @brief   Create an empty directory listing
+  @return  Pointer to listing, with one reference (NULL on failure)
+*/
+cramp_listing_t* cramp_listing_init(void) {
+  cramp_listing_t* l = calloc(1, sizeof(cramp_listing_t));
+  if (l == NULL) {
+    return NULL;
+  }
+
+  l->slots = calloc(LISTING_SLOTS, sizeof(listing_entry_t*));
+  if (l->slots == NULL) {
+    free((void*)l);
+    return NULL;
+  }
+
+  l->mask  = LISTING_SLOTS - 1;
+  l->chunk = LISTING_CHUNK;
+  l->tail  = &l->head;
+  l->refs  = 1;
+
+  return l;
+}
+
+/**
+  @brief   Add a real entry to a listing
+  @param   l     Listing (unsealed)
+  @param   name  Entry name
+  @return  Pointer to the entry's (zeroed) stat structure (NULL on failure)
+
+  A virtual entry of the same name is masked, as is the virtual index of
+  a masked virtual BAM (i.e., foo.bam.bai, for foo.bam).
+*/
+struct stat* cramp_listing_real(cramp_listing_t* l, const char* name) {
+  uint32_t hash = listing_hash(name);
+  listing_entry_t* entry = *listing_slot(l, name, hash);
+
+  if (entry == NULL) {
+    entry = listing_add(l, name, hash, 0);
+    return entry ? &entry->st : NULL;
+  }
+
+  size_t len = strlen(name);
+  if (entry->virtual && !entry->masked
+   && len >= 4 && len <= NAME_MAX && strcmp(name + len - 4, ".bam") == 0) {
+    char index_name[NAME_MAX + sizeof(".bai")];
+    memcpy(index_name, name, len);
+    memcpy(index_name + len, ".bai", sizeof(".bai"));
+
+    listing_entry_t* index = *listing_slot(l, index_name, listing_hash(index_name));
+    if (index && index->virtual) {
+      index->masked = 1;
+    }
+  }
+
+  /* Take over the virtual entry, in place */
+  entry->virtual = 0;
+  entry->masked  = 0;
+  memset(&entry->st, 0, sizeof(struct stat));
+
+  return &entry->st;
+}
+
+/**
+  @brief   Add a virtual entry to a listing
+  @param   l     Listing (unsealed)
+  @param   name  Entry name
+  @param   st    Stat structure of entry (copied)
+  @return  Pointer to the entry's stat structure (NULL on failure)
+
+  Nothing is added if there's a clash with a listed entry, in which case
+  errno is set to EEXIST.
+*/
+struct stat* cramp_listing_virtual(cramp_listing_t* l, const char* name, const struct stat* st) {
+  uint32_t hash = listing_hash(name);
+  listing_entry_t* entry = *listing_slot(l, name, hash);
+
+  if (entry && !entry->masked) {
+    errno = EEXIST;
+    return NULL;
+  }
+
+  if (entry == NULL) {
+    entry = listing_add(l, name, hash, 1);
+    if (entry == NULL) {
+      return NULL;
+    }
+  }
+
+  entry->virtual = 1;
+  entry->masked  = 0;
+  memcpy(&entry->st, st, sizeof(struct stat));
+
+  return &entry->st;
+}
+
+/**
+  @brief   Seal a complete listing, indexing its listed entries
+  @param   l  Listing
+  @return  Exit status (0 = OK; -1 = Failure)
+
+  Nothing more can be added to a sealed listing.
+*/
+int cramp_listing_seal(cramp_listing_t* l) {
+  listing_entry_t** listed = listing_alloc(l, (l->count ? l->count : 1) * sizeof(listing_entry_t*));
+  if (listed == NULL) {
+    return -1;
+  }
+
+  size_t n = 0;
+  for (listing_entry_t* entry = l->head; entry; entry = entry->next) {
+    if (!entry->masked) {
+      listed[n++] = entry;
+    }
+  }
+
+  free((void*)l->slots);
+  l->slots   = NULL;
+  l->listed  = listed;
+  l->nlisted = n;
+
+  return 0;
+}
+
+/**
+  @brief   Listed entry, by position
+  @param   l      Listing (sealed)
+  @param   index  Position
+  @param   st     Set to the entry's stat structure
+  @return  Entry name (NULL = No more entries)
+*/
+const char* cramp_listing_at(cramp_listing_t* l, size_t index, const struct stat** st) {
+  if (l->listed == NULL || index >= l->nlisted) {
+    return NULL;
+  }
+
+  *st = &l->listed[index]->st;
+  return l->listed[index]->name;
+}
+
+/**
+  @brief   Memory used by a listing
+  @param   l  Listing
+  @return  Size (bytes)
+*/
+size_t cramp_listing_size(cramp_listing_t* l) {
+  return sizeof(cramp_listing_t) + l->bytes
+       + (l->slots ? (l->mask + 1) * sizeof(listing_entry_t*) : 0);
+}
+
+/**
+  @brief   Take another reference to a listing
+  @param   l  Listing
+
+  n.b., Shared listings are held and released under their owner's lock
+*/
+void cramp_listing_hold(cramp_listing_t* l) {
+  ++l->refs;
+}
+
+/**
+  @brief   Release a reference to a listing, freeing it with the last
+  @param   l  Listing (NULL = No-op)
+*/
+void cramp_listing_release(cramp_listing_t* l) {
+  if (l == NULL || --l->refs > 0) {
+    return;
+  }
+
+  while (l->chunks) {
+    listing_chunk_t* chunk = l->chunks;
+    l->chunks = chunk->next;
+    free((void*)chunk);
+  }
+
+  free((void*)l->slots);
+  free((void*)l);
+}
@@ -0,0 +1,25 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#ifndef _CRAMP_LISTING_H
+#define _CRAMP_LISTING_H
+
+/* Needed for size_t */
+#include <sys/types.h>
+
+/* Needed for struct stat */
+#include <sys/stat.h>
+
+/* Opaque directory listing */
+typedef struct cramp_listing cramp_listing_t;
+
+extern cramp_listing_t* cramp_listing_init(void);
+extern struct stat*     cramp_listing_real(cramp_listing_t*, const char*);
+extern struct stat*     cramp_listing_virtual(cramp_listing_t*, const char*, const struct stat*);
+extern int              cramp_listing_seal(cramp_listing_t*);
+extern const char*      cramp_listing_at(cramp_listing_t*, size_t, const struct stat**);
+extern size_t           cramp_listing_size(cramp_listing_t*);
+extern void             cramp_listing_hold(cramp_listing_t*);
+extern void             cramp_listing_release(cramp_listing_t*);
+
+#endif
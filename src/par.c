@@ -0,0 +1,652 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "container.h"
+#include "handles.h"
+#include "par.h"
+#include "ring.h"
+#include "util.h"
+
+#include <htslib/bgzf.h>
+#include <htslib/cram.h>
+#include <htslib/hfile.h>
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+
+/*
+  NOTES
+
+  A BGZF file is just a concatenation of independently compressed
+  blocks, so a whole file conversion can be split up and farmed out to
+  the thread pool, in two stages:
+
+  1. Each CRAM container is decoded, by a worker, into uncompressed BAM
+     records (with HTSLib's own writer, so they're serialised exactly as
+     they would be otherwise).
+
+  2. The records are packed into blocks, in order, following HTSLib's
+     rule: a record goes into a new block if it won't fit in what's left
+     of the current one (unless it's bigger than a block, in which case
+     it spans as many as it needs). The header is flushed into its own
+     block(s). Each block is then compressed, by a worker, with the same
+     function (and level) that BGZF uses.
+
+  Packing is cheap, so it's done by whoever's asking for blocks, which
+  come back in order. The result is byte for byte identical to a
+  sequential conversion, so sizes and checkpoints are interchangeable
+  between the two; the packing also tells us where the checkpoints are,
+  for free. Finally, an empty block compresses to the BGZF EOF marker.
+
+  Each worker needs its own CRAM file pointer to decode from; these are
+  borrowed from the pool (see handles.c) and kept in a free list, so
+  there are only ever as many as there have been concurrent decoding
+  jobs. They go back to the pool when the conversion is closed.
+*/
+
+/* Initial size of a container's decoded output buffer */
+#define PAR_DECODE_BUFFER (1024 * 1024)
+
+/**
+  @brief   CRAM file pointer for decoding
+  @var     handle  Borrowed CRAM file pointer
+  @var     next    Next free file pointer
+*/
+typedef struct par_handle {
+  cramp_handle_t*    handle;
+  struct par_handle* next;
+} par_handle_t;
+
+/**
+  @brief   Container decoding job
+  @var     par  Parallel conversion
+  @var     c    Index of the container
+  @var     raw  Uncompressed BAM records
+  @var     res  Exit status (0 = OK; -1 = Fail)
+*/
+typedef struct par_decode {
+  cramp_par_t*  par;
+  size_t        c;
+  cramp_ring_t* raw;
+  int           res;
+} par_decode_t;
+
+/**
+  @brief   Block compression job
+  @var     level       Compression level
+  @var     raw         Uncompressed data
+  @var     rawlen      Uncompressed data length
+  @var     data        Compressed block
+  @var     len         Compressed block length
+  @var     checkpoint  Block starts a checkpoint (0 = False; 1 = True)
+  @var     cram        Offset of the checkpoint's CRAM container
+  @var     skip        Records in that container preceding the checkpoint
+  @var     res         Exit status (0 = OK; -1 = Fail)
+*/
+typedef struct par_compress {
+  int    level;
+  char   raw[BGZF_BLOCK_SIZE];
+  size_t rawlen;
+  char   data[BGZF_MAX_BLOCK_SIZE];
+  size_t len;
+  int    checkpoint;
+  off_t  cram;
+  size_t skip;
+  int    res;
+} par_compress_t;
+
+/**
+  @brief   Parallel conversion
+  @var     path     CRAM file path
+  @var     header   BAM header
+  @var     cont     CRAM container locations
+  @var     ncont    Number of CRAM containers
+  @var     pool     Thread pool
+  @var     level    Compression level
+  @var     view     Decoding view
+  @var     dq       Decoding queue
+  @var     dsent    Decoding jobs dispatched
+  @var     dgot     Decoding jobs collected
+  @var     dmax     Maximum decoding jobs in flight
+  @var     cq       Compression queue
+  @var     csent    Compression jobs dispatched
+  @var     cgot     Compression jobs collected
+  @var     cmax     Maximum compression jobs in flight
+  @var     handles  Free CRAM file pointers
+  @var     lock     Mutex for the free list
+  @var     hdr      Uncompressed BAM header
+  @var     hpos     Header bytes packed
+  @var     cur      Container being packed (NULL = None)
+  @var     pos      Container bytes packed
+  @var     rec      Ordinal of the record being packed, in its container
+  @var     reclen   Length of the record being packed
+  @var     part     Bytes of the record packed
+  @var     want     Looking for a checkpoint (0 = False; 1 = True)
+  @var     block    Block being packed (NULL = None)
+  @var     packed   Everything has been packed (0 = False; 1 = True)
+  @var     ended    EOF block has been dispatched (0 = False; 1 = True)
+  @var     last     Block last returned (freed on the next call)
+*/
+struct cramp_par {
+  const char*              path;
+  const bam_hdr_t*         header;
+  const cramp_container_t* cont;
+  size_t                   ncont;
+  htsThreadPool*           pool;
+  int                      level;
+  enum cramp_view          view;
+  hts_tpool_process*       dq;
+  size_t                   dsent;
+  size_t                   dgot;
+  size_t                   dmax;
+  hts_tpool_process*       cq;
+  size_t                   csent;
+  size_t                   cgot;
+  size_t                   cmax;
+  par_handle_t*            handles;
+  pthread_mutex_t          lock;
+  cramp_ring_t*            hdr;
+  size_t                   hpos;
+  par_decode_t*            cur;
+  size_t                   pos;
+  size_t                   rec;
+  size_t                   reclen;
+  size_t                   part;
+  int                      want;
+  par_compress_t*          block;
+  int                      packed;
+  int                      ended;
+  par_compress_t*          last;
+};
+
+/**
+  @brief   Open an uncompressed BAM writer into a growing buffer
+  @param   raw  Buffer
+  @return  BAM file pointer (NULL on failure)
+*/
+static htsFile* par_raw_open(cramp_ring_t* raw) {
+  hFILE* hfp = cramp_ring_hopen(raw, NULL, NULL);
+  if (hfp == NULL) {
+    return NULL;
+  }
+
+  htsFile* out = hts_hopen(hfp, "-", "wbu");
+  if (out == NULL) {
+    (void)hclose(hfp);
+  }
+
+  return out;
+}
+
+/**
+  @brief   Take a CRAM file pointer from the free list, or borrow a new one
+  @param   par  Parallel conversion
+  @return  CRAM file pointer (NULL on failure)
+*/
+static par_handle_t* par_handle_get(cramp_par_t* par) {
+  (void)pthread_mutex_lock(&par->lock);
+  par_handle_t* h = par->handles;
+  if (h) {
+    par->handles = h->next;
+  }
+  (void)pthread_mutex_unlock(&par->lock);
+
+  if (h) {
+    return h;
+  }
+
+  h = calloc(1, sizeof(par_handle_t));
+  if (h == NULL) {
+    return NULL;
+  }
+
+  h->handle = cramp_handles_get(CTX->handles, par->path, par->view);
+  if (h->handle == NULL) {
+    free((void*)h);
+    return NULL;
+  }
+
+  return h;
+}
+
+/**
+  @brief   Return a CRAM file pointer to the free list
+  @param   par  Parallel conversion
+  @param   h    CRAM file pointer (NULL = Nothing to return)
+*/
+static void par_handle_put(cramp_par_t* par, par_handle_t* h) {
+  if (h) {
+    (void)pthread_mutex_lock(&par->lock);
+    h->next = par->handles;
+    par->handles = h;
+    (void)pthread_mutex_unlock(&par->lock);
+  }
+}
+
+/**
+  @brief   Decode a container into uncompressed BAM records (job)
+  @param   arg  Decoding job
+  @return  Decoding job
+*/
+static void* par_decode(void* arg) {
+  par_decode_t*            job  = (par_decode_t*)arg;
+  cramp_par_t*             par  = job->par;
+  const cramp_container_t* cont = &par->cont[job->c];
+
+  par_handle_t* h   = par_handle_get(par);
+  bam1_t*       bam = bam_init1();
+  htsFile*      out = NULL;
+
+  job->res = -1;
+  job->raw = cramp_ring_buffer(PAR_DECODE_BUFFER);
+
+  if (h == NULL || bam == NULL || job->raw == NULL) {
+    goto finish_up;
+  }
+
+  out = par_raw_open(job->raw);
+  if (out == NULL) {
+    goto finish_up;
+  }
+
+  if (cram_seek(h->handle->fp->fp.cram, cont->offset, SEEK_SET) != 0) {
+    goto finish_up;
+  }
+
+  for (size_t i = 0; i < cont->nrec; ++i) {
+    if (sam_read1(h->handle->fp, h->handle->header, bam) < 0
+     || sam_write1(out, par->header, bam) < 0) {
+      goto finish_up;
+    }
+  }
+
+  job->res = 0;
+
+finish_up:
+  if (out && hts_close(out) < 0) {
+    job->res = -1;
+  }
+
+  if (bam) {
+    bam_destroy1(bam);
+  }
+
+  par_handle_put(par, h);
+  return job;
+}
+
+/**
+  @brief   Free a decoding job
+  @param   job  Decoding job (may be NULL)
+*/
+static void par_decode_free(par_decode_t* job) {
+  if (job) {
+    cramp_ring_destroy(job->raw);
+    free((void*)job);
+  }
+}
+
+/**
+  @brief   Compress a block (job)
+  @param   arg  Compression job
+  @return  Compression job
+*/
+static void* par_compress(void* arg) {
+  par_compress_t* job = (par_compress_t*)arg;
+
+  job->len = BGZF_MAX_BLOCK_SIZE;
+  job->res = bgzf_compress(job->data, &job->len, job->raw, job->rawlen, job->level);
+
+  return job;
+}
+
+/**
+  @brief   Dispatch containers for decoding, up to the limit in flight
+  @param   par  Parallel conversion
+  @return  1 = Success; 0 = Fail
+*/
+static int par_dispatch(cramp_par_t* par) {
+  while (par->dsent < par->ncont && par->dsent - par->dgot < par->dmax) {
+    par_decode_t* job = calloc(1, sizeof(par_decode_t));
+    if (job == NULL) {
+      return 0;
+    }
+
+    job->par = par;
+    job->c   = par->dsent;
+
+    if (hts_tpool_dispatch(par->pool->pool, par->dq, par_decode, job) < 0) {
+      free((void*)job);
+      return 0;
+    }
+
+    ++par->dsent;
+  }
+
+  return 1;
+}
+
+/**
+  @brief   Pack the next block
+  @param   par    Parallel conversion
+  @param   block  Pointer to block, to be set
+  @return  1 = Block packed; 0 = Nothing left; -1 = Fail
+
+  Containers are collected, in order, as they're needed.
+*/
+static int par_pack(cramp_par_t* par, par_compress_t** block) {
+  if (par->block == NULL) {
+    par->block = calloc(1, sizeof(par_compress_t));
+    if (par->block == NULL) {
+      return -1;
+    }
+  }
+
+  par_compress_t* b = par->block;
+
+  /* The header is flushed on its own */
+  while (par->hpos < par->hdr->len) {
+    size_t take = par->hdr->len - par->hpos;
+    if (take > BGZF_BLOCK_SIZE - b->rawlen) {
+      take = BGZF_BLOCK_SIZE - b->rawlen;
+    }
+
+    memcpy(b->raw + b->rawlen, par->hdr->data + par->hpos, take);
+    b->rawlen += take;
+    par->hpos += take;
+
+    if (b->rawlen == BGZF_BLOCK_SIZE || par->hpos == par->hdr->len) {
+      goto ready;
+    }
+  }
+
+  while (1) {
+    if (par->cur == NULL || par->pos == par->cur->raw->len) {
+      /* Move on to the next container */
+      if (par->cur) {
+        if (par->part || par->rec != par->cont[par->cur->c].nrec) {
+          return -1;
+        }
+
+        par_decode_free(par->cur);
+        par->cur = NULL;
+      }
+
+      if (par->dgot == par->ncont) {
+        par->packed = 1;
+        if (b->rawlen) {
+          goto ready;
+        }
+
+        free((void*)b);
+        par->block = NULL;
+        return 0;
+      }
+
+      if (!par_dispatch(par)) {
+        return -1;
+      }
+
+      hts_tpool_result* r = hts_tpool_next_result_wait(par->dq);
+      if (r == NULL) {
+        return -1;
+      }
+
+      par->cur = (par_decode_t*)hts_tpool_result_data(r);
+      hts_tpool_delete_result(r, 0);
+      ++par->dgot;
+
+      if (par->cur->res < 0) {
+        return -1;
+      }
+
+      par->pos  = 0;
+      par->rec  = 0;
+      par->part = 0;
+      par->want = 1;
+      continue;
+    }
+
+    const unsigned char* data = (const unsigned char*)par->cur->raw->data + par->pos;
+    size_t avail = par->cur->raw->len - par->pos;
+
+    if (par->part == 0) {
+      /* Start of a record: block_size (little endian) doesn't include
+         itself                                                       */
+      if (avail < 4) {
+        return -1;
+      }
+
+      par->reclen = 4 + ((uint32_t)data[0]       | (uint32_t)data[1] << 8
+                       | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+
+      if (b->rawlen && b->rawlen + par->reclen > BGZF_BLOCK_SIZE) {
+        goto ready;
+      }
+
+      /* The first record to start a block in each container */
+      if (par->want && b->rawlen == 0) {
+        b->checkpoint = 1;
+        b->cram       = par->cont[par->cur->c].offset;
+        b->skip       = par->rec;
+        par->want     = 0;
+      }
+    }
+
+    size_t take = par->reclen - par->part;
+    if (take > BGZF_BLOCK_SIZE - b->rawlen) {
+      take = BGZF_BLOCK_SIZE - b->rawlen;
+    }
+
+    if (take > avail) {
+      return -1;
+    }
+
+    memcpy(b->raw + b->rawlen, data, take);
+    b->rawlen += take;
+    par->pos  += take;
+    par->part += take;
+
+    if (par->part == par->reclen) {
+      par->part = 0;
+      ++par->rec;
+    }
+
+    if (b->rawlen == BGZF_BLOCK_SIZE) {
+      goto ready;
+    }
+  }
+
+ready:
+  par->block = NULL;
+  *block = b;
+  return 1;
+}
+
+/**
+  @brief   Start a parallel conversion
+  @param   path    Path to CRAM file
+  @param   header  BAM header (borrowed)
+  @param   cont    CRAM container locations (borrowed)
+  @param   ncont   Number of CRAM containers
+  @param   pool    Thread pool
+  @param   level   BGZF compression level
+  @param   view    Decoding view
+  @return  Pointer to parallel conversion (NULL on failure)
+
+  The header and containers must outlive the conversion.
+*/
+cramp_par_t* cramp_par_open(const char* path, const bam_hdr_t* header,
+                            const cramp_container_t* cont, size_t ncont,
+                            htsThreadPool* pool, int level, enum cramp_view view) {
+  cramp_par_t* par = calloc(1, sizeof(cramp_par_t));
+  if (par == NULL) {
+    return NULL;
+  }
+
+  par->path   = path;
+  par->header = header;
+  par->cont   = cont;
+  par->ncont  = ncont;
+  par->pool   = pool;
+  par->level  = level;
+  par->view   = view;
+  (void)pthread_mutex_init(&par->lock, NULL);
+
+  /* As many containers in flight as there are threads to decode them,
+     but as many blocks as the pool's queue allows                    */
+  int threads = hts_tpool_size(pool->pool);
+  par->dmax = threads > 0 ? threads : 1;
+  par->cmax = pool->qsize > 0 ? (size_t)pool->qsize : par->dmax;
+
+  par->dq  = hts_tpool_process_init(pool->pool, par->dmax, 0);
+  par->cq  = hts_tpool_process_init(pool->pool, par->cmax, 0);
+  par->hdr = cramp_ring_buffer(PAR_DECODE_BUFFER);
+
+  if (par->dq == NULL || par->cq == NULL || par->hdr == NULL) {
+    cramp_par_close(par);
+    return NULL;
+  }
+
+  /* Serialise the header */
+  htsFile* out = par_raw_open(par->hdr);
+  if (out == NULL) {
+    cramp_par_close(par);
+    return NULL;
+  }
+
+  int res = sam_hdr_write(out, header);
+  if (hts_close(out) < 0 || res < 0 || !par_dispatch(par)) {
+    cramp_par_close(par);
+    return NULL;
+  }
+
+  return par;
+}
+
+/**
+  @brief   Get the next compressed block of a parallel conversion
+  @param   par    Parallel conversion
+  @param   block  Pointer to block, to be set
+  @return  1 = Block; 0 = End of conversion; -1 = Fail
+
+  The block is only valid until the next call.
+*/
+int cramp_par_next(cramp_par_t* par, cramp_par_block_t* block) {
+  free((void*)par->last);
+  par->last = NULL;
+
+  /* Keep the compressors busy */
+  while (!par->ended && par->csent - par->cgot < par->cmax) {
+    par_compress_t* job = NULL;
+
+    int res = par->packed ? 0 : par_pack(par, &job);
+    if (res < 0) {
+      return -1;
+    }
+
+    if (res == 0) {
+      /* An empty block compresses to the EOF marker (which BGZF always
+         writes at the default level)                                 */
+      job = calloc(1, sizeof(par_compress_t));
+      if (job == NULL) {
+        return -1;
+      }
+      job->level = -1;
+      par->ended = 1;
+
+    } else {
+      job->level = par->level;
+    }
+
+    if (hts_tpool_dispatch(par->pool->pool, par->cq, par_compress, job) < 0) {
+      free((void*)job);
+      return -1;
+    }
+
+    ++par->csent;
+  }
+
+  if (par->cgot == par->csent) {
+    return 0;
+  }
+
+  hts_tpool_result* r = hts_tpool_next_result_wait(par->cq);
+  if (r == NULL) {
+    return -1;
+  }
+
+  par_compress_t* job = (par_compress_t*)hts_tpool_result_data(r);
+  hts_tpool_delete_result(r, 0);
+  ++par->cgot;
+
+  par->last = job;
+  if (job->res < 0) {
+    return -1;
+  }
+
+  block->data       = job->data;
+  block->len        = job->len;
+  block->checkpoint = job->checkpoint;
+  block->cram       = job->cram;
+  block->skip       = job->skip;
+
+  return 1;
+}
+
+/**
+  @brief   Stop a parallel conversion
+  @param   par  Parallel conversion
+
+  Any jobs still in flight are waited for and discarded.
+*/
+void cramp_par_close(cramp_par_t* par) {
+  for (; par->cgot < par->csent; ++par->cgot) {
+    hts_tpool_result* r = hts_tpool_next_result_wait(par->cq);
+    if (r) {
+      free(hts_tpool_result_data(r));
+      hts_tpool_delete_result(r, 0);
+    }
+  }
+
+  for (; par->dgot < par->dsent; ++par->dgot) {
+    hts_tpool_result* r = hts_tpool_next_result_wait(par->dq);
+    if (r) {
+      par_decode_free((par_decode_t*)hts_tpool_result_data(r));
+      hts_tpool_delete_result(r, 0);
+    }
+  }
+
+  if (par->dq) {
+    hts_tpool_process_destroy(par->dq);
+  }
+
+  if (par->cq) {
+    hts_tpool_process_destroy(par->cq);
+  }
+
+  while (par->handles) {
+    par_handle_t* h = par->handles;
+    par->handles = h->next;
+
+    cramp_handles_put(CTX->handles, h->handle);
+    free((void*)h);
+  }
+
+  par_decode_free(par->cur);
+  cramp_ring_destroy(par->hdr);
+  free((void*)par->block);
+  free((void*)par->last);
+
+  (void)pthread_mutex_destroy(&par->lock);
+  free((void*)par);
+}
@@ -0,0 +1,43 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#ifndef _CRAMP_PAR_H
+#define _CRAMP_PAR_H
+
+/* Needed for off_t and size_t */
+#include <sys/types.h>
+
+/* Needed for htsThreadPool and bam_hdr_t */
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+
+/* Needed for cramp_container_t */
+#include "container.h"
+
+/* Needed for enum cramp_view */
+#include "handles.h"
+
+/* Opaque parallel conversion */
+typedef struct cramp_par cramp_par_t;
+
+/**
+  @brief   Compressed BGZF block of a parallel conversion
+  @var     data        Block data
+  @var     len         Block length (bytes)
+  @var     checkpoint  Block starts a checkpoint (0 = False; 1 = True)
+  @var     cram        Offset of the checkpoint's CRAM container
+  @var     skip        Records in that container preceding the checkpoint
+*/
+typedef struct cramp_par_block {
+  const char* data;
+  size_t      len;
+  int         checkpoint;
+  off_t       cram;
+  size_t      skip;
+} cramp_par_block_t;
+
+extern cramp_par_t* cramp_par_open(const char*, const bam_hdr_t*, const cramp_container_t*, size_t, htsThreadPool*, int, enum cramp_view);
+extern int          cramp_par_next(cramp_par_t*, cramp_par_block_t*);
+extern void         cramp_par_close(cramp_par_t*);
+
+#endif
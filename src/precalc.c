@@ -0,0 +1,779 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "13amp.h"
+#include "cache.h"
+#include "conv.h"
+#include "log.h"
+#include "precalc.h"
+#include "util.h"
+
+#include <htslib/khash.h>
+
+/*
+  NOTES
+
+  Until a virtual BAM has been converted in full, its size is unknown,
+  so it's reported as --bamsize (i.e., huge). Rather than waiting for
+  somebody to read each one to the end, a small pool of background
+  workers calculates the sizes of the CRAMs under the source directory,
+  from when the filesystem is mounted, and puts them into the stat cache.
+
+  The work is a queue of jobs, each of which is either a directory to
+  scan or a CRAM to size. A scan queues the CRAMs that aren't in the
+  cache, or whose mtime has changed since they were cached, in directory
+  order; the initial walk of the source tree also queues subdirectories.
+
+  The spill cache (see spill.c) also queues a third kind of job, to read
+  a frequently opened virtual BAM through to the end, at a given level,
+  so all of its pages are spilled to disk. A fourth builds the BAI index
+  of a virtual BAM, at a given level, when it's asked for (see fs.c)
+  before it's been built; that's queued at the front, at the high
+  priority, as somebody's waiting for it.
+
+  There are two priorities: the walk runs at the low one, first in first
+  out; opening a directory (i.e., listing it) queues a scan at the high
+  one, at the front, so whatever was most recently listed is done next.
+  Queued paths are kept in a set, with their priority, so nothing is
+  queued twice, unless it's promoted. Popping a job whose path isn't in
+  the set (at the job's priority) means it's been done, or superseded.
+
+  The workers shouldn't starve interactive reads, so they sleep while
+  any read is in progress, or for a second after one finishes. They
+  check between jobs and between each step of a size calculation (see
+  cramp_precalc_yield), which is also how they give up when the
+  filesystem is unmounted.
+
+  The walk follows neither symlinked directories nor other filesystems;
+  the latter stops it walking into the mount point (see TODO note 1).
+*/
+
+/* Quiet period after an interactive read, before resuming (ms) */
+#define PRECALC_GRACE 1000
+
+/* Interval between checks for quiet, while throttled (ms) */
+#define PRECALC_NAP 100
+
+/* Job priorities */
+enum { PRECALC_LOW, PRECALC_HIGH };
+
+/* Job kinds: scan a directory, size a CRAM, fill the spill cache or
+   build a virtual BAI                                                */
+enum { PRECALC_SCAN, PRECALC_SIZE, PRECALC_FILL, PRECALC_INDEX };
+
+/* Size of the buffer used to read through a conversion, to fill */
+#define PRECALC_FILL_BUFFER (1024 * 1024)
+
+/**
+  @brief   Precalculation job
+  @var     path      CRAM file, or directory (with a trailing slash)
+  @var     name      Name in the set of queued jobs
+  @var     kind      Job kind
+  @var     walk      Also queue subdirectories (0 = False; 1 = True)
+  @var     level     BGZF compression level to fill (or index) at
+  @var     priority  Priority
+  @var     next      Next job in the queue
+*/
+typedef struct precalc_job {
+  const char*         path;
+  const char*         name;
+  int                 kind;
+  int                 walk;
+  int                 level;
+  int                 priority;
+  struct precalc_job* next;
+} precalc_job_t;
+
+/**
+  @brief   Job queue
+  @var     head  First job (NULL = Empty)
+  @var     tail  Last job
+*/
+typedef struct precalc_queue {
+  precalc_job_t* head;
+  precalc_job_t* tail;
+} precalc_queue_t;
+
+/* Initialise queued job set type (name => priority) */
+KHASH_MAP_INIT_STR(precalc_set, int)
+
+/**
+  @brief   Background precalculation pool
+  @var     dev      Device of the source directory
+  @var     threads  Worker threads
+  @var     n        Number of worker threads
+  @var     queue    Job queues, by priority
+  @var     queued   Set of queued jobs
+  @var     stop     Shut down (0 = False; 1 = True)
+  @var     reads    Number of interactive reads in progress
+  @var     quiet    When the last interactive read finished (monotonic)
+  @var     lock     Mutex
+  @var     work     Condition for there being jobs (or shutdown)
+  @var     idle     Condition for shutdown, while throttled
+*/
+struct cramp_precalc {
+  dev_t                 dev;
+  pthread_t*            threads;
+  int                   n;
+  precalc_queue_t       queue[2];
+  khash_t(precalc_set)* queued;
+  int                   stop;
+  int                   reads;
+  struct timespec       quiet;
+  pthread_mutex_t       lock;
+  pthread_cond_t        work;
+  pthread_cond_t        idle;
+};
+
+/* The pool that the current thread works for (NULL = Not a worker) */
+static __thread cramp_precalc_t* self = NULL;
+
+/**
+  @brief   Create a job
+  @param   path      CRAM file or directory
+  @param   kind      Job kind
+  @param   walk      Also queue subdirectories (0 = False; 1 = True)
+  @param   level     BGZF compression level (fill and index jobs only)
+  @param   priority  Priority
+  @return  Pointer to job (NULL on failure)
+
+  Jobs are named for the set of queued jobs: directories get a trailing
+  slash, fills are their cache key with a leading "+" and indices are
+  theirs with a leading "#", so none of them clash with the CRAM paths
+  of sizing jobs.
+*/
+static precalc_job_t* job_new(const char* path, int kind, int walk, int level, int priority) {
+  precalc_job_t* job = calloc(1, sizeof(precalc_job_t));
+  if (job == NULL) {
+    return NULL;
+  }
+
+  size_t len = strlen(path);
+  job->path = (kind == PRECALC_SCAN) ? path_concat(path, "") : malloc(len + 1);
+
+  if (job->path) {
+    if (kind != PRECALC_SCAN) {
+      memcpy((void*)job->path, path, len + 1);
+    }
+
+    if (kind == PRECALC_FILL || kind == PRECALC_INDEX) {
+      const char* key = cramp_cache_key(path, level);
+      if (key) {
+        size_t keylen = strlen(key);
+        job->name = malloc(keylen + 2);
+        if (job->name) {
+          *(char*)job->name = (kind == PRECALC_FILL) ? '+' : '#';
+          memcpy((void*)(job->name + 1), key, keylen + 1);
+        }
+        free((void*)key);
+      }
+
+    } else {
+      len = strlen(job->path);
+      job->name = malloc(len + 1);
+      if (job->name) {
+        memcpy((void*)job->name, job->path, len + 1);
+      }
+    }
+  }
+
+  if (job->path == NULL || job->name == NULL) {
+    free((void*)job->path);
+    free((void*)job->name);
+    free((void*)job);
+    return NULL;
+  }
+
+  job->kind     = kind;
+  job->walk     = walk;
+  job->level    = level;
+  job->priority = priority;
+  job->next     = NULL;
+
+  return job;
+}
+
+/**
+  @brief   Free a chain of jobs
+  @param   job  First job
+*/
+static void job_free(precalc_job_t* job) {
+  while (job) {
+    precalc_job_t* next = job->next;
+    free((void*)job->path);
+    free((void*)job->name);
+    free((void*)job);
+    job = next;
+  }
+}
+
+/**
+  @brief   Queue a chain of jobs, of the same priority
+  @param   p         Precalculation pool (locked)
+  @param   chain     First job in the chain
+  @param   priority  Priority of the jobs
+  @param   front     Queue at the front (0 = Back; 1 = Front)
+
+  Jobs that are already queued, at the same priority or higher, are
+  dropped. Otherwise, the chain's order is preserved.
+*/
+static void precalc_push(cramp_precalc_t* p, precalc_job_t* chain, int priority, int front) {
+  precalc_job_t *first = NULL, *last = NULL;
+
+  while (chain) {
+    precalc_job_t* job = chain;
+    chain = job->next;
+    job->next = NULL;
+
+    khiter_t key = kh_get(precalc_set, p->queued, job->name);
+    if (key != kh_end(p->queued)) {
+      if (kh_value(p->queued, key) >= priority) {
+        job_free(job);
+        continue;
+      }
+
+    } else {
+      /* The set has its own copy of the name */
+      size_t len = strlen(job->name);
+      char* copy = malloc(len + 1);
+      int ret = -1;
+
+      if (copy) {
+        memcpy(copy, job->name, len + 1);
+        key = kh_put(precalc_set, p->queued, copy, &ret);
+      }
+
+      if (ret == -1) {
+        free((void*)copy);
+        job_free(job);
+        continue;
+      }
+    }
+
+    kh_value(p->queued, key) = priority;
+
+    if (last) {
+      last->next = job;
+    } else {
+      first = job;
+    }
+    last = job;
+  }
+
+  if (first == NULL) {
+    return;
+  }
+
+  precalc_queue_t* q = &p->queue[priority];
+
+  if (front) {
+    last->next = q->head;
+    q->head = first;
+    if (q->tail == NULL) {
+      q->tail = last;
+    }
+
+  } else {
+    if (q->tail) {
+      q->tail->next = first;
+    } else {
+      q->head = first;
+    }
+    q->tail = last;
+  }
+
+  (void)pthread_cond_broadcast(&p->work);
+}
+
+/**
+  @brief   Take the next job from the queues
+  @param   p  Precalculation pool (locked)
+  @return  Pointer to job (NULL if there's nothing to do)
+*/
+static precalc_job_t* precalc_pop(cramp_precalc_t* p) {
+  for (int priority = PRECALC_HIGH; priority >= PRECALC_LOW; --priority) {
+    precalc_queue_t* q = &p->queue[priority];
+
+    while (q->head) {
+      precalc_job_t* job = q->head;
+      q->head = job->next;
+      if (q->head == NULL) {
+        q->tail = NULL;
+      }
+      job->next = NULL;
+
+      /* Only the job that put its name in the set gets to do it */
+      khiter_t key = kh_get(precalc_set, p->queued, job->name);
+      if (key != kh_end(p->queued) && kh_value(p->queued, key) == job->priority) {
+        free((void*)kh_key(p->queued, key));
+        kh_del(precalc_set, p->queued, key);
+        return job;
+      }
+
+      job_free(job);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  @brief   Milliseconds elapsed since a monotonic time
+  @param   since  Monotonic time
+  @return  Elapsed time (ms)
+*/
+static long elapsed(const struct timespec* since) {
+  struct timespec now;
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since->tv_sec) * 1000
+       + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+  @brief   Wait until interactive reads have gone quiet
+  @param   p  Precalculation pool
+  @return  Shut down (0 = Carry on; 1 = Give up)
+*/
+static int precalc_throttle(cramp_precalc_t* p) {
+  (void)pthread_mutex_lock(&p->lock);
+
+  while (!p->stop && (p->reads > 0 || elapsed(&p->quiet) < PRECALC_GRACE)) {
+    struct timespec until;
+    (void)clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += PRECALC_NAP * 1000000L;
+    until.tv_sec  += until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+
+    (void)pthread_cond_timedwait(&p->idle, &p->lock, &until);
+  }
+
+  int stop = p->stop;
+  (void)pthread_mutex_unlock(&p->lock);
+
+  return stop;
+}
+
+/**
+  @brief   Check whether a CRAM's size needs calculating
+  @param   path  CRAM file
+  @param   st    stat structure of the CRAM file
+  @return  Missing or stale (0 = False; 1 = True)
+*/
+static int precalc_stale(const char* path, const struct stat* st) {
+  cramp_ctx_t* ctx = CTX;
+
+  const char* key = cramp_cache_key(path, ctx->conf->bam_level);
+  if (key == NULL) {
+    return 0;
+  }
+
+  cramp_stat_t  copy;
+  cramp_stat_t* record = cramp_cache_get(ctx->cache, key, &copy);
+  free((void*)key);
+
+  return record == NULL || record->mtime != st->st_mtime;
+}
+
+/**
+  @brief   Scan a directory for CRAMs to size
+  @param   p    Precalculation pool
+  @param   job  Scanning job
+*/
+static void precalc_scan(cramp_precalc_t* p, precalc_job_t* job) {
+  DIR* dp = opendir(job->path);
+  if (dp == NULL) {
+    LOG("Couldn't scan %s for precalculation", job->path);
+    return;
+  }
+
+  precalc_job_t *crams = NULL, *lastcram = NULL;
+  precalc_job_t *dirs  = NULL, *lastdir  = NULL;
+  struct dirent* entry;
+
+  while ((entry = readdir(dp))) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+
+    const char* path = path_concat(job->path, entry->d_name);
+    if (path == NULL) {
+      break;
+    }
+
+    struct stat st;
+    precalc_job_t* found = NULL;
+
+    if (lstat(path, &st) == 0) {
+      if (S_ISDIR(st.st_mode)) {
+        if (job->walk && st.st_dev == p->dev) {
+          found = job_new(path, PRECALC_SCAN, 1, -1, PRECALC_LOW);
+          if (found) {
+            *(lastdir ? &lastdir->next : &dirs) = found;
+            lastdir = found;
+          }
+        }
+
+      } else if (has_extension(entry->d_name, ".cram")
+              && stat(path, &st) == 0 && S_ISREG(st.st_mode)
+              && precalc_stale(path, &st)) {
+        found = job_new(path, PRECALC_SIZE, 0, -1, job->priority);
+        if (found) {
+          *(lastcram ? &lastcram->next : &crams) = found;
+          lastcram = found;
+        }
+      }
+    }
+
+    free((void*)path);
+  }
+
+  (void)closedir(dp);
+
+  (void)pthread_mutex_lock(&p->lock);
+  precalc_push(p, crams, job->priority, job->priority == PRECALC_HIGH);
+  precalc_push(p, dirs, PRECALC_LOW, 0);
+  (void)pthread_mutex_unlock(&p->lock);
+}
+
+/**
+  @brief   Calculate a CRAM's converted size (and checkpoints)
+  @param   job  Sizing job
+
+  cramp_conv_size puts its results into the cache, against the mtime
+  the CRAM had when it started; if it changes in the meantime, it'll
+  just be stale again.
+*/
+static void precalc_size(precalc_job_t* job) {
+  cramp_ctx_t* ctx = CTX;
+  struct stat st;
+
+  /* It may have been done (or deleted) since it was queued */
+  if (stat(job->path, &st) == -1 || !precalc_stale(job->path, &st)) {
+    return;
+  }
+
+  if (is_cram(job->path) != 1) {
+    return;
+  }
+
+  if (cramp_conv_size(job->path, ctx->conf->bam_level) < 0) {
+    LOG("Couldn't precalculate the size of %s", job->path);
+  }
+}
+
+/**
+  @brief   Convert a whole CRAM through a stream, to fill the spill cache
+  @param   job  Filling job
+
+  The stream puts what it converts into the block and spill caches, so
+  this just reads it all, giving way to interactive reads as it goes.
+*/
+static void precalc_fill(precalc_job_t* job) {
+  cramp_conv_t* conv = cramp_conv_open(job->path, NULL, job->level, view_full, NULL);
+  char* buf = malloc(PRECALC_FILL_BUFFER);
+
+  if (conv && buf) {
+    off_t offset = 0;
+    ssize_t len;
+
+    while (!cramp_precalc_yield()
+        && (len = cramp_conv_read(conv, buf, PRECALC_FILL_BUFFER, offset)) > 0) {
+      offset += len;
+    }
+
+    LOG("Filled %ld bytes of %s (level %d)", offset, job->path, job->level);
+  }
+
+  free((void*)buf);
+  if (conv) {
+    (void)cramp_conv_close(conv);
+  }
+}
+
+/**
+  @brief   Build the BAI index of a virtual BAM
+  @param   job  Indexing job
+
+  cramp_conv_bai doesn't convert again if it's been built since it was
+  queued, which also sizes the CRAM at the job's level.
+*/
+static void precalc_index(precalc_job_t* job) {
+  if (is_cram(job->path) != 1) {
+    return;
+  }
+
+  if (cramp_conv_bai(job->path, job->level, NULL) < 0) {
+    LOG("Couldn't build the BAI of %s (level %d)", job->path, job->level);
+  }
+}
+
+/**
+  @brief   Worker thread
+  @param   arg  Precalculation pool
+  @return  NULL
+*/
+static void* precalc_main(void* arg) {
+  cramp_precalc_t* p = (cramp_precalc_t*)arg;
+  self = p;
+
+  (void)pthread_mutex_lock(&p->lock);
+
+  while (!p->stop) {
+    precalc_job_t* job = precalc_pop(p);
+    if (job == NULL) {
+      (void)pthread_cond_wait(&p->work, &p->lock);
+      continue;
+    }
+
+    (void)pthread_mutex_unlock(&p->lock);
+
+    if (!precalc_throttle(p)) {
+      switch (job->kind) {
+        case PRECALC_SCAN:  precalc_scan(p, job); break;
+        case PRECALC_SIZE:  precalc_size(job);    break;
+        case PRECALC_FILL:  precalc_fill(job);    break;
+        case PRECALC_INDEX: precalc_index(job);   break;
+      }
+    }
+    job_free(job);
+
+    (void)pthread_mutex_lock(&p->lock);
+  }
+
+  (void)pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+/**
+  @brief   Start the background precalculation pool
+  @param   source   Source directory
+  @param   workers  Number of worker threads
+  @return  Pointer to pool (NULL on failure, or when there are no workers)
+
+  The pool starts by walking the whole source directory.
+*/
+cramp_precalc_t* cramp_precalc_init(const char* source, int workers) {
+  struct stat st;
+  if (workers <= 0 || stat(source, &st) == -1) {
+    return NULL;
+  }
+
+  cramp_precalc_t* p = calloc(1, sizeof(cramp_precalc_t));
+  if (p == NULL) {
+    return NULL;
+  }
+
+  p->dev     = st.st_dev;
+  p->threads = calloc(workers, sizeof(pthread_t));
+  p->queued  = kh_init(precalc_set);
+  precalc_job_t* walk = job_new(source, PRECALC_SCAN, 1, -1, PRECALC_LOW);
+
+  if (p->threads == NULL || p->queued == NULL || walk == NULL) {
+    job_free(walk);
+    if (p->queued) {
+      kh_destroy(precalc_set, p->queued);
+    }
+    free((void*)p->threads);
+    free((void*)p);
+    return NULL;
+  }
+
+  (void)pthread_mutex_init(&p->lock, NULL);
+  (void)pthread_cond_init(&p->work, NULL);
+  (void)pthread_cond_init(&p->idle, NULL);
+
+  /* Nothing has been read yet, so there's no need to wait */
+  (void)clock_gettime(CLOCK_MONOTONIC, &p->quiet);
+  p->quiet.tv_sec -= PRECALC_GRACE / 1000 + 1;
+
+  precalc_push(p, walk, PRECALC_LOW, 0);
+
+  for (p->n = 0; p->n < workers; ++p->n) {
+    if (pthread_create(&p->threads[p->n], NULL, precalc_main, p) != 0) {
+      break;
+    }
+  }
+
+  if (p->n == 0) {
+    cramp_precalc_destroy(p);
+    return NULL;
+  }
+
+  return p;
+}
+
+/**
+  @brief   Prioritise the CRAMs in a directory (e.g., when it's listed)
+  @param   p    Precalculation pool (NULL = No-op)
+  @param   dir  Source directory
+*/
+void cramp_precalc_hint(cramp_precalc_t* p, const char* dir) {
+  if (p == NULL) {
+    return;
+  }
+
+  precalc_job_t* job = job_new(dir, PRECALC_SCAN, 0, -1, PRECALC_HIGH);
+  if (job) {
+    (void)pthread_mutex_lock(&p->lock);
+    precalc_push(p, job, PRECALC_HIGH, 1);
+    (void)pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/**
+  @brief   Prioritise a CRAM (e.g., when it's been changed)
+  @param   p     Precalculation pool (NULL = No-op)
+  @param   path  Source CRAM file
+*/
+void cramp_precalc_file(cramp_precalc_t* p, const char* path) {
+  if (p == NULL) {
+    return;
+  }
+
+  precalc_job_t* job = job_new(path, PRECALC_SIZE, 0, -1, PRECALC_HIGH);
+  if (job) {
+    (void)pthread_mutex_lock(&p->lock);
+    precalc_push(p, job, PRECALC_HIGH, 1);
+    (void)pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/**
+  @brief   Convert a whole CRAM, at a level, for the spill cache
+  @param   p      Precalculation pool (NULL = No-op)
+  @param   path   Source CRAM file
+  @param   level  BGZF compression level (-1 = Default)
+*/
+void cramp_precalc_fill(cramp_precalc_t* p, const char* path, int level) {
+  if (p == NULL) {
+    return;
+  }
+
+  precalc_job_t* job = job_new(path, PRECALC_FILL, 0, level, PRECALC_LOW);
+  if (job) {
+    (void)pthread_mutex_lock(&p->lock);
+    precalc_push(p, job, PRECALC_LOW, 0);
+    (void)pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/**
+  @brief   Build the BAI index of a virtual BAM, as soon as possible
+  @param   p      Precalculation pool (NULL = No-op)
+  @param   path   Source CRAM file
+  @param   level  BGZF compression level (-1 = Default)
+*/
+void cramp_precalc_bai(cramp_precalc_t* p, const char* path, int level) {
+  if (p == NULL) {
+    return;
+  }
+
+  precalc_job_t* job = job_new(path, PRECALC_INDEX, 0, level, PRECALC_HIGH);
+  if (job) {
+    (void)pthread_mutex_lock(&p->lock);
+    precalc_push(p, job, PRECALC_HIGH, 1);
+    (void)pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/**
+  @brief   Walk a directory tree again (e.g., when changes were missed)
+  @param   p    Precalculation pool (NULL = No-op)
+  @param   dir  Source directory
+*/
+void cramp_precalc_walk(cramp_precalc_t* p, const char* dir) {
+  if (p == NULL) {
+    return;
+  }
+
+  precalc_job_t* job = job_new(dir, PRECALC_SCAN, 1, -1, PRECALC_LOW);
+  if (job) {
+    (void)pthread_mutex_lock(&p->lock);
+    precalc_push(p, job, PRECALC_LOW, 0);
+    (void)pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/**
+  @brief   Note the start of an interactive read
+  @param   p  Precalculation pool (NULL = No-op)
+*/
+void cramp_precalc_enter(cramp_precalc_t* p) {
+  if (p) {
+    (void)pthread_mutex_lock(&p->lock);
+    ++p->reads;
+    (void)pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/**
+  @brief   Note the end of an interactive read
+  @param   p  Precalculation pool (NULL = No-op)
+*/
+void cramp_precalc_leave(cramp_precalc_t* p) {
+  if (p) {
+    (void)pthread_mutex_lock(&p->lock);
+    --p->reads;
+    (void)clock_gettime(CLOCK_MONOTONIC, &p->quiet);
+    (void)pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/**
+  @brief   Give way to interactive reads, if called from a worker
+  @return  Give up (0 = Carry on; 1 = The pool is shutting down)
+
+  Long running work (i.e., size calculations) should call this often.
+  It returns straight away in any thread that isn't a worker.
+*/
+int cramp_precalc_yield(void) {
+  return self ? precalc_throttle(self) : 0;
+}
+
+/**
+  @brief   Stop the workers and free the pool
+  @param   p  Precalculation pool (NULL = No-op)
+
+  Work in progress is abandoned at the next yield.
+*/
+void cramp_precalc_destroy(cramp_precalc_t* p) {
+  if (p == NULL) {
+    return;
+  }
+
+  (void)pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  (void)pthread_cond_broadcast(&p->work);
+  (void)pthread_cond_broadcast(&p->idle);
+  (void)pthread_mutex_unlock(&p->lock);
+
+  for (int i = 0; i < p->n; ++i) {
+    (void)pthread_join(p->threads[i], NULL);
+  }
+
+  for (int priority = PRECALC_LOW; priority <= PRECALC_HIGH; ++priority) {
+    job_free(p->queue[priority].head);
+  }
+
+  const char* path;
+  kh_foreach_key(p->queued, path, free((void*)path));
+  kh_destroy(precalc_set, p->queued);
+
+  (void)pthread_mutex_destroy(&p->lock);
+  (void)pthread_cond_destroy(&p->work);
+  (void)pthread_cond_destroy(&p->idle);
+  free((void*)p->threads);
+  free((void*)p);
+}
@@ -0,0 +1,21 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#ifndef _CRAMP_PRECALC_H
+#define _CRAMP_PRECALC_H
+
+/* Opaque background precalculation pool */
+typedef struct cramp_precalc cramp_precalc_t;
+
+extern cramp_precalc_t* cramp_precalc_init(const char*, int);
+extern void             cramp_precalc_hint(cramp_precalc_t*, const char*);
+extern void             cramp_precalc_file(cramp_precalc_t*, const char*);
+extern void             cramp_precalc_walk(cramp_precalc_t*, const char*);
+extern void             cramp_precalc_fill(cramp_precalc_t*, const char*, int);
+extern void             cramp_precalc_bai(cramp_precalc_t*, const char*, int);
+extern void             cramp_precalc_enter(cramp_precalc_t*);
+extern void             cramp_precalc_leave(cramp_precalc_t*);
+extern int              cramp_precalc_yield(void);
+extern void             cramp_precalc_destroy(cramp_precalc_t*);
+
+#endif
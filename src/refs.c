@@ -0,0 +1,394 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "log.h"
+#include "refs.h"
+#include "util.h"
+
+#include <htslib/cram.h>
+#include <htslib/hts.h>
+#include <htslib/khash.h>
+#include <htslib/sam.h>
+
+/*
+  NOTES
+
+  Every CRAM file pointer resolves and loads its own reference sequences
+  (per REF_CACHE, REF_PATH, or the UR tag), so many concurrent readers of
+  CRAMs against the same assembly each hold their own copy of it, having
+  each repeated the same MD5 lookups.
+
+  Instead, CRAMs whose headers declare the same reference sequences (the
+  same SN, LN and M5 -- or, failing that, UR -- of each @SQ line, in the
+  same order) share one HTSLib reference store (CRAM_OPT_SHARED_REF), so
+  each sequence is looked up and loaded (or, from a local REF_CACHE,
+  mmapped) once, for all of them.
+
+  The store for each distinct set of references is kept alive by an
+  anchor file pointer, on the first CRAM to use it. HTSLib counts the
+  file pointers sharing a store, so it's only freed when its anchor and
+  everyone else using it has been closed.
+
+  However, HTSLib doesn't lock that count, so file pointers sharing a
+  store, closed concurrently, could free it from under each other (or
+  twice). So it's only ever changed under the store's lock: that is, a
+  file pointer is only given a store (cramp_refs_share), and any file
+  pointer that might have been given one is only closed (including the
+  anchors), through this module (cramp_refs_close).
+
+  Sets are costed at their total length, which is what they'd take if
+  every sequence were loaded, against a fixed budget (--ref-memory). The
+  least recently used sets' anchors are closed to make room; a set that
+  doesn't fit at all isn't shared, so its readers load their own, as
+  before.
+*/
+
+/**
+  @brief   Shared set of references
+  @var     key     Reference sequences, per the CRAM header
+  @var     size    Total length of the references (bytes)
+  @var     anchor  File pointer that owns the shared store
+  @var     refs    Shared store
+  @var     prev    More recently used set (NULL = Most recent)
+  @var     next    Less recently used set (NULL = Least recent)
+*/
+typedef struct refs_set {
+  const char*      key;
+  size_t           size;
+  htsFile*         anchor;
+  refs_t*          refs;
+  struct refs_set* prev;
+  struct refs_set* next;
+} refs_set_t;
+
+/* Initialise set map type (reference sequences => set) */
+KHASH_MAP_INIT_STR(set_map, refs_set_t*)
+
+/**
+  @brief   Shared reference store
+  @var     budget  Memory budget (bytes)
+  @var     used    Total length of the shared sets (bytes)
+  @var     sets    Shared sets, by reference sequences
+  @var     head    Most recently used set
+  @var     tail    Least recently used set
+  @var     lock    Mutex
+*/
+struct cramp_refs {
+  size_t            budget;
+  size_t            used;
+  khash_t(set_map)* sets;
+  refs_set_t*       head;
+  refs_set_t*       tail;
+  pthread_mutex_t   lock;
+};
+
+/**
+  @brief   Take a set out of the LRU list
+  @param   r    Store (locked)
+  @param   set  Set
+*/
+static void refs_unlink(cramp_refs_t* r, refs_set_t* set) {
+  *(set->prev ? &set->prev->next : &r->head) = set->next;
+  *(set->next ? &set->next->prev : &r->tail) = set->prev;
+  set->prev = set->next = NULL;
+}
+
+/**
+  @brief   Put a set at the front of the LRU list
+  @param   r    Store (locked)
+  @param   set  Set (unlinked)
+*/
+static void refs_touch(cramp_refs_t* r, refs_set_t* set) {
+  set->next = r->head;
+  *(r->head ? &r->head->prev : &r->tail) = set;
+  r->head = set;
+}
+
+/**
+  @brief   Stop sharing a set
+  @param   r    Store (locked)
+  @param   set  Set
+
+  Anyone still using the set's references keeps them until they close.
+*/
+static void refs_drop(cramp_refs_t* r, refs_set_t* set) {
+  khiter_t key = kh_get(set_map, r->sets, set->key);
+  if (key != kh_end(r->sets)) {
+    kh_del(set_map, r->sets, key);
+  }
+
+  refs_unlink(r, set);
+  r->used -= set->size;
+
+  (void)hts_close(set->anchor);
+  free((void*)set->key);
+  free((void*)set);
+}
+
+/**
+  @brief   Append a tag's value from a header line to a key
+  @param   line  Header line
+  @param   end   End of the header line
+  @param   tag   Tag (e.g., "SN:")
+  @param   key   Key buffer
+  @param   len   Key length
+  @param   cap   Key buffer capacity
+  @return  Exit status (0 = OK; -1 = Memory allocation failure)
+
+  The value is followed by a tab; missing tags are left empty.
+*/
+static int refs_key_tag(const char* line, const char* end, const char* tag, char** key, size_t* len, size_t* cap) {
+  const char* value = NULL;
+  size_t      vlen  = 0;
+
+  for (const char* f = line; f && f < end; ) {
+    if (strncmp(f, tag, 3) == 0) {
+      value = f + 3;
+      const char* tab = memchr(value, '\t', end - value);
+      vlen = (tab ? tab : end) - value;
+      break;
+    }
+
+    f = memchr(f, '\t', end - f);
+    if (f) {
+      ++f;
+    }
+  }
+
+  if (*len + vlen + 2 > *cap) {
+    size_t want = (*cap ? *cap : 256);
+    while (*len + vlen + 2 > want) {
+      want *= 2;
+    }
+
+    char* grown = realloc(*key, want);
+    if (grown == NULL) {
+      return -1;
+    }
+    *key = grown;
+    *cap = want;
+  }
+
+  if (vlen) {
+    memcpy(*key + *len, value, vlen);
+  }
+  *len += vlen;
+  (*key)[(*len)++] = '\t';
+  (*key)[*len] = '\0';
+  return 0;
+}
+
+/**
+  @brief   Describe the reference sequences a CRAM header declares
+  @param   header  CRAM header
+  @param   size    Total length of the references (bytes)
+  @return  Key (NULL if there are none, or on failure)
+
+  Each @SQ line contributes its SN, LN and M5; or SN, LN and UR, without
+  an M5. The key must be freed by the caller.
+*/
+static const char* refs_key(const bam_hdr_t* header, size_t* size) {
+  char*  key = NULL;
+  size_t len = 0;
+  size_t cap = 0;
+
+  *size = 0;
+  for (int32_t i = 0; i < header->n_targets; ++i) {
+    *size += header->target_len[i];
+  }
+
+  const char* text = header->text;
+  const char* done = text + header->l_text;
+
+  while (text && text < done) {
+    const char* end = memchr(text, '\n', done - text);
+    if (end == NULL) {
+      end = done;
+    }
+
+    if (end - text > 4 && strncmp(text, "@SQ\t", 4) == 0) {
+      const char* line = text + 4;
+      int has_md5 = 0;
+
+      for (const char* f = line; f && f < end; ) {
+        if (strncmp(f, "M5:", 3) == 0) {
+          has_md5 = 1;
+          break;
+        }
+
+        f = memchr(f, '\t', end - f);
+        if (f) {
+          ++f;
+        }
+      }
+
+      if (refs_key_tag(line, end, "SN:", &key, &len, &cap) == -1
+       || refs_key_tag(line, end, "LN:", &key, &len, &cap) == -1
+       || refs_key_tag(line, end, has_md5 ? "M5:" : "UR:", &key, &len, &cap) == -1) {
+        free((void*)key);
+        return NULL;
+      }
+      key[len - 1] = '\n';
+    }
+
+    text = end + 1;
+  }
+
+  return key;
+}
+
+/**
+  @brief   Create a shared reference store
+  @param   budget  Memory budget (bytes)
+  @return  Pointer to store (NULL on failure)
+*/
+cramp_refs_t* cramp_refs_init(size_t budget) {
+  cramp_refs_t* r = calloc(1, sizeof(cramp_refs_t));
+  if (r == NULL) {
+    return NULL;
+  }
+
+  r->budget = budget;
+  r->sets   = kh_init(set_map);
+  if (r->sets == NULL) {
+    free((void*)r);
+    return NULL;
+  }
+
+  (void)pthread_mutex_init(&r->lock, NULL);
+  return r;
+}
+
+/**
+  @brief   Have a CRAM file pointer use the shared references
+  @param   r       Store (NULL = No-op)
+  @param   path    Path to CRAM file
+  @param   fp      CRAM file pointer, before anything's been decoded
+  @param   header  CRAM header
+
+  If the CRAM's references can't be shared, the file pointer is left to
+  load its own.
+*/
+void cramp_refs_share(cramp_refs_t* r, const char* path, htsFile* fp, const bam_hdr_t* header) {
+  if (r == NULL || fp == NULL || header == NULL) {
+    return;
+  }
+
+  const htsFormat* format = hts_get_format(fp);
+  if (format == NULL || format->format != cram) {
+    return;
+  }
+
+  size_t size;
+  const char* setkey = refs_key(header, &size);
+  if (setkey == NULL) {
+    return;
+  }
+
+  (void)pthread_mutex_lock(&r->lock);
+
+  refs_set_t* set = NULL;
+  khiter_t key = kh_get(set_map, r->sets, setkey);
+  if (key != kh_end(r->sets)) {
+    set = kh_value(r->sets, key);
+    refs_unlink(r, set);
+    refs_touch(r, set);
+    goto share;
+  }
+
+  if (size > r->budget) {
+    goto finish_up;
+  }
+
+  set = calloc(1, sizeof(refs_set_t));
+  if (set == NULL) {
+    goto finish_up;
+  }
+
+  /* The anchor's only ever used for its references */
+  set->anchor = hts_open(path, "r");
+  set->refs   = set->anchor ? cram_get_refs(set->anchor) : NULL;
+  if (set->refs == NULL) {
+    if (set->anchor) {
+      (void)hts_close(set->anchor);
+    }
+    free((void*)set);
+    set = NULL;
+    goto finish_up;
+  }
+
+  int ret;
+  key = kh_put(set_map, r->sets, setkey, &ret);
+  if (ret == -1) {
+    (void)hts_close(set->anchor);
+    free((void*)set);
+    set = NULL;
+    goto finish_up;
+  }
+
+  while (r->tail && r->used + size > r->budget) {
+    refs_drop(r, r->tail);
+  }
+
+  set->key  = setkey;
+  set->size = size;
+  kh_value(r->sets, key) = set;
+  refs_touch(r, set);
+  r->used += size;
+  setkey = NULL;
+
+  LOG("Sharing %s of references, first used by %s", human_size(size), path);
+
+share:
+  /* HTSLib counts the file pointers using the store */
+  (void)hts_set_opt(fp, CRAM_OPT_SHARED_REF, set->refs);
+
+finish_up:
+  (void)pthread_mutex_unlock(&r->lock);
+  free((void*)setkey);
+}
+
+/**
+  @brief   Close a CRAM file pointer that might use the shared references
+  @param   r   Store (NULL = Just close it)
+  @param   fp  CRAM file pointer
+  @return  Exit status, per hts_close
+
+  n.b., The references' count is decremented under the store's lock
+*/
+int cramp_refs_close(cramp_refs_t* r, htsFile* fp) {
+  if (r == NULL) {
+    return hts_close(fp);
+  }
+
+  (void)pthread_mutex_lock(&r->lock);
+  int res = hts_close(fp);
+  (void)pthread_mutex_unlock(&r->lock);
+
+  return res;
+}
+
+/**
+  @brief   Free all memory allocated by the store
+  @param   r  Store (NULL = No-op)
+*/
+void cramp_refs_destroy(cramp_refs_t* r) {
+  if (r == NULL) {
+    return;
+  }
+
+  while (r->tail) {
+    refs_drop(r, r->tail);
+  }
+  kh_destroy(set_map, r->sets);
+
+  (void)pthread_mutex_destroy(&r->lock);
+  free((void*)r);
+}
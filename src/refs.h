@@ -0,0 +1,25 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#ifndef _CRAMP_REFS_H
+#define _CRAMP_REFS_H
+
+/* Needed for size_t */
+#include <sys/types.h>
+
+/* Needed for htsFile and bam_hdr_t */
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+
+/* Default memory budget for shared references */
+#define CRAMP_REFS_DEFAULT ((size_t)4 << 30)
+
+/* Opaque shared reference store */
+typedef struct cramp_refs cramp_refs_t;
+
+extern cramp_refs_t* cramp_refs_init(size_t);
+extern void          cramp_refs_share(cramp_refs_t*, const char*, htsFile*, const bam_hdr_t*);
+extern int           cramp_refs_close(cramp_refs_t*, htsFile*);
+extern void          cramp_refs_destroy(cramp_refs_t*);
+
+#endif
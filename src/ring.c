@@ -0,0 +1,402 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "ring.h"
+
+#include <htslib/hfile.h>
+
+/*
+  NOTES
+
+  Converted BGZF data is written straight into a ring buffer, through a
+  custom HTSLib hFILE backend, from which reads can then be copied. The
+  ring retains the most recently written data, up to its capacity, so
+  it doubles as a lookback window; older data is overwritten. A ring
+  with no capacity retains nothing, but still counts what goes through
+  it, which is all that's needed to calculate the size of a conversion.
+  Conversely, a ring can be made to grow rather than overwrite, in which
+  case it's just an in-memory output buffer (and never wraps).
+
+  When the BGZF output is multithreaded, blocks are written into the
+  ring by HTSLib's writer thread, so the ring is locked. The hFILE also
+  parses the BGZF block headers as they go past, so the offset of each
+  block can be reported back (its ordinal is all the converting thread
+  can know in advance).
+
+  HTSLib doesn't install hfile_internal.h, which defines the interface
+  for hFILE backends, so the backend structure and the constructor are
+  declared below. This is the interface that HTSLib's own plugins (e.g.,
+  libcurl, S3) are built against, so it's much more stable than the
+  layout of any particular backend's private structure.
+*/
+
+/**
+  @brief   hFILE backend operations (per HTSLib's hfile_internal.h)
+*/
+struct hFILE_backend {
+  ssize_t (*read)(hFILE*, void*, size_t);
+  ssize_t (*write)(hFILE*, const void*, size_t);
+  off_t   (*seek)(hFILE*, off_t, int);
+  int     (*flush)(hFILE*);
+  int     (*close)(hFILE*);
+};
+
+extern hFILE* hfile_init(size_t, const char*, size_t);
+
+/* hFILE buffer capacity: As small as possible, so BGZF blocks bypass the
+   buffer and are written straight into the ring                      */
+#define RING_HFILE_CAPACITY 1
+
+/* BGZF block header length and the offset of its BSIZE field */
+#define BGZF_HEADER_LEN 18
+#define BGZF_BSIZE_AT   16
+
+/**
+  @brief   hFILE that writes into a ring buffer
+  @var     base      hFILE base structure (must come first)
+  @var     ring      Ring buffer
+  @var     on_block  Block callback (NULL = None)
+  @var     arg       Block callback argument
+  @var     pos       Stream offset of the next byte to be written
+  @var     next      Stream offset of the next block header
+  @var     blocks    Number of blocks seen
+  @var     hdr       Partial block header
+  @var     hdrlen    Length of partial block header
+*/
+struct hFILE_ring {
+  hFILE               base;
+  cramp_ring_t*       ring;
+  cramp_ring_block_fn on_block;
+  void*               arg;
+  off_t               pos;
+  off_t               next;
+  size_t              blocks;
+  unsigned char       hdr[BGZF_HEADER_LEN];
+  size_t              hdrlen;
+};
+
+/**
+  @brief   Initialise a ring buffer
+  @param   cap  Capacity (bytes; 0 = Count only)
+  @return  Pointer to ring buffer (NULL on failure)
+*/
+cramp_ring_t* cramp_ring_init(size_t cap) {
+  cramp_ring_t* ring = calloc(1, sizeof(cramp_ring_t));
+  if (ring == NULL) {
+    return NULL;
+  }
+
+  if (cap) {
+    ring->data = malloc(cap);
+    if (ring->data == NULL) {
+      free((void*)ring);
+      return NULL;
+    }
+  }
+
+  ring->cap = cap;
+  (void)pthread_mutex_init(&ring->lock, NULL);
+
+  return ring;
+}
+
+/**
+  @brief   Initialise a ring buffer that grows, rather than overwriting
+  @param   cap  Initial capacity (bytes; must be nonzero)
+  @return  Pointer to ring buffer (NULL on failure)
+
+  Everything written is retained, contiguously, from ring->data.
+*/
+cramp_ring_t* cramp_ring_buffer(size_t cap) {
+  cramp_ring_t* ring = cramp_ring_init(cap);
+  if (ring) {
+    ring->grow = 1;
+  }
+
+  return ring;
+}
+
+/**
+  @brief   Empty a ring buffer
+  @param   ring   Ring buffer
+  @param   start  Stream offset of the next byte to be written
+*/
+void cramp_ring_reset(cramp_ring_t* ring, off_t start) {
+  (void)pthread_mutex_lock(&ring->lock);
+  ring->head  = 0;
+  ring->len   = 0;
+  ring->start = start;
+  (void)pthread_mutex_unlock(&ring->lock);
+}
+
+/**
+  @brief   Stream offset of the oldest retained byte
+  @param   ring  Ring buffer
+  @return  Offset
+*/
+off_t cramp_ring_start(cramp_ring_t* ring) {
+  (void)pthread_mutex_lock(&ring->lock);
+  off_t start = ring->start;
+  (void)pthread_mutex_unlock(&ring->lock);
+
+  return start;
+}
+
+/**
+  @brief   Stream offset just past the newest retained byte
+  @param   ring  Ring buffer
+  @return  Offset
+
+  n.b., For a ring with no capacity, this is the total written.
+*/
+off_t cramp_ring_end(cramp_ring_t* ring) {
+  (void)pthread_mutex_lock(&ring->lock);
+  off_t end = ring->start + (off_t)ring->len;
+  (void)pthread_mutex_unlock(&ring->lock);
+
+  return end;
+}
+
+/**
+  @brief   Append data to a ring buffer
+  @param   ring  Ring buffer
+  @param   data  Data
+  @param   size  Size of data (bytes)
+  @return  1 = Success; 0 = Fail
+
+  The oldest data is overwritten to make room. If the data is bigger
+  than the ring, the ring is grown to fit it (rather than dropping any of
+  what's being written).
+*/
+int cramp_ring_write(cramp_ring_t* ring, const void* data, size_t size) {
+  (void)pthread_mutex_lock(&ring->lock);
+
+  if (ring->cap == 0) {
+    ring->start += size;
+    (void)pthread_mutex_unlock(&ring->lock);
+    return 1;
+  }
+
+  if (ring->grow && ring->len + size > ring->cap) {
+    /* Grow in place: Nothing has been dropped, so nothing has wrapped */
+    size_t cap = ring->cap * 2;
+    if (cap < ring->len + size) {
+      cap = ring->len + size;
+    }
+
+    char* grown = realloc(ring->data, cap);
+    if (grown == NULL) {
+      (void)pthread_mutex_unlock(&ring->lock);
+      return 0;
+    }
+
+    ring->data = grown;
+    ring->cap  = cap;
+  }
+
+  if (size > ring->cap) {
+    /* Grow and unwrap: Nothing old survives the write, anyway */
+    char* grown = realloc(ring->data, size);
+    if (grown == NULL) {
+      (void)pthread_mutex_unlock(&ring->lock);
+      return 0;
+    }
+
+    ring->data = grown;
+    ring->cap  = size;
+    ring->start += ring->len;
+    ring->head = 0;
+    ring->len  = 0;
+  }
+
+  /* Drop the oldest data, if necessary */
+  if (ring->len + size > ring->cap) {
+    size_t drop = ring->len + size - ring->cap;
+    ring->head   = (ring->head + drop) % ring->cap;
+    ring->len   -= drop;
+    ring->start += drop;
+  }
+
+  /* Copy, wrapping around the end of the buffer */
+  size_t tail  = (ring->head + ring->len) % ring->cap;
+  size_t first = ring->cap - tail;
+  if (first > size) {
+    first = size;
+  }
+
+  memcpy(ring->data + tail, data, first);
+  memcpy(ring->data, (const char*)data + first, size - first);
+  ring->len += size;
+
+  (void)pthread_mutex_unlock(&ring->lock);
+  return 1;
+}
+
+/**
+  @brief   Copy data out of a ring buffer
+  @param   ring    Ring buffer
+  @param   buf     Output buffer
+  @param   offset  Stream offset to copy from
+  @param   size    Maximum number of bytes to copy
+  @return  Number of bytes copied
+
+  Nothing is copied unless the offset is retained by the ring.
+*/
+size_t cramp_ring_copy(cramp_ring_t* ring, char* buf, off_t offset, size_t size) {
+  (void)pthread_mutex_lock(&ring->lock);
+
+  off_t end = ring->start + (off_t)ring->len;
+  if (offset < ring->start || offset >= end) {
+    (void)pthread_mutex_unlock(&ring->lock);
+    return 0;
+  }
+
+  size_t avail = end - offset;
+  if (size > avail) {
+    size = avail;
+  }
+
+  size_t from  = (ring->head + (offset - ring->start)) % ring->cap;
+  size_t first = ring->cap - from;
+  if (first > size) {
+    first = size;
+  }
+
+  memcpy(buf, ring->data + from, first);
+  memcpy(buf + first, ring->data, size - first);
+
+  (void)pthread_mutex_unlock(&ring->lock);
+  return size;
+}
+
+/**
+  @brief   Free all memory allocated by a ring buffer
+  @param   ring  Ring buffer (may be NULL)
+*/
+void cramp_ring_destroy(cramp_ring_t* ring) {
+  if (ring) {
+    (void)pthread_mutex_destroy(&ring->lock);
+    free((void*)ring->data);
+    free((void*)ring);
+  }
+}
+
+/* hFILE backend operations */
+
+static ssize_t ring_read(hFILE* fpv, void* buffer, size_t nbytes) {
+  (void)fpv; (void)buffer; (void)nbytes;
+  errno = EBADF;
+  return -1;
+}
+
+/**
+  @brief   Find the BGZF block headers in data being written
+  @param   fp      Ring hFILE
+  @param   buffer  Data
+  @param   nbytes  Size of data (bytes)
+
+  Headers may straddle writes, so they are accumulated as necessary.
+*/
+static void ring_parse(struct hFILE_ring* fp, const unsigned char* buffer, size_t nbytes) {
+  size_t i = 0;
+
+  while (i < nbytes) {
+    if (fp->hdrlen == 0 && fp->pos + (off_t)i < fp->next) {
+      /* Skip over the rest of the current block */
+      size_t skip = fp->next - (fp->pos + i);
+      i += (skip < nbytes - i) ? skip : nbytes - i;
+      continue;
+    }
+
+    size_t take = BGZF_HEADER_LEN - fp->hdrlen;
+    if (take > nbytes - i) {
+      take = nbytes - i;
+    }
+
+    memcpy(fp->hdr + fp->hdrlen, buffer + i, take);
+    fp->hdrlen += take;
+    i += take;
+
+    if (fp->hdrlen == BGZF_HEADER_LEN) {
+      /* BSIZE is the total block size, minus one */
+      size_t bsize = fp->hdr[BGZF_BSIZE_AT] | (fp->hdr[BGZF_BSIZE_AT + 1] << 8);
+
+      fp->on_block(fp->arg, fp->blocks++, fp->next);
+      fp->next  += bsize + 1;
+      fp->hdrlen = 0;
+    }
+  }
+
+  fp->pos += nbytes;
+}
+
+static ssize_t ring_write(hFILE* fpv, const void* buffer, size_t nbytes) {
+  struct hFILE_ring* fp = (struct hFILE_ring*)fpv;
+
+  if (!cramp_ring_write(fp->ring, buffer, nbytes)) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  if (fp->on_block) {
+    ring_parse(fp, (const unsigned char*)buffer, nbytes);
+  }
+
+  return nbytes;
+}
+
+static off_t ring_seek(hFILE* fpv, off_t offset, int whence) {
+  (void)fpv; (void)offset; (void)whence;
+  errno = ESPIPE;
+  return -1;
+}
+
+static int ring_flush(hFILE* fpv) {
+  (void)fpv;
+  return 0;
+}
+
+static int ring_close(hFILE* fpv) {
+  /* The ring belongs to whoever opened the hFILE */
+  (void)fpv;
+  return 0;
+}
+
+static const struct hFILE_backend ring_backend = {
+  ring_read, ring_write, ring_seek, ring_flush, ring_close
+};
+
+/**
+  @brief   Open an hFILE that writes into a ring buffer
+  @param   ring      Ring buffer
+  @param   on_block  Callback for each BGZF block written (NULL = None)
+  @param   arg       Callback argument
+  @return  Pointer to hFILE (NULL on failure)
+
+  The first block is expected at the ring's current end. Closing the
+  hFILE doesn't destroy the ring.
+*/
+hFILE* cramp_ring_hopen(cramp_ring_t* ring, cramp_ring_block_fn on_block, void* arg) {
+  struct hFILE_ring* fp = (struct hFILE_ring*)hfile_init(sizeof(struct hFILE_ring), "w", RING_HFILE_CAPACITY);
+  if (fp == NULL) {
+    return NULL;
+  }
+
+  fp->ring     = ring;
+  fp->on_block = on_block;
+  fp->arg      = arg;
+  fp->pos      = fp->next = cramp_ring_end(ring);
+  fp->blocks   = 0;
+  fp->hdrlen   = 0;
+  fp->base.backend = &ring_backend;
+
+  return &fp->base;
+}
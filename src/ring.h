@@ -0,0 +1,50 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#ifndef _CRAMP_RING_H
+#define _CRAMP_RING_H
+
+/* Needed for pthread_mutex_t */
+#include <pthread.h>
+
+/* Needed for off_t and size_t */
+#include <sys/types.h>
+
+/* Needed for hFILE */
+#include <htslib/hfile.h>
+
+/**
+  @brief   Ring buffer over a stream of data
+  @var     data   Buffer
+  @var     cap    Capacity of buffer (bytes; 0 = Count only)
+  @var     head   Index of the oldest retained byte in the buffer
+  @var     len    Number of retained bytes
+  @var     start  Stream offset of the oldest retained byte
+  @var     grow   Grow rather than overwrite (0 = False; 1 = True)
+  @var     lock   Mutex (writes may come from HTSLib's BGZF writer thread)
+*/
+typedef struct cramp_ring {
+  char*           data;
+  size_t          cap;
+  size_t          head;
+  size_t          len;
+  off_t           start;
+  int             grow;
+  pthread_mutex_t lock;
+} cramp_ring_t;
+
+/* Callback for each BGZF block written: argument, ordinal and offset */
+typedef void (*cramp_ring_block_fn)(void*, size_t, off_t);
+
+extern cramp_ring_t* cramp_ring_init(size_t);
+extern cramp_ring_t* cramp_ring_buffer(size_t);
+extern void          cramp_ring_reset(cramp_ring_t*, off_t);
+extern int           cramp_ring_write(cramp_ring_t*, const void*, size_t);
+extern size_t        cramp_ring_copy(cramp_ring_t*, char*, off_t, size_t);
+extern off_t         cramp_ring_start(cramp_ring_t*);
+extern off_t         cramp_ring_end(cramp_ring_t*);
+extern void          cramp_ring_destroy(cramp_ring_t*);
+
+extern hFILE*        cramp_ring_hopen(cramp_ring_t*, cramp_ring_block_fn, void*);
+
+#endif
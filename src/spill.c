@@ -0,0 +1,692 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "13amp.h"
+#include "blocks.h"
+#include "cache.h"
+#include "log.h"
+#include "precalc.h"
+#include "spill.h"
+#include "util.h"
+
+#include <htslib/khash.h>
+
+/*
+  NOTES
+
+  The block cache (see blocks.c) goes when the filesystem is unmounted,
+  so a remount converts everything from scratch. The spill cache keeps
+  converted data on local disk instead, in a directory beside the stat
+  cache file, within its own budget (--spill).
+
+  Data is kept in the same pages as the block cache, written at their
+  offsets into one sparse segment file per virtual BAM (i.e., per stat
+  cache key and CRAM mtime), with a bitmap of which pages are there.
+  Whole files are evicted, least recently used first, to make room.
+
+  Admission is by frequency: every open of a virtual BAM is counted, and
+  its converted pages are only admitted from its SPILL_ADMIT'th open.
+  At its SPILL_PROMOTE'th open, the rest of it is converted in the
+  background (see cramp_precalc_fill). Once every page, up to the
+  (short) last one, is there, the segment file *is* the virtual BAM, so
+  it's opened and read with pread like any other file.
+
+  The index of segment files, with their open counts, is written at
+  unmount (bitmaps alongside, as <id>.pages) and read back at mount.
+  Segment files that aren't in the index (e.g., after a crash) are
+  deleted. The index and bitmaps are kept under one lock, but the disk
+  I/O is done without it: pages are only ever added to a file until it's
+  deleted as a whole, so a read takes the run of pages that are there
+  and reads them afterwards (an open that loses the race with deletion
+  just fails, and the data's converted instead). A page that's written
+  has its space reserved first, and is only marked as there once it's
+  written, if its file's still the same one; otherwise, the segment it
+  recreated is deleted.
+*/
+
+/* Opens before a virtual BAM's pages are admitted */
+#define SPILL_ADMIT 2
+
+/* Opens before a virtual BAM is converted in full */
+#define SPILL_PROMOTE 4
+
+/* Index file name */
+#define SPILL_INDEX "index"
+
+/**
+  @brief   Spilled virtual BAM
+  @var     key      Stat cache key
+  @var     level    BGZF compression level (-1 = Default)
+  @var     mtime    CRAM mtime the data is for
+  @var     id       Segment file ID
+  @var     hits     Number of opens
+  @var     atime    Logical time of last access
+  @var     map      Bitmap of pages that are there
+  @var     mapsize  Size of bitmap (bytes)
+  @var     present  Number of pages that are there
+  @var     last     Page number of the last page (-1 = Not yet known)
+  @var     filling  Conversion in full has been queued (0 = False; 1 = True)
+*/
+typedef struct spill_file {
+  const char*    key;
+  int            level;
+  time_t         mtime;
+  unsigned long  id;
+  unsigned long  hits;
+  unsigned long  atime;
+  uint8_t*       map;
+  size_t         mapsize;
+  size_t         present;
+  ssize_t        last;
+  int            filling;
+} spill_file_t;
+
+/* Initialise spilled file map type (stat cache key => file) */
+KHASH_MAP_INIT_STR(spill_map, spill_file_t*)
+
+/* Initialise segment ID set type */
+KHASH_SET_INIT_INT64(spill_ids)
+
+/**
+  @brief   On-disk converted data cache
+  @var     dir     Spill directory
+  @var     budget  Disk budget (bytes)
+  @var     used    Disk used by pages (bytes)
+  @var     nextid  Next segment file ID
+  @var     clock   Logical clock, for LRU
+  @var     files   Spilled files, by stat cache key
+  @var     lock    Mutex
+*/
+struct cramp_spill {
+  const char*         dir;
+  size_t              budget;
+  size_t              used;
+  unsigned long       nextid;
+  unsigned long       clock;
+  khash_t(spill_map)* files;
+  pthread_mutex_t     lock;
+};
+
+/**
+  @brief   Path of a spilled file's segment (or bitmap)
+  @param   s    Spill cache
+  @param   id   Segment file ID
+  @param   ext  Extension (e.g., ".bam")
+  @return  malloc'd path (NULL on failure)
+*/
+static const char* spill_path(cramp_spill_t* s, unsigned long id, const char* ext) {
+  char name[32];
+  (void)snprintf(name, sizeof(name), "%lu%s", id, ext);
+  return path_concat(s->dir, name);
+}
+
+/**
+  @brief   Check whether a page is there
+  @param   f      Spilled file
+  @param   index  Page number
+  @return  There (0 = False; 1 = True)
+*/
+static int spill_has(const spill_file_t* f, size_t index) {
+  return index / 8 < f->mapsize && (f->map[index / 8] & (1 << (index % 8)));
+}
+
+/**
+  @brief   Check whether a spilled file is complete
+  @param   f  Spilled file
+  @return  Complete (0 = False; 1 = True)
+*/
+static int spill_complete(const spill_file_t* f) {
+  return f->last >= 0 && f->present == (size_t)f->last + 1;
+}
+
+/**
+  @brief   Delete a spilled file
+  @param   s  Spill cache (locked)
+  @param   f  Spilled file
+*/
+static void spill_drop(cramp_spill_t* s, spill_file_t* f) {
+  const char* bam   = spill_path(s, f->id, ".bam");
+  const char* pages = spill_path(s, f->id, ".pages");
+  if (bam) {
+    (void)unlink(bam);
+  }
+  if (pages) {
+    (void)unlink(pages);
+  }
+  free((void*)bam);
+  free((void*)pages);
+
+  khiter_t key = kh_get(spill_map, s->files, f->key);
+  if (key != kh_end(s->files)) {
+    kh_del(spill_map, s->files, key);
+  }
+
+  s->used -= f->present * CRAMP_BLOCKS_PAGE;
+
+  free((void*)f->key);
+  free((void*)f->map);
+  free((void*)f);
+}
+
+/**
+  @brief   Make room, by deleting the least recently used files
+  @param   s     Spill cache (locked)
+  @param   need  Space needed (bytes)
+  @param   keep  Spilled file not to delete
+  @return  Room made (0 = False; 1 = True)
+*/
+static int spill_evict(cramp_spill_t* s, size_t need, spill_file_t* keep) {
+  while (s->used + need > s->budget) {
+    spill_file_t* lru = NULL;
+    spill_file_t* f;
+
+    kh_foreach_value(s->files, f, {
+      if (f != keep && f->present && (lru == NULL || f->atime < lru->atime)) {
+        lru = f;
+      }
+    });
+
+    if (lru == NULL) {
+      return 0;
+    }
+
+    LOG("Evicting %s from the spill cache", lru->key);
+    spill_drop(s, lru);
+  }
+
+  return 1;
+}
+
+/**
+  @brief   Find (or create) a spilled file
+  @param   s       Spill cache (locked)
+  @param   source  Stat cache key
+  @param   mtime   CRAM mtime
+  @param   create  Create the file if it's not there (0 = False; 1 = True)
+  @return  Pointer to spilled file (NULL if not found, or on failure)
+
+  A file for any other mtime is out of date, so it's deleted.
+*/
+static spill_file_t* spill_file(cramp_spill_t* s, const char* source, time_t mtime, int create) {
+  spill_file_t* f = NULL;
+
+  khiter_t key = kh_get(spill_map, s->files, source);
+  if (key != kh_end(s->files)) {
+    f = kh_value(s->files, key);
+    if (f->mtime != mtime) {
+      spill_drop(s, f);
+      f = NULL;
+    }
+  }
+
+  if (f == NULL && create) {
+    size_t len = strlen(source);
+    f = calloc(1, sizeof(spill_file_t));
+    char* copy = malloc(len + 1);
+    int ret = -1;
+
+    if (f && copy) {
+      memcpy(copy, source, len + 1);
+      key = kh_put(spill_map, s->files, copy, &ret);
+    }
+
+    if (ret == -1) {
+      free((void*)copy);
+      free((void*)f);
+      return NULL;
+    }
+
+    f->key   = copy;
+    f->level = -1;
+    f->mtime = mtime;
+    f->id    = s->nextid++;
+    f->last  = -1;
+    kh_value(s->files, key) = f;
+  }
+
+  return f;
+}
+
+/**
+  @brief   Read the index (and bitmaps) of spilled files
+  @param   s  Spill cache
+
+  Anything in the directory that isn't in the index is deleted.
+*/
+static void spill_load(cramp_spill_t* s) {
+  const char* path = path_concat(s->dir, SPILL_INDEX);
+  FILE* index = path ? fopen(path, "r") : NULL;
+  free((void*)path);
+
+  khash_t(spill_ids)* ids = kh_init(spill_ids);
+  char* line = malloc(LINE_MAX + 1);
+
+  while (index && ids && line && fgets(line, LINE_MAX + 1, index)) {
+    spill_file_t rec = { .last = -1 };
+    int n = 0;
+
+    if (*line == '#' || sscanf(line, "%lu:%ld:%lu:%zd:%d:%n", &rec.id, &rec.mtime,
+                               &rec.hits, &rec.last, &rec.level, &n) < 5 || n == 0) {
+      continue;
+    }
+
+    line[strcspn(line, "\n")] = '\0';
+    spill_file_t* f = spill_file(s, line + n, rec.mtime, 1);
+    if (f == NULL) {
+      continue;
+    }
+
+    f->id    = rec.id;
+    f->hits  = rec.hits;
+    f->last  = rec.last;
+    f->level = rec.level;
+    if (rec.id >= s->nextid) {
+      s->nextid = rec.id + 1;
+    }
+
+    /* Pick up the bitmap of pages */
+    const char* pages = spill_path(s, f->id, ".pages");
+    FILE* map = pages ? fopen(pages, "r") : NULL;
+    struct stat st;
+
+    if (map && fstat(fileno(map), &st) == 0 && st.st_size > 0) {
+      f->map = malloc(st.st_size);
+      if (f->map && fread(f->map, 1, st.st_size, map) == (size_t)st.st_size) {
+        f->mapsize = st.st_size;
+        for (size_t i = 0; i < f->mapsize * 8; ++i) {
+          f->present += spill_has(f, i);
+        }
+      } else {
+        free((void*)f->map);
+        f->map = NULL;
+      }
+    }
+
+    if (map) {
+      (void)fclose(map);
+    }
+    free((void*)pages);
+
+    s->used += f->present * CRAMP_BLOCKS_PAGE;
+
+    int ret;
+    (void)kh_put(spill_ids, ids, f->id, &ret);
+  }
+
+  if (index) {
+    (void)fclose(index);
+  }
+  free((void*)line);
+
+  /* Tidy up anything we don't know about */
+  DIR* dp = ids ? opendir(s->dir) : NULL;
+  if (dp) {
+    struct dirent* entry;
+    while ((entry = readdir(dp))) {
+      unsigned long id;
+      char ext[8];
+
+      if (sscanf(entry->d_name, "%lu.%7s", &id, ext) == 2
+       && kh_get(spill_ids, ids, id) == kh_end(ids)) {
+        const char* orphan = path_concat(s->dir, entry->d_name);
+        if (orphan) {
+          (void)unlink(orphan);
+          free((void*)orphan);
+        }
+      }
+    }
+    (void)closedir(dp);
+  }
+
+  if (ids) {
+    kh_destroy(spill_ids, ids);
+  }
+
+  /* The budget may have shrunk since last time */
+  (void)spill_evict(s, 0, NULL);
+
+  LOG("Spill cache has %ld files, using %s", (long)kh_size(s->files), human_size(s->used));
+}
+
+/**
+  @brief   Create an on-disk converted data cache
+  @param   dir     Spill directory (created if necessary)
+  @param   budget  Disk budget (bytes)
+  @return  Pointer to cache (NULL on failure)
+*/
+cramp_spill_t* cramp_spill_init(const char* dir, size_t budget) {
+  if (mkdir(dir, S_IRWXU) == -1 && errno != EEXIST) {
+    return NULL;
+  }
+
+  cramp_spill_t* s = calloc(1, sizeof(cramp_spill_t));
+  if (s == NULL) {
+    return NULL;
+  }
+
+  size_t len = strlen(dir);
+  s->dir    = malloc(len + 1);
+  s->files  = kh_init(spill_map);
+  s->budget = budget;
+
+  if (s->dir == NULL || s->files == NULL) {
+    free((void*)s->dir);
+    if (s->files) {
+      kh_destroy(spill_map, s->files);
+    }
+    free((void*)s);
+    return NULL;
+  }
+  memcpy((void*)s->dir, dir, len + 1);
+
+  (void)pthread_mutex_init(&s->lock, NULL);
+  spill_load(s);
+
+  return s;
+}
+
+/**
+  @brief   Note that a virtual BAM has been opened
+  @param   s      Spill cache (NULL = No-op)
+  @param   path   CRAM file
+  @param   level  BGZF compression level (-1 = Default)
+  @param   mtime  CRAM mtime
+  @return  Read only file descriptor of the materialised BAM (-1 if not)
+
+  Frequently opened virtual BAMs are converted in full, in the
+  background, once they're opened often enough.
+*/
+int cramp_spill_open(cramp_spill_t* s, const char* path, int level, time_t mtime) {
+  int fd = -1;
+  int fill = 0;
+
+  const char* key = cramp_cache_key(path, level);
+  if (s == NULL || key == NULL) {
+    free((void*)key);
+    return -1;
+  }
+
+  const char* bam = NULL;
+
+  (void)pthread_mutex_lock(&s->lock);
+
+  spill_file_t* f = spill_file(s, key, mtime, 1);
+  if (f) {
+    ++f->hits;
+    f->level = level;
+    f->atime = ++s->clock;
+
+    if (spill_complete(f)) {
+      bam = spill_path(s, f->id, ".bam");
+
+    } else if (f->hits >= SPILL_PROMOTE && !f->filling) {
+      f->filling = fill = 1;
+    }
+  }
+
+  (void)pthread_mutex_unlock(&s->lock);
+
+  if (bam) {
+    fd = open(bam, O_RDONLY);
+    free((void*)bam);
+  }
+
+  if (fill) {
+    LOG("Converting %s (level %d) in full, for the spill cache", path, level);
+    cramp_precalc_fill(CTX->precalc, path, level);
+  }
+
+  free((void*)key);
+  return fd;
+}
+
+/**
+  @brief   Read from the spill cache
+  @param   s       Spill cache (NULL = No-op)
+  @param   source  Stat cache key
+  @param   mtime   CRAM mtime
+  @param   buf     Data buffer
+  @param   size    Data size (bytes)
+  @param   offset  Data offset (bytes)
+  @param   eof     Set when the read reached the end of the file
+  @return  Number of bytes read, contiguously from the offset
+*/
+size_t cramp_spill_read(cramp_spill_t* s, const char* source, time_t mtime, char* buf, size_t size, off_t offset, int* eof) {
+  const char* bam  = NULL;
+  size_t      want = 0;
+  int         last = 0;
+  *eof = 0;
+
+  if (s == NULL || size == 0) {
+    return 0;
+  }
+
+  /* Find the run of pages that are there from the offset */
+  (void)pthread_mutex_lock(&s->lock);
+
+  spill_file_t* f = spill_file(s, source, mtime, 0);
+  while (f && want < size) {
+    off_t  at    = offset + want;
+    size_t index = at / CRAMP_BLOCKS_PAGE;
+
+    if (!spill_has(f, index)) {
+      break;
+    }
+
+    size_t len = (index + 1) * CRAMP_BLOCKS_PAGE - at;
+    want += (len < size - want) ? len : size - want;
+
+    if ((ssize_t)index == f->last) {
+      last = 1;
+      break;
+    }
+  }
+
+  if (want) {
+    f->atime = ++s->clock;
+    bam = spill_path(s, f->id, ".bam");
+  }
+
+  (void)pthread_mutex_unlock(&s->lock);
+
+  /* ...and read them */
+  int fd = bam ? open(bam, O_RDONLY) : -1;
+  free((void*)bam);
+  if (fd == -1) {
+    return 0;
+  }
+
+  size_t copied = 0;
+  while (copied < want) {
+    ssize_t got = pread(fd, buf + copied, want - copied, offset + copied);
+    if (got <= 0) {
+      break;
+    }
+    copied += got;
+  }
+  (void)close(fd);
+
+  /* Only the last page is short */
+  if (last && copied < size) {
+    *eof = 1;
+  }
+
+  return copied;
+}
+
+/**
+  @brief   Check whether a page would be admitted
+  @param   s       Spill cache (NULL = No-op)
+  @param   source  Stat cache key
+  @param   mtime   CRAM mtime
+  @param   index   Page number
+  @return  Admitted and not already there (0 = False; 1 = True)
+*/
+int cramp_spill_wants(cramp_spill_t* s, const char* source, time_t mtime, size_t index) {
+  int wants = 0;
+
+  if (s == NULL) {
+    return 0;
+  }
+
+  (void)pthread_mutex_lock(&s->lock);
+
+  spill_file_t* f = spill_file(s, source, mtime, 0);
+  if (f && f->hits >= SPILL_ADMIT && !spill_has(f, index)) {
+    wants = 1;
+  }
+
+  (void)pthread_mutex_unlock(&s->lock);
+  return wants;
+}
+
+/**
+  @brief   Put a page into the spill cache, if it's admitted
+  @param   s       Spill cache (NULL = No-op)
+  @param   source  Stat cache key
+  @param   mtime   CRAM mtime
+  @param   index   Page number
+  @param   data    Page data
+  @param   len     Length of data (a whole page, unless it's the last)
+*/
+void cramp_spill_put(cramp_spill_t* s, const char* source, time_t mtime, size_t index, const char* data, size_t len) {
+  const char*   bam = NULL;
+  unsigned long id  = 0;
+
+  if (s == NULL) {
+    return;
+  }
+
+  (void)pthread_mutex_lock(&s->lock);
+
+  spill_file_t* f = spill_file(s, source, mtime, 0);
+  if (f == NULL || f->hits < SPILL_ADMIT || spill_has(f, index)
+   || !spill_evict(s, CRAMP_BLOCKS_PAGE, f)) {
+    goto finish_up;
+  }
+
+  /* Grow the bitmap, if necessary */
+  if (index / 8 >= f->mapsize) {
+    size_t mapsize = f->mapsize ? f->mapsize : 64;
+    while (index / 8 >= mapsize) {
+      mapsize *= 2;
+    }
+
+    uint8_t* map = realloc(f->map, mapsize);
+    if (map == NULL) {
+      goto finish_up;
+    }
+    memset(map + f->mapsize, 0, mapsize - f->mapsize);
+    f->map     = map;
+    f->mapsize = mapsize;
+  }
+
+  /* Reserve the space while the page's written */
+  bam = spill_path(s, f->id, ".bam");
+  if (bam) {
+    id = f->id;
+    s->used += CRAMP_BLOCKS_PAGE;
+  }
+
+finish_up:
+  (void)pthread_mutex_unlock(&s->lock);
+
+  if (bam == NULL) {
+    return;
+  }
+
+  int fd = open(bam, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+  ssize_t written = (fd == -1) ? -1 : pwrite(fd, data, len, (off_t)index * CRAMP_BLOCKS_PAGE);
+  int ok = fd != -1 && close(fd) == 0 && written == (ssize_t)len;
+
+  (void)pthread_mutex_lock(&s->lock);
+  s->used -= CRAMP_BLOCKS_PAGE;
+
+  /* The file may have been deleted meanwhile (and recreated by the
+     write), or the page written by someone else                     */
+  f = spill_file(s, source, mtime, 0);
+  if (f == NULL || f->id != id) {
+    (void)unlink(bam);
+
+  } else if (ok && !spill_has(f, index)) {
+    f->map[index / 8] |= 1 << (index % 8);
+    ++f->present;
+    s->used += CRAMP_BLOCKS_PAGE;
+
+    if (len < CRAMP_BLOCKS_PAGE) {
+      f->last = index;
+    }
+
+    if (spill_complete(f)) {
+      LOG("%s is fully spilled", f->key);
+    }
+  }
+
+  (void)pthread_mutex_unlock(&s->lock);
+  free((void*)bam);
+}
+
+/**
+  @brief   Write the index of spilled files and free the cache
+  @param   s  Spill cache (NULL = No-op)
+*/
+void cramp_spill_destroy(cramp_spill_t* s) {
+  if (s == NULL) {
+    return;
+  }
+
+  const char* path = path_concat(s->dir, SPILL_INDEX);
+  FILE* index = path ? fopen(path, "w") : NULL;
+  free((void*)path);
+
+  if (index) {
+    (void)fprintf(index, "# id:mtime:hits:last:level:key\n");
+  }
+
+  spill_file_t* f;
+  kh_foreach_value(s->files, f, {
+    if (index) {
+      (void)fprintf(index, "%lu:%ld:%lu:%zd:%d:%s\n", f->id, f->mtime,
+                    f->hits, f->last, f->level, f->key);
+    }
+
+    if (f->map) {
+      const char* pages = spill_path(s, f->id, ".pages");
+      FILE* map = pages ? fopen(pages, "w") : NULL;
+      if (map) {
+        (void)fwrite(f->map, 1, f->mapsize, map);
+        (void)fclose(map);
+      }
+      free((void*)pages);
+    }
+
+    free((void*)f->key);
+    free((void*)f->map);
+    free((void*)f);
+  });
+
+  if (index) {
+    (void)fclose(index);
+  }
+
+  kh_destroy(spill_map, s->files);
+  (void)pthread_mutex_destroy(&s->lock);
+  free((void*)s->dir);
+  free((void*)s);
+}
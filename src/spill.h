@@ -0,0 +1,23 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#ifndef _CRAMP_SPILL_H
+#define _CRAMP_SPILL_H
+
+/* Needed for off_t and size_t */
+#include <sys/types.h>
+
+/* Needed for time_t */
+#include <time.h>
+
+/* Opaque on-disk converted data cache */
+typedef struct cramp_spill cramp_spill_t;
+
+extern cramp_spill_t* cramp_spill_init(const char*, size_t);
+extern int            cramp_spill_open(cramp_spill_t*, const char*, int, time_t);
+extern size_t         cramp_spill_read(cramp_spill_t*, const char*, time_t, char*, size_t, off_t, int*);
+extern int            cramp_spill_wants(cramp_spill_t*, const char*, time_t, size_t);
+extern void           cramp_spill_put(cramp_spill_t*, const char*, time_t, size_t, const char*, size_t);
+extern void           cramp_spill_destroy(cramp_spill_t*);
+
+#endif
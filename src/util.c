@@ -3,11 +3,15 @@
 
 #include "config.h"
 
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include "13amp.h"
@@ -15,7 +19,34 @@
 
 #include <fuse.h>
 
-#include <htslib/hts.h>
+/* Global context, for threads that weren't started by FUSE */
+static cramp_ctx_t* global_ctx = NULL;
+
+/**
+  @brief   Get the global context
+  @return  Pointer to global context
+
+  FUSE only gives its own threads a context; anywhere else (e.g., our
+  background workers), fuse_get_context returns one that's zeroed. In
+  that case, we fall back to the copy taken by cramp_init.
+*/
+cramp_ctx_t* cramp_ctx(void) {
+  struct fuse_context* fuse = fuse_get_context();
+
+  if (fuse && fuse->private_data) {
+    return (cramp_ctx_t*)fuse->private_data;
+  }
+
+  return global_ctx;
+}
+
+/**
+  @brief   Set the global context for non-FUSE threads
+  @param   ctx  Pointer to global context
+*/
+void cramp_ctx_set(cramp_ctx_t* ctx) {
+  global_ctx = ctx;
+}
 
 /**
   @brief   Concatenate two path strings
@@ -96,6 +127,50 @@ const char* human_size(ssize_t size) {
   return output;
 }
 
+/**
+  @brief   Parse a human file size
+  @param   size  Size string (e.g., "4G"; base 2 prefixes, "B" optional)
+  @return  Size in bytes (-1 on failure)
+
+  The inverse of human_size, more or less: "512M", "4GiB" and "1024"
+  are all fine; fractions aren't.
+*/
+ssize_t parse_size(const char* size) {
+  static const char* prefix = "kMGTPE";
+
+  char* end;
+  errno = 0;
+  long long value = strtoll(size, &end, 10);
+  if (errno || end == size || value < 0) {
+    return -1;
+  }
+
+  if (*end && *end != 'B') {
+    const char* p = strchr(prefix, *end == 'K' ? 'k' : *end);
+    if (p == NULL) {
+      return -1;
+    }
+
+    for (ptrdiff_t i = 0; i <= p - prefix; ++i) {
+      if (value > SSIZE_MAX / 1024) {
+        return -1;
+      }
+      value *= 1024;
+    }
+
+    ++end;
+    if (*end == 'i') {
+      ++end;
+    }
+  }
+
+  if (*end == 'B') {
+    ++end;
+  }
+
+  return *end ? -1 : (ssize_t)value;
+}
+
 /**
   @brief   Check if a path name ends with a specified extension
   @param   path  File path
@@ -141,27 +216,251 @@ const char* sub_extension(const char* path, const char* ext) {
 
   Note: This doesn't check that the path is a regular file/symlink, that
   should be done in advance.
+
+  Only the magic number is checked, when the file's fingerprinted for
+  the stat cache, so it's only read again once it's changed (see
+  cramp_cache_is_cram).
 */
 int is_cram(const char* path) {
-  int ret = 0;
-
-  /* Use HTSLib to open the file and check its format */
-  htsFile* fp = hts_open(path, "r");
-  if (fp) {
-    const htsFormat* format = hts_get_format(fp);
-    if (format) {
-      ret = (format->format == cram);
-    } else {
-      ret = -errno;
+  return cramp_cache_is_cram(path);
+}
+
+/**
+  @brief   Find the CRAM file behind a virtual BAM file
+  @param   path   Source path of the virtual BAM file
+  @param   level  Pointer to compression level, to be set
+  @param   st     stat structure, to be filled from the CRAM file
+  @return  malloc'd pointer to CRAM path (NULL on failure, with errno)
+
+  foo.bam is foo.cram at the mount's compression level; foo.lN.bam is
+  foo.cram at level N (0..9), unless there's a foo.lN.cram, which takes
+  precedence. CRAM files are stat'd, rather than lstat'd, to follow
+  symlinks.
+*/
+const char* virtual_cram(const char* path, int* level, struct stat* st) {
+  cramp_ctx_t* ctx = CTX;
+
+  const char* cram_name = sub_extension(path, ".cram");
+  if (cram_name == NULL) {
+    return NULL;
+  }
+
+  if (stat(cram_name, st) == 0) {
+    *level = ctx->conf->bam_level;
+    return cram_name;
+  }
+
+  int errsav = errno;
+  free((void*)cram_name);
+
+  /* Look for a level suffix before the extension */
+  const char* ext = strrchr(path, '.');
+  size_t stem = ext ? ext - path : 0;
+
+  if (stem >= 3 && path[stem - 3] == '.' && path[stem - 2] == 'l'
+                && isdigit((unsigned char)path[stem - 1])) {
+    char* variant = malloc(stem - 3 + sizeof(".cram"));
+    if (variant == NULL) {
+      return NULL;
     }
-    if (hts_close(fp) == -1) {
-      ret = -errno;
+
+    memcpy(variant, path, stem - 3);
+    memcpy(variant + stem - 3, ".cram", sizeof(".cram"));
+
+    if (stat(variant, st) == 0) {
+      *level = path[stem - 1] - '0';
+      return variant;
     }
-  } else {
-    ret = -errno;
+
+    errsav = errno;
+    free((void*)variant);
   }
 
-  return ret;
+  errno = errsav;
+  return NULL;
+}
+
+/**
+  @brief   Find the CRAM file behind a virtual region directory
+  @param   path  Source path of the virtual region directory
+  @param   st    stat structure, to be filled from the CRAM file
+  @return  malloc'd pointer to CRAM path (NULL on failure, with errno)
+
+  foo.cram.d holds the regions of foo.cram, which must be indexed (i.e.,
+  there's a foo.cram.crai). It isn't listed and can't be opened, but
+  paths through it resolve.
+*/
+const char* virtual_region_dir(const char* path, struct stat* st) {
+  static const char ext[] = ".cram.d";
+  size_t len = strlen(path);
+
+  if (len <= sizeof(ext) - 1 || strcmp(path + len - (sizeof(ext) - 1), ext) != 0) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  /* foo.cram.d => foo.cram and foo.cram.crai */
+  char* cram_name = malloc(len + 4);
+  if (cram_name == NULL) {
+    return NULL;
+  }
+  memcpy(cram_name, path, len - 2);
+  memcpy(cram_name + len - 2, ".crai", 6);
+
+  int found = (stat(cram_name, st) == 0);
+  cram_name[len - 2] = '\0';
+
+  if (!found || stat(cram_name, st) == -1) {
+    int errsav = errno;
+    free((void*)cram_name);
+    errno = errsav;
+    return NULL;
+  }
+
+  return cram_name;
+}
+
+/**
+  @brief   Find the CRAM file behind a virtual region BAM file
+  @param   path    Source path of the virtual region BAM file
+  @param   level   Pointer to compression level, to be set
+  @param   region  Pointer to be set to the malloc'd region
+  @param   st      stat structure, to be filled from the CRAM file
+  @return  malloc'd pointer to CRAM path (NULL on failure, with errno)
+
+  foo.cram.d/REGION.bam is the part of foo.cram that overlaps REGION
+  (e.g., chr1 or chr1:1-5000000, per `samtools view`), at the mount's
+  compression level. Whether the region is valid isn't checked here.
+*/
+const char* virtual_region(const char* path, int* level, const char** region, struct stat* st) {
+  cramp_ctx_t* ctx = CTX;
+
+  const char* name = strrchr(path, '/');
+  size_t namelen = name ? strlen(name + 1) : 0;
+
+  if (namelen <= 4 || !has_extension(name, ".bam")) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  size_t dirlen = name - path;
+  char* dir = malloc(dirlen + 1);
+  if (dir == NULL) {
+    return NULL;
+  }
+  memcpy(dir, path, dirlen);
+  dir[dirlen] = '\0';
+
+  const char* cram_name = virtual_region_dir(dir, st);
+  int errsav = errno;
+  free((void*)dir);
+
+  if (cram_name == NULL) {
+    errno = errsav;
+    return NULL;
+  }
+
+  /* REGION.bam => REGION */
+  char* reg = malloc(namelen - 3);
+  if (reg == NULL) {
+    free((void*)cram_name);
+    return NULL;
+  }
+  memcpy(reg, name + 1, namelen - 4);
+  reg[namelen - 4] = '\0';
+
+  *level  = ctx->conf->bam_level;
+  *region = reg;
+  return cram_name;
+}
+
+/**
+  @brief   Find the CRAM file behind a virtual BAM file of a decoding view
+  @param   path   Source path of the virtual BAM file
+  @param   level  Pointer to compression level, to be set
+  @param   view   Pointer to decoding view, to be set
+  @param   st     stat structure, to be filled from the CRAM file
+  @return  malloc'd pointer to CRAM path (NULL on failure, with errno)
+
+  foo.VIEW.bam (e.g., foo.noqual.bam) is foo.cram, with only the view's
+  fields decoded, at the mount's compression level.
+*/
+const char* virtual_view(const char* path, int* level, enum cramp_view* view, struct stat* st) {
+  cramp_ctx_t* ctx = CTX;
+  size_t len = strlen(path);
+
+  for (int v = view_full + 1; v < view_count; ++v) {
+    const char* name = cramp_view_name(v);
+    size_t namelen = strlen(name);
+
+    /* foo.VIEW.bam => foo.cram */
+    size_t stem = len - namelen - sizeof(".bam");
+    if (len <= namelen + sizeof(".bam") || path[stem] != '.'
+                                        || strncmp(path + stem + 1, name, namelen) != 0
+                                        || strcmp(path + stem + 1 + namelen, ".bam") != 0) {
+      continue;
+    }
+
+    char* cram_name = malloc(stem + sizeof(".cram"));
+    if (cram_name == NULL) {
+      return NULL;
+    }
+    memcpy(cram_name, path, stem);
+    memcpy(cram_name + stem, ".cram", sizeof(".cram"));
+
+    if (stat(cram_name, st) == 0) {
+      *level = ctx->conf->bam_level;
+      *view  = v;
+      return cram_name;
+    }
+
+    int errsav = errno;
+    free((void*)cram_name);
+    errno = errsav;
+    return NULL;
+  }
+
+  errno = ENOENT;
+  return NULL;
+}
+
+/**
+  @brief   Find the CRAM file behind a virtual BAI file
+  @param   path   Source path of the virtual BAI file
+  @param   level  Pointer to compression level, to be set
+  @param   st     stat structure, to be filled from the CRAM file
+  @return  malloc'd pointer to CRAM path (NULL on failure, with errno)
+
+  foo.bam.bai is the index of foo.bam, if that's a virtual BAM file (a
+  real foo.bam doesn't get a virtual index).
+*/
+const char* virtual_bai(const char* path, int* level, struct stat* st) {
+  size_t len = strlen(path);
+
+  if (!has_extension(path, ".bai") || len < sizeof(".bam.bai")) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  char* bam_name = malloc(len - 3);
+  if (bam_name == NULL) {
+    return NULL;
+  }
+  memcpy(bam_name, path, len - 4);
+  bam_name[len - 4] = '\0';
+
+  const char* cram_name = NULL;
+  if (!has_extension(bam_name, ".bam") || lstat(bam_name, st) == 0) {
+    errno = ENOENT;
+  } else if (errno == ENOENT) {
+    cram_name = virtual_cram(bam_name, level, st);
+  }
+
+  int errsav = errno;
+  free((void*)bam_name);
+  errno = errsav;
+
+  return cram_name;
 }
 
 /**
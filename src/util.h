@@ -7,71 +7,88 @@
 /* Needed for DIR */
 #include <dirent.h>
 
-/* Needed for ssize_t */
+/* Needed for ssize_t and struct stat */
+#include <sys/stat.h>
 #include <sys/types.h>
 
-/* Needed for htsFile */
-#include <htslib/hts.h>
+/* Needed for cramp_conv_t */
+#include "conv.h"
+
+/* Needed for cramp_listing_t */
+#include "listing.h"
 
 /* Needed for fuse_file_info */
 #include "13amp.h"
 #include <fuse.h>
 
-/* Get FUSE context macro */
-#define CTX (cramp_ctx_t*)(fuse_get_context()->private_data)
+/* Get global context macro (safe outside FUSE's threads) */
+#define CTX cramp_ctx()
 
 /**
   @brief   Directory structure
-  @var     dp      Directory handle
-  @var     entry   Pointer to directory entity
-  @var     offset  Offset
+  @var     dp       Directory handle
+  @var     path     Source directory (without a trailing slash)
+  @var     listing  Listing, once built or found in the cache
 */
 struct cramp_dirp {
-  DIR*           dp;
-  struct dirent* entry;
-  off_t          offset;
+  DIR*             dp;
+  const char*      path;
+  cramp_listing_t* listing;
 };
 
 /**
-  @brief   Directory entry structure
-  @var     st       Stat structure of entry
-  @var     virtual  Entry is virtual (0 = False; 1 = True)
+  @brief   In-memory file contents
+  @var     data  Contents
+  @var     len   Length of contents (bytes)
 */
-struct cramp_entry_t {
-  struct stat* st;
-  int          virtual;
+struct cramp_mem {
+  char*  data;
+  size_t len;
 };
 
 /**
   @brief   File descriptor type
   @var     fd_normal  File descriptor per open(2)
-  @var     fd_cram    File descriptor per hts_open
+  @var     fd_cram    Conversion stream per cramp_conv_open
+  @var     fd_mem     In-memory contents (e.g., a virtual BAI)
 */
-enum fd_type {fd_normal, fd_cram};
+enum fd_type {fd_normal, fd_cram, fd_mem};
 
 /**
   @brief   File structure (tagged union of file/CRAM handle)
   @var     type    Union tag
   @var     filep   Normal file handle
-  @var     cramp   CRAM file handle for HTSLib
+  @var     conv    CRAM conversion stream
+  @var     mem     In-memory contents
   @var     offset  Read progress (bytes)
 */
 struct cramp_filep {
   enum fd_type type;
   union {
-    int        filep;
-    htsFile*   cramp;
+    int               filep;
+    cramp_conv_t*     conv;
+    struct cramp_mem* mem;
   };
   off_t        offset;
 };
 
+/* Global context */
+extern cramp_ctx_t* cramp_ctx(void);
+extern void         cramp_ctx_set(cramp_ctx_t*);
+
 /* Utility functions to support file system operations */
 extern const char* path_concat(const char*, const char*);
 extern const char* source_path(const char*);
 extern const char* human_size(ssize_t);
+extern ssize_t     parse_size(const char*);
 extern int         has_extension(const char*, const char*);
 extern const char* sub_extension(const char*, const char*);
 extern int         is_cram(const char*);
+extern const char* virtual_cram(const char*, int*, struct stat*);
+extern const char* virtual_bai(const char*, int*, struct stat*);
+extern const char* virtual_region_dir(const char*, struct stat*);
+extern const char* virtual_region(const char*, int*, const char**, struct stat*);
+extern const char* virtual_view(const char*, int*, enum cramp_view*, struct stat*);
 
 extern struct cramp_dirp*  get_dirp(struct fuse_file_info*);
 extern struct cramp_filep* get_filep(struct fuse_file_info*);
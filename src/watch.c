@@ -0,0 +1,410 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "13amp.h"
+#include "attrs.h"
+#include "cache.h"
+#include "dirs.h"
+#include "log.h"
+#include "precalc.h"
+#include "util.h"
+#include "watch.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#include <htslib/khash.h>
+
+/*
+  NOTES
+
+  The stat cache is otherwise only checked lazily, against the CRAM's
+  mtime, which misses CRAMs that are deleted, or replaced by one that's
+  older (e.g., mv preserves the mtime). It also means new CRAMs are only
+  sized when somebody gets round to it.
+
+  Instead, every directory in the source tree is watched with inotify.
+  When a CRAM is written (IN_CLOSE_WRITE), its records, at every
+  compression level and view, are evicted from the cache. Records are
+  keyed by the CRAM's fingerprint (see cache.c), which survives a rename,
+  so when one's moved in (IN_MOVED_TO), moved out (IN_MOVED_FROM) or
+  deleted (IN_DELETE), only its path is forgotten. If it's still there,
+  it's then queued for precalculation (see precalc.c), ahead of anything
+  else, which puts the new size and checkpoints back into the cache (or
+  finds them already there, if it was just moved).
+
+  Any change in a directory, other than a file that isn't a CRAM being
+  written, also makes its cached listing (see dirs.c) and the cached
+  attributes of its virtual files (see attrs.c) stale.
+
+  New directories are watched as they appear (and walked, in case they
+  were moved in with CRAMs already in them); directories that are moved
+  out stop being watched. Like the precalculation walk, symlinked
+  directories and other filesystems aren't followed.
+
+  If the kernel's event queue overflows, we've missed something, so the
+  whole tree is walked again. If we run out of watches (per
+  fs.inotify.max_user_watches), the directories we couldn't watch are
+  left to the lazy checks.
+*/
+
+/* Events of interest, in watched directories */
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | IN_ONLYDIR)
+
+/* Size of the event buffer (enough for plenty of events) */
+#define WATCH_BUFFER (64 * 1024)
+
+/* Initialise watch descriptor map type (wd => directory) */
+KHASH_MAP_INIT_INT(watch_map, const char*)
+
+/**
+  @brief   Source directory watcher
+  @var     fd      inotify file descriptor
+  @var     wake    Pipe to wake the watcher thread, to stop it
+  @var     dev     Device of the source directory
+  @var     dirs    Watched directories, by watch descriptor
+  @var     thread  Watcher thread
+*/
+struct cramp_watch {
+  int                 fd;
+  int                 wake[2];
+  dev_t               dev;
+  khash_t(watch_map)* dirs;
+  pthread_t           thread;
+};
+
+/**
+  @brief   Watch a directory and, recursively, its subdirectories
+  @param   w    Watcher
+  @param   dir  Directory
+*/
+static void watch_add(cramp_watch_t* w, const char* dir) {
+  int wd = inotify_add_watch(w->fd, dir, WATCH_EVENTS);
+  if (wd == -1) {
+    LOG("Couldn't watch %s", dir);
+    return;
+  }
+
+  size_t len = strlen(dir);
+  const char* copy = malloc(len + 1);
+  if (copy == NULL) {
+    return;
+  }
+  memcpy((void*)copy, dir, len + 1);
+
+  /* The same directory gets the same descriptor, so replace its path */
+  int ret;
+  khiter_t key = kh_put(watch_map, w->dirs, wd, &ret);
+  if (ret == -1) {
+    free((void*)copy);
+    return;
+  }
+  if (ret == 0) {
+    free((void*)kh_value(w->dirs, key));
+  }
+  kh_value(w->dirs, key) = copy;
+
+  DIR* dp = opendir(dir);
+  if (dp == NULL) {
+    return;
+  }
+
+  struct dirent* entry;
+  while ((entry = readdir(dp))) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+
+    const char* path = path_concat(dir, entry->d_name);
+    if (path == NULL) {
+      break;
+    }
+
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode) && st.st_dev == w->dev) {
+      watch_add(w, path);
+    }
+
+    free((void*)path);
+  }
+
+  (void)closedir(dp);
+}
+
+/**
+  @brief   Stop watching a directory and its subdirectories
+  @param   w    Watcher
+  @param   dir  Directory
+*/
+static void watch_forget(cramp_watch_t* w, const char* dir) {
+  size_t len = strlen(dir);
+
+  for (khiter_t key = kh_begin(w->dirs); key != kh_end(w->dirs); ++key) {
+    if (!kh_exist(w->dirs, key)) {
+      continue;
+    }
+
+    const char* path = kh_value(w->dirs, key);
+    if (strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/')) {
+      (void)inotify_rm_watch(w->fd, kh_key(w->dirs, key));
+      free((void*)path);
+      kh_del(watch_map, w->dirs, key);
+    }
+  }
+}
+
+/**
+  @brief   Mount path of a watched directory
+  @param   dir  Watched directory
+  @return  Pointer into dir ("" = The root)
+
+  n.b., The source directory is canonical, so has no trailing slash
+*/
+static const char* watch_mount_path(const char* dir) {
+  const char* source = CTX->conf->source;
+  size_t len = strlen(source);
+
+  return (strncmp(dir, source, len) == 0) ? dir + len : dir;
+}
+
+/**
+  @brief   Handle an inotify event
+  @param   w   Watcher
+  @param   ev  Event
+*/
+static void watch_event(cramp_watch_t* w, const struct inotify_event* ev) {
+  cramp_ctx_t* ctx = CTX;
+
+  if (ev->mask & IN_Q_OVERFLOW) {
+    LOG("Missed changes to %s; walking it again", ctx->conf->source);
+    cramp_dirs_forget(ctx->dirs, NULL);
+    cramp_attrs_forget(ctx->attrs, NULL);
+    cramp_precalc_walk(ctx->precalc, ctx->conf->source);
+    return;
+  }
+
+  khiter_t key = kh_get(watch_map, w->dirs, ev->wd);
+  if (key == kh_end(w->dirs)) {
+    return;
+  }
+
+  /* The directory's gone, or we stopped watching it */
+  if (ev->mask & IN_IGNORED) {
+    cramp_dirs_forget(ctx->dirs, kh_value(w->dirs, key));
+    cramp_attrs_forget(ctx->attrs, watch_mount_path(kh_value(w->dirs, key)));
+    free((void*)kh_value(w->dirs, key));
+    kh_del(watch_map, w->dirs, key);
+    return;
+  }
+
+  if (ev->len == 0) {
+    return;
+  }
+
+  /* The directory's listing and attributes are stale, unless all
+     that's happened is something other than a CRAM being written   */
+  if (!(ev->mask & IN_CLOSE_WRITE) || has_extension(ev->name, ".cram")) {
+    cramp_dirs_forget(ctx->dirs, kh_value(w->dirs, key));
+    cramp_attrs_forget(ctx->attrs, watch_mount_path(kh_value(w->dirs, key)));
+  }
+
+  const char* path = path_concat(kh_value(w->dirs, key), ev->name);
+  if (path == NULL) {
+    return;
+  }
+
+  if (ev->mask & IN_ISDIR) {
+    if (ev->mask & IN_MOVED_FROM) {
+      watch_forget(w, path);
+    }
+
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+      watch_add(w, path);
+      cramp_precalc_walk(ctx->precalc, path);
+    }
+
+  } else if (has_extension(ev->name, ".cram")) {
+    int changed = ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO);
+
+    /* Newly created files aren't ready until they're closed, but new
+       symlinks won't ever be written                                 */
+    struct stat st;
+    if ((ev->mask & IN_CREATE) && lstat(path, &st) == 0 && S_ISLNK(st.st_mode)) {
+      changed = 1;
+    }
+
+    /* Records are keyed by fingerprint, so only a CRAM that's been
+       written is out of date; otherwise, its path is just forgotten,
+       as any records it had may be another path's, too             */
+    if (ev->mask & IN_CLOSE_WRITE) {
+      LOG("%s has changed", path);
+      (void)cramp_cache_evict_file(ctx->cache, path);
+
+    } else if (changed || (ev->mask & (IN_MOVED_FROM | IN_DELETE))) {
+      LOG("%s has moved", path);
+      cramp_cache_unalias(path);
+    }
+
+    if (changed) {
+      cramp_precalc_file(ctx->precalc, path);
+    }
+  }
+
+  free((void*)path);
+}
+
+/**
+  @brief   Watcher thread
+  @param   arg  Watcher
+  @return  NULL
+*/
+static void* watch_main(void* arg) {
+  cramp_watch_t* w = (cramp_watch_t*)arg;
+
+  char* buf = malloc(WATCH_BUFFER);
+  if (buf == NULL) {
+    return NULL;
+  }
+
+  struct pollfd fds[2] = {
+    { w->fd,      POLLIN, 0 },
+    { w->wake[0], POLLIN, 0 }
+  };
+
+  while (1) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    if (fds[1].revents) {
+      break;
+    }
+
+    ssize_t len = read(w->fd, buf, WATCH_BUFFER);
+    if (len <= 0) {
+      if (len == -1 && errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    /* Events are variable length (n.b., malloc's alignment suffices) */
+    for (char* ev = buf; ev < buf + len; ) {
+      const struct inotify_event* event = (const struct inotify_event*)ev;
+      watch_event(w, event);
+      ev += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  free((void*)buf);
+  return NULL;
+}
+
+/**
+  @brief   Free a watcher
+  @param   w  Watcher
+*/
+static void watch_free(cramp_watch_t* w) {
+  if (w->fd != -1) {
+    (void)close(w->fd);
+  }
+  if (w->wake[0] != -1) {
+    (void)close(w->wake[0]);
+    (void)close(w->wake[1]);
+  }
+
+  if (w->dirs) {
+    const char* dir;
+    kh_foreach_value(w->dirs, dir, free((void*)dir));
+    kh_destroy(watch_map, w->dirs);
+  }
+
+  free((void*)w);
+}
+
+/**
+  @brief   Start watching the source directory tree
+  @param   source  Source directory
+  @return  Pointer to watcher (NULL on failure)
+*/
+cramp_watch_t* cramp_watch_init(const char* source) {
+  struct stat st;
+  if (stat(source, &st) == -1) {
+    return NULL;
+  }
+
+  cramp_watch_t* w = calloc(1, sizeof(cramp_watch_t));
+  if (w == NULL) {
+    return NULL;
+  }
+
+  w->dev  = st.st_dev;
+  w->fd   = inotify_init1(IN_CLOEXEC);
+  w->dirs = kh_init(watch_map);
+
+  if (pipe(w->wake) == -1) {
+    w->wake[0] = w->wake[1] = -1;
+  }
+
+  if (w->fd == -1 || w->wake[0] == -1 || w->dirs == NULL) {
+    int errsav = errno;
+    watch_free(w);
+    errno = errsav;
+    return NULL;
+  }
+
+  watch_add(w, source);
+
+  if (pthread_create(&w->thread, NULL, watch_main, w) != 0) {
+    watch_free(w);
+    return NULL;
+  }
+
+  return w;
+}
+
+/**
+  @brief   Stop watching and free the watcher
+  @param   w  Watcher (NULL = No-op)
+*/
+void cramp_watch_destroy(cramp_watch_t* w) {
+  if (w == NULL) {
+    return;
+  }
+
+  (void)write(w->wake[1], "", 1);
+  (void)pthread_join(w->thread, NULL);
+  watch_free(w);
+}
+
+#else
+
+/* Without inotify, the stat cache is only checked lazily */
+
+cramp_watch_t* cramp_watch_init(const char* source) {
+  (void)source;
+  errno = ENOSYS;
+  return NULL;
+}
+
+void cramp_watch_destroy(cramp_watch_t* w) {
+  (void)w;
+}
+
+#endif
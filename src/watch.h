@@ -0,0 +1,13 @@
+/* GPLv3 or later
+ * Copyright (c) 2015 Genome Research Limited */
+
+#ifndef _CRAMP_WATCH_H
+#define _CRAMP_WATCH_H
+
+/* Opaque source directory watcher */
+typedef struct cramp_watch cramp_watch_t;
+
+extern cramp_watch_t* cramp_watch_init(const char*);
+extern void           cramp_watch_destroy(cramp_watch_t*);
+
+#endif
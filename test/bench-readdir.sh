@@ -0,0 +1,109 @@
+#!/bin/bash
+
+# GPLv3 or later
+# Copyright (c) 2015 Genome Research Limited
+
+# Time listing large directories through 13amp
+# n.b., Sizes and runs can be overridden from the command line:
+#   SIZES="1000 10000 100000" RUNS=5 ./bench-readdir.sh
+# Every CRAM_EVERY'th entry is a symlink to a real CRAM, so gets virtual
+# BAMs injected; listings are timed with and without --trust-extension,
+# without the directory listing cache, and then with it
+
+set -eu -o pipefail
+
+# Echo to stderr
+function stderr {
+  >&2 echo "$@"
+}
+
+REPODIR=$(git rev-parse --show-toplevel)
+TESTDIR=$REPODIR/test
+
+# Find 13amp binary
+CRAMP=$(find $REPODIR -name 13amp -type f -perm -u=x)
+if [ -z "$CRAMP" ]; then
+  stderr "13amp binary not found"
+  exit 1
+fi
+
+: "${SIZES:=10000 100000}"
+: "${RUNS:=3}"
+: "${CRAM_EVERY:=100}"
+
+CRAM=$TESTDIR/source/bar.cram
+if [ ! -f "$CRAM" ]; then
+  stderr "CRAM not found: $CRAM"
+  exit 1
+fi
+
+# Working directories
+WORKDIR=$(mktemp -d)
+SRCDIR=$WORKDIR/source
+MNTDIR=$WORKDIR/mount
+mkdir -p $SRCDIR $MNTDIR
+
+# Unmount and clean up on exit
+function cleanup {
+  umount $MNTDIR 2>/dev/null || true
+  rm -rf $WORKDIR
+}
+trap cleanup EXIT
+
+# Populate the source directory up to the given number of entries
+function populate {
+  local size=$1
+  local have=$(ls -f $SRCDIR | wc -l)
+
+  for ((i = have - 2; i < size; ++i)); do
+    if (( i % CRAM_EVERY == 0 )); then
+      ln -s $CRAM $(printf "$SRCDIR/entry%07d.cram" $i)
+    else
+      printf "$SRCDIR/entry%07d.txt\0" $i
+    fi
+  done | xargs -0 -r touch
+}
+
+# Best wall clock time (seconds) of listing a directory
+function best {
+  local dir=$1
+  local best=
+
+  for ((run = 0; run < RUNS; ++run)); do
+    local start=$(date +%s.%N)
+    ls -f $dir > /dev/null
+    local end=$(date +%s.%N)
+    best=$(awk -v start=$start -v end=$end -v best="$best" \
+             'BEGIN { t = end - start; print (best == "" || t < best) ? t : best }')
+  done
+
+  echo $best
+}
+
+printf "%-10s %-10s %-12s %-12s %-12s %-12s\n" Entries Listed Source Checked Trusted Cached
+
+for SIZE in $SIZES; do
+  populate $SIZE
+  SOURCE=$(best $SRCDIR)
+
+  for MODE in Checked Trusted Cached; do
+    case $MODE in
+      Checked) OPTS="--dir-cache=0" ;;
+      Trusted) OPTS="--dir-cache=0 --trust-extension" ;;
+      Cached)  OPTS="" ;;
+    esac
+
+    $CRAMP $MNTDIR -S $SRCDIR $OPTS
+
+    # FIXME Wait for mount
+    sleep 1
+
+    # The first listing checks (and fingerprints) the CRAMs
+    LISTED=$(ls -f $MNTDIR | wc -l)
+    eval "$MODE=\$(best \$MNTDIR)"
+
+    umount $MNTDIR
+  done
+
+  printf "%-10s %-10s %-12s %-12s %-12s %-12s\n" $SIZE $LISTED $SOURCE $Checked $Trusted $Cached
+done
@@ -72,26 +72,74 @@ for CRAM in $CRAMS; do
   if [ ! -e "$BAM" ]; then
     echo "Creating $BAM"
     $SAMTOOLS view -b -o $BAM $CRAM
+    $SAMTOOLS index $BAM
   fi
+
+  # Reduced-decode views, with the fields and MD/NM generation per
+  # handles.c (n.b., listed even if there's a real BAM)
+  for VIEW in "noqual 0x7ffffbff" "minimal 0x1fe"; do
+    read NAME FIELDS <<< $VIEW
+    VIEW_BAM=$(sed "s/\.cram$/.$NAME.bam/" <<< $CRAM)
+    echo "Creating $VIEW_BAM"
+    $SAMTOOLS view -b -o $VIEW_BAM \
+                   --input-fmt-option required_fields=$FIELDS \
+                   --input-fmt-option decode_md=0 \
+                   $CRAM
+  done
 done
 
+# Stat cache file, so each run starts afresh
+CACHE=$TESTDIR/cache
+rm -rf $CACHE $CACHE.journal $CACHE.d
+
+# Mount the virtual filesystem, with any extra options
+function mount_cramp {
+  $CRAMP $MNTDIR -S $SRCDIR --cache=$CACHE "$@"
+
+  # FIXME Wait for mount
+  sleep 1
+}
+
+# ...and remount it
+function remount_cramp {
+  umount $MNTDIR
+  mount_cramp "$@"
+}
+
 # Mount directory
 echo "Mounting virtual filesystem"
-$CRAMP $MNTDIR -S $SRCDIR
-
-# FIXME Wait for mount
-sleep 1
+mount_cramp
 
 # Unmount and clean up on exit
+# n.b., It might not be mounted, if a remount failed
 function cleanup {
   echo "Unmounting and cleaning up"
-  umount $MNTDIR
-  rm -rf $MNTDIR $CHKDIR
+  kill ${STATTERS:-} 2>/dev/null || true
+  rm -f $SRCDIR/listing-copy.cram $SRCDIR/stat-churn.cram
+  if [ -e "$SRCDIR/renamed.cram" ]; then
+    mv $SRCDIR/renamed.cram $SRCDIR/bar.cram
+  fi
+  umount $MNTDIR 2>/dev/null || true
+  rm -rf $MNTDIR $CHKDIR $CACHE $CACHE.journal $CACHE.d
 }
 trap cleanup EXIT
 
+# Virtual indices are only listed once they're built, in the background
+# (n.b., statting one that isn't queues it)
+function indexed {
+  for BAI in $(sed "s+^$CHKDIR+$MNTDIR+;s/\.cram$/.bam.bai/" <<< "$CRAMS"); do
+    for _ in $(seq 240); do
+      stat $BAI &>/dev/null && continue 2
+      sleep 0.5
+    done
+    stderr "Virtual index wasn't built: $BAI"
+    exit 1
+  done
+}
+
 # Check the two directories contain the same files
 echo "Checking directory structure"
+indexed
 
 function contents {
   find $1 | sed "s|^$1||;/^$/d" | sort
@@ -104,11 +152,213 @@ if [ -n "$DIR_DIFF" ]; then
   exit 1
 fi
 
+# Check cached directory listings (and attributes) don't outlive
+# changes to the source
+echo "Checking directory listings and attributes follow changes"
+
+function listed {
+  ls -a $MNTDIR | grep -qx "$1"
+}
+
+# n.b., Cached misses are forgotten by the watcher, asynchronously
+function appears {
+  for _ in $(seq 10); do
+    stat "$1" &>/dev/null && return 0
+    sleep 0.2
+  done
+  return 1
+}
+
+contents $MNTDIR >/dev/null
+if stat $MNTDIR/listing-copy.bam &>/dev/null; then
+  stderr "Virtual BAM of a nonexistent CRAM exists"
+  exit 1
+fi
+
+cp $(head -n 1 <<< "$CRAMS") $SRCDIR/listing-copy.cram
+if ! listed listing-copy.bam; then
+  stderr "Virtual BAM of a new CRAM isn't listed"
+  exit 1
+fi
+if ! appears $MNTDIR/listing-copy.bam; then
+  stderr "Virtual BAM of a new CRAM doesn't exist"
+  exit 1
+fi
+
+rm $SRCDIR/listing-copy.cram
+if listed listing-copy.bam; then
+  stderr "Virtual BAM of a deleted CRAM is still listed"
+  exit 1
+fi
+
+# n.b., Without the watcher, as if the CRAM were written by another
+# client of a network filesystem; cached attributes are revalidated
+# against it (after the kernel's own second)
+remount_cramp --no-watch --attr-cache=600
+cp $(head -n 1 <<< "$CRAMS") $SRCDIR/listing-copy.cram
+stat $MNTDIR/listing-copy.bam >/dev/null
+touch -m -d 2001-01-01 $SRCDIR/listing-copy.cram
+sleep 1.5
+if [ "$(stat -c %Y $MNTDIR/listing-copy.bam)" != "$(stat -c %Y $SRCDIR/listing-copy.cram)" ]; then
+  stderr "Virtual BAM's cached attributes outlive a change to its CRAM"
+  exit 1
+fi
+rm $SRCDIR/listing-copy.cram
+
+# Hammer getattr from many threads while conversions insert sizes
+# n.b., Without the attribute cache, so every stat looks up its CRAM's
+# path alias, while another path to one of them keeps being aliased and
+# forgotten (when the watcher sees it removed)
+echo "Checking concurrent stat cache access"
+remount_cramp --attr-cache=0
+
+BAMS=$(sed "s+^$CHKDIR+$MNTDIR+;s/\.cram$/.bam/" <<< "$CRAMS")
+: "${STAT_THREADS:=16}"
+
+STATTERS=""
+for _ in $(seq $STAT_THREADS); do
+  ( while true; do stat $BAMS >/dev/null 2>&1 || true; done ) &
+  STATTERS="$STATTERS $!"
+done
+
+CHURN=$(sed "s+^$CHKDIR+$SRCDIR+" <<< "$CRAMS" | head -n 1)
+( while true; do
+    ln $CHURN $SRCDIR/stat-churn.cram 2>/dev/null
+    stat $MNTDIR/stat-churn.bam >/dev/null 2>&1 || true
+    rm -f $SRCDIR/stat-churn.cram
+  done ) &
+STATTERS="$STATTERS $!"
+
+READERS=""
+for BAM in $BAMS; do
+  cat $BAM >/dev/null &
+  READERS="$READERS $!"
+done
+wait $READERS
+
+kill $STATTERS 2>/dev/null || true
+wait $STATTERS 2>/dev/null || true
+rm -f $SRCDIR/stat-churn.cram
+
+for BAM in $BAMS; do
+  READ=$(wc -c < $BAM)
+  STATED=$(stat -c %s $BAM)
+  if [ "$READ" != "$STATED" ]; then
+    stderr "$BAM: read $READ bytes, but stat says $STATED"
+    exit 1
+  fi
+done
+
 # Check file contents are the same
-# n.b., Up to (and including) the specimen file size
+# n.b., Up to (and including) the specimen file size; any arguments
+# are extra find tests, to narrow down the files that are checked
+function check_contents {
+  for FILE in $(find -L $MNTDIR -type f "$@"); do
+    CHECK=$(sed "s+^$MNTDIR+$CHKDIR+" <<< $FILE)
+    LIMIT=$(wc -c < "$CHECK")
+    FILE_DIFF=$(cmp -n $LIMIT $FILE $CHECK || true)
+    if [ -n "$FILE_DIFF" ]; then
+      stderr "$FILE_DIFF"
+      exit 1
+    fi
+  done
+}
+
 echo "Checking file contents"
-for FILE in $(find -L $MNTDIR -type f); do
-  CHECK=$(sed "s+^$MNTDIR+$CHKDIR+" <<< $FILE)
+check_contents
+
+# Check reads that start part way into virtual BAMs, which resume from
+# the checkpoints recorded when they were read in full, above
+echo "Checking reads from the middle of files"
+
+function check_middles {
+  for BAM in $BAMS; do
+    CHECK=$(sed "s+^$MNTDIR+$CHKDIR+" <<< $BAM)
+    SKIP=$(( $(wc -c < "$CHECK") / 2 ))
+    FILE_DIFF=$(cmp <(dd if=$BAM bs=1 skip=$SKIP 2>/dev/null) \
+                    <(tail -c +$(( SKIP + 1 )) $CHECK) || true)
+    if [ -n "$FILE_DIFF" ]; then
+      stderr "$BAM from byte $SKIP: $FILE_DIFF"
+      exit 1
+    fi
+  done
+}
+
+check_middles
+
+# Check a sized CRAM is still sized as soon as it's renamed, as its
+# records are keyed by its fingerprint, rather than its path
+echo "Checking sizes survive renaming"
+mv $SRCDIR/bar.cram $SRCDIR/renamed.cram
+EXPECTED=$(wc -c < $CHKDIR/bar.bam)
+STATED=$(stat -c %s $MNTDIR/renamed.bam)
+mv $SRCDIR/renamed.cram $SRCDIR/bar.cram
+if [ "$STATED" != "$EXPECTED" ]; then
+  stderr "renamed.bam: stat says $STATED, rather than $EXPECTED"
+  exit 1
+fi
+
+# Check an index that hasn't been built (n.b., they're kept in memory)
+# is missing, rather than opening it converting the CRAM in full, and
+# is listed once it's been built in the background
+echo "Checking virtual indices are built in the background"
+remount_cramp
+if listed bar.bam.bai || stat $MNTDIR/bar.bam.bai &>/dev/null; then
+  stderr "Virtual index exists before it's built"
+  exit 1
+fi
+indexed
+if ! listed bar.bam.bai; then
+  stderr "Built virtual index isn't listed"
+  exit 1
+fi
+
+# Check the virtual indices' offsets are good for the virtual BAMs, by
+# reading each reference's records through them
+echo "Checking virtual indices"
+REGIONS=$($SAMTOOLS idxstats $CHKDIR/bar.bam | awk '$3 > 0 { print $1 }')
+for REGION in $REGIONS; do
+  EXPECTED=$($SAMTOOLS view $CHKDIR/bar.bam $REGION)
+  if [ -z "$EXPECTED" ]; then
+    stderr "No records in $REGION"
+    exit 1
+  fi
+
+  REGION_DIFF=$(diff <(echo "$EXPECTED") <($SAMTOOLS view $MNTDIR/bar.bam $REGION) || true)
+  if [ -n "$REGION_DIFF" ]; then
+    stderr "$REGION records differ:"
+    stderr "$REGION_DIFF"
+    exit 1
+  fi
+done
+
+# Check the regions of an indexed CRAM, served from its (unlisted)
+# region directory, have the same records as the CRAM (n.b., not the
+# same bytes, as the BGZF blocks needn't match)
+echo "Checking region directories"
+for REGION in $REGIONS; do
+  for RANGE in $REGION $REGION:1-100; do
+    EXPECTED=$($SAMTOOLS view $CHKDIR/bar.cram $RANGE)
+    if [ -z "$EXPECTED" ]; then
+      stderr "No records in $RANGE"
+      exit 1
+    fi
+
+    REGION_DIFF=$(diff <(echo "$EXPECTED") <($SAMTOOLS view "$MNTDIR/bar.cram.d/$RANGE.bam") || true)
+    if [ -n "$REGION_DIFF" ]; then
+      stderr "bar.cram.d/$RANGE.bam records differ:"
+      stderr "$REGION_DIFF"
+      exit 1
+    fi
+  done
+done
+
+# Check the (unlisted) per-file compression level variants
+echo "Checking compression level variants"
+for CRAM in $CRAMS; do
+  FILE=$(sed "s+^$CHKDIR+$MNTDIR+;s/\.cram$/.l1.bam/" <<< $CRAM)
+  CHECK=$(sed "s/\.cram$/.l1.check/" <<< $CRAM)
+  $SAMTOOLS view -b -l 1 -o $CHECK $CRAM
   LIMIT=$(wc -c < "$CHECK")
   FILE_DIFF=$(cmp -n $LIMIT $FILE $CHECK || true)
   if [ -n "$FILE_DIFF" ]; then
@@ -117,6 +367,191 @@ for FILE in $(find -L $MNTDIR -type f); do
   fi
 done
 
+# Check level 0 sizes, which are calculated without converting: with
+# level 0 as the default, they're calculated in the background, then
+# each variant must read as many bytes as stat says
+echo "Checking level 0 sizes"
+remount_cramp --bam-level=0
+
+PLACEHOLDER=9223372036854775807
+for CRAM in $CRAMS; do
+  FILE=$(sed "s+^$CHKDIR+$MNTDIR+;s/\.cram$/.l0.bam/" <<< $CRAM)
+  for _ in $(seq 300); do
+    STATED=$(stat -c %s $FILE)
+    [ "$STATED" != "$PLACEHOLDER" ] && break
+    sleep 0.1
+  done
+
+  READ=$(wc -c < $FILE)
+  if [ "$READ" != "$STATED" ]; then
+    stderr "$FILE: read $READ bytes, but stat says $STATED"
+    exit 1
+  fi
+done
+
+# Check sizes survive remounting, via the stat cache file: each virtual
+# BAM's size must be final the first time it's statted (n.b., without
+# anything being sized in the background)
+echo "Checking sizes persist between mounts"
+
+function check_sizes {
+  for BAM in $BAMS; do
+    CHECK=$(sed "s+^$MNTDIR+$CHKDIR+" <<< $BAM)
+    EXPECTED=$(wc -c < "$CHECK")
+    STATED=$(stat -c %s $BAM)
+    if [ "$STATED" != "$EXPECTED" ]; then
+      stderr "$BAM: stat says $STATED after remounting, rather than $EXPECTED"
+      exit 1
+    fi
+  done
+}
+
+remount_cramp --precalc=0
+check_sizes
+check_contents
+
+# ...and via the journal alone, as left by a mount that's killed before
+# it can compact the journal into the cache file
+echo "Checking sizes persist via the journal"
+umount $MNTDIR
+rm -f $CACHE $CACHE.journal
+mount_cramp --precalc=0
+
+for BAM in $BAMS; do
+  cat $BAM >/dev/null
+done
+
+pkill -KILL -f "$CRAMP $MNTDIR"
+while pgrep -f "$CRAMP $MNTDIR" >/dev/null; do
+  sleep 0.1
+done
+umount $MNTDIR
+
+if [ ! -s "$CACHE.journal" ]; then
+  stderr "No journal was left by the killed mount"
+  exit 1
+fi
+
+mount_cramp --precalc=0
+check_sizes
+check_contents
+
+# ...and via a cache file in the old, plain-text format, which is keyed
+# by path, so its records must be re-keyed by fingerprint as it's read
+echo "Checking sizes are imported from a text cache file"
+umount $MNTDIR
+rm -f $CACHE $CACHE.journal
+
+echo "# $SRCDIR" > $CACHE
+for CRAM in $CRAMS; do
+  SOURCE=$(sed "s+^$CHKDIR+$SRCDIR+" <<< $CRAM)
+  CHECK=$(sed "s/\.cram$/.bam/" <<< $CRAM)
+  echo "$SOURCE:$(stat -L -c %Y $SOURCE):$(wc -c < $CHECK)" >> $CACHE
+done
+
+mount_cramp --precalc=0
+check_sizes
+
+# Check CRAMs aren't read to list them after remounting, as whether each
+# is a CRAM is kept with its fingerprint in the cache file (n.b., per
+# their access times, which reading them would update, unless the source
+# is mounted with noatime)
+echo "Checking listings don't read CRAMs after remounting"
+umount $MNTDIR
+
+SOURCES=$(find -L $SRCDIR -name "*.cram" -type f)
+touch -a -d "2000-01-01" $SOURCES
+ACCESSED=$(stat -L -c %X $SOURCES)
+
+mount_cramp --precalc=0
+ls -lR $MNTDIR >/dev/null
+
+if [ "$(stat -L -c %X $SOURCES)" != "$ACCESSED" ]; then
+  stderr "CRAMs were read to list them after remounting"
+  exit 1
+fi
+
+# Check reads of just the header, or just the EOF marker, of virtual
+# BAMs that haven't been converted, which are served without converting
+# (n.b., Freshly mounted, sized per the stat cache, but with nothing
+# being sized in the background)
+echo "Checking header and EOF marker reads"
+remount_cramp --precalc=0
+for BAM in $BAMS; do
+  CHECK=$(sed "s+^$MNTDIR+$CHKDIR+" <<< $BAM)
+  for PART in "head -c 256" "tail -c 28"; do
+    FILE_DIFF=$(cmp <($PART $BAM) <($PART $CHECK) || true)
+    if [ -n "$FILE_DIFF" ]; then
+      stderr "$BAM ($PART): $FILE_DIFF"
+      exit 1
+    fi
+  done
+done
+
+# Check whole file conversions, a container at a time across threads,
+# are byte identical
+echo "Checking parallel conversion"
+remount_cramp --threads=2 --parallel
+check_contents
+
+# Check reads through the block cache: the first pass fills it, so the
+# second is served from it
+echo "Checking reads through the block cache"
+remount_cramp --block-cache=256M
+for PASS in 1 2; do
+  check_contents
+  check_middles
+done
+
+# Check the spill cache: a virtual BAM that's opened often enough is
+# converted in full onto local disk (beside the stat cache file), and
+# served from there after remounting
+echo "Checking the spill cache"
+remount_cramp --spill=256M
+
+SPILLED=$(head -n 1 <<< "$BAMS")
+CHECK=$(sed "s+^$MNTDIR+$CHKDIR+" <<< $SPILLED)
+for _ in $(seq 4); do
+  cat $SPILLED >/dev/null
+done
+
+# n.b., Its segment file reaches its full size once it's filled
+function spilled {
+  [ -n "$(find $CACHE.d -name "*.bam" -size $(wc -c < $CHECK)c)" ]
+}
+
+for _ in $(seq 100); do
+  spilled && break
+  sleep 0.1
+done
+if ! spilled; then
+  stderr "$SPILLED wasn't spilled in full"
+  exit 1
+fi
+
+remount_cramp --spill=256M
+FILE_DIFF=$(cmp $SPILLED $CHECK || true)
+if [ -n "$FILE_DIFF" ]; then
+  stderr "$SPILLED from the spill cache: $FILE_DIFF"
+  exit 1
+fi
+
+# Check trusting the extension: every *.cram is listed without being
+# read, so a non-CRAM is too, but fails when it's opened
+echo "Checking trusted extensions"
+remount_cramp --trust-extension
+
+if ! listed ceci.nest.pas.une.bam; then
+  stderr "Virtual BAM of a trusted non-CRAM isn't listed"
+  exit 1
+fi
+if cat $MNTDIR/ceci.nest.pas.une.bam &>/dev/null; then
+  stderr "Virtual BAM of a trusted non-CRAM can be read"
+  exit 1
+fi
+
+check_contents -not -name "ceci.nest.pas.une.*"
+
 # We're good :)
 TICK="\xe2\x9c\x93"
 ANSI="\033["